@@ -0,0 +1,159 @@
+#include "cachedloader.h"
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+namespace redispp {
+
+typedef std::chrono::steady_clock Clock;
+
+static const char* unlockScript =
+    "if redis.call('get', KEYS[1]) == ARGV[1] then "
+    "return redis.call('del', KEYS[1]) else return 0 end";
+
+// Splits a stored "<millis>:<value>" string, false if it is not one.
+static bool decode(const std::string& stored, int64_t* delta,
+                   std::string* value) {
+  const size_t colon = stored.find(':');
+  if (colon == 0 || colon == std::string::npos || colon > 18) {
+    return false;
+  }
+  int64_t ret = 0;
+  for (size_t i = 0; i < colon; ++i) {
+    if (stored[i] < '0' || stored[i] > '9') {
+      return false;
+    }
+    ret = ret * 10 + (stored[i] - '0');
+  }
+  *delta = ret;
+  value->assign(stored, colon + 1, std::string::npos);
+  return true;
+}
+
+CachedLoader::CachedLoader(Connection* conn, const Options& options)
+    : conn(conn), options(options), random(std::random_device()()), hits(0),
+      misses(0), earlyRefreshes(0), staleServed(0), lockWaits(0) {}
+
+CachedLoaderStats CachedLoader::stats() const {
+  CachedLoaderStats ret;
+  ret.hits = hits;
+  ret.misses = misses;
+  ret.earlyRefreshes = earlyRefreshes;
+  ret.staleServed = staleServed;
+  ret.lockWaits = lockWaits;
+  return ret;
+}
+
+void CachedLoader::invalidate(const std::string& key) {
+  conn->del(key).result();
+}
+
+// XFetch: recompute when now - delta * beta * ln(rand) passes the expiry.
+bool CachedLoader::shouldRefresh(int64_t delta, int64_t remaining) {
+  if (remaining < 0) {
+    return remaining == -2;
+  }
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  const double r = 1.0 - uniform(random); // (0, 1]
+  return -double(delta) * options.beta * std::log(r) >= double(remaining);
+}
+
+bool CachedLoader::tryLock(const std::string& lock, std::string* token) {
+  *token = boost::lexical_cast<std::string>(random());
+  ArgList args;
+  args.push_back("SET");
+  args.push_back(lock);
+  args.push_back(*token);
+  args.push_back("NX");
+  args.push_back("PX");
+  args.push_back(boost::lexical_cast<std::string>(options.lockMillis));
+  return !conn->command(args).result().isNil();
+}
+
+std::string CachedLoader::load(const std::string& key, const Loader& loader,
+                               const std::string* lockToken) {
+  const std::string lock = key + options.lockSuffix;
+  ArgList unlock;
+  if (lockToken) {
+    unlock.push_back("EVAL");
+    unlock.push_back(unlockScript);
+    unlock.push_back("1");
+    unlock.push_back(lock);
+    unlock.push_back(*lockToken);
+  }
+
+  const Clock::time_point start = Clock::now();
+  std::string value;
+  try {
+    value = loader();
+  } catch (...) {
+    if (lockToken) {
+      conn->command(unlock).result();
+    }
+    throw;
+  }
+  const int64_t delta = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            Clock::now() - start)
+                            .count();
+
+  // the store and the unlock go out together
+  VoidReply stored = conn->setEx(
+      key, options.ttlSeconds,
+      boost::lexical_cast<std::string>(delta) + ":" + value);
+  if (lockToken) {
+    ValueReply unlocked = conn->command(unlock);
+    stored.result();
+    unlocked.result();
+  } else {
+    stored.result();
+  }
+  return value;
+}
+
+std::string CachedLoader::get(const std::string& key, const Loader& loader) {
+  const std::string lock = key + options.lockSuffix;
+  const Clock::time_point deadline =
+      Clock::now() + std::chrono::milliseconds(options.lockMillis);
+  bool waited = false;
+  for (;;) {
+    // both replies are read after both commands are sent
+    StringReply stored = conn->get(key);
+    IntReply remaining = conn->pttl(key);
+    const boost::optional<std::string>& result = stored.result();
+    const int64_t ttl = remaining.result();
+
+    int64_t delta = 0;
+    std::string value;
+    std::string token;
+    if (result && decode(*result, &delta, &value)) {
+      if (!shouldRefresh(delta, ttl)) {
+        ++hits;
+        return value;
+      }
+      if (!tryLock(lock, &token)) {
+        ++hits;
+        ++staleServed;
+        return value;
+      }
+      ++hits;
+      ++earlyRefreshes;
+      return load(key, loader, &token);
+    }
+
+    if (tryLock(lock, &token)) {
+      ++misses;
+      return load(key, loader, &token);
+    }
+    // another worker is computing it, give it a chance to finish
+    if (!waited) {
+      waited = true;
+      ++lockWaits;
+    }
+    if (Clock::now() >= deadline) {
+      ++misses;
+      return load(key, loader, NULL);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(options.waitMillis));
+  }
+}
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "redispp.h"
+#include <atomic>
+#include <boost/noncopyable.hpp>
+#include <functional>
+#include <random>
+#include <string>
+
+namespace redispp {
+
+struct CachedLoaderStats {
+  CachedLoaderStats()
+      : hits(0), misses(0), earlyRefreshes(0), staleServed(0), lockWaits(0) {}
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t earlyRefreshes; // hits that recomputed the value before it expired
+  uint64_t staleServed;    // early refreshes left to the lock holder
+  uint64_t lockWaits;      // misses that waited for another worker's value
+};
+
+// Cache-aside on top of get/setEx/pttl with XFetch probabilistic early
+// recomputation: the closer a value is to expiring, and the longer it took to
+// compute, the more likely a read is to recompute it ahead of time. A short
+// SET NX PX lock makes sure one worker recomputes while the others keep
+// serving the current value. Values are stored as "<compute millis>:<value>",
+// so the keys should only be written through a CachedLoader. Like Connection,
+// a loader must not be shared between threads.
+class CachedLoader : boost::noncopyable {
+public:
+  typedef std::function<std::string()> Loader;
+
+  struct Options {
+    Options()
+        : ttlSeconds(60), beta(1.0), lockMillis(5000), waitMillis(20),
+          lockSuffix(":lock") {}
+
+    // Expiry of stored values.
+    int ttlSeconds;
+    // XFetch tuning, values above 1 favour earlier recomputation.
+    double beta;
+    // Expiry of the recompute lock, bounds how long a crashed worker can
+    // hold it and how long others wait on a miss before loading themselves.
+    int lockMillis;
+    // Poll interval while waiting for another worker to fill a missing key.
+    int waitMillis;
+    // Appended to the key to name its lock.
+    std::string lockSuffix;
+  };
+
+  explicit CachedLoader(Connection* conn, const Options& options = Options());
+
+  // Returns the cached value of key, calling loader to compute and store it
+  // when it is missing or chosen for early recomputation.
+  std::string get(const std::string& key, const Loader& loader);
+
+  // Removes the cached value so the next get recomputes it.
+  void invalidate(const std::string& key);
+
+  CachedLoaderStats stats() const;
+
+private:
+  bool tryLock(const std::string& lock, std::string* token);
+  std::string load(const std::string& key, const Loader& loader,
+                   const std::string* lockToken);
+  bool shouldRefresh(int64_t delta, int64_t remaining);
+
+  Connection* conn;
+  Options options;
+  std::mt19937_64 random;
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+  std::atomic<uint64_t> earlyRefreshes;
+  std::atomic<uint64_t> staleServed;
+  std::atomic<uint64_t> lockWaits;
+};
+};
@@ -0,0 +1,132 @@
+#include "coalescing.h"
+
+namespace redispp {
+
+CoalescingReader::CoalescingReader(Connection* conn)
+    : nextSlot(0), requests(0), coalesced(0) {
+  slots.push_back(std::unique_ptr<Slot>(new Slot(conn)));
+}
+
+CoalescingReader::CoalescingReader(const std::vector<Connection*>& pool)
+    : nextSlot(0), requests(0), coalesced(0) {
+  if (pool.empty()) {
+    throw std::invalid_argument("CoalescingReader needs a connection");
+  }
+  for (size_t i = 0; i < pool.size(); ++i) {
+    slots.push_back(std::unique_ptr<Slot>(new Slot(pool[i])));
+  }
+}
+
+CoalescingStats CoalescingReader::stats() const {
+  CoalescingStats ret;
+  ret.requests = requests;
+  ret.coalesced = coalesced;
+  return ret;
+}
+
+// Sends args on the first idle connection, or waits for one.
+Value CoalescingReader::send(const ArgList& args) {
+  const size_t start = nextSlot++;
+  for (size_t i = 0; i < slots.size(); ++i) {
+    Slot& slot = *slots[(start + i) % slots.size()];
+    std::unique_lock<std::mutex> lock(slot.mutex, std::try_to_lock);
+    if (lock.owns_lock()) {
+      return slot.conn->command(args).result();
+    }
+  }
+  Slot& slot = *slots[start % slots.size()];
+  std::lock_guard<std::mutex> lock(slot.mutex);
+  return slot.conn->command(args).result();
+}
+
+Value CoalescingReader::command(const ArgList& args) {
+  // length prefixed so that different argument splits never collide
+  std::string id;
+  BOOST_FOREACH (const std::string& arg, args) {
+    id += boost::lexical_cast<std::string>(arg.size());
+    id += ':';
+    id += arg;
+  }
+
+  ++requests;
+  std::shared_ptr<Call> call;
+  bool leader = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<Call>& existing = inFlight[id];
+    if (existing) {
+      ++coalesced;
+    } else {
+      existing = std::make_shared<Call>();
+      leader = true;
+    }
+    call = existing;
+  }
+
+  if (leader) {
+    // the call leaves the table before it completes, so nobody can attach to
+    // a reply that is already being delivered
+    try {
+      Value ret = send(args);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        inFlight.erase(id);
+      }
+      call->promise.set_value(ret);
+      return ret;
+    } catch (...) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        inFlight.erase(id);
+      }
+      call->promise.set_exception(std::current_exception());
+      throw;
+    }
+  }
+  return call->future.get();
+}
+
+static ArgList makeArgs(const char* name, const std::string& arg1) {
+  ArgList args;
+  args.push_back(name);
+  args.push_back(arg1);
+  return args;
+}
+
+static boost::optional<std::string> toOptionalString(const Value& value) {
+  if (value.isNil()) {
+    return boost::none;
+  }
+  return value.str;
+}
+
+boost::optional<std::string> CoalescingReader::get(const std::string& key) {
+  return toOptionalString(command(makeArgs("GET", key)));
+}
+
+boost::optional<std::string> CoalescingReader::hget(const std::string& key,
+                                                    const std::string& field) {
+  ArgList args = makeArgs("HGET", key);
+  args.push_back(field);
+  return toOptionalString(command(args));
+}
+
+KeyValueVector CoalescingReader::hgetAll(const std::string& key) {
+  const Value value = command(makeArgs("HGETALL", key));
+  KeyValueVector ret(value.elements.size() / 2);
+  for (size_t i = 0; i < ret.size(); ++i) {
+    ret[i].first = value.elements[2 * i].str;
+    ret[i].second = value.elements[2 * i + 1].str;
+  }
+  return ret;
+}
+
+std::vector<std::string> CoalescingReader::smembers(const std::string& key) {
+  const Value value = command(makeArgs("SMEMBERS", key));
+  std::vector<std::string> ret(value.elements.size());
+  for (size_t i = 0; i < ret.size(); ++i) {
+    ret[i] = value.elements[i].str;
+  }
+  return ret;
+}
+};
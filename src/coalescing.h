@@ -0,0 +1,68 @@
+#pragma once
+
+#include "redispp.h"
+#include <atomic>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace redispp {
+
+struct CoalescingStats {
+  CoalescingStats() : requests(0), coalesced(0) {}
+
+  uint64_t requests;
+  uint64_t coalesced; // requests answered by another caller's reply
+};
+
+// Shares one or more connections between threads and collapses identical read
+// commands that are in flight at the same time: the first caller sends the
+// command, later callers with the same command and arguments wait for its
+// reply instead of sending their own. Only use it for commands without side
+// effects. The connections must not be used directly while the reader exists.
+class CoalescingReader : boost::noncopyable {
+public:
+  explicit CoalescingReader(Connection* conn);
+  explicit CoalescingReader(const std::vector<Connection*>& pool);
+
+  boost::optional<std::string> get(const std::string& key);
+  boost::optional<std::string> hget(const std::string& key,
+                                    const std::string& field);
+  KeyValueVector hgetAll(const std::string& key);
+  std::vector<std::string> smembers(const std::string& key);
+
+  // Any read command, the first element of args being its name.
+  Value command(const ArgList& args);
+
+  CoalescingStats stats() const;
+
+private:
+  struct Slot {
+    explicit Slot(Connection* conn) : conn(conn) {}
+
+    Connection* conn;
+    std::mutex mutex;
+  };
+
+  struct Call {
+    Call() : future(promise.get_future().share()) {}
+
+    std::promise<Value> promise;
+    std::shared_future<Value> future;
+  };
+
+  Value send(const ArgList& args);
+
+  std::vector<std::unique_ptr<Slot>> slots;
+  std::atomic<size_t> nextSlot;
+  std::mutex mutex;
+  std::unordered_map<std::string, std::shared_ptr<Call>> inFlight;
+  std::atomic<uint64_t> requests;
+  std::atomic<uint64_t> coalesced;
+};
+};
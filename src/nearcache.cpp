@@ -0,0 +1,916 @@
+#include "nearcache.h"
+#include <algorithm>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/lexical_cast.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+
+namespace redispp {
+
+static const char* const s_invalidateChannel = "__redis__:invalidate";
+
+// rough per-entry overhead of the maps, list node and Entry itself
+static const size_t kEntryOverhead = 160;
+
+// restored entries checked together when one of them is first accessed
+static const size_t kRevalidateBatch = 64;
+
+// Digests of the views of KEYS[1] named by ARGV: "string", "hash", "set", or
+// "fields" followed by a count and that many hash fields. Items are length
+// prefixed; hashes and sets are digested regardless of order (see
+// unorderedDigest). A view the key no longer has digests as "".
+static const char* kDigests =
+    "local function enc(s) return #s .. ':' .. s end\n"
+    "local function unordered(items, step)\n"
+    "  local acc = {0, 0, 0, 0, 0}\n"
+    "  for i = 1, #items, step do\n"
+    "    local item = enc(items[i])\n"
+    "    if step == 2 then item = item .. enc(items[i + 1]) end\n"
+    "    local sha = redis.sha1hex(item)\n"
+    "    for j = 1, 5 do\n"
+    "      local word = tonumber(string.sub(sha, j * 8 - 7, j * 8), 16)\n"
+    "      acc[j] = bit.bxor(acc[j], word)\n"
+    "    end\n"
+    "  end\n"
+    "  local out = (#items / step) .. ':'\n"
+    "  for j = 1, 5 do out = out .. bit.tohex(acc[j]) end\n"
+    "  return out\n"
+    "end\n"
+    "local key = KEYS[1]\n"
+    "local out = {}\n"
+    "local i = 1\n"
+    "while i <= #ARGV do\n"
+    "  local view = ARGV[i]\n"
+    "  local digest = ''\n"
+    "  if view == 'string' then\n"
+    "    local value = redis.pcall('GET', key)\n"
+    "    if type(value) == 'string' then digest = redis.sha1hex(value) end\n"
+    "    i = i + 1\n"
+    "  elseif view == 'hash' or view == 'set' then\n"
+    "    local hash = view == 'hash'\n"
+    "    local items = redis.pcall(hash and 'HGETALL' or 'SMEMBERS', key)\n"
+    "    if not items.err then digest = unordered(items, hash and 2 or 1) end\n"
+    "    i = i + 1\n"
+    "  else\n"
+    "    local count = tonumber(ARGV[i + 1])\n"
+    "    local values = redis.pcall('HMGET', key,\n"
+    "                               unpack(ARGV, i + 2, i + 1 + count))\n"
+    "    if not values.err then\n"
+    "      local all = ''\n"
+    "      for j = 1, count do\n"
+    "        all = all .. (values[j] and enc(values[j]) or '-')\n"
+    "      end\n"
+    "      digest = redis.sha1hex(all)\n"
+    "    end\n"
+    "    i = i + 2 + count\n"
+    "  end\n"
+    "  out[#out + 1] = digest\n"
+    "end\n"
+    "return out\n";
+
+static const char s_snapshotMagic[4] = {'R', 'P', 'N', 'C'};
+static const uint32_t kSnapshotVersion = 1;
+static const uint32_t kSnapshotByteOrder = 0x01020304;
+
+enum SnapshotFlags {
+  HasValue = 1,
+  ValueNotNull = 2,
+  HasHash = 4,
+  HasMembers = 8,
+  ServerExpires = 16,
+};
+
+static size_t nextPowerOfTwo(size_t n) {
+  size_t ret = 1;
+  while (ret < n) {
+    ret <<= 1;
+  }
+  return ret;
+}
+
+static int64_t nowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+NearCache::FrequencySketch::FrequencySketch(size_t width)
+    : table(4 * nextPowerOfTwo(std::max<size_t>(width, 64)), 0),
+      mask(table.size() / 4 - 1), additions(0), sampleSize(table.size() * 4) {}
+
+static inline size_t sketchIndex(size_t hash, size_t row, size_t mask) {
+  static const uint64_t seeds[] = {0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+                                   0x9ae16a3b2f90404fULL,
+                                   0xcbf29ce484222325ULL};
+  uint64_t h = (hash + seeds[row]) * seeds[(row + 1) & 3];
+  h ^= h >> 32;
+  return row * (mask + 1) + (h & mask);
+}
+
+void NearCache::FrequencySketch::increment(size_t hash) {
+  bool added = false;
+  for (size_t row = 0; row < 4; ++row) {
+    unsigned char& counter = table[sketchIndex(hash, row, mask)];
+    if (counter < 15) {
+      ++counter;
+      added = true;
+    }
+  }
+  if (added && ++additions >= sampleSize) {
+    for (size_t i = 0; i < table.size(); ++i) {
+      table[i] >>= 1;
+    }
+    additions /= 2;
+  }
+}
+
+unsigned NearCache::FrequencySketch::estimate(size_t hash) const {
+  unsigned ret = 15;
+  for (size_t row = 0; row < 4; ++row) {
+    ret = std::min<unsigned>(ret, table[sketchIndex(hash, row, mask)]);
+  }
+  return ret;
+}
+
+NearCache::NearCache(Connection* conn, const Options& options)
+    : conn(conn), invalidationConn(NULL), options(options),
+      digestScript(kDigests), lastPoll(0), hits(0), misses(0), evictions(0),
+      rejections(0), invalidations(0), restored(0), stale(0) {
+  start();
+}
+
+NearCache::NearCache(Connection* conn, Connection* invalidations,
+                     const Options& options)
+    : conn(conn), invalidationConn(invalidations), options(options),
+      digestScript(kDigests), lastPoll(0), hits(0), misses(0), evictions(0),
+      rejections(0), invalidations(0), restored(0), stale(0) {
+  start();
+}
+
+NearCache::~NearCache() {
+  std::lock_guard<std::mutex> lock(connMutex);
+  try {
+    conn->clientTracking(false).result();
+  } catch (...) {
+  }
+  conn->setPushHandler(PushHandler());
+  if (invalidationConn) {
+    invalidationConn->setPushHandler(PushHandler());
+  }
+}
+
+void NearCache::start() {
+  const size_t count = std::max<size_t>(options.shards, 1);
+  const size_t capacity = std::max<size_t>(options.maxBytes / count, 1);
+  for (size_t i = 0; i < count; ++i) {
+    shards.push_back(std::unique_ptr<Shard>(
+        new Shard(capacity, capacity / kEntryOverhead)));
+  }
+
+  const PushHandler handler =
+      std::bind(&NearCache::onPush, this, std::placeholders::_1);
+  if (invalidationConn) {
+    invalidationConn->setPushHandler(handler);
+    const int64_t id = invalidationConn->clientId().result();
+    invalidationConn->subscribe(s_invalidateChannel);
+    conn->clientTracking(true, id).result();
+  } else {
+    conn->setPushHandler(handler);
+    conn->hello(3).result();
+    conn->clientTracking(true).result();
+  }
+}
+
+void NearCache::onPush(const Value& push) {
+  if (push.elements.size() == 2 && push.elements[0].str == "invalidate") {
+    invalidateKeys(push.elements[1]);
+  } else if (push.elements.size() == 3 && push.elements[0].str == "message" &&
+             push.elements[1].str == s_invalidateChannel) {
+    invalidateKeys(push.elements[2]);
+  }
+}
+
+void NearCache::invalidateKeys(const Value& keys) {
+  if (keys.isNil()) {
+    // FLUSHDB/FLUSHALL
+    clear();
+    return;
+  }
+  for (size_t i = 0; i < keys.elements.size(); ++i) {
+    invalidate(keys.elements[i].str);
+  }
+}
+
+void NearCache::invalidate(const std::string& key) {
+  size_t hash;
+  Shard& shard = shardFor(key, &hash);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  ++shard.epoch;
+  ++invalidations;
+  EntryMap::iterator it = shard.entries.find(key);
+  if (it != shard.entries.end()) {
+    erase(shard, it);
+  }
+}
+
+void NearCache::clear() {
+  for (size_t i = 0; i < shards.size(); ++i) {
+    Shard& shard = *shards[i];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    ++shard.epoch;
+    shard.entries.clear();
+    shard.lru.clear();
+    shard.bytes = 0;
+  }
+}
+
+size_t NearCache::poll(int timeoutMs) {
+  std::lock_guard<std::mutex> lock(connMutex);
+  lastPoll = nowMicros();
+  return (invalidationConn ? invalidationConn : conn)->processPushes(timeoutMs);
+}
+
+void NearCache::maybePoll() {
+  const int64_t now = nowMicros();
+  if (now - lastPoll < options.pollIntervalMicros) {
+    return;
+  }
+  // whoever holds the connection is reading from it and handles any pushes
+  std::unique_lock<std::mutex> lock(connMutex, std::try_to_lock);
+  if (lock.owns_lock()) {
+    lastPoll = now;
+    (invalidationConn ? invalidationConn : conn)->processPushes(0);
+  }
+}
+
+NearCacheStats NearCache::stats() const {
+  NearCacheStats ret;
+  ret.hits = hits;
+  ret.misses = misses;
+  ret.evictions = evictions;
+  ret.rejections = rejections;
+  ret.invalidations = invalidations;
+  ret.restored = restored;
+  ret.stale = stale;
+  for (size_t i = 0; i < shards.size(); ++i) {
+    Shard& shard = *shards[i];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    ret.entries += shard.entries.size();
+    ret.bytes += shard.bytes;
+  }
+  return ret;
+}
+
+NearCache::Shard& NearCache::shardFor(const std::string& key, size_t* hash) {
+  *hash = std::hash<std::string>()(key);
+  return *shards[(*hash >> 7) % shards.size()];
+}
+
+NearCache::Entry* NearCache::findEntry(Shard& shard, const std::string& key) {
+  EntryMap::iterator it = shard.entries.find(key);
+  if (it == shard.entries.end()) {
+    return NULL;
+  }
+  Entry& entry = it->second;
+  if (entry.expiresAt != Clock::time_point() &&
+      Clock::now() >= entry.expiresAt) {
+    erase(shard, it);
+    return NULL;
+  }
+  shard.lru.splice(shard.lru.begin(), shard.lru, entry.lru);
+  return &entry;
+}
+
+NearCache::Entry* NearCache::admit(Shard& shard, size_t hash,
+                                   const std::string& key, uint64_t epoch,
+                                   int64_t ttl) {
+  if (shard.epoch != epoch) {
+    // invalidated while the reply was in flight
+    return NULL;
+  }
+
+  // TTL has one second resolution, expire locally a little early
+  Clock::time_point expiresAt;
+  if (ttl > 0) {
+    expiresAt = Clock::now() + std::chrono::milliseconds(ttl * 1000 - 500);
+  }
+  if (options.maxTtlSeconds > 0) {
+    const Clock::time_point limit =
+        Clock::now() + std::chrono::seconds(options.maxTtlSeconds);
+    if (expiresAt == Clock::time_point() || limit < expiresAt) {
+      expiresAt = limit;
+    }
+  }
+
+  EntryMap::iterator it = shard.entries.find(key);
+  if (it != shard.entries.end()) {
+    it->second.expiresAt = expiresAt;
+    it->second.serverExpires = ttl > 0;
+    return &it->second;
+  }
+
+  if (options.tinyLfu && !shard.lru.empty() &&
+      shard.bytes + key.size() + kEntryOverhead > shard.capacity) {
+    const std::string& victim = shard.lru.back();
+    if (shard.sketch.estimate(hash) <=
+        shard.sketch.estimate(std::hash<std::string>()(victim))) {
+      ++rejections;
+      return NULL;
+    }
+  }
+
+  Entry& entry = shard.entries[key];
+  entry.expiresAt = expiresAt;
+  entry.serverExpires = ttl > 0;
+  shard.lru.push_front(key);
+  entry.lru = shard.lru.begin();
+  entry.bytes = 0;
+  return &entry;
+}
+
+void NearCache::account(Shard& shard, Entry& entry, size_t bytes) {
+  if (entry.bytes == 0) {
+    bytes += entry.lru->size() + kEntryOverhead;
+  }
+  entry.bytes += bytes;
+  shard.bytes += bytes;
+  while (shard.bytes > shard.capacity && !shard.lru.empty()) {
+    erase(shard, shard.entries.find(shard.lru.back()));
+    ++evictions;
+  }
+}
+
+void NearCache::erase(Shard& shard, EntryMap::iterator it) {
+  shard.bytes -= it->second.bytes;
+  shard.lru.erase(it->second.lru);
+  shard.entries.erase(it);
+}
+
+// Serves a view of key from the shard, or fetches it together with the key's
+// TTL in one round trip and stores it. lookup returns a pointer to the cached
+// view, fetch issues the pipelined read and store saves the view returning
+// its size.
+template <typename T, typename Lookup, typename Fetch, typename Store>
+T NearCache::cached(const std::string& key, Lookup lookup, Fetch fetch,
+                    Store store) {
+  maybePoll();
+
+  size_t hash;
+  Shard& shard = shardFor(key, &hash);
+  uint64_t epoch = 0;
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      if (attempt == 0) {
+        shard.sketch.increment(hash);
+      }
+      Entry* const entry = findEntry(shard, key);
+      epoch = shard.epoch;
+      if (!entry) {
+        break;
+      }
+      if (entry->verified) {
+        const T* const found = lookup(*entry);
+        if (found) {
+          ++hits;
+          return *found;
+        }
+        break;
+      }
+    }
+    // restored from a snapshot, check it before serving
+    verify(&key, kRevalidateBatch);
+  }
+
+  ++misses;
+  std::lock_guard<std::mutex> connLock(connMutex);
+  T ret;
+  IntReply ttl = fetch(ret);
+  const int64_t seconds = ttl.result();
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  Entry* const entry = admit(shard, hash, key, epoch, seconds);
+  if (entry) {
+    account(shard, *entry, store(*entry, ret));
+  }
+  return ret;
+}
+
+boost::optional<std::string> NearCache::get(const std::string& key) {
+  typedef boost::optional<std::string> Result;
+  return cached<Result>(
+      key,
+      [](Entry& entry) -> const Result* {
+        return entry.value ? &*entry.value : NULL;
+      },
+      [&](Result& out) {
+        StringReply value = conn->get(key);
+        IntReply ttl = conn->ttl(key);
+        out = value.result();
+        return ttl;
+      },
+      [](Entry& entry, const Result& value) -> size_t {
+        entry.value = value;
+        return value ? value->size() : 0;
+      });
+}
+
+boost::optional<std::string> NearCache::hget(const std::string& key,
+                                             const std::string& field) {
+  typedef boost::optional<std::string> Result;
+  return cached<Result>(
+      key,
+      [&](Entry& entry) -> const Result* {
+        auto it = entry.fields.find(field);
+        return it == entry.fields.end() ? NULL : &it->second;
+      },
+      [&](Result& out) {
+        StringReply value = conn->hget(key, field);
+        IntReply ttl = conn->ttl(key);
+        out = value.result();
+        return ttl;
+      },
+      [&](Entry& entry, const Result& value) -> size_t {
+        entry.fields[field] = value;
+        return field.size() + (value ? value->size() : 0);
+      });
+}
+
+KeyValueVector NearCache::hgetAll(const std::string& key) {
+  return cached<KeyValueVector>(
+      key,
+      [](Entry& entry) -> const KeyValueVector* {
+        return entry.hash ? &*entry.hash : NULL;
+      },
+      [&](KeyValueVector& out) {
+        MapReply value = conn->hgetAllMap(key);
+        IntReply ttl = conn->ttl(key);
+        out = value.result();
+        return ttl;
+      },
+      [](Entry& entry, const KeyValueVector& value) -> size_t {
+        size_t bytes = 0;
+        for (size_t i = 0; i < value.size(); ++i) {
+          bytes += value[i].first.size() + value[i].second.size();
+        }
+        entry.hash = value;
+        return bytes;
+      });
+}
+
+std::vector<std::string> NearCache::smembers(const std::string& key) {
+  typedef std::vector<std::string> Result;
+  return cached<Result>(
+      key,
+      [](Entry& entry) -> const Result* {
+        return entry.members ? &*entry.members : NULL;
+      },
+      [&](Result& out) {
+        MultiBulkEnumerator value = conn->smembers(key);
+        IntReply ttl = conn->ttl(key);
+        std::string member;
+        while (value.next(&member)) {
+          out.push_back(member);
+        }
+        return ttl;
+      },
+      [](Entry& entry, const Result& value) -> size_t {
+        size_t bytes = 0;
+        for (size_t i = 0; i < value.size(); ++i) {
+          bytes += value[i].size();
+        }
+        entry.members = value;
+        return bytes;
+      });
+}
+
+// Length-prefixed, so that digests of concatenations are unambiguous.
+static std::string encoded(const std::string& str) {
+  return boost::lexical_cast<std::string>(str.size()) + ":" + str;
+}
+
+// The count followed by the XOR of the SHA1s of the items, which does not
+// depend on the order the server returns a hash or set in, as kDigests
+// computes it.
+static std::string unorderedDigest(const std::vector<std::string>& items) {
+  uint32_t acc[5] = {0, 0, 0, 0, 0};
+  for (size_t i = 0; i < items.size(); ++i) {
+    const std::string sha = sha1Hex(items[i]);
+    for (int j = 0; j < 5; ++j) {
+      acc[j] ^= (uint32_t)strtoul(sha.substr(j * 8, 8).c_str(), NULL, 16);
+    }
+  }
+  char hex[41];
+  for (int j = 0; j < 5; ++j) {
+    snprintf(hex + j * 8, 9, "%08x", acc[j]);
+  }
+  return boost::lexical_cast<std::string>(items.size()) + ":" + hex;
+}
+
+size_t NearCache::revalidate(size_t maxEntries) {
+  return verify(NULL, maxEntries);
+}
+
+size_t NearCache::verify(const std::string* first, size_t maxEntries) {
+  std::vector<std::string> keys;
+  if (first) {
+    keys.push_back(*first);
+  }
+  {
+    std::lock_guard<std::mutex> lock(unverifiedMutex);
+    while (keys.size() < maxEntries && !unverified.empty()) {
+      keys.push_back(unverified.front());
+      unverified.pop_front();
+    }
+  }
+  if (keys.empty()) {
+    return 0;
+  }
+
+  // Each cached view of a key is compared by digest, computed by kDigests on
+  // the server so that only the digests cross the wire. The checks are made
+  // under the shard lock and sent after it is released: making room in the
+  // pipeline can read invalidations, which take the shard locks.
+  struct Check {
+    std::string key;
+    Shard* shard;
+    uint64_t epoch;
+    bool missing; // a cached nil, the key must not exist
+    ArgList views;
+    std::vector<std::string> expected; // a digest per view
+  };
+
+  std::vector<Check> checks;
+  checks.reserve(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    size_t hash;
+    Check check;
+    check.key = keys[i];
+    check.shard = &shardFor(check.key, &hash);
+    std::lock_guard<std::mutex> lock(check.shard->mutex);
+    EntryMap::iterator it = check.shard->entries.find(check.key);
+    if (it == check.shard->entries.end() || it->second.verified) {
+      continue;
+    }
+    const Entry& entry = it->second;
+    check.epoch = check.shard->epoch;
+    check.missing = entry.value && !*entry.value;
+    if (entry.value && *entry.value) {
+      check.views.push_back("string");
+      check.expected.push_back(sha1Hex(**entry.value));
+    }
+    if (entry.hash) {
+      std::vector<std::string> items;
+      for (size_t j = 0; j < entry.hash->size(); ++j) {
+        items.push_back(encoded((*entry.hash)[j].first) +
+                        encoded((*entry.hash)[j].second));
+      }
+      check.views.push_back("hash");
+      check.expected.push_back(unorderedDigest(items));
+    }
+    if (entry.members) {
+      std::vector<std::string> items;
+      for (size_t j = 0; j < entry.members->size(); ++j) {
+        items.push_back(encoded((*entry.members)[j]));
+      }
+      check.views.push_back("set");
+      check.expected.push_back(unorderedDigest(items));
+    }
+    if (!entry.fields.empty()) {
+      check.views.push_back("fields");
+      check.views.push_back(
+          boost::lexical_cast<std::string>(entry.fields.size()));
+      std::string values;
+      for (auto field = entry.fields.begin(); field != entry.fields.end();
+           ++field) {
+        check.views.push_back(field->first);
+        values += field->second ? encoded(*field->second) : "-";
+      }
+      check.expected.push_back(sha1Hex(values));
+    }
+    checks.push_back(check);
+  }
+
+  std::lock_guard<std::mutex> connLock(connMutex);
+  std::vector<IntReply> ttls;
+  std::vector<ScriptReply> reads;
+  ttls.reserve(checks.size());
+  reads.reserve(checks.size());
+  for (size_t i = 0; i < checks.size(); ++i) {
+    const Check& check = checks[i];
+    // TTL is a read command, so it also registers the key for tracking
+    ttls.push_back(conn->ttl(check.key));
+    reads.push_back(check.views.empty()
+                        ? ScriptReply()
+                        : digestScript.run(conn, ArgList(1, check.key),
+                                           check.views));
+  }
+
+  for (size_t i = 0; i < checks.size(); ++i) {
+    const Check& check = checks[i];
+    const int64_t ttl = ttls[i].result();
+    bool valid = check.missing ? ttl == -2 : ttl != -2;
+    if (valid && !check.views.empty()) {
+      // an error, e.g. for a key now of another type, is a mismatch
+      const Expected<Value> read = reads[i].tryResult();
+      valid = read && read->elements.size() == check.expected.size();
+      for (size_t j = 0; valid && j < check.expected.size(); ++j) {
+        valid = read->elements[j].str == check.expected[j];
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(check.shard->mutex);
+    EntryMap::iterator it = check.shard->entries.find(check.key);
+    if (it == check.shard->entries.end() || it->second.verified) {
+      continue;
+    }
+    Entry& entry = it->second;
+    if (!valid || check.shard->epoch != check.epoch ||
+        (!check.missing && entry.serverExpires != (ttl > 0))) {
+      ++stale;
+      erase(*check.shard, it);
+      continue;
+    }
+    entry.verified = true;
+    if (ttl > 0) {
+      entry.expiresAt =
+          Clock::now() + std::chrono::milliseconds(ttl * 1000 - 500);
+    }
+  }
+  return checks.size();
+}
+
+namespace {
+
+class SnapshotWriter {
+public:
+  explicit SnapshotWriter(std::string& out) : out(out) {}
+
+  void put(const void* data, size_t len) {
+    out.append((const char*)data, len);
+  }
+
+  template <typename T> void put(T value) { put(&value, sizeof(value)); }
+
+  void put(const std::string& str) {
+    put<uint32_t>(str.size());
+    put(str.data(), str.size());
+  }
+
+private:
+  std::string& out;
+};
+
+class SnapshotReader {
+public:
+  SnapshotReader(const char* data, size_t len) : spot(data), end(data + len) {}
+
+  const char* get(size_t len) {
+    if ((size_t)(end - spot) < len) {
+      throw std::runtime_error("truncated near cache snapshot");
+    }
+    const char* const ret = spot;
+    spot += len;
+    return ret;
+  }
+
+  template <typename T> T get() {
+    T ret;
+    memcpy(&ret, get(sizeof(ret)), sizeof(ret));
+    return ret;
+  }
+
+  std::string getString() {
+    const uint32_t len = get<uint32_t>();
+    return std::string(get(len), len);
+  }
+
+  // A count of items taking at least itemBytes each, checked against what is
+  // left before anything is allocated for them.
+  template <typename T> T getCount(size_t itemBytes) {
+    const T count = get<T>();
+    if (count > (uint64_t)(end - spot) / itemBytes) {
+      throw std::runtime_error("corrupt near cache snapshot");
+    }
+    return count;
+  }
+
+  bool done() const { return spot == end; }
+
+private:
+  const char* spot;
+  const char* end;
+};
+}
+
+void NearCache::save(const std::string& path) const {
+  namespace ipc = boost::interprocess;
+
+  std::string data;
+  SnapshotWriter writer(data);
+  writer.put(s_snapshotMagic, sizeof(s_snapshotMagic));
+  writer.put<uint32_t>(kSnapshotVersion);
+  writer.put<uint32_t>(kSnapshotByteOrder);
+  const size_t countOffset = data.size();
+  writer.put<uint64_t>(0);
+
+  // expiry is stored as wall clock time so it survives the restart
+  const Clock::time_point now = Clock::now();
+  const int64_t wallNow =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count();
+  uint64_t count = 0;
+  for (size_t i = 0; i < shards.size(); ++i) {
+    Shard& shard = *shards[i];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    for (EntryMap::const_iterator it = shard.entries.begin();
+         it != shard.entries.end(); ++it) {
+      const Entry& entry = it->second;
+      int64_t expiresAt = 0;
+      if (entry.expiresAt != Clock::time_point()) {
+        if (entry.expiresAt <= now) {
+          continue;
+        }
+        expiresAt =
+            wallNow + std::chrono::duration_cast<std::chrono::milliseconds>(
+                          entry.expiresAt - now)
+                          .count();
+      }
+      uint8_t flags = entry.serverExpires ? ServerExpires : 0;
+      if (entry.value) {
+        flags |= HasValue | (*entry.value ? ValueNotNull : 0);
+      }
+      flags |= entry.hash ? HasHash : 0;
+      flags |= entry.members ? HasMembers : 0;
+
+      writer.put(it->first);
+      writer.put<uint8_t>(flags);
+      writer.put<int64_t>(expiresAt);
+      if (flags & ValueNotNull) {
+        writer.put(**entry.value);
+      }
+      if (entry.hash) {
+        writer.put<uint32_t>(entry.hash->size());
+        for (size_t j = 0; j < entry.hash->size(); ++j) {
+          writer.put((*entry.hash)[j].first);
+          writer.put((*entry.hash)[j].second);
+        }
+      }
+      if (entry.members) {
+        writer.put<uint32_t>(entry.members->size());
+        for (size_t j = 0; j < entry.members->size(); ++j) {
+          writer.put((*entry.members)[j]);
+        }
+      }
+      writer.put<uint32_t>(entry.fields.size());
+      for (auto field = entry.fields.begin(); field != entry.fields.end();
+           ++field) {
+        writer.put(field->first);
+        writer.put<uint8_t>(field->second ? 1 : 0);
+        if (field->second) {
+          writer.put(*field->second);
+        }
+      }
+      ++count;
+    }
+  }
+  memcpy(&data[countOffset], &count, sizeof(count));
+
+  // write to a temporary file and rename it, so a crash never leaves a
+  // partial snapshot behind
+  const std::string tmp = path + ".tmp";
+  {
+    std::filebuf file;
+    if (!file.open(tmp.c_str(),
+                   std::ios::out | std::ios::trunc | std::ios::binary)) {
+      throw std::runtime_error("error creating near cache snapshot " + tmp);
+    }
+    file.pubseekoff(data.size() - 1, std::ios::beg);
+    file.sputc(0);
+  }
+  {
+    ipc::file_mapping mapping(tmp.c_str(), ipc::read_write);
+    ipc::mapped_region region(mapping, ipc::read_write);
+    memcpy(region.get_address(), data.data(), data.size());
+    region.flush();
+  }
+#ifdef _WIN32
+  std::remove(path.c_str());
+#endif
+  if (std::rename(tmp.c_str(), path.c_str())) {
+    throw std::runtime_error("error replacing near cache snapshot " + path);
+  }
+}
+
+size_t NearCache::load(const std::string& path) {
+  namespace ipc = boost::interprocess;
+
+  ipc::file_mapping mapping(path.c_str(), ipc::read_only);
+  ipc::mapped_region region(mapping, ipc::read_only);
+  SnapshotReader reader((const char*)region.get_address(), region.get_size());
+
+  if (region.get_size() < sizeof(s_snapshotMagic) + 16 ||
+      memcmp(reader.get(sizeof(s_snapshotMagic)), s_snapshotMagic,
+             sizeof(s_snapshotMagic)) ||
+      reader.get<uint32_t>() != kSnapshotVersion ||
+      reader.get<uint32_t>() != kSnapshotByteOrder) {
+    return 0;
+  }
+
+  const Clock::time_point now = Clock::now();
+  const int64_t wallNow =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count();
+  // parsed whole before anything is inserted, so that a damaged file loads
+  // nothing; an entry is at least a key length, flags, expiry and field count
+  struct Parsed {
+    std::string key;
+    Entry entry;
+    size_t bytes;
+  };
+  std::vector<Parsed> parsed;
+  const uint64_t count = reader.getCount<uint64_t>(4 + 1 + 8 + 4);
+  parsed.reserve(count);
+  for (uint64_t i = 0; i < count; ++i) {
+    Entry entry;
+    const std::string key = reader.getString();
+    const uint8_t flags = reader.get<uint8_t>();
+    const int64_t expiresAt = reader.get<int64_t>();
+    size_t bytes = 0;
+    if (flags & HasValue) {
+      entry.value = boost::optional<std::string>();
+      if (flags & ValueNotNull) {
+        *entry.value = reader.getString();
+        bytes += (*entry.value)->size();
+      }
+    }
+    if (flags & HasHash) {
+      entry.hash = KeyValueVector(reader.getCount<uint32_t>(8));
+      for (size_t j = 0; j < entry.hash->size(); ++j) {
+        (*entry.hash)[j].first = reader.getString();
+        (*entry.hash)[j].second = reader.getString();
+        bytes += (*entry.hash)[j].first.size() + (*entry.hash)[j].second.size();
+      }
+    }
+    if (flags & HasMembers) {
+      entry.members =
+          std::vector<std::string>(reader.getCount<uint32_t>(4));
+      for (size_t j = 0; j < entry.members->size(); ++j) {
+        (*entry.members)[j] = reader.getString();
+        bytes += (*entry.members)[j].size();
+      }
+    }
+    const uint32_t fields = reader.getCount<uint32_t>(5);
+    for (uint32_t j = 0; j < fields; ++j) {
+      const std::string field = reader.getString();
+      boost::optional<std::string>& value = entry.fields[field];
+      if (reader.get<uint8_t>()) {
+        value = reader.getString();
+        bytes += value->size();
+      }
+      bytes += field.size();
+    }
+
+    if (expiresAt != 0) {
+      if (expiresAt <= wallNow) {
+        continue;
+      }
+      entry.expiresAt = now + std::chrono::milliseconds(expiresAt - wallNow);
+    }
+    entry.serverExpires = (flags & ServerExpires) != 0;
+    entry.verified = false;
+    parsed.push_back(Parsed{key, std::move(entry), bytes});
+  }
+  if (!reader.done()) {
+    throw std::runtime_error("trailing data in near cache snapshot");
+  }
+
+  size_t loaded = 0;
+  for (size_t i = 0; i < parsed.size(); ++i) {
+    const std::string& key = parsed[i].key;
+    size_t hash;
+    Shard& shard = shardFor(key, &hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.entries.count(key)) {
+      // already read since startup
+      continue;
+    }
+    Entry& stored = shard.entries[key];
+    stored = std::move(parsed[i].entry);
+    shard.lru.push_front(key);
+    stored.lru = shard.lru.begin();
+    account(shard, stored, parsed[i].bytes);
+    {
+      std::lock_guard<std::mutex> queueLock(unverifiedMutex);
+      unverified.push_back(key);
+    }
+    ++loaded;
+  }
+  restored += loaded;
+  return loaded;
+}
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "redispp.h"
+#include "script.h"
+#include <atomic>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace redispp {
+
+struct NearCacheStats {
+  NearCacheStats()
+      : hits(0), misses(0), evictions(0), rejections(0), invalidations(0),
+        restored(0), stale(0), entries(0), bytes(0) {}
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t rejections; // fetched values not admitted by TinyLFU
+  uint64_t invalidations;
+  uint64_t restored; // entries loaded from a snapshot
+  uint64_t stale;    // restored entries dropped by revalidation
+  size_t entries;
+  size_t bytes;
+};
+
+// An in-process cache in front of get, hget, hgetAll and smembers, kept
+// coherent with CLIENT TRACKING. With a single connection the connection is
+// switched to RESP3 and invalidations arrive as pushes. With a second
+// connection the invalidations are redirected to it as RESP2 pub/sub messages
+// on __redis__:invalidate. Both connections must be used only through the
+// cache (or, for the RESP3 connection, from the thread holding it) since the
+// cache installs their push handlers. The cache is safe to share between
+// threads; misses are serialized on the connection.
+class NearCache : boost::noncopyable {
+public:
+  struct Options {
+    Options()
+        : maxBytes(64 * 1024 * 1024), shards(16), maxTtlSeconds(0),
+          tinyLfu(true), pollIntervalMicros(0) {}
+
+    // Approximate bound on the memory used by keys and values.
+    size_t maxBytes;
+    // Number of independently locked LRU shards.
+    size_t shards;
+    // Upper bound on how long an entry is served, 0 means until it is
+    // invalidated, expires on the server or is evicted.
+    int maxTtlSeconds;
+    // Only admit a new key over the LRU victim if it is used more often.
+    bool tinyLfu;
+    // How often a cache hit checks the connection for invalidations.
+    int64_t pollIntervalMicros;
+  };
+
+  NearCache(Connection* conn, const Options& options = Options());
+  NearCache(Connection* conn, Connection* invalidations,
+            const Options& options = Options());
+  ~NearCache();
+
+  boost::optional<std::string> get(const std::string& key);
+  boost::optional<std::string> hget(const std::string& key,
+                                    const std::string& field);
+  KeyValueVector hgetAll(const std::string& key);
+  std::vector<std::string> smembers(const std::string& key);
+
+  // Drops the local copy of key.
+  void invalidate(const std::string& key);
+  void clear();
+
+  // Reads invalidations that arrived while the connections were idle, waiting
+  // up to timeoutMs for the first one.
+  size_t poll(int timeoutMs = 0);
+
+  // Writes the cache to a memory-mapped snapshot file, replacing path.
+  void save(const std::string& path) const;
+
+  // Restores entries from a snapshot written by save, returning how many were
+  // loaded. Snapshots of another format version are ignored. Restored entries
+  // are not served until revalidated: the first access to one checks it (and
+  // a batch of other restored entries) with pipelined TTL probes, which also
+  // register the keys for tracking again, and a script comparing digests of
+  // the cached views, so that the values themselves are not read again.
+  size_t load(const std::string& path);
+
+  // Revalidates up to maxEntries restored entries in one round trip,
+  // returning the number checked.
+  size_t revalidate(size_t maxEntries = 256);
+
+  NearCacheStats stats() const;
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Entry {
+    Entry() : bytes(0), verified(true), serverExpires(false) {}
+
+    Clock::time_point expiresAt; // epoch means never
+    boost::optional<boost::optional<std::string>> value;
+    boost::optional<KeyValueVector> hash;
+    boost::optional<std::vector<std::string>> members;
+    std::unordered_map<std::string, boost::optional<std::string>> fields;
+    size_t bytes;
+    std::list<std::string>::iterator lru;
+    bool verified;      // false until a restored entry is revalidated
+    bool serverExpires; // the key had a TTL when it was read
+  };
+
+  typedef std::unordered_map<std::string, Entry> EntryMap;
+
+  // Count-min sketch of recent access frequencies, halved periodically.
+  class FrequencySketch {
+  public:
+    explicit FrequencySketch(size_t width);
+    void increment(size_t hash);
+    unsigned estimate(size_t hash) const;
+
+  private:
+    std::vector<unsigned char> table;
+    size_t mask;
+    size_t additions;
+    size_t sampleSize;
+  };
+
+  struct Shard {
+    Shard(size_t capacity, size_t sketchWidth)
+        : capacity(capacity), bytes(0), epoch(0), sketch(sketchWidth) {}
+
+    std::mutex mutex;
+    size_t capacity;
+    size_t bytes;
+    uint64_t epoch; // bumped on every invalidation
+    EntryMap entries;
+    std::list<std::string> lru; // most recently used first
+    FrequencySketch sketch;
+  };
+
+  template <typename T, typename Lookup, typename Fetch, typename Store>
+  T cached(const std::string& key, Lookup lookup, Fetch fetch, Store store);
+
+  Shard& shardFor(const std::string& key, size_t* hash);
+  void start();
+  void onPush(const Value& push);
+  void invalidateKeys(const Value& keys);
+  void maybePoll();
+  Entry* findEntry(Shard& shard, const std::string& key);
+  Entry* admit(Shard& shard, size_t hash, const std::string& key,
+               uint64_t epoch, int64_t ttl);
+  void account(Shard& shard, Entry& entry, size_t bytes);
+  void erase(Shard& shard, EntryMap::iterator it);
+  size_t verify(const std::string* first, size_t maxEntries);
+
+  Connection* conn;
+  Connection* invalidationConn;
+  Options options;
+  Script digestScript; // see verify
+  std::vector<std::unique_ptr<Shard>> shards;
+  std::mutex connMutex;
+  std::atomic<int64_t> lastPoll;
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+  std::atomic<uint64_t> evictions;
+  std::atomic<uint64_t> rejections;
+  std::atomic<uint64_t> invalidations;
+  std::atomic<uint64_t> restored;
+  std::atomic<uint64_t> stale;
+  std::mutex unverifiedMutex;
+  std::deque<std::string> unverified;
+};
+};
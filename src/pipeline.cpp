@@ -0,0 +1,317 @@
+#include "pipeline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unordered_set>
+
+namespace redispp {
+
+void PipelineBase::appendNumber(size_t number) {
+  char buf[24];
+  const int len = snprintf(buf, sizeof(buf), "%zu\r\n", number);
+  commands.append(buf, len);
+}
+
+void PipelineBase::appendArg(const std::string& arg) {
+  commands += '$';
+  appendNumber(arg.size());
+  commands += arg;
+  commands += "\r\n";
+}
+
+void PipelineBase::appendArg(const char* arg) { appendArg(std::string(arg)); }
+
+void PipelineBase::appendArg(int arg) { appendArg((int64_t)arg); }
+
+void PipelineBase::appendArg(int64_t arg) {
+  char buf[24];
+  snprintf(buf, sizeof(buf), "%lld", (long long)arg);
+  appendArg(std::string(buf));
+}
+
+void PipelineBase::appendArg(double arg) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.17g", arg);
+  appendArg(std::string(buf));
+}
+
+void PipelineBase::appendCommand(const ArgList& args) {
+  if (args.empty()) {
+    throw std::invalid_argument("command requires at least a name");
+  }
+  closeRun();
+  commands += '*';
+  appendNumber(args.size());
+  BOOST_FOREACH (const std::string& arg, args) { appendArg(arg); }
+  ++count;
+}
+
+void PipelineBase::take(PipelineBase& other) {
+  commands.swap(other.commands);
+  count = other.count;
+  other.count = 0;
+  std::swap(open, other.open);
+  runs.swap(other.runs);
+}
+
+void PipelineBase::appendFusable(RunKind kind, const std::string& key,
+                                 const std::string& arg,
+                                 const std::string& value) {
+  if (fusion == KeepCommands) {
+    appendSingle(kind, key, arg, value);
+    ++count;
+    return;
+  }
+  if (open.kind != kind || (kind != GetRun && open.key != key)) {
+    closeRun();
+    open.kind = kind;
+    open.key = key;
+    open.first = count;
+  }
+  if (kind == GetRun) {
+    open.args.push_back(key);
+  } else {
+    open.args.push_back(arg);
+    if (kind == HSetRun) {
+      open.args.push_back(value);
+    }
+  }
+  ++count;
+}
+
+void PipelineBase::appendSingle(RunKind kind, const std::string& key,
+                                const std::string& arg,
+                                const std::string& value) {
+  static const char* const names[] = {NULL, "GET", "HSET", "SADD", "RPUSH"};
+  commands += '*';
+  appendNumber(kind == GetRun ? 2 : kind == HSetRun ? 4 : 3);
+  appendArg(names[kind]);
+  appendArg(key);
+  if (kind != GetRun) {
+    appendArg(arg);
+  }
+  if (kind == HSetRun) {
+    appendArg(value);
+  }
+}
+
+// Appends name, key unless it is NULL, then every stride-th of args.
+void PipelineBase::appendFused(const char* name, const std::string* key,
+                               const std::vector<std::string>& args,
+                               size_t stride) {
+  commands += '*';
+  appendNumber(1 + (key ? 1 : 0) + args.size() / stride);
+  appendArg(name);
+  if (key) {
+    appendArg(*key);
+  }
+  for (size_t i = 0; i < args.size(); i += stride) {
+    appendArg(args[i]);
+  }
+}
+
+// Encodes the open run, fused if it is long enough to gain from it.
+void PipelineBase::closeRun() {
+  if (open.kind == NoRun) {
+    return;
+  }
+  const size_t minimum =
+      open.kind == HSetRun || open.kind == SAddRun ? 3 : 2;
+  if (open.size() < minimum) {
+    const bool hset = open.kind == HSetRun;
+    for (size_t i = 0; i < open.args.size(); i += hset ? 2 : 1) {
+      appendSingle(open.kind, open.kind == GetRun ? open.args[i] : open.key,
+                   open.args[i], hset ? open.args[i + 1] : std::string());
+    }
+  } else {
+    switch (open.kind) {
+    case GetRun:
+      appendFused("MGET", NULL, open.args, 1);
+      break;
+    case HSetRun:
+      appendFused("HMGET", &open.key, open.args, 2);
+      appendFused("HSET", &open.key, open.args, 1);
+      break;
+    case SAddRun:
+      appendFused("SMISMEMBER", &open.key, open.args, 1);
+      appendFused("SADD", &open.key, open.args, 1);
+      break;
+    default:
+      appendFused("RPUSH", &open.key, open.args, 1);
+      break;
+    }
+    runs.push_back(Run());
+    std::swap(runs.back(), open);
+  }
+  open = Run();
+}
+
+void PipelineBase::send() {
+  closeRun();
+  slot = 0;
+  nextRun = 0;
+  if (conn->transaction) {
+    throw std::logic_error("a pipeline cannot run inside a transaction");
+  }
+  if (conn->noReplies || conn->skipReply) {
+    throw std::logic_error("a pipeline needs replies to be on");
+  }
+  // earlier replies come first on the socket
+  conn->readOutstandingReplies();
+  conn->ioStream->write(commands.data(), commands.size());
+  commands.clear();
+  count = 0;
+}
+
+void PipelineBase::finish() {
+  runs.clear();
+  if (error) {
+    std::exception_ptr tmp;
+    std::swap(tmp, error);
+    std::rethrow_exception(tmp);
+  }
+}
+
+void PipelineBase::read(pipeline::Void, bool& out) {
+  conn->readStatusCodeReply();
+  out = true;
+}
+
+void PipelineBase::read(pipeline::Bool, bool& out) {
+  out = conn->readIntegerReply() != 0;
+}
+
+void PipelineBase::read(pipeline::Int, int64_t& out) {
+  out = conn->readIntegerReply();
+}
+
+void PipelineBase::read(pipeline::Bulk, boost::optional<std::string>& out) {
+  conn->readBulkReply(out);
+}
+
+void PipelineBase::read(pipeline::Double, boost::optional<double>& out) {
+  const boost::optional<std::string> text = conn->readBulkReply();
+  if (text) {
+    char* end = NULL;
+    out = strtod(text->c_str(), &end);
+    if (end == text->c_str()) {
+      throw std::runtime_error(std::string("error parsing double: ") + *text);
+    }
+  }
+}
+
+void PipelineBase::read(pipeline::Multi,
+                        std::vector<boost::optional<std::string>>& out) {
+  conn->readErrorReply();
+  const char code = conn->statusCode();
+  const size_t count = conn->readAggregateHeader(code);
+  // RESP3 maps are read as alternating keys and values
+  out.resize(code == '%' ? count * 2 : count);
+  for (size_t i = 0; i < out.size(); ++i) {
+    conn->readBulkReply(out[i]);
+  }
+}
+
+void PipelineBase::read(pipeline::Any, Value& out) {
+  conn->readReply(out);
+  if (out.isError()) {
+    throw std::runtime_error(std::string("Received Error: ") + out.str);
+  }
+}
+
+// The fused run the current slot is in, if any. Its replies are read when
+// its first slot is.
+PipelineBase::Run* PipelineBase::fusedRun() {
+  if (nextRun == runs.size() || slot < runs[nextRun].first) {
+    return NULL;
+  }
+  Run& run = runs[nextRun];
+  if (slot == run.first) {
+    readRun(run);
+  }
+  if (slot + 1 == run.first + run.size()) {
+    ++nextRun;
+  }
+  return &run;
+}
+
+void PipelineBase::readRun(Run& run) {
+  const size_t size = run.size();
+  std::vector<boost::optional<std::string>> fields;
+  Value members;
+  try {
+    if (run.kind == HSetRun) {
+      read(pipeline::Multi(), fields);
+    } else if (run.kind == SAddRun) {
+      read(pipeline::Any(), members);
+    }
+  } catch (...) {
+    run.error = std::current_exception();
+  }
+  int64_t total = 0;
+  try {
+    if (run.kind == GetRun) {
+      read(pipeline::Multi(), run.values);
+    } else {
+      read(pipeline::Int(), total);
+    }
+  } catch (...) {
+    if (!run.error) {
+      run.error = std::current_exception();
+    }
+  }
+  if (run.error || run.kind == GetRun) {
+    return;
+  }
+
+  run.numbers.resize(size);
+  if (run.kind == RPushRun) {
+    // the length after each push
+    for (size_t i = 0; i < size; ++i) {
+      run.numbers[i] = total - int64_t(size - 1 - i);
+    }
+    return;
+  }
+  // added if absent before and not added earlier in the run
+  std::unordered_set<std::string> added;
+  for (size_t i = 0; i < size; ++i) {
+    const bool existed = run.kind == HSetRun
+                             ? fields.at(i).is_initialized()
+                             : members.elements.at(i).integer != 0;
+    const std::string& name = run.args[run.kind == HSetRun ? 2 * i : i];
+    run.numbers[i] = !existed && added.insert(name).second ? 1 : 0;
+  }
+}
+
+bool PipelineBase::readFused(boost::optional<std::string>& out) {
+  Run* const run = fusedRun();
+  if (!run) {
+    return false;
+  }
+  if (run->error) {
+    std::rethrow_exception(run->error);
+  }
+  out.swap(run->values.at(slot - run->first));
+  return true;
+}
+
+bool PipelineBase::readFused(int64_t& out) {
+  Run* const run = fusedRun();
+  if (!run) {
+    return false;
+  }
+  if (run->error) {
+    std::rethrow_exception(run->error);
+  }
+  out = run->numbers.at(slot - run->first);
+  return true;
+}
+
+bool PipelineBase::readFused(bool& out) {
+  int64_t number = 0;
+  if (!readFused(number)) {
+    return false;
+  }
+  out = number != 0;
+  return true;
+}
+};
@@ -0,0 +1,329 @@
+#pragma once
+
+#include "redispp.h"
+#include <exception>
+#include <tuple>
+#include <vector>
+
+namespace redispp {
+
+// Whether a Pipeline fuses runs of compatible commands, see Pipeline.
+enum PipelineFusion {
+  KeepCommands,
+  FuseCommands,
+};
+
+// Reply kinds of pipelined commands, each naming the type its reply is parsed
+// into.
+namespace pipeline {
+struct Void {
+  typedef bool Type;
+};
+struct Bool {
+  typedef bool Type;
+};
+struct Int {
+  typedef int64_t Type;
+};
+struct Bulk {
+  typedef boost::optional<std::string> Type;
+};
+struct Double {
+  typedef boost::optional<double> Type;
+};
+struct Multi {
+  typedef std::vector<boost::optional<std::string>> Type;
+};
+struct Any {
+  typedef Value Type;
+};
+
+template <size_t...> struct Indices {};
+
+template <size_t N, size_t... Is>
+struct MakeIndices : MakeIndices<N - 1, N - 1, Is...> {};
+
+template <size_t... Is> struct MakeIndices<0, Is...> {
+  typedef Indices<Is...> Type;
+};
+};
+
+class PipelineBase {
+protected:
+  enum RunKind {
+    NoRun,
+    GetRun,
+    HSetRun,
+    SAddRun,
+    RPushRun,
+  };
+
+  // Consecutive fusable commands, GETs of any keys or the others on one key.
+  struct Run {
+    Run() : kind(NoRun), first(0) {}
+
+    size_t size() const {
+      return kind == HSetRun ? args.size() / 2 : args.size();
+    }
+
+    RunKind kind;
+    std::string key;
+    // the keys of GETs, otherwise the fields and values, members or values
+    std::vector<std::string> args;
+    size_t first; // slot of the first command
+    // the results, once read
+    std::vector<boost::optional<std::string>> values;
+    std::vector<int64_t> numbers;
+    std::exception_ptr error;
+  };
+
+  PipelineBase(Connection* conn, PipelineFusion fusion)
+      : conn(conn), count(0), fusion(fusion), slot(0), nextRun(0) {}
+
+  // Takes the queued commands of other.
+  void take(PipelineBase& other);
+
+  template <typename... Args> void append(const Args&... args) {
+    closeRun();
+    commands += '*';
+    appendNumber(sizeof...(Args));
+    int expand[] = {0, (appendArg(args), 0)...};
+    (void)expand;
+    ++count;
+  }
+
+  void appendArg(const std::string& arg);
+  void appendArg(const char* arg);
+  void appendArg(int arg);
+  void appendArg(int64_t arg);
+  void appendArg(double arg);
+  void appendNumber(size_t number);
+  void appendCommand(const ArgList& args);
+
+  // Queues GET, HSET, SADD or RPUSH, which is fused with the commands before
+  // it when fusing.
+  void appendFusable(RunKind kind, const std::string& key,
+                     const std::string& arg = std::string(),
+                     const std::string& value = std::string());
+  void appendSingle(RunKind kind, const std::string& key,
+                    const std::string& arg, const std::string& value);
+  void appendFused(const char* name, const std::string* key,
+                   const std::vector<std::string>& args, size_t stride);
+  void closeRun();
+
+  // Reads the replies outstanding on the connection, then writes the whole
+  // batch with one write.
+  void send();
+
+  // Reads one reply, keeping the first error for finish so that the rest of
+  // the batch is still consumed.
+  template <typename Kind> void readSlot(Kind kind, typename Kind::Type& out) {
+    try {
+      if (!readFused(out)) {
+        read(kind, out);
+      }
+    } catch (...) {
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+    ++slot;
+  }
+
+  // Takes the result of the current slot from its fused run, if it is in
+  // one, returning whether it was.
+  bool readFused(boost::optional<std::string>& out);
+  bool readFused(int64_t& out);
+  bool readFused(bool& out);
+  template <typename T> bool readFused(T&) { return false; }
+  Run* fusedRun();
+  void readRun(Run& run);
+
+  void read(pipeline::Void, bool& out);
+  void read(pipeline::Bool, bool& out);
+  void read(pipeline::Int, int64_t& out);
+  void read(pipeline::Bulk, boost::optional<std::string>& out);
+  void read(pipeline::Double, boost::optional<double>& out);
+  void read(pipeline::Multi, std::vector<boost::optional<std::string>>& out);
+  void read(pipeline::Any, Value& out);
+
+  // Rethrows the first error of the batch.
+  void finish();
+
+  Connection* conn;
+  std::string commands;
+  size_t count; // commands queued, counting each fused one
+  std::exception_ptr error;
+  PipelineFusion fusion;
+  Run open;              // not yet encoded
+  std::vector<Run> runs; // fused, in the order sent
+  size_t slot;           // being read
+  size_t nextRun;        // the run slot is in or comes before
+};
+
+// A batch of commands whose result types are known at compile time. Adding a
+// command returns a new pipeline with the command's result type appended,
+// moving the queued commands out of the one it was called on, so calls are
+// meant to be chained:
+//
+//   std::tuple<bool, boost::optional<std::string>, int64_t> results =
+//       Pipeline<>(&conn).set("a", "1").get("a").incr("n").execute();
+//
+// execute encodes the whole batch into one write and parses every reply
+// straight into the result tuple, without creating reply objects. If any
+// command fails the rest of the replies are still read, then the first error
+// is thrown.
+//
+// With FuseCommands, runs of consecutive gets, or of hsets, sadds or rpushes
+// to one key, are sent as one MGET, multi-field HSET, variadic SADD or RPUSH,
+// and each command's result is recovered from the combined reply. To tell
+// which fields or members are new, a fused HSET or SADD is preceded by an
+// HMGET or SMISMEMBER (Redis 6.2) of them, so it is only done for runs of at
+// least three. Results then differ from separate commands in two ways: a
+// fused get of a key that is not a string returns nothing instead of failing,
+// and a client changing the hash or set between the two commands can make the
+// new-field flags wrong (the writes themselves are not affected).
+template <typename... Kinds> class Pipeline : public PipelineBase {
+  template <typename...> friend class Pipeline;
+
+public:
+  typedef std::tuple<typename Kinds::Type...> Results;
+
+  explicit Pipeline(Connection* conn, PipelineFusion fusion = KeepCommands)
+      : PipelineBase(conn, fusion) {}
+
+  // Queues any command, its reply parsed as Kind.
+  template <typename Kind, typename... Args>
+  Pipeline<Kinds..., Kind> add(const Args&... args) {
+    append(args...);
+    return Pipeline<Kinds..., Kind>(*this);
+  }
+
+  // Queues any command, the first element of args being its name.
+  Pipeline<Kinds..., pipeline::Any> command(const ArgList& args) {
+    appendCommand(args);
+    return Pipeline<Kinds..., pipeline::Any>(*this);
+  }
+
+  Pipeline<Kinds..., pipeline::Void> set(const std::string& key,
+                                         const std::string& value) {
+    return add<pipeline::Void>("SET", key, value);
+  }
+  Pipeline<Kinds..., pipeline::Void>
+  setEx(const std::string& key, int seconds, const std::string& value) {
+    return add<pipeline::Void>("SETEX", key, seconds, value);
+  }
+  Pipeline<Kinds..., pipeline::Bulk> get(const std::string& key) {
+    appendFusable(GetRun, key);
+    return Pipeline<Kinds..., pipeline::Bulk>(*this);
+  }
+  Pipeline<Kinds..., pipeline::Bool> del(const std::string& key) {
+    return add<pipeline::Bool>("DEL", key);
+  }
+  Pipeline<Kinds..., pipeline::Bool> exists(const std::string& key) {
+    return add<pipeline::Bool>("EXISTS", key);
+  }
+  Pipeline<Kinds..., pipeline::Bool> expire(const std::string& key,
+                                            int seconds) {
+    return add<pipeline::Bool>("EXPIRE", key, seconds);
+  }
+  Pipeline<Kinds..., pipeline::Int> incr(const std::string& key) {
+    return add<pipeline::Int>("INCR", key);
+  }
+  Pipeline<Kinds..., pipeline::Int> incrBy(const std::string& key,
+                                           int64_t value) {
+    return add<pipeline::Int>("INCRBY", key, value);
+  }
+  Pipeline<Kinds..., pipeline::Int> rpush(const std::string& key,
+                                          const std::string& value) {
+    appendFusable(RPushRun, key, value);
+    return Pipeline<Kinds..., pipeline::Int>(*this);
+  }
+  Pipeline<Kinds..., pipeline::Int> lpush(const std::string& key,
+                                          const std::string& value) {
+    return add<pipeline::Int>("LPUSH", key, value);
+  }
+  Pipeline<Kinds..., pipeline::Bulk> lpop(const std::string& key) {
+    return add<pipeline::Bulk>("LPOP", key);
+  }
+  Pipeline<Kinds..., pipeline::Bulk> rpop(const std::string& key) {
+    return add<pipeline::Bulk>("RPOP", key);
+  }
+  Pipeline<Kinds..., pipeline::Multi> lrange(const std::string& key,
+                                             int64_t start, int64_t stop) {
+    return add<pipeline::Multi>("LRANGE", key, start, stop);
+  }
+  Pipeline<Kinds..., pipeline::Bool> sadd(const std::string& key,
+                                          const std::string& member) {
+    appendFusable(SAddRun, key, member);
+    return Pipeline<Kinds..., pipeline::Bool>(*this);
+  }
+  Pipeline<Kinds..., pipeline::Bool> srem(const std::string& key,
+                                          const std::string& member) {
+    return add<pipeline::Bool>("SREM", key, member);
+  }
+  Pipeline<Kinds..., pipeline::Bool> sisMember(const std::string& key,
+                                               const std::string& member) {
+    return add<pipeline::Bool>("SISMEMBER", key, member);
+  }
+  Pipeline<Kinds..., pipeline::Multi> smembers(const std::string& key) {
+    return add<pipeline::Multi>("SMEMBERS", key);
+  }
+  Pipeline<Kinds..., pipeline::Bool> hset(const std::string& key,
+                                          const std::string& field,
+                                          const std::string& value) {
+    appendFusable(HSetRun, key, field, value);
+    return Pipeline<Kinds..., pipeline::Bool>(*this);
+  }
+  Pipeline<Kinds..., pipeline::Bulk> hget(const std::string& key,
+                                          const std::string& field) {
+    return add<pipeline::Bulk>("HGET", key, field);
+  }
+  Pipeline<Kinds..., pipeline::Bool> hdel(const std::string& key,
+                                          const std::string& field) {
+    return add<pipeline::Bool>("HDEL", key, field);
+  }
+  Pipeline<Kinds..., pipeline::Int>
+  hincrBy(const std::string& key, const std::string& field, int64_t value) {
+    return add<pipeline::Int>("HINCRBY", key, field, value);
+  }
+  Pipeline<Kinds..., pipeline::Multi> hgetAll(const std::string& key) {
+    return add<pipeline::Multi>("HGETALL", key);
+  }
+  Pipeline<Kinds..., pipeline::Bool>
+  zadd(const std::string& key, double score, const std::string& member) {
+    return add<pipeline::Bool>("ZADD", key, score, member);
+  }
+  Pipeline<Kinds..., pipeline::Double> zscore(const std::string& key,
+                                              const std::string& member) {
+    return add<pipeline::Double>("ZSCORE", key, member);
+  }
+  Pipeline<Kinds..., pipeline::Double>
+  zincrBy(const std::string& key, double increment, const std::string& member) {
+    return add<pipeline::Double>("ZINCRBY", key, increment, member);
+  }
+
+  size_t size() const { return count; }
+
+  Results execute() {
+    Results results;
+    send();
+    readAll(results, typename pipeline::MakeIndices<sizeof...(Kinds)>::Type());
+    finish();
+    return results;
+  }
+
+private:
+  template <typename... Others>
+  explicit Pipeline(Pipeline<Others...>& other)
+      : PipelineBase(other.conn, other.fusion) {
+    take(other);
+  }
+
+  template <size_t... Is>
+  void readAll(Results& results, pipeline::Indices<Is...>) {
+    int expand[] = {0, (readSlot(Kinds(), std::get<Is>(results)), 0)...};
+    (void)expand;
+  }
+};
+};
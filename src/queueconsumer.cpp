@@ -0,0 +1,196 @@
+#include "queueconsumer.h"
+#include <boost/lexical_cast.hpp>
+#include <list>
+#include <mutex>
+#include <thread>
+
+namespace redispp {
+
+// Moves up to ARGV[1] items from the queue to the processing list.
+static const char* kMoveBatch =
+    "local items = {}\n"
+    "for i = 1, tonumber(ARGV[1]) do\n"
+    "  local item = redis.call('RPOPLPUSH', KEYS[1], KEYS[2])\n"
+    "  if not item then break end\n"
+    "  items[i] = item\n"
+    "end\n"
+    "return items\n";
+
+// Moves the processing list back to the consuming end of the queue, oldest
+// item last so that it is taken first.
+static const char* kRestore =
+    "local count = 0\n"
+    "local item = redis.call('LPOP', KEYS[1])\n"
+    "while item do\n"
+    "  redis.call('RPUSH', KEYS[2], item)\n"
+    "  count = count + 1\n"
+    "  item = redis.call('LPOP', KEYS[1])\n"
+    "end\n"
+    "return count\n";
+
+QueueConsumer::QueueConsumer(Connection* conn, const std::string& queue,
+                             const QueueOptions& options)
+    : queue(queue), options(options), moveBatch(kMoveBatch),
+      restore(kRestore), stopping(false) {
+  init(std::vector<Connection*>(1, conn));
+}
+
+QueueConsumer::QueueConsumer(const std::vector<Connection*>& pool,
+                             const std::string& queue,
+                             const QueueOptions& options)
+    : queue(queue), options(options), moveBatch(kMoveBatch),
+      restore(kRestore), stopping(false) {
+  init(pool);
+}
+
+void QueueConsumer::init(const std::vector<Connection*>& pool) {
+  if (pool.empty()) {
+    throw std::invalid_argument("QueueConsumer requires a connection");
+  }
+  if (options.batchSize == 0) {
+    throw std::invalid_argument("QueueConsumer requires a batch size");
+  }
+  const std::string prefix = options.processing.empty()
+                                 ? queue + ":processing"
+                                 : options.processing;
+  for (size_t i = 0; i < pool.size(); ++i) {
+    slots.emplace_back(new Slot(
+        pool[i], prefix + ":" + boost::lexical_cast<std::string>(i)));
+  }
+}
+
+const std::string& QueueConsumer::processingList(size_t index) const {
+  return slots.at(index)->processing;
+}
+
+void QueueConsumer::fetch(Batch& items) { fetch(*slots[0], items); }
+
+void QueueConsumer::ack(const Batch& items) { ack(*slots[0], items); }
+
+void QueueConsumer::ack(Slot& slot, const Batch& items) {
+  std::list<IntReply> replies;
+  BOOST_FOREACH (const std::string& item, items) {
+    replies.push_back(slot.conn->lrem(slot.processing, 1, item));
+  }
+  BOOST_FOREACH (IntReply& reply, replies) { reply.result(); }
+}
+
+// Sends the pending acknowledgements of the slot followed by the fetch, so
+// that both take one round trip.
+void QueueConsumer::fetch(Slot& slot, Batch& items) {
+  Connection* const conn = slot.conn;
+  items.clear();
+  std::list<IntReply> acked;
+  BOOST_FOREACH (const std::string& item, slot.acks) {
+    acked.push_back(conn->lrem(slot.processing, 1, item));
+  }
+  slot.acks.clear();
+
+  const std::string count =
+      boost::lexical_cast<std::string>(options.batchSize);
+  ArgList args;
+  Value batch;
+  if (options.mode == Reliable) {
+    ArgList keys;
+    keys.push_back(queue);
+    keys.push_back(slot.processing);
+    args.push_back(count);
+    batch = moveBatch.run(conn, keys, args).result();
+  } else {
+    args.push_back("RPOP");
+    args.push_back(queue);
+    args.push_back(count);
+    batch = conn->command(args).result();
+  }
+  BOOST_FOREACH (IntReply& reply, acked) { reply.result(); }
+  BOOST_FOREACH (Value& item, batch.elements) {
+    items.push_back(std::string());
+    items.back().swap(item.str);
+  }
+  if (!items.empty() || options.blockSeconds <= 0) {
+    return;
+  }
+
+  args.clear();
+  const std::string timeout =
+      boost::lexical_cast<std::string>(options.blockSeconds);
+  if (options.mode == Reliable) {
+    args.push_back("BRPOPLPUSH");
+    args.push_back(queue);
+    args.push_back(slot.processing);
+    args.push_back(timeout);
+    Value item = conn->command(args).result();
+    if (!item.isNil()) {
+      items.push_back(std::string());
+      items.back().swap(item.str);
+    }
+  } else {
+    args.push_back("BRPOP");
+    args.push_back(queue);
+    args.push_back(timeout);
+    Value popped = conn->command(args).result();
+    if (popped.elements.size() == 2) {
+      items.push_back(std::string());
+      items.back().swap(popped.elements[1].str);
+    }
+  }
+}
+
+void QueueConsumer::consume(Slot& slot, const BatchHandler& handler) {
+  Batch items;
+  while (!stopping) {
+    fetch(slot, items);
+    if (!items.empty()) {
+      handler(items);
+      if (options.mode == Reliable) {
+        slot.acks.swap(items);
+      }
+    }
+  }
+  if (!slot.acks.empty()) {
+    // sent by the next fetch otherwise
+    ack(slot, slot.acks);
+  }
+}
+
+void QueueConsumer::run(const BatchHandler& handler) {
+  std::mutex mutex;
+  std::exception_ptr error;
+  std::vector<std::thread> threads;
+  BOOST_FOREACH (std::unique_ptr<Slot>& slot, slots) {
+    Slot* const current = slot.get();
+    threads.emplace_back([&, current]() {
+      try {
+        consume(*current, handler);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+        stopping = true;
+      }
+    });
+  }
+  BOOST_FOREACH (std::thread& thread, threads) { thread.join(); }
+  stopping = false;
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+size_t QueueConsumer::recover() {
+  Connection* const conn = slots[0]->conn;
+  std::list<ScriptReply> replies;
+  BOOST_FOREACH (const std::unique_ptr<Slot>& slot, slots) {
+    ArgList keys;
+    keys.push_back(slot->processing);
+    keys.push_back(queue);
+    replies.push_back(restore.run(conn, keys));
+  }
+  size_t moved = 0;
+  BOOST_FOREACH (ScriptReply& reply, replies) {
+    moved += size_t(reply.result().integer);
+  }
+  return moved;
+}
+};
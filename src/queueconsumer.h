@@ -0,0 +1,99 @@
+#pragma once
+
+#include "redispp.h"
+#include "script.h"
+#include <atomic>
+#include <boost/noncopyable.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace redispp {
+
+enum QueueMode {
+  // Items are popped and lost if the consumer dies before handling them.
+  AtMostOnce,
+  // Items are moved to a processing list of the consumer and removed from it
+  // once acknowledged. recover puts unacknowledged items back on the queue.
+  Reliable,
+};
+
+struct QueueOptions {
+  QueueOptions() : mode(Reliable), batchSize(100), blockSeconds(1) {}
+
+  QueueMode mode;
+  size_t batchSize;
+  // How long to block waiting for an item when the queue is empty, 0 to
+  // return at once.
+  int blockSeconds;
+  // The processing lists are named processing:0, processing:1... for each
+  // connection. Defaults to queue + ":processing". It must be unique to the
+  // process if several processes consume the same queue.
+  std::string processing;
+};
+
+// Consumes a list used as a FIFO work queue (producers LPUSH, consumers take
+// from the right) in batches, one round trip per batch instead of per item.
+// An at-most-once batch is one RPOP with a count. A reliable batch is moved to
+// the processing list by a script. Only when the queue is empty does the
+// consumer block, with BRPOP or BRPOPLPUSH for a single item. run pipelines
+// the acknowledgements of a batch (one LREM per item) with the next fetch.
+//
+// With a pool, run consumes with a thread per connection. The connections
+// must not be used directly while the consumer exists.
+class QueueConsumer : boost::noncopyable {
+public:
+  typedef std::vector<std::string> Batch;
+  typedef std::function<void(const Batch& items)> BatchHandler;
+
+  QueueConsumer(Connection* conn, const std::string& queue,
+                const QueueOptions& options = QueueOptions());
+  QueueConsumer(const std::vector<Connection*>& pool, const std::string& queue,
+                const QueueOptions& options = QueueOptions());
+
+  // Fetches up to batchSize items into items, oldest first, using the first
+  // connection. Reliable items must be passed to ack once handled.
+  void fetch(Batch& items);
+  // Removes handled items from the processing list with pipelined LREMs.
+  void ack(const Batch& items);
+
+  // Fetches batches on every connection and passes them to handler, which may
+  // be called from several threads at once. A batch is acknowledged when the
+  // handler returns. Returns when stop is called, which takes up to
+  // blockSeconds, or rethrows the first exception of a handler after the
+  // other threads stopped. The batch the handler failed on stays in the
+  // processing list.
+  void run(const BatchHandler& handler);
+  void stop() { stopping = true; }
+
+  // Moves the items left in the processing lists, by a previous run of the
+  // process that did not acknowledge them, back to the consuming end of the
+  // queue. Returns the number of items moved.
+  size_t recover();
+
+  // The processing list of the connection at index.
+  const std::string& processingList(size_t index) const;
+
+private:
+  struct Slot {
+    Slot(Connection* conn, const std::string& processing)
+        : conn(conn), processing(processing) {}
+
+    Connection* conn;
+    std::string processing;
+    Batch acks; // handled but not yet acknowledged
+  };
+
+  void init(const std::vector<Connection*>& pool);
+  void fetch(Slot& slot, Batch& items);
+  void ack(Slot& slot, const Batch& items);
+  void consume(Slot& slot, const BatchHandler& handler);
+
+  std::string queue;
+  QueueOptions options;
+  std::vector<std::unique_ptr<Slot>> slots;
+  Script moveBatch;
+  Script restore;
+  std::atomic<bool> stopping;
+};
+};
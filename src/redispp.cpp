@@ -1,5 +1,8 @@
 #include "redispp.h"
 #include <errno.h>
+#include <limits>
+#include <random>
+#include <thread>
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -21,6 +24,7 @@ static const char* getLastErrorMessage() {
 #else
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
@@ -47,7 +51,7 @@ namespace redispp {
 class ClientSocket : boost::noncopyable {
 public:
   ClientSocket(const char* host, const char* port)
-      : sockFd(-1), streamBuf(this) {
+      : sockFd(-1), streamBuf(this), received(0) {
     struct addrinfo hints;
     struct addrinfo* res = NULL;
 
@@ -82,7 +86,8 @@ public:
   }
 
 #ifndef _WIN32
-  ClientSocket(const char* unixDomainSocket) : sockFd(-1), streamBuf(this) {
+  ClientSocket(const char* unixDomainSocket)
+      : sockFd(-1), streamBuf(this), received(0) {
     struct sockaddr_un sockaddr;
     sockaddr.sun_family = AF_UNIX;
     strncpy(sockaddr.sun_path, unixDomainSocket, sizeof(sockaddr.sun_path));
@@ -106,6 +111,10 @@ public:
   }
 #endif
 
+  explicit ClientSocket(std::unique_ptr<Transport> transport)
+      : sockFd(-1), streamBuf(this), received(0),
+        transport(std::move(transport)) {}
+
   void tcpNoDelay(bool enable) {
     const bool ret = setSocketFlag(sockFd, IPPROTO_TCP, TCP_NODELAY, enable);
     if (!ret) {
@@ -115,6 +124,10 @@ public:
   }
 
   void write(const void* data, size_t len) {
+    if (transport) {
+      transport->write(data, len);
+      return;
+    }
     size_t sent = 0;
     while (sent < len) {
       const ssize_t ret =
@@ -127,15 +140,55 @@ public:
     }
   }
 
+  bool waitReadable(int timeoutMs) {
+    if (transport) {
+      return transport->waitReadable(timeoutMs);
+    }
+#ifdef _WIN32
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(sockFd, &fds);
+    struct timeval tv;
+    tv.tv_sec = timeoutMs / 1000;
+    tv.tv_usec = (timeoutMs % 1000) * 1000;
+    const int ret = select(0, &fds, NULL, NULL, timeoutMs < 0 ? NULL : &tv);
+#else
+    struct pollfd pfd;
+    pfd.fd = sockFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    const int ret = ::poll(&pfd, 1, timeoutMs);
+#endif
+    if (ret < 0) {
+      throw std::runtime_error(std::string("error polling socket: ") +
+                               getLastErrorMessage());
+    }
+    return ret > 0;
+  }
+
   size_t read(void* data, size_t len) {
+    if (transport) {
+      const size_t got = transport->read(data, len);
+      received += got;
+      return got;
+    }
     const ssize_t ret = ::recv(sockFd, (RecvBufferType)data, len, 0);
     if (ret <= 0) {
       throw std::runtime_error(std::string("error reading from socket: ") +
                                getLastErrorMessage());
     }
+    received += ret;
     return ret;
   }
 
+  uint64_t bytesReceived() const { return received; }
+
+  // Consumes text if it comes next in the receive buffer, after the line
+  // ending left over from the previous reply.
+  bool skipBuffered(const char* text, size_t len) {
+    return streamBuf.skip(text, len);
+  }
+
   ~ClientSocket() {
     if (sockFd >= 0) {
       close(sockFd);
@@ -210,6 +263,19 @@ public:
       return numRead;
     }
 
+    bool skip(const char* text, size_t len) {
+      char* begin = gptr();
+      char* const end = egptr();
+      while (begin < end && (*begin == '\r' || *begin == '\n')) {
+        ++begin;
+      }
+      if (size_t(end - begin) < len || memcmp(begin, text, len) != 0) {
+        return false;
+      }
+      setg(eback(), begin + len, end);
+      return true;
+    }
+
   private:
     char outBuffer[1400];
     char inBuffer[1400];
@@ -219,6 +285,8 @@ public:
 private:
   SOCKET sockFd;
   StreamBuf streamBuf;
+  uint64_t received;
+  std::unique_ptr<Transport> transport; // used instead of sockFd if set
 };
 
 class Buffer {
@@ -303,6 +371,8 @@ public:
 
   void resetToMark() { spot = marked; }
 
+  size_t available() const { return end - spot; }
+
   void checkSpace(size_t needed) {
     if (spot + needed >= end) {
       throw std::runtime_error("buffer is full: spot + needed >= end");
@@ -339,59 +409,136 @@ private:
   do {                                                                         \
     buffer->resetToMark();                                                     \
     _##cmd##Command.execute(buffer);                                           \
-    ioStream->write(buffer->data(), buffer->length());                         \
+    send();                                                                    \
   } while (0)
 
 #define EXECUTE_COMMAND_SYNC1(cmd, arg1)                                       \
   do {                                                                         \
     buffer->resetToMark();                                                     \
     _##cmd##Command.execute(arg1, buffer);                                     \
-    ioStream->write(buffer->data(), buffer->length());                         \
+    send();                                                                    \
   } while (0)
 
 #define EXECUTE_COMMAND_SYNC2(cmd, arg1, arg2)                                 \
   do {                                                                         \
     buffer->resetToMark();                                                     \
     _##cmd##Command.execute(arg1, arg2, buffer);                               \
-    ioStream->write(buffer->data(), buffer->length());                         \
+    send();                                                                    \
   } while (0)
 
 #define EXECUTE_COMMAND_SYNC3(cmd, arg1, arg2, arg3)                           \
   do {                                                                         \
     buffer->resetToMark();                                                     \
     _##cmd##Command.execute(arg1, arg2, arg3, buffer);                         \
-    ioStream->write(buffer->data(), buffer->length());                         \
+    send();                                                                    \
   } while (0)
 
+static double parseDouble(const std::string& text) {
+  // strtod understands the inf, -inf and nan spellings used by RESP3
+  char* end = NULL;
+  const double ret = strtod(text.c_str(), &end);
+  if (end == text.c_str()) {
+    throw std::runtime_error(std::string("error parsing double: ") + text);
+  }
+  return ret;
+}
+
+static std::string formatDouble(double value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.17g", value);
+  return buf;
+}
+
 NullReplyException::NullReplyException()
     : std::out_of_range("Casting null bulk reply to string") {}
 
-BaseReply::BaseReply(Connection* conn) : conn(conn) {
+BaseReply::BaseReply(Connection* conn)
+    : conn(conn), ignored(false), hasError(false) {
+  if (conn->noReplies || conn->replySkipped) {
+    // nothing will arrive for this reply
+    conn->replySkipped = false;
+    this->conn = NULL;
+    return;
+  }
   conn->outstandingReplies.push_back(*this);
+  ++conn->pendingEstimate;
+  ++conn->repliesQueued;
   if (conn->transaction) {
     conn->transaction->replies.count += 1;
   }
 }
 
-BaseReply::BaseReply(const BaseReply& other) : conn(other.conn) {
-  other.conn = NULL;
-  if (conn)
+BaseReply::BaseReply(BaseReply&& other) noexcept
+    : conn(other.conn), ignored(other.ignored), hasError(other.hasError),
+      errorText(std::move(other.errorText)) {
+  if (other.is_linked()) {
     conn->outstandingReplies.insert(conn->outstandingReplies.iterator_to(other),
                                     *this);
-  const_cast<BaseReply&>(other).unlink();
+    other.unlink();
+  }
+  other.conn = NULL;
 }
 
-BaseReply& BaseReply::operator=(const BaseReply& other) {
+BaseReply& BaseReply::operator=(BaseReply&& other) noexcept {
+  if (this == &other) {
+    return *this;
+  }
+  if (conn) {
+    try {
+      readResult();
+    } catch (...) {
+    }
+  }
   unlink();
   conn = other.conn;
-  if (conn)
+  ignored = other.ignored;
+  hasError = other.hasError;
+  errorText = std::move(other.errorText);
+  if (other.is_linked()) {
     conn->outstandingReplies.insert(conn->outstandingReplies.iterator_to(other),
                                     *this);
+    other.unlink();
+  }
   other.conn = NULL;
-  const_cast<BaseReply&>(other).unlink();
   return *this;
 }
 
+bool BaseReply::readServerError(Connection* from) {
+  hasError = from->readError(errorText);
+  return hasError;
+}
+
+void BaseReply::throwError() const {
+  if (hasError) {
+    throw std::runtime_error("Received Error: " + errorText);
+  }
+}
+
+bool BaseReply::heldInTransaction() {
+  if (!conn->transaction || !conn->holdPlace(*this)) {
+    return false;
+  }
+  conn = NULL;
+  hasError = true;
+  errorText = "reply read before its transaction was committed";
+  return true;
+}
+
+bool BaseReply::skipIgnored() {
+  if (heldInTransaction()) {
+    return true;
+  }
+  if (!ignored) {
+    return false;
+  }
+  clearPendingResults();
+  Connection* const tmp = conn;
+  conn = NULL;
+  unlink();
+  tmp->skipValue();
+  return true;
+}
+
 void BaseReply::clearPendingResults() {
   ReplyList::iterator cur = conn->outstandingReplies.begin();
   ReplyList::iterator const end = conn->outstandingReplies.iterator_to(*this);
@@ -406,98 +553,452 @@ VoidReply::VoidReply(Connection* conn) : BaseReply(conn), storedResult(false) {}
 
 VoidReply::~VoidReply() {
   try {
-    result();
+    readResult();
   } catch (...) {
   }
 }
 
-bool VoidReply::result() {
-  if (conn) {
+void VoidReply::readResult() {
+  if (conn && !skipIgnored()) {
     clearPendingResults();
     Connection* const tmp = conn;
     conn = NULL;
-    tmp->readStatusCodeReply();
-    storedResult = true;
     unlink();
+    if (!readServerError(tmp)) {
+      tmp->readStatusCodeReply();
+      storedResult = true;
+    }
   }
+}
+
+bool VoidReply::result() {
+  readResult();
+  throwError();
   return storedResult;
 }
 
+Expected<bool> VoidReply::tryResult() {
+  readResult();
+  return Expected<bool>(storedResult, hasError, errorText);
+}
+
 BoolReply::BoolReply(Connection* conn) : BaseReply(conn), storedResult(false) {}
 
 BoolReply::~BoolReply() {
   try {
-    result();
+    readResult();
   } catch (...) {
   }
 }
 
-bool BoolReply::result() {
-  if (conn) {
+void BoolReply::readResult() {
+  if (conn && !skipIgnored()) {
     clearPendingResults();
     Connection* const tmp = conn;
     conn = NULL;
-    storedResult = tmp->readIntegerReply() > 0;
     unlink();
+    if (!readServerError(tmp)) {
+      storedResult = tmp->readIntegerReply() > 0;
+    }
   }
+}
+
+bool BoolReply::result() {
+  readResult();
+  throwError();
   return storedResult;
 }
 
+Expected<bool> BoolReply::tryResult() {
+  readResult();
+  return Expected<bool>(storedResult, hasError, errorText);
+}
+
 IntReply::IntReply(Connection* conn) : BaseReply(conn), storedResult(0) {}
 
 IntReply::~IntReply() {
   try {
-    result();
+    readResult();
   } catch (...) {
   }
 }
 
-int64_t IntReply::result() {
-  if (conn) {
+void IntReply::readResult() {
+  if (conn && !skipIgnored()) {
     clearPendingResults();
     Connection* const tmp = conn;
     conn = NULL;
-    storedResult = tmp->readIntegerReply();
     unlink();
+    if (!readServerError(tmp)) {
+      storedResult = tmp->readIntegerReply();
+    }
   }
+}
+
+int64_t IntReply::result() {
+  readResult();
+  throwError();
   return storedResult;
 }
 
+Expected<int64_t> IntReply::tryResult() {
+  readResult();
+  return Expected<int64_t>(storedResult, hasError, errorText);
+}
+
 StringReply::StringReply(Connection* conn) : BaseReply(conn) {}
 
 StringReply::~StringReply() {
   try {
-    result();
+    readResult();
   } catch (...) {
   }
 }
 
+void StringReply::readResult() {
+  if (conn && !skipIgnored()) {
+    clearPendingResults();
+    Connection* const tmp = conn;
+    conn = NULL;
+    unlink();
+    if (!readServerError(tmp)) {
+      tmp->readBulkReply(storedResult);
+    }
+  }
+}
+
 const boost::optional<std::string>& StringReply::result() {
-  if (conn) {
+  readResult();
+  throwError();
+  return storedResult;
+}
+
+Expected<boost::optional<std::string>> StringReply::tryResult() {
+  readResult();
+  return Expected<boost::optional<std::string>>(storedResult, hasError,
+                                                errorText);
+}
+
+DoubleReply::DoubleReply(Connection* conn) : BaseReply(conn) {}
+
+DoubleReply::~DoubleReply() {
+  try {
+    readResult();
+  } catch (...) {
+  }
+}
+
+void DoubleReply::readResult() {
+  if (conn && !skipIgnored()) {
     clearPendingResults();
     Connection* const tmp = conn;
     conn = NULL;
-    tmp->readBulkReply(storedResult);
     unlink();
+    if (!readServerError(tmp)) {
+      const boost::optional<std::string> text = tmp->readBulkReply();
+      if (text) {
+        storedResult = parseDouble(*text);
+      }
+    }
   }
+}
+
+const boost::optional<double>& DoubleReply::result() {
+  readResult();
+  throwError();
   return storedResult;
 }
 
+Expected<boost::optional<double>> DoubleReply::tryResult() {
+  readResult();
+  return Expected<boost::optional<double>>(storedResult, hasError, errorText);
+}
+
+MapReply::MapReply(Connection* conn) : BaseReply(conn) {}
+
+MapReply::~MapReply() {
+  try {
+    readResult();
+  } catch (...) {
+  }
+}
+
+void MapReply::readResult() {
+  if (conn && !skipIgnored()) {
+    clearPendingResults();
+    Connection* const tmp = conn;
+    conn = NULL;
+    unlink();
+    if (readServerError(tmp)) {
+      return;
+    }
+    const char code = tmp->statusCode();
+    size_t count = tmp->readAggregateHeader(code);
+    if (code != '%') {
+      if (count % 2) {
+        throw std::runtime_error("odd number of elements in map reply");
+      }
+      count /= 2;
+    }
+    storedResult.resize(count);
+    boost::optional<std::string> item;
+    for (size_t i = 0; i < count; ++i) {
+      tmp->readBulkReply(item);
+      if (item) {
+        storedResult[i].first.swap(*item);
+      }
+      tmp->readBulkReply(item);
+      if (item) {
+        storedResult[i].second.swap(*item);
+      }
+    }
+  }
+}
+
+const KeyValueVector& MapReply::result() {
+  readResult();
+  throwError();
+  return storedResult;
+}
+
+Expected<KeyValueVector> MapReply::tryResult() {
+  readResult();
+  return Expected<KeyValueVector>(storedResult, hasError, errorText);
+}
+
+OptionalIntReply::OptionalIntReply(Connection* conn) : BaseReply(conn) {}
+
+OptionalIntReply::~OptionalIntReply() {
+  try {
+    readResult();
+  } catch (...) {
+  }
+}
+
+void OptionalIntReply::readResult() {
+  if (conn && !skipIgnored()) {
+    clearPendingResults();
+    Connection* const tmp = conn;
+    conn = NULL;
+    unlink();
+    if (readServerError(tmp)) {
+      return;
+    }
+    const char code = tmp->statusCode();
+    if (code == '$' || code == '_') {
+      boost::optional<std::string> nil;
+      tmp->readBulkReply(nil);
+      storedResult = boost::none;
+    } else {
+      storedResult = tmp->readIntegerReply();
+    }
+  }
+}
+
+const boost::optional<int64_t>& OptionalIntReply::result() {
+  readResult();
+  throwError();
+  return storedResult;
+}
+
+Expected<boost::optional<int64_t>> OptionalIntReply::tryResult() {
+  readResult();
+  return Expected<boost::optional<int64_t>>(storedResult, hasError,
+                                            errorText);
+}
+
+ScoredReply::ScoredReply(Connection* conn) : BaseReply(conn) {}
+
+ScoredReply::~ScoredReply() {
+  try {
+    readResult();
+  } catch (...) {
+  }
+}
+
+void ScoredReply::readResult() {
+  if (conn && !skipIgnored()) {
+    clearPendingResults();
+    Connection* const tmp = conn;
+    conn = NULL;
+    unlink();
+    if (readServerError(tmp)) {
+      return;
+    }
+    const size_t count = tmp->readAggregateHeader(tmp->statusCode());
+    storedResult.reserve(count);
+    boost::optional<std::string> member;
+    boost::optional<std::string> score;
+    for (size_t i = 0; i < count; ++i) {
+      const char code = tmp->statusCode();
+      if (code == '*') {
+        if (tmp->readAggregateHeader(code) != 2) {
+          throw std::runtime_error("bad member and score pair");
+        }
+      } else if (++i >= count) {
+        throw std::runtime_error("odd number of elements in scored reply");
+      }
+      tmp->readBulkReply(member);
+      tmp->readBulkReply(score);
+      if (!member || !score) {
+        throw NullReplyException();
+      }
+      storedResult.push_back(ScoredMember(std::string(), parseDouble(*score)));
+      storedResult.back().first.swap(*member);
+    }
+  }
+}
+
+const ScoredMemberVector& ScoredReply::result() {
+  readResult();
+  throwError();
+  return storedResult;
+}
+
+Expected<ScoredMemberVector> ScoredReply::tryResult() {
+  readResult();
+  return Expected<ScoredMemberVector>(storedResult, hasError, errorText);
+}
+
+ScanReply::ScanReply(Connection* conn) : BaseReply(conn) {}
+
+ScanReply::~ScanReply() {
+  try {
+    readResult();
+  } catch (...) {
+  }
+}
+
+void ScanReply::readResult() {
+  if (conn && !skipIgnored()) {
+    clearPendingResults();
+    Connection* const tmp = conn;
+    conn = NULL;
+    unlink();
+    if (readServerError(tmp)) {
+      return;
+    }
+    if (tmp->readAggregateHeader(tmp->statusCode()) != 2) {
+      throw std::runtime_error("bad scan reply");
+    }
+    boost::optional<std::string> item;
+    tmp->readBulkReply(item);
+    if (!item) {
+      throw NullReplyException();
+    }
+    storedResult.cursor.swap(*item);
+    const size_t count = tmp->readAggregateHeader(tmp->statusCode());
+    storedResult.elements.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+      tmp->readBulkReply(item);
+      if (item) {
+        storedResult.elements[i].swap(*item);
+      }
+    }
+  }
+}
+
+ScanPage& ScanReply::result() {
+  readResult();
+  throwError();
+  return storedResult;
+}
+
+Expected<ScanPage> ScanReply::tryResult() {
+  readResult();
+  return Expected<ScanPage>(storedResult, hasError, errorText);
+}
+
+ValueReply::ValueReply(Connection* conn) : BaseReply(conn) {}
+
+ValueReply::~ValueReply() {
+  try {
+    readResult();
+  } catch (...) {
+  }
+}
+
+void ValueReply::readResult() {
+  if (conn && !skipIgnored()) {
+    clearPendingResults();
+    Connection* const tmp = conn;
+    conn = NULL;
+    unlink();
+    tmp->readReply(storedResult);
+    if (storedResult.isError()) {
+      hasError = true;
+      errorText = storedResult.str;
+    }
+  }
+}
+
+const Value& ValueReply::result() {
+  readResult();
+  throwError();
+  return storedResult;
+}
+
+Expected<Value> ValueReply::tryResult() {
+  readResult();
+  return Expected<Value>(storedResult, hasError, errorText);
+}
+
+Value ValueReply::take() {
+  readResult();
+  throwError();
+  return std::move(storedResult);
+}
+
 MultiBulkEnumerator::MultiBulkEnumerator(Connection* conn)
     : BaseReply(conn), headerDone(false), count(0) {}
 
-MultiBulkEnumerator::~MultiBulkEnumerator() {
+MultiBulkEnumerator::~MultiBulkEnumerator() { discard(); }
+
+void MultiBulkEnumerator::discard() noexcept {
+  pending.clear();
+  if (!conn) {
+    return;
+  }
   try {
-    if (conn && count > 0) {
-      std::string tmp;
-      while (next(&tmp))
-        ;
+    if (heldInTransaction()) {
+      return;
+    }
+    if (!headerDone) {
+      clearPendingResults();
+      conn->skipValue();
+    } else {
+      for (; count > 0; --count) {
+        conn->skipValue();
+      }
     }
   } catch (...) {
   }
+  conn = NULL;
+  unlink();
+}
+
+void MultiBulkEnumerator::readResult() {
+  if (ignored) {
+    discard();
+  } else if (conn && (!headerDone || count > 0)) {
+    std::list<boost::optional<std::string>> readPending;
+    boost::optional<std::string> tmp;
+    while (tryNextOptional(tmp)) {
+      readPending.push_back(tmp);
+    }
+    pending.splice(pending.end(), readPending);
+  }
 }
 
 bool MultiBulkEnumerator::nextOptional(boost::optional<std::string>& out) {
+  if (tryNextOptional(out)) {
+    return true;
+  }
+  throwError();
+  return false;
+}
+
+bool MultiBulkEnumerator::tryNextOptional(boost::optional<std::string>& out) {
   if (!pending.empty()) {
     out = pending.front();
     pending.pop_front();
@@ -509,15 +1010,32 @@ bool MultiBulkEnumerator::nextOptional(boost::optional<std::string>& out) {
 
   char code = 0;
   if (!headerDone) {
+    if (heldInTransaction()) {
+      return false;
+    }
     clearPendingResults();
-    conn->readErrorReply();
     headerDone = true;
+    if (readServerError(conn)) {
+      conn = NULL;
+      unlink();
+      return false;
+    }
+    code = conn->statusCode();
+    if (code == '_') {
+      conn->ioStream->get();
+      conn = NULL;
+      unlink();
+      return false;
+    }
     if (!(*conn->ioStream >> code >> count)) {
       conn = NULL;
       unlink();
       throw std::runtime_error("error reading bulk response header");
     }
-    if (code != '*') {
+    if (code == '%') {
+      // RESP3 maps are enumerated as alternating keys and values
+      count *= 2;
+    } else if (code != '*' && code != '~' && code != '>') {
       conn = NULL;
       unlink();
       throw std::runtime_error(std::string("bad multi-bulk header code: ") +
@@ -536,10 +1054,8 @@ bool MultiBulkEnumerator::nextOptional(boost::optional<std::string>& out) {
   }
   --count;
   code = conn->statusCode();
-  if (code == '$') {
+  if (strchr("$:,#(=+_-!", code)) {
     out = conn->readBulkReply();
-  } else if (code == ':') {
-    out = boost::lexical_cast<std::string>(conn->readIntegerReply());
   } else {
     conn = NULL;
     unlink();
@@ -564,12 +1080,69 @@ bool MultiBulkEnumerator::next(std::string* out) {
   return result;
 }
 
+Expected<int64_t> ChunkedIntReply::tryResult() {
+  while (!parts.empty()) {
+    const Expected<int64_t> part = parts.front().tryResult();
+    if (part) {
+      storedResult += *part;
+    } else if (!hasError) {
+      hasError = true;
+      errorText = part.error();
+    }
+    parts.pop_front();
+  }
+  return Expected<int64_t>(storedResult, hasError, errorText);
+}
+
+int64_t ChunkedIntReply::result() { return tryResult().value(); }
+
+Expected<std::vector<boost::optional<std::string>>>
+ChunkedStringReply::tryResult() {
+  while (!parts.empty()) {
+    MultiBulkEnumerator& part = parts.front();
+    boost::optional<std::string> value;
+    while (part.tryNextOptional(value)) {
+      storedResult.push_back(value);
+    }
+    if (part.failed() && !hasError) {
+      hasError = true;
+      errorText = part.error();
+    }
+    parts.pop_front();
+  }
+  return Expected<std::vector<boost::optional<std::string>>>(
+      storedResult, hasError, errorText);
+}
+
+const std::vector<boost::optional<std::string>>& ChunkedStringReply::result() {
+  return tryResult().value();
+}
+
+Expected<bool> ChunkedVoidReply::tryResult() {
+  while (!parts.empty()) {
+    const Expected<bool> part = parts.front().tryResult();
+    if (!part && !hasError) {
+      hasError = true;
+      errorText = part.error();
+    }
+    parts.pop_front();
+  }
+  storedResult = !hasError;
+  return Expected<bool>(storedResult, hasError, errorText);
+}
+
+void ChunkedVoidReply::result() { tryResult().value(); }
+
 Connection::Connection(const std::string& host, const std::string& port,
                        const std::string& password, bool noDelay,
                        size_t bufferSize)
     : connection(new ClientSocket(host.c_str(), port.c_str())),
       ioStream(new std::iostream(connection->getStreamBuf())),
-      buffer(new Buffer(bufferSize)), transaction(NULL) {
+      buffer(new Buffer(bufferSize)), transaction(NULL),
+      maxKeysPerCommand(1024), noReplies(false), skipReply(false),
+      replySkipped(false), commandsSent(0), corked(false), depthLimit(0),
+      pendingEstimate(0), repliesQueued(0), replyBytes(0), replyRate(0),
+      roundTrip(0), lastConsumed(0), drainsSinceProbe(0) {
   if (noDelay) {
     connection->tcpNoDelay(true);
   }
@@ -584,13 +1157,31 @@ Connection::Connection(const std::string& unixDomainSocket,
                        const std::string& password, size_t bufferSize)
     : connection(new ClientSocket(unixDomainSocket.c_str())),
       ioStream(new std::iostream(connection->getStreamBuf())),
-      buffer(new Buffer(bufferSize)), transaction(NULL) {
+      buffer(new Buffer(bufferSize)), transaction(NULL),
+      maxKeysPerCommand(1024), noReplies(false), skipReply(false),
+      replySkipped(false), commandsSent(0), corked(false), depthLimit(0),
+      pendingEstimate(0), repliesQueued(0), replyBytes(0), replyRate(0),
+      roundTrip(0), lastConsumed(0), drainsSinceProbe(0) {
   if (!password.empty()) {
     authenticate(password.c_str());
   }
 }
 #endif
 
+Connection::Connection(std::unique_ptr<Transport> transport,
+                       const std::string& password, size_t bufferSize)
+    : connection(new ClientSocket(std::move(transport))),
+      ioStream(new std::iostream(connection->getStreamBuf())),
+      buffer(new Buffer(bufferSize)), transaction(NULL),
+      maxKeysPerCommand(1024), noReplies(false), skipReply(false),
+      replySkipped(false), commandsSent(0), corked(false), depthLimit(0),
+      pendingEstimate(0), repliesQueued(0), replyBytes(0), replyRate(0),
+      roundTrip(0), lastConsumed(0), drainsSinceProbe(0) {
+  if (!password.empty()) {
+    authenticate(password.c_str());
+  }
+}
+
 Connection::~Connection() {
   ioStream.reset(); // make sure this is cleared first, since it references the
                     // connection
@@ -600,7 +1191,53 @@ static inline std::istream& getlineRN(std::istream& is, std::string& str) {
   return std::getline(is, str, '\r');
 }
 
-char Connection::statusCode() {
+void Connection::readOutstandingReplies() {
+  ReplyList::iterator cur = outstandingReplies.begin();
+  while (cur != outstandingReplies.end()) {
+    BaseReply& reply = *cur;
+    ++cur;
+    reply.readResult();
+  }
+}
+
+// Advances past one reply of any type without storing it, skipping bulk
+// payloads by length.
+void Connection::skipValue() {
+  const char code = statusCode();
+  int64_t length = 0;
+  switch (code) {
+  case '$':
+  case '=':
+  case '!':
+    ioStream->get();
+    if (!(*ioStream >> length)) {
+      throw std::runtime_error("error reading bulk response header");
+    }
+    ioStream->ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    if (length > 0) {
+      ioStream->ignore(length);
+    }
+    return;
+  case '*':
+  case '~':
+  case '%':
+    ioStream->get();
+    if (!(*ioStream >> length)) {
+      throw std::runtime_error("error reading aggregate response header");
+    }
+    if (code == '%') {
+      length *= 2;
+    }
+    for (int64_t i = 0; i < length; ++i) {
+      skipValue();
+    }
+    return;
+  default:
+    ioStream->ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+  }
+}
+
+char Connection::peekCode() {
   char code = 0;
 
   *ioStream >> std::ws;
@@ -608,82 +1245,659 @@ char Connection::statusCode() {
     throw std::runtime_error("No data available on stream");
   }
 
-  return code;
+  return code;
+}
+
+char Connection::statusCode() {
+  for (;;) {
+    const char code = peekCode();
+    if (code == '>') {
+      Value push;
+      readValue(push);
+      if (pushHandler) {
+        pushHandler(push);
+      }
+    } else if (code == '|') {
+      // read aside, as an attribute can carry attributes of its own
+      Value read;
+      readValue(read);
+      attribute = std::move(read);
+    } else {
+      return code;
+    }
+  }
+}
+
+bool Connection::readError(std::string& message) {
+  char code = statusCode();
+
+  if (code == '-') {
+    ioStream->get();
+    readLine(message);
+    return true;
+  }
+  if (code == '!') {
+    boost::optional<std::string> error;
+    readBlob(&code, error);
+    message = error.get_value_or(std::string());
+    return true;
+  }
+  return false;
+}
+
+void Connection::readErrorReply() {
+  std::string error;
+  if (readError(error)) {
+    throw std::runtime_error(std::string("Received Error: ") + error);
+  }
+}
+
+std::string Connection::readStatusCodeReply() {
+  std::string ret;
+  readStatusCodeReply(&ret);
+  return ret;
+}
+
+void Connection::readStatusCodeReply(std::string* out) {
+  readErrorReply();
+
+  char code = 0;
+  if (!(*ioStream >> code) || !getlineRN(*ioStream, *out)) {
+    throw std::runtime_error("error reading status response");
+  }
+  if (code != '+') {
+    throw std::runtime_error(std::string("read error response: ") + *out);
+  }
+}
+
+int64_t Connection::readIntegerReply() {
+  readErrorReply();
+
+  char code = 0;
+  int64_t ret = 0;
+  if (statusCode() == '#') {
+    char value = 0;
+    if (!(*ioStream >> code >> value)) {
+      throw std::runtime_error("error reading boolean response");
+    }
+    return value == 't' ? 1 : 0;
+  }
+  if (!(*ioStream >> code >> ret)) {
+    throw std::runtime_error("error reading integer response");
+  }
+  return ret;
+}
+
+boost::optional<std::string> Connection::readBulkReply() {
+  boost::optional<std::string> ret;
+  readBulkReply(ret);
+  return ret;
+}
+
+void Connection::readLine(std::string& out) {
+  if (!getlineRN(*ioStream, out)) {
+    throw std::runtime_error("error reading response line");
+  }
+}
+
+// Reads any scalar reply as a string. RESP3 null, double, boolean, big number
+// and verbatim replies map onto what the equivalent RESP2 reply would give.
+void Connection::readBulkReply(boost::optional<std::string>& out) {
+  readErrorReply();
+
+  char code = 0;
+  switch (statusCode()) {
+  case '_':
+    ioStream->get();
+    out = boost::none;
+    return;
+  case '+':
+  case ',':
+  case '(':
+  case ':':
+    ioStream->get();
+    out = std::string();
+    readLine(*out);
+    return;
+  case '#':
+    ioStream->get();
+    out = std::string(ioStream->get() == 't' ? "1" : "0");
+    return;
+  }
+  readBlob(&code, out);
+  if (code != '$' && code != '=') {
+    throw std::runtime_error(std::string("bad bulk header code: ") + code);
+  }
+  if (code == '=' && out && out->size() >= 4 && (*out)[3] == ':') {
+    out->erase(0, 4);
+  }
+}
+
+// Reads a length prefixed bulk, verbatim or blob error payload.
+void Connection::readBlob(char* code, boost::optional<std::string>& out) {
+  int count = 0;
+  if (!(*ioStream >> *code >> count)) {
+    throw std::runtime_error("error reading bulk response header");
+  }
+  if (count < 0) {
+    out = boost::optional<std::string>();
+  } else {
+    ioStream->get(); //'\r'
+    ioStream->get(); //'\n'
+    out = std::string();
+    out->resize(count, '\0');
+    ioStream->read((char*)out->c_str(), out->size());
+  }
+}
+
+size_t Connection::readAggregateHeader(char code) {
+  int64_t count = 0;
+  if (code == '_') {
+    ioStream->get();
+    return 0;
+  }
+  if (!strchr("*%~>|", code) || !(*ioStream >> code >> count)) {
+    throw std::runtime_error(std::string("bad aggregate header code: ") +
+                             code);
+  }
+  return count < 0 ? 0 : (size_t)count;
+}
+
+void Connection::readValue(Value& out) {
+  out.str.clear();
+  out.format.clear();
+  out.elements.clear();
+  out.integer = 0;
+  out.real = 0.0;
+
+  const char code = peekCode();
+  switch (code) {
+  case '+':
+  case '-':
+  case '(':
+    ioStream->get();
+    readLine(out.str);
+    out.kind = code == '+' ? Value::Status
+                           : code == '-' ? Value::Error : Value::BigNumber;
+    return;
+  case ':':
+    ioStream->get();
+    if (!(*ioStream >> out.integer)) {
+      throw std::runtime_error("error reading integer response");
+    }
+    out.kind = Value::Integer;
+    return;
+  case ',':
+    ioStream->get();
+    readLine(out.str);
+    out.real = parseDouble(out.str);
+    out.kind = Value::Double;
+    return;
+  case '#':
+    ioStream->get();
+    out.integer = ioStream->get() == 't' ? 1 : 0;
+    out.kind = Value::Boolean;
+    return;
+  case '_':
+    ioStream->get();
+    out.kind = Value::Nil;
+    return;
+  case '$':
+  case '=':
+  case '!': {
+    char header = 0;
+    boost::optional<std::string> bulk;
+    readBlob(&header, bulk);
+    if (!bulk) {
+      out.kind = Value::Nil;
+      return;
+    }
+    out.str.swap(*bulk);
+    out.kind = code == '$' ? Value::Bulk
+                           : code == '=' ? Value::Verbatim : Value::Error;
+    if (code == '=' && out.str.size() >= 4 && out.str[3] == ':') {
+      out.format = out.str.substr(0, 3);
+      out.str.erase(0, 4);
+    }
+    return;
+  }
+  }
+
+  int64_t count = 0;
+  char header = 0;
+  if (!(*ioStream >> header >> count)) {
+    throw std::runtime_error("error reading aggregate response header");
+  }
+  switch (code) {
+  case '*':
+    out.kind = Value::Array;
+    break;
+  case '~':
+    out.kind = Value::Set;
+    break;
+  case '>':
+    out.kind = Value::Push;
+    break;
+  case '%':
+    out.kind = Value::Map;
+    count *= 2;
+    break;
+  case '|':
+    out.kind = Value::Attribute;
+    count *= 2;
+    break;
+  default:
+    throw std::runtime_error(std::string("unsupported reply code: ") + code);
+  }
+  if (count < 0) {
+    out.kind = Value::Nil;
+    return;
+  }
+  out.elements.resize(count);
+  for (int64_t i = 0; i < count; ++i) {
+    while (peekCode() == '|') {
+      // out may be attribute itself
+      Value read;
+      readValue(read);
+      attribute = std::move(read);
+    }
+    readValue(out.elements[i]);
+  }
+}
+
+// Reads a whole reply as a Value, after the pushes and attribute sent ahead of
+// it. readValue alone would return a pending push as the reply.
+void Connection::readReply(Value& out) {
+  statusCode();
+  readValue(out);
+}
+
+void Connection::quit() { EXECUTE_COMMAND_SYNC(Quit); }
+
+VoidReply Connection::authenticate(const char* password) {
+  EXECUTE_COMMAND_SYNC1(Auth, password);
+  return VoidReply(this);
+}
+
+ValueReply Connection::hello(int protocolVersion) {
+  EXECUTE_COMMAND_SYNC1(Hello, protocolVersion);
+  return ValueReply(this);
+}
+
+void Connection::setPushHandler(const PushHandler& handler) {
+  pushHandler = handler;
+}
+
+size_t Connection::processPushes(int timeoutMs) {
+  if (!outstandingReplies.empty()) {
+    return 0;
+  }
+  size_t count = 0;
+  std::streambuf* const buf = ioStream->rdbuf();
+  for (;;) {
+    while (buf->in_avail() > 0 && isspace(buf->sgetc())) {
+      buf->sbumpc();
+    }
+    if (buf->in_avail() <= 0 &&
+        !connection->waitReadable(count > 0 ? 0 : timeoutMs)) {
+      break;
+    }
+    Value value;
+    readValue(value);
+    if (value.kind == Value::Attribute) {
+      attribute = value;
+      continue;
+    }
+    if (pushHandler) {
+      pushHandler(value);
+    }
+    ++count;
+  }
+  return count;
+}
+
+// Reads what has arrived, up to len bytes, bypassing the reply parser. Waits
+// up to timeoutMs for data and returns 0 if none came.
+size_t Connection::readSome(char* data, size_t len, int timeoutMs) {
+  std::streambuf* const buf = ioStream->rdbuf();
+  const std::streamsize buffered = buf->in_avail();
+  if (buffered > 0) {
+    return buf->sgetn(data, std::min<std::streamsize>(buffered, len));
+  }
+  if (!connection->waitReadable(timeoutMs)) {
+    return 0;
+  }
+  return connection->read(data, len);
+}
+
+ValueReply Connection::command(const ArgList& args) {
+  if (args.empty()) {
+    throw std::invalid_argument("command requires at least a name");
+  }
+  buffer->resetToMark();
+  buffer->write('*');
+  buffer->write(args.size());
+  buffer->write("\r\n");
+  BOOST_FOREACH (const std::string& arg, args) { buffer->writeArg(arg); }
+  send();
+  return ValueReply(this);
+}
+
+void Connection::repliesOff() {
+  if (transaction) {
+    throw std::logic_error("cannot turn replies off inside a transaction");
+  }
+  if (!noReplies) {
+    EXECUTE_COMMAND_SYNC2(Client, "REPLY", "OFF");
+    noReplies = true;
+  }
+}
+
+void Connection::repliesOn() {
+  if (noReplies) {
+    EXECUTE_COMMAND_SYNC2(Client, "REPLY", "ON");
+    noReplies = false;
+    VoidReply(this).result();
+  }
+}
+
+void Connection::skipNextReply() {
+  if (transaction) {
+    throw std::logic_error("cannot skip replies inside a transaction");
+  }
+  if (!noReplies) {
+    EXECUTE_COMMAND_SYNC2(Client, "REPLY", "SKIP");
+    skipReply = true;
+  }
+}
+
+void Connection::setMaxKeysPerCommand(size_t maxKeys) {
+  if (maxKeys == 0) {
+    throw std::invalid_argument("maxKeys must be positive");
+  }
+  maxKeysPerCommand = maxKeys;
+}
+
+void Connection::setFlowControl(const FlowControl& flowControl) {
+  this->flowControl = flowControl;
+  // measurements are only taken while limited, start over
+  replyBytes = 0;
+  replyRate = 0;
+  roundTrip = 0;
+  lastDrain = std::chrono::steady_clock::time_point();
+  drainsSinceProbe = 0;
+  updateDepthLimit();
+}
+
+// Reply size assumed for the byte budget until replies have been measured.
+static const double kAssumedReplyBytes = 64;
+
+void Connection::updateDepthLimit() {
+  const size_t unlimited = std::numeric_limits<size_t>::max();
+  size_t limit =
+      flowControl.maxInFlight > 0 ? flowControl.maxInFlight : unlimited;
+  if (flowControl.maxInFlightBytes > 0) {
+    const double bytes = replyBytes > 0 ? replyBytes : kAssumedReplyBytes;
+    const size_t fit = size_t(flowControl.maxInFlightBytes / bytes);
+    limit = std::min(limit, std::max<size_t>(1, fit));
+  }
+  if (flowControl.adaptive) {
+    // twice the bandwidth-delay product, in replies
+    double depth = double(flowControl.minInFlight);
+    if (replyRate > 0 && roundTrip > 0) {
+      depth = std::max(depth, std::min(2 * replyRate * roundTrip, 1e9));
+    }
+    limit = std::min(limit, std::max<size_t>(1, size_t(depth)));
+  }
+  depthLimit = limit == unlimited ? 0 : limit;
+}
+
+void Connection::send() {
+  // the skip applies to this command, whether or not it makes a reply object
+  replySkipped = skipReply;
+  skipReply = false;
+  if (corked) {
+    corkedWrites.append(buffer->data(), buffer->length());
+  } else {
+    throttle();
+    ioStream->write(buffer->data(), buffer->length());
+  }
+  ++commandsSent;
+}
+
+// Sends the commands collected while corked in one write. Throttling waits
+// until they are written, as their replies cannot be drained before.
+void Connection::uncork() {
+  corked = false;
+  std::string writes;
+  writes.swap(corkedWrites);
+  ioStream->write(writes.data(), writes.size());
+  throttle();
+}
+
+Connection::Cork::Cork(Connection* conn)
+    : conn(conn), nested(conn->corked), queued(conn->repliesQueued) {
+  conn->corked = true;
+}
+
+Connection::Cork::~Cork() {
+  if (nested || !conn->corked) {
+    return;
+  }
+  conn->corked = false;
+  conn->corkedWrites.clear();
+  // nothing was sent, so nothing will arrive for the replies queued since
+  for (uint64_t i = queued;
+       i < conn->repliesQueued && !conn->outstandingReplies.empty(); ++i) {
+    BaseReply& reply = conn->outstandingReplies.back();
+    reply.conn = NULL;
+    reply.hasError = true;
+    reply.errorText = "command not sent";
+    reply.unlink();
+  }
+}
+
+void Connection::Cork::release() {
+  if (!nested) {
+    conn->uncork();
+  }
+}
+
+// Replies queued in a transaction cannot be read before EXEC. If one is
+// (typically a temporary being destroyed) an ignored placeholder takes its
+// place to skip its EXEC result. Returns whether reply was queued.
+bool Connection::holdPlace(BaseReply& reply) {
+  QueuedReply& queued = transaction->replies;
+  if (queued.state != Dirty || !queued.is_linked()) {
+    return false;
+  }
+  ReplyList::iterator cur = outstandingReplies.iterator_to(queued);
+  ReplyList::iterator const end = outstandingReplies.end();
+  while (++cur != end && &*cur != &reply) {
+  }
+  if (cur == end) {
+    return false;
+  }
+  transaction->placeholders.push_back(VoidReply());
+  VoidReply& placeholder = transaction->placeholders.back();
+  placeholder.conn = this;
+  placeholder.ignored = true;
+  outstandingReplies.insert(cur, placeholder);
+  reply.unlink();
+  return true;
+}
+
+// Detaches the count replies queued after after, failing them with reason or
+// with the error that refused them.
+void Connection::failReplies(BaseReply& after, size_t count,
+                             const std::string& reason,
+                             const QueueErrors& errors) {
+  QueueErrors::const_iterator error = errors.begin();
+  ReplyList::iterator cur = outstandingReplies.iterator_to(after);
+  ++cur;
+  for (size_t i = 0; i < count && cur != outstandingReplies.end(); ++i) {
+    BaseReply& reply = *cur;
+    ++cur;
+    reply.conn = NULL;
+    reply.hasError = true;
+    if (error != errors.end() && error->first == i) {
+      reply.errorText = error->second;
+      ++error;
+    } else {
+      reply.errorText = reason;
+    }
+    reply.unlink();
+  }
+}
+
+// Consumes a +QUEUED acknowledgement in place if it is already buffered,
+// returning false (having read nothing) if it is not.
+bool Connection::skipQueued() {
+  static const char queued[] = "+QUEUED\r\n";
+  return connection->skipBuffered(queued, sizeof(queued) - 1);
+}
+
+// pendingEstimate is not decremented when replies are read by their owners,
+// so the queue is only counted once the estimate reaches the limit.
+void Connection::throttle() {
+  if (depthLimit == 0 || transaction || noReplies ||
+      pendingEstimate < depthLimit) {
+    return;
+  }
+  const size_t pending =
+      std::distance(outstandingReplies.begin(), outstandingReplies.end());
+  pendingEstimate = pending;
+  if (pending >= depthLimit) {
+    drain(pending, pending - depthLimit / 2);
+  }
+}
+
+// Reads the count oldest of the pending outstanding replies, measuring reply
+// size and throughput. In adaptive mode the round trip is sampled every so
+// often by emptying the pipeline and timing a PING, so that it does not
+// include time spent queued behind other replies.
+void Connection::drain(size_t pending, size_t count) {
+  typedef std::chrono::steady_clock Clock;
+  const bool probe =
+      flowControl.adaptive && (roundTrip == 0 || ++drainsSinceProbe >= 32);
+  if (probe) {
+    count = pending;
+  }
+  std::streambuf* const buf = ioStream->rdbuf();
+  const uint64_t startBytes = connection->bytesReceived() - buf->in_avail();
+  size_t drained = 0;
+  while (drained < count && !outstandingReplies.empty()) {
+    BaseReply& reply = outstandingReplies.front();
+    if (!reply.conn) {
+      // a read that failed part way leaves the reply queued
+      reply.unlink();
+      continue;
+    }
+    reply.readResult();
+    ++drained;
+  }
+  pendingEstimate = pending - drained;
+  if (drained == 0) {
+    return;
+  }
+
+  const double bytes =
+      double(connection->bytesReceived() - buf->in_avail() - startBytes) /
+      drained;
+  replyBytes = replyBytes == 0 ? bytes : (3 * replyBytes + bytes) / 4;
+
+  // throughput over the whole cycle since the previous drain
+  const Clock::time_point now = Clock::now();
+  const uint64_t consumed = repliesQueued - pendingEstimate;
+  if (lastDrain != Clock::time_point()) {
+    const double elapsed =
+        std::chrono::duration<double>(now - lastDrain).count();
+    if (elapsed > 0) {
+      const double rate = (consumed - lastConsumed) / elapsed;
+      replyRate = replyRate == 0 ? rate : (3 * replyRate + rate) / 4;
+    }
+  }
+  lastDrain = now;
+  lastConsumed = consumed;
+
+  if (probe && outstandingReplies.empty()) {
+    static const char ping[] = "*1\r\n$4\r\nPING\r\n";
+    ioStream->write(ping, sizeof(ping) - 1);
+    readStatusCodeReply();
+    lastDrain = Clock::now();
+    const double sample =
+        std::chrono::duration<double>(lastDrain - now).count();
+    roundTrip = roundTrip == 0 ? sample : (3 * roundTrip + sample) / 4;
+    drainsSinceProbe = 0;
+  }
+  updateDepthLimit();
 }
 
-void Connection::readErrorReply() {
-  char code = statusCode();
+// Encoded size of an argument, as reserved by Buffer::writeArg.
+static size_t argBytes(const std::string& arg) { return arg.size() + 16; }
 
-  if (code == '-') {
-    std::string error;
-    *ioStream >> code;
-    std::getline(*ioStream, error);
-    throw std::runtime_error(std::string("Received Error: ") + error);
-  }
+static size_t argBytes(const KeyValuePair& pair) {
+  return argBytes(pair.first) + argBytes(pair.second);
 }
 
-std::string Connection::readStatusCodeReply() {
-  std::string ret;
-  readStatusCodeReply(&ret);
-  return ret;
-}
+static size_t argCount(const std::string&) { return 1; }
 
-void Connection::readStatusCodeReply(std::string* out) {
-  readErrorReply();
+static size_t argCount(const KeyValuePair&) { return 2; }
 
-  char code = 0;
-  if (!(*ioStream >> code) || !getlineRN(*ioStream, *out)) {
-    throw std::runtime_error("error reading status response");
-  }
-  if (code != '+') {
-    throw std::runtime_error(std::string("read error response: ") + *out);
-  }
+static void writeArgs(Buffer& buffer, const std::string& arg) {
+  buffer.writeArg(arg);
 }
 
-int64_t Connection::readIntegerReply() {
-  readErrorReply();
-
-  char code = 0;
-  int64_t ret = 0;
-  if (!(*ioStream >> code >> ret)) {
-    throw std::runtime_error("error reading integer response");
-  }
-  return ret;
+static void writeArgs(Buffer& buffer, const KeyValuePair& pair) {
+  buffer.writeArg(pair.first);
+  buffer.writeArg(pair.second);
 }
 
-boost::optional<std::string> Connection::readBulkReply() {
-  boost::optional<std::string> ret;
-  readBulkReply(ret);
-  return ret;
+// Sorted set entries are sent as score, member.
+static size_t argBytes(const ScoredMember& entry) {
+  return argBytes(entry.first) + 32 + 16;
 }
 
-void Connection::readBulkReply(boost::optional<std::string>& out) {
-  readErrorReply();
+static size_t argCount(const ScoredMember&) { return 2; }
 
-  char code = 0;
-  int count = 0;
-  if (!(*ioStream >> code >> count)) {
-    throw std::runtime_error("error reading bulk response header");
-  }
-  if (code != '$') {
-    throw std::runtime_error(std::string("bad bulk header code: ") + code);
-  }
-  if (count < 0) {
-    out = boost::optional<std::string>();
-  } else {
-    ioStream->get(); //'\r'
-    ioStream->get(); //'\n'
-    out = std::string();
-    out->resize(count, '\0');
-    ioStream->read((char*)out->c_str(), out->size());
-  }
+static void writeArgs(Buffer& buffer, const ScoredMember& entry) {
+  buffer.writeArg(formatDouble(entry.second));
+  buffer.writeArg(entry.first);
 }
 
-void Connection::quit() { EXECUTE_COMMAND_SYNC(Quit); }
+// Writes name, the head arguments and as many of [first, last) as the chunk
+// limits allow as one command. Returns the first element not written.
+template <typename Iterator>
+Iterator Connection::writeChunk(const char* name, const ArgList& head,
+                                Iterator first, Iterator last) {
+  buffer->resetToMark();
+  size_t space = buffer->available();
+  size_t header = 14 + argBytes(name);
+  BOOST_FOREACH (const std::string& arg, head) { header += argBytes(arg); }
+  space = space > header ? space - header : 0;
 
-VoidReply Connection::authenticate(const char* password) {
-  EXECUTE_COMMAND_SYNC1(Auth, password);
-  return VoidReply(this);
+  size_t elements = 0;
+  size_t args = 1 + head.size();
+  Iterator end = first;
+  for (; end != last && elements < maxKeysPerCommand; ++end, ++elements) {
+    const size_t bytes = argBytes(*end);
+    if (elements > 0 && bytes > space) {
+      break;
+    }
+    space = bytes > space ? 0 : space - bytes;
+    args += argCount(*end);
+  }
+
+  buffer->write('*');
+  buffer->write(args);
+  buffer->write("\r\n");
+  buffer->writeArg(name);
+  BOOST_FOREACH (const std::string& arg, head) { buffer->writeArg(arg); }
+  for (; first != end; ++first) {
+    writeArgs(*buffer, *first);
+  }
+  send();
+  return end;
 }
 
 BoolReply Connection::exists(const std::string& name) {
@@ -696,6 +1910,26 @@ BoolReply Connection::del(const std::string& name) {
   return BoolReply(this);
 }
 
+ChunkedIntReply Connection::del(const ArgList& names) {
+  ChunkedIntReply ret;
+  ArgList::const_iterator it = names.begin();
+  while (it != names.end()) {
+    it = writeChunk("DEL", ArgList(), it, names.end());
+    ret.parts.push_back(IntReply(this));
+  }
+  return ret;
+}
+
+ChunkedIntReply Connection::unlink(const ArgList& names) {
+  ChunkedIntReply ret;
+  ArgList::const_iterator it = names.begin();
+  while (it != names.end()) {
+    it = writeChunk("UNLINK", ArgList(), it, names.end());
+    ret.parts.push_back(IntReply(this));
+  }
+  return ret;
+}
+
 static std::string s_none = "none";
 static std::string s_string = "string";
 static std::string s_list = "list";
@@ -727,6 +1961,33 @@ MultiBulkEnumerator Connection::keys(const std::string& pattern) {
   return MultiBulkEnumerator(this);
 }
 
+static ArgList scanArgs(const std::string& cursor, const ScanOptions& options,
+                        bool allowType) {
+  ArgList args(1, cursor);
+  if (!options.match.empty()) {
+    args.push_back("MATCH");
+    args.push_back(options.match);
+  }
+  if (options.count > 0) {
+    args.push_back("COUNT");
+    args.push_back(boost::lexical_cast<std::string>(options.count));
+  }
+  if (!options.type.empty()) {
+    if (!allowType) {
+      throw std::invalid_argument("TYPE only applies to SCAN");
+    }
+    args.push_back("TYPE");
+    args.push_back(options.type);
+  }
+  return args;
+}
+
+ScanReply Connection::scan(const std::string& cursor,
+                           const ScanOptions& options) {
+  EXECUTE_COMMAND_SYNC1(Scan, scanArgs(cursor, options, true));
+  return ScanReply(this);
+}
+
 StringReply Connection::randomKey() {
   EXECUTE_COMMAND_SYNC(RandomKey);
   return StringReply(this);
@@ -766,6 +2027,11 @@ IntReply Connection::ttl(const std::string& name) {
   return IntReply(this);
 }
 
+IntReply Connection::pttl(const std::string& name) {
+  EXECUTE_COMMAND_SYNC1(PTtl, name);
+  return IntReply(this);
+}
+
 VoidReply Connection::select(int db) {
   EXECUTE_COMMAND_SYNC1(Select, db);
   return VoidReply(this);
@@ -796,7 +2062,15 @@ StringReply Connection::get(const std::string& name) {
   return StringReply(this);
 }
 
-// TODO: mget
+ChunkedStringReply Connection::mget(const ArgList& names) {
+  ChunkedStringReply ret;
+  ArgList::const_iterator it = names.begin();
+  while (it != names.end()) {
+    it = writeChunk("MGET", ArgList(), it, names.end());
+    ret.parts.push_back(MultiBulkEnumerator(this));
+  }
+  return ret;
+}
 
 StringReply Connection::getSet(const std::string& name,
                                const std::string& value) {
@@ -815,6 +2089,36 @@ VoidReply Connection::setEx(const std::string& name, int time,
   return VoidReply(this);
 }
 
+ChunkedVoidReply Connection::mset(const KeyValueList& pairs) {
+  ChunkedVoidReply ret;
+  KeyValueList::const_iterator it = pairs.begin();
+  while (it != pairs.end()) {
+    it = writeChunk("MSET", ArgList(), it, pairs.end());
+    ret.parts.push_back(VoidReply(this));
+  }
+  return ret;
+}
+
+BoolReply Connection::msetNX(const KeyValueList& pairs) {
+  size_t bytes = 14 + argBytes("MSETNX");
+  BOOST_FOREACH (const KeyValuePair& pair, pairs) { bytes += argBytes(pair); }
+  buffer->resetToMark();
+  if (bytes > buffer->available()) {
+    throw std::runtime_error("msetNX does not fit in the buffer");
+  }
+  // sent whole, as MSETNX split in chunks would no longer be atomic
+  struct Unlimited {
+    explicit Unlimited(size_t& maxKeys) : maxKeys(maxKeys), saved(maxKeys) {
+      maxKeys = std::numeric_limits<size_t>::max();
+    }
+    ~Unlimited() { maxKeys = saved; }
+    size_t& maxKeys;
+    const size_t saved;
+  } unlimited(maxKeysPerCommand);
+  writeChunk("MSETNX", ArgList(), pairs.begin(), pairs.end());
+  return BoolReply(this);
+}
+
 IntReply Connection::incr(const std::string& name) {
   EXECUTE_COMMAND_SYNC1(Incr, name);
   return IntReply(this);
@@ -825,6 +2129,11 @@ IntReply Connection::incrBy(const std::string& name, int value) {
   return IntReply(this);
 }
 
+DoubleReply Connection::incrByFloat(const std::string& name, double value) {
+  EXECUTE_COMMAND_SYNC2(IncrByFloat, name, formatDouble(value));
+  return DoubleReply(this);
+}
+
 IntReply Connection::decr(const std::string& name) {
   EXECUTE_COMMAND_SYNC1(Decr, name);
   return IntReply(this);
@@ -840,6 +2149,11 @@ IntReply Connection::append(const std::string& name, const std::string& value) {
   return IntReply(this);
 }
 
+IntReply Connection::strlen(const std::string& name) {
+  EXECUTE_COMMAND_SYNC1(StrLen, name);
+  return IntReply(this);
+}
+
 StringReply Connection::subStr(const std::string& name, int start, int end) {
   EXECUTE_COMMAND_SYNC3(SubStr, name, start, end);
   return StringReply(this);
@@ -924,6 +2238,28 @@ BoolReply Connection::srem(const std::string& key, const std::string& member) {
   return BoolReply(this);
 }
 
+ChunkedIntReply Connection::sadd(const std::string& key,
+                                 const ArgList& members) {
+  ChunkedIntReply ret;
+  ArgList::const_iterator it = members.begin();
+  while (it != members.end()) {
+    it = writeChunk("SADD", ArgList(1, key), it, members.end());
+    ret.parts.push_back(IntReply(this));
+  }
+  return ret;
+}
+
+ChunkedIntReply Connection::srem(const std::string& key,
+                                 const ArgList& members) {
+  ChunkedIntReply ret;
+  ArgList::const_iterator it = members.begin();
+  while (it != members.end()) {
+    it = writeChunk("SREM", ArgList(1, key), it, members.end());
+    ret.parts.push_back(IntReply(this));
+  }
+  return ret;
+}
+
 StringReply Connection::spop(const std::string& key) {
   EXECUTE_COMMAND_SYNC1(SPop, key);
   return StringReply(this);
@@ -986,7 +2322,254 @@ StringReply Connection::srandMember(const std::string& key) {
   return StringReply(this);
 }
 
-// TODO: all Z* functions
+ScanReply Connection::sscan(const std::string& key, const std::string& cursor,
+                            const ScanOptions& options) {
+  EXECUTE_COMMAND_SYNC2(SScan, key, scanArgs(cursor, options, false));
+  return ScanReply(this);
+}
+
+BoolReply Connection::zadd(const std::string& key, double score,
+                           const std::string& member) {
+  EXECUTE_COMMAND_SYNC3(ZAdd, key, formatDouble(score), member);
+  return BoolReply(this);
+}
+
+ChunkedIntReply Connection::zadd(const std::string& key,
+                                 const ScoredMemberVector& members, int flags) {
+  ArgList head(1, key);
+  if (flags & ZAddNX) {
+    head.push_back("NX");
+  }
+  if (flags & ZAddXX) {
+    head.push_back("XX");
+  }
+  if (flags & ZAddGT) {
+    head.push_back("GT");
+  }
+  if (flags & ZAddLT) {
+    head.push_back("LT");
+  }
+  if (flags & ZAddCH) {
+    head.push_back("CH");
+  }
+  ChunkedIntReply ret;
+  ScoredMemberVector::const_iterator it = members.begin();
+  while (it != members.end()) {
+    it = writeChunk("ZADD", head, it, members.end());
+    ret.parts.push_back(IntReply(this));
+  }
+  return ret;
+}
+
+BoolReply Connection::zrem(const std::string& key, const std::string& member) {
+  EXECUTE_COMMAND_SYNC2(ZRem, key, member);
+  return BoolReply(this);
+}
+
+ChunkedIntReply Connection::zrem(const std::string& key,
+                                 const ArgList& members) {
+  ChunkedIntReply ret;
+  ArgList::const_iterator it = members.begin();
+  while (it != members.end()) {
+    it = writeChunk("ZREM", ArgList(1, key), it, members.end());
+    ret.parts.push_back(IntReply(this));
+  }
+  return ret;
+}
+
+DoubleReply Connection::zincrBy(const std::string& key, double increment,
+                                const std::string& member) {
+  EXECUTE_COMMAND_SYNC3(ZIncrBy, key, formatDouble(increment), member);
+  return DoubleReply(this);
+}
+
+OptionalIntReply Connection::zrank(const std::string& key,
+                                   const std::string& member) {
+  EXECUTE_COMMAND_SYNC2(ZRank, key, member);
+  return OptionalIntReply(this);
+}
+
+OptionalIntReply Connection::zrevRank(const std::string& key,
+                                      const std::string& member) {
+  EXECUTE_COMMAND_SYNC2(ZRevRank, key, member);
+  return OptionalIntReply(this);
+}
+
+MultiBulkEnumerator Connection::zrange(const std::string& key, int64_t start,
+                                       int64_t stop) {
+  EXECUTE_COMMAND_SYNC3(ZRange, key, start, stop);
+  return MultiBulkEnumerator(this);
+}
+
+ScoredReply Connection::zrangeWithScores(const std::string& key, int64_t start,
+                                         int64_t stop) {
+  ArgList args;
+  args.push_back(key);
+  args.push_back(boost::lexical_cast<std::string>(start));
+  args.push_back(boost::lexical_cast<std::string>(stop));
+  args.push_back("WITHSCORES");
+  EXECUTE_COMMAND_SYNC1(ZRange, args);
+  return ScoredReply(this);
+}
+
+MultiBulkEnumerator Connection::zrevRange(const std::string& key,
+                                          int64_t start, int64_t stop) {
+  EXECUTE_COMMAND_SYNC3(ZRevRange, key, start, stop);
+  return MultiBulkEnumerator(this);
+}
+
+ScoredReply Connection::zrevRangeWithScores(const std::string& key,
+                                            int64_t start, int64_t stop) {
+  ArgList args;
+  args.push_back(key);
+  args.push_back(boost::lexical_cast<std::string>(start));
+  args.push_back(boost::lexical_cast<std::string>(stop));
+  args.push_back("WITHSCORES");
+  EXECUTE_COMMAND_SYNC1(ZRevRange, args);
+  return ScoredReply(this);
+}
+
+MultiBulkEnumerator Connection::zrangeByScore(const std::string& key,
+                                              double min, double max) {
+  EXECUTE_COMMAND_SYNC3(ZRangeByScore, key, formatDouble(min),
+                        formatDouble(max));
+  return MultiBulkEnumerator(this);
+}
+
+ScoredReply Connection::zrangeByScoreWithScores(const std::string& key,
+                                                double min, double max) {
+  ArgList args;
+  args.push_back(key);
+  args.push_back(formatDouble(min));
+  args.push_back(formatDouble(max));
+  args.push_back("WITHSCORES");
+  EXECUTE_COMMAND_SYNC1(ZRangeByScore, args);
+  return ScoredReply(this);
+}
+
+static ArgList zrangeArgs(const std::string& key, const std::string& start,
+                          const std::string& stop,
+                          const ZRangeOptions& options) {
+  ArgList args;
+  args.push_back(key);
+  args.push_back(start);
+  args.push_back(stop);
+  if (options.byScore) {
+    args.push_back("BYSCORE");
+  }
+  if (options.rev) {
+    args.push_back("REV");
+  }
+  if (options.count >= 0) {
+    args.push_back("LIMIT");
+    args.push_back(boost::lexical_cast<std::string>(options.offset));
+    args.push_back(boost::lexical_cast<std::string>(options.count));
+  }
+  return args;
+}
+
+MultiBulkEnumerator Connection::zrange(const std::string& key,
+                                       const std::string& start,
+                                       const std::string& stop,
+                                       const ZRangeOptions& options) {
+  EXECUTE_COMMAND_SYNC1(ZRange, zrangeArgs(key, start, stop, options));
+  return MultiBulkEnumerator(this);
+}
+
+ScoredReply Connection::zrangeWithScores(const std::string& key,
+                                         const std::string& start,
+                                         const std::string& stop,
+                                         const ZRangeOptions& options) {
+  ArgList args = zrangeArgs(key, start, stop, options);
+  args.push_back("WITHSCORES");
+  EXECUTE_COMMAND_SYNC1(ZRange, args);
+  return ScoredReply(this);
+}
+
+IntReply Connection::zcount(const std::string& key, const std::string& min,
+                            const std::string& max) {
+  EXECUTE_COMMAND_SYNC3(ZCount, key, min, max);
+  return IntReply(this);
+}
+
+IntReply Connection::zremRangeByRank(const std::string& key, int64_t start,
+                                     int64_t stop) {
+  EXECUTE_COMMAND_SYNC3(ZRemRangeByRank, key, start, stop);
+  return IntReply(this);
+}
+
+IntReply Connection::zremRangeByScore(const std::string& key,
+                                      const std::string& min,
+                                      const std::string& max) {
+  EXECUTE_COMMAND_SYNC3(ZRemRangeByScore, key, min, max);
+  return IntReply(this);
+}
+
+IntReply Connection::zcard(const std::string& key) {
+  EXECUTE_COMMAND_SYNC1(ZCard, key);
+  return IntReply(this);
+}
+
+DoubleReply Connection::zscore(const std::string& key,
+                               const std::string& member) {
+  EXECUTE_COMMAND_SYNC2(ZScore, key, member);
+  return DoubleReply(this);
+}
+
+ScoredReply Connection::zpopMin(const std::string& key, int64_t count) {
+  EXECUTE_COMMAND_SYNC2(ZPopMin, key, count);
+  return ScoredReply(this);
+}
+
+ScoredReply Connection::zpopMax(const std::string& key, int64_t count) {
+  EXECUTE_COMMAND_SYNC2(ZPopMax, key, count);
+  return ScoredReply(this);
+}
+
+ScanReply Connection::zscan(const std::string& key, const std::string& cursor,
+                            const ScanOptions& options) {
+  EXECUTE_COMMAND_SYNC2(ZScan, key, scanArgs(cursor, options, false));
+  return ScanReply(this);
+}
+
+static ArgList zstoreArgs(const std::string& dest, const ArgList& keys,
+                          const std::vector<double>& weights,
+                          Aggregate aggregate) {
+  if (!weights.empty() && weights.size() != keys.size()) {
+    throw std::invalid_argument("weights must match the number of keys");
+  }
+  ArgList args;
+  args.push_back(dest);
+  args.push_back(boost::lexical_cast<std::string>(keys.size()));
+  args.insert(args.end(), keys.begin(), keys.end());
+  if (!weights.empty()) {
+    args.push_back("WEIGHTS");
+    BOOST_FOREACH (double weight, weights) {
+      args.push_back(formatDouble(weight));
+    }
+  }
+  if (aggregate != AggregateSum) {
+    args.push_back("AGGREGATE");
+    args.push_back(aggregate == AggregateMin ? "MIN" : "MAX");
+  }
+  return args;
+}
+
+IntReply Connection::zunionStore(const std::string& dest, const ArgList& keys,
+                                 const std::vector<double>& weights,
+                                 Aggregate aggregate) {
+  EXECUTE_COMMAND_SYNC1(ZUnionStore,
+                        zstoreArgs(dest, keys, weights, aggregate));
+  return IntReply(this);
+}
+
+IntReply Connection::zinterStore(const std::string& dest, const ArgList& keys,
+                                 const std::vector<double>& weights,
+                                 Aggregate aggregate) {
+  EXECUTE_COMMAND_SYNC1(ZInterStore,
+                        zstoreArgs(dest, keys, weights, aggregate));
+  return IntReply(this);
+}
 
 BoolReply Connection::hset(const std::string& key, const std::string& field,
                            const std::string& value) {
@@ -1023,6 +2606,12 @@ IntReply Connection::hincrBy(const std::string& key, const std::string& field,
   return IntReply(this);
 }
 
+DoubleReply Connection::hincrByFloat(const std::string& key,
+                                      const std::string& field, double value) {
+  EXECUTE_COMMAND_SYNC3(HIncrByFloat, key, field, formatDouble(value));
+  return DoubleReply(this);
+}
+
 BoolReply Connection::hexists(const std::string& key,
                               const std::string& field) {
   EXECUTE_COMMAND_SYNC2(HExists, key, field);
@@ -1034,6 +2623,17 @@ BoolReply Connection::hdel(const std::string& key, const std::string& field) {
   return BoolReply(this);
 }
 
+ChunkedIntReply Connection::hdel(const std::string& key,
+                                 const ArgList& fields) {
+  ChunkedIntReply ret;
+  ArgList::const_iterator it = fields.begin();
+  while (it != fields.end()) {
+    it = writeChunk("HDEL", ArgList(1, key), it, fields.end());
+    ret.parts.push_back(IntReply(this));
+  }
+  return ret;
+}
+
 IntReply Connection::hlen(const std::string& key) {
   EXECUTE_COMMAND_SYNC1(HLen, key);
   return IntReply(this);
@@ -1054,6 +2654,17 @@ MultiBulkEnumerator Connection::hgetAll(const std::string& key) {
   return MultiBulkEnumerator(this);
 }
 
+MapReply Connection::hgetAllMap(const std::string& key) {
+  EXECUTE_COMMAND_SYNC1(HGetAll, key);
+  return MapReply(this);
+}
+
+ScanReply Connection::hscan(const std::string& key, const std::string& cursor,
+                            const ScanOptions& options) {
+  EXECUTE_COMMAND_SYNC2(HScan, key, scanArgs(cursor, options, false));
+  return ScanReply(this);
+}
+
 MultiBulkEnumerator Connection::scriptExists(const ArgList& scripts) {
   EXECUTE_COMMAND_SYNC2(Script, std::string("exists"), scripts);
   return MultiBulkEnumerator(this);
@@ -1061,6 +2672,7 @@ MultiBulkEnumerator Connection::scriptExists(const ArgList& scripts) {
 
 VoidReply Connection::scriptFlush() {
   EXECUTE_COMMAND_SYNC1(Script, std::string("flush"));
+  loadedScripts.clear();
   return VoidReply(this);
 }
 
@@ -1114,6 +2726,23 @@ StringReply Connection::info() {
   return StringReply(this);
 }
 
+IntReply Connection::clientId() {
+  EXECUTE_COMMAND_SYNC1(Client, std::string("id"));
+  return IntReply(this);
+}
+
+VoidReply Connection::clientTracking(bool enable, int64_t redirectId) {
+  ArgList args;
+  args.push_back("tracking");
+  args.push_back(enable ? "on" : "off");
+  if (enable && redirectId >= 0) {
+    args.push_back("redirect");
+    args.push_back(boost::lexical_cast<std::string>(redirectId));
+  }
+  EXECUTE_COMMAND_SYNC1(Client, args);
+  return VoidReply(this);
+}
+
 void Connection::subscribe(const std::string& channel) {
   EXECUTE_COMMAND_SYNC1(Subscribe, channel);
 }
@@ -1136,17 +2765,34 @@ IntReply Connection::publish(const std::string& channel,
   return IntReply(this);
 }
 
+VoidReply Connection::watch(const ArgList& keys) {
+  EXECUTE_COMMAND_SYNC1(Watch, keys);
+  return VoidReply(this);
+}
+
+VoidReply Connection::unwatch() {
+  EXECUTE_COMMAND_SYNC(Unwatch);
+  return VoidReply(this);
+}
+
 void Connection::multi() { EXECUTE_COMMAND_SYNC(Multi); }
 
 void Connection::exec() { EXECUTE_COMMAND_SYNC(Exec); }
 
 void Connection::discard() { EXECUTE_COMMAND_SYNC(Discard); }
 
-Transaction::Transaction(Connection* conn) : conn(conn), replies(conn) {
+Transaction::Transaction(Connection* conn, TransactionMode mode)
+    : conn(conn), replies(conn), buffered(mode == SendOnCommit) {
+  if (conn->noReplies)
+    throw std::logic_error("cannot start a transaction while replies are off");
+  if (conn->skipReply)
+    throw std::logic_error(
+        "cannot start a transaction while a reply is being skipped");
   if (conn->transaction)
     throw std::runtime_error(
         "cannot start a transaction while the connection is already in one");
 
+  conn->corked = buffered;
   conn->multi();
 
   conn->transaction = this;
@@ -1161,41 +2807,184 @@ Transaction::~Transaction() {
   conn->transaction = NULL;
 }
 
-void Transaction::commit() {
+bool Transaction::commit() {
   if (replies.state == Dirty) {
     replies.state = Committed;
     conn->exec();
+    if (buffered) {
+      conn->uncork();
+    }
     replies.readResult();
   }
+  return replies.state == Committed;
 }
 
 void Transaction::abort() {
   if (replies.state == Dirty) {
     replies.state = Aborted;
+    if (buffered) {
+      // nothing was sent
+      conn->corked = false;
+      conn->corkedWrites.clear();
+      conn->failReplies(replies, replies.count, "transaction aborted");
+      replies.conn = NULL;
+      replies.unlink();
+      return;
+    }
     conn->discard();
     replies.readResult();
   }
 }
 
+// The reply is made before MULTI is sent, so it is never that of a skipped
+// command sent earlier without a reply object.
+Connection* QueuedReply::unskipped(Connection* conn) {
+  conn->replySkipped = false;
+  return conn;
+}
+
 void QueuedReply::readResult() {
   if (!conn)
     return;
 
+  // reads pipelined ahead of the MULTI, such as those behind a WATCH
+  clearPendingResults();
   Connection* const tmp = conn;
   conn = NULL;
   tmp->readStatusCodeReply(); // one +OK for the MULTI
-  // one +QUEUED per queued request (including this QueuedReply)
+  // one +QUEUED per queued request, or the error refusing it
+  QueueErrors errors;
   for (size_t i = 0; i < count; ++i) {
-    tmp->readStatusCodeReply();
+    if (!tmp->skipQueued()) {
+      std::string error;
+      if (tmp->readError(error)) {
+        errors.push_back(std::make_pair(i, error));
+      } else {
+        tmp->readStatusCodeReply();
+      }
+    }
   }
   if (state == Committed) {
-    const int64_t expectedCount = tmp->readIntegerReply();
-    if (count != expectedCount)
-      throw std::runtime_error("transaction item count did not match");
+    std::string error;
+    if (tmp->readError(error)) {
+      // EXECABORT, the refused commands fail with their own errors
+      state = Aborted;
+      tmp->failReplies(*this, count, error, errors);
+    } else {
+      int64_t expectedCount = -1;
+      if (tmp->statusCode() == '_') {
+        boost::optional<std::string> nil;
+        tmp->readBulkReply(nil);
+      } else {
+        expectedCount = tmp->readIntegerReply();
+      }
+      if (expectedCount < 0) {
+        // a watched key changed
+        state = Aborted;
+        tmp->failReplies(*this, count, "transaction aborted by WATCH");
+      } else if (count != size_t(expectedCount)) {
+        throw std::runtime_error("transaction item count did not match");
+      }
+      // each queued reply reads its own element of the EXEC array
+    }
   } else if (state == Aborted) {
     tmp->readStatusCodeReply();
-    // TODO: discard all remaining items to be parsed
+    tmp->failReplies(*this, count, "transaction aborted", errors);
   }
+  unlink();
+}
+
+CheckAndSet::CheckAndSet(Connection* conn, const ArgList& keys,
+                         const CasOptions& options)
+    : conn(conn), keys(keys), options(options), attempt(1), watching(false) {
+  if (conn->skipReply) {
+    throw std::logic_error("cannot check-and-set while a reply is skipped");
+  }
+  watch();
+}
+
+CheckAndSet::~CheckAndSet() {
+  transaction.reset();
+  if (watching) {
+    try {
+      conn->unwatch().result();
+    } catch (...) {
+    }
+  }
+}
+
+void CheckAndSet::watch() {
+  watchReply = conn->watch(keys);
+  watching = true;
+}
+
+void CheckAndSet::multi() {
+  if (transaction) {
+    throw std::logic_error("multi was already called for this attempt");
+  }
+  watchReply.result();
+  transaction.reset(new Transaction(conn, SendOnCommit));
+}
+
+bool CheckAndSet::exec() {
+  watchReply.result();
+  if (!transaction) {
+    watching = false;
+    conn->unwatch().result();
+    return true;
+  }
+  // EXEC unwatches the keys whatever the outcome
+  watching = false;
+  const bool committed = transaction->commit();
+  transaction.reset();
+  if (committed) {
+    return true;
+  }
+  if (attempt >= options.maxAttempts) {
+    throw std::runtime_error("check-and-set failed after " +
+                             boost::lexical_cast<std::string>(attempt) +
+                             " attempts");
+  }
+  const int shift = int(std::min<size_t>(attempt - 1, 16));
+  // in 64 bits, clamped before the shift can overflow
+  const int64_t limit = std::max(options.maxBackoffMillis, 0);
+  const int64_t base =
+      std::min<int64_t>(std::max(options.backoffMillis, 0), limit);
+  const int backoff = int(std::min(limit, base << shift));
+  if (backoff > 0) {
+    static thread_local std::minstd_rand random(
+        (unsigned)std::chrono::steady_clock::now().time_since_epoch().count());
+    const int jittered = backoff / 2 + int(random() % (backoff / 2 + 1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(jittered));
+  }
+  ++attempt;
+  watch();
+  return false;
+}
+
+void checkAndSet(Connection* conn, const ArgList& keys,
+                 const std::function<void(CheckAndSet&)>& body,
+                 const CasOptions& options) {
+  CheckAndSet cas(conn, keys, options);
+  do {
+    body(cas);
+  } while (!cas.exec());
+}
+
+FireAndForget::FireAndForget(Connection* conn) : conn(conn) {
+  conn->repliesOff();
+}
+
+FireAndForget::~FireAndForget() {
+  try {
+    conn->repliesOn();
+  } catch (...) {
+  }
+}
+
+void FireAndForget::sync() {
+  conn->repliesOn();
+  conn->repliesOff();
 }
 
 }; // namespace redispp
@@ -5,12 +5,16 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/optional.hpp>
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <list>
 #include <memory>
 #include <stdexcept>
 #include <string.h>
 #include <string>
+#include <unordered_set>
+#include <vector>
 
 namespace redispp {
 
@@ -22,6 +26,51 @@ public:
 typedef std::pair<std::string, std::string> KeyValuePair;
 typedef std::list<std::string> ArgList;
 typedef std::list<KeyValuePair> KeyValueList;
+typedef std::vector<KeyValuePair> KeyValueVector;
+typedef std::pair<std::string, double> ScoredMember;
+typedef std::vector<ScoredMember> ScoredMemberVector;
+
+// A fully parsed reply of any RESP2 or RESP3 type. Map and attribute entries
+// are stored flattened in elements as key, value, key, value...
+struct Value {
+  enum Kind {
+    Nil,
+    Status,
+    Error,
+    Integer,
+    Double,
+    Boolean,
+    BigNumber,
+    Bulk,
+    Verbatim,
+    Array,
+    Map,
+    Set,
+    Push,
+    Attribute,
+  };
+
+  Value() : kind(Nil), integer(0), real(0.0) {}
+
+  bool isNil() const { return kind == Nil; }
+  bool isError() const { return kind == Error; }
+  bool isAggregate() const {
+    return kind == Array || kind == Map || kind == Set || kind == Push ||
+           kind == Attribute;
+  }
+
+  Kind kind;
+  // Status, Error, BigNumber, Bulk and Verbatim payloads. Double keeps the
+  // text sent by the server. Verbatim strings have the format prefix removed
+  // and stored in format.
+  std::string str;
+  std::string format;
+  int64_t integer; // Integer, or Boolean as 0/1
+  double real;     // Double
+  std::vector<Value> elements;
+};
+
+typedef std::function<void(const Value&)> PushHandler;
 
 template <typename BufferType> struct Command {
   Command(const char* name) : cmdName(std::string(name)), numArgs(0) {}
@@ -136,34 +185,180 @@ enum Type {
   Hash,
 };
 
+// Options of the SCAN family. count is a hint of the page size, 0 leaving it
+// to the server. type only applies to SCAN.
+struct ScanOptions {
+  ScanOptions() : count(0) {}
+
+  std::string match;
+  int64_t count;
+  std::string type;
+};
+
+// One page of a SCAN family command. HSCAN and ZSCAN elements are flattened
+// as field, value, field, value...
+struct ScanPage {
+  std::string cursor; // "0" once the scan is complete
+  std::vector<std::string> elements;
+};
+
+// ZADD options, combined with |.
+enum ZAddFlags {
+  ZAddNX = 1,  // only add new members
+  ZAddXX = 2,  // only update existing members
+  ZAddGT = 4,  // only update when the new score is greater
+  ZAddLT = 8,  // only update when the new score is less
+  ZAddCH = 16, // count changed members instead of added ones
+};
+
+enum Aggregate {
+  AggregateSum,
+  AggregateMin,
+  AggregateMax,
+};
+
+// The general form of ZRANGE. start and stop are ranks, or scores with byScore
+// where "(" marks an exclusive bound and "-inf"/"+inf" are accepted. With rev
+// the range runs from the highest entry and, by score, start is the upper
+// bound. count < 0 means no LIMIT.
+struct ZRangeOptions {
+  ZRangeOptions() : byScore(false), rev(false), offset(0), count(-1) {}
+
+  bool byScore;
+  bool rev;
+  int64_t offset;
+  int64_t count;
+};
+
+// Limits on the replies a connection lets pile up. When a command is about to
+// be sent beyond them, the oldest outstanding replies are read first (and kept
+// in their reply objects) until half the limit is left in flight.
+struct FlowControl {
+  FlowControl()
+      : maxInFlight(0), maxInFlightBytes(0), adaptive(false), minInFlight(64) {
+  }
+
+  size_t maxInFlight; // outstanding replies, 0 for no limit
+  // Estimated from the average size of the replies drained so far, 0 for no
+  // limit.
+  size_t maxInFlightBytes;
+  // Tunes the limit, between minInFlight and the limits above, to twice the
+  // observed throughput times the round trip time: deep enough to keep the
+  // link busy, no deeper. The round trip is sampled with a PING after
+  // emptying the pipeline every 32 drains.
+  bool adaptive;
+  // Keeps each drain large enough to amortize its system calls when the
+  // round trip is short.
+  size_t minInFlight;
+};
+
 class Connection;
 class ClientSocket;
 class Buffer;
 
+// A byte stream a Connection can run over instead of a socket, e.g. to replay
+// recorded replies in benchmarks.
+class Transport {
+public:
+  virtual ~Transport() {}
+
+  virtual void write(const void* data, size_t len) = 0;
+  // Reads at least one byte, up to len. Throws if the stream has ended.
+  virtual size_t read(void* data, size_t len) = 0;
+  virtual bool waitReadable(int timeoutMs) = 0;
+};
+
 typedef boost::intrusive::list_base_hook<
     boost::intrusive::link_mode<boost::intrusive::auto_unlink>>
     auto_unlink_hook;
 
+// The outcome of reading a reply without exceptions for server errors: the
+// value, or the message of the error reply that result() would have thrown. A
+// missing key is not an error but an empty optional value. Failing to read the
+// connection itself still throws. Refers to the reply object, which must
+// outlive it.
+template <typename T> class Expected {
+public:
+  Expected(const T& value, bool failed, const std::string& message)
+      : val(&value), failed(failed), message(&message) {}
+
+  bool ok() const { return !failed; }
+  explicit operator bool() const { return !failed; }
+
+  // Default constructed if the reply was an error.
+  const T& operator*() const { return *val; }
+  const T* operator->() const { return val; }
+
+  // The value, throwing as result() does if the reply was an error.
+  const T& value() const {
+    if (failed) {
+      throw std::runtime_error("Received Error: " + *message);
+    }
+    return *val;
+  }
+
+  // The server's error message, empty if ok.
+  const std::string& error() const { return *message; }
+
+private:
+  const T* val;
+  bool failed;
+  const std::string* message;
+};
+
 class BaseReply : public auto_unlink_hook {
   friend class Connection;
 
 public:
-  BaseReply() : conn(NULL) {}
+  BaseReply() : conn(NULL), ignored(false), hasError(false) {}
+
+  // Replies are moved, never copied: the moved-to object takes the place of
+  // other in the connection's queue of outstanding replies.
+  BaseReply(BaseReply&& other) noexcept;
 
-  BaseReply(const BaseReply& other);
+  // Reads (and drops) this reply if it is still outstanding, ignoring errors
+  // as the destructor does, then takes over other.
+  BaseReply& operator=(BaseReply&& other) noexcept;
 
-  BaseReply& operator=(const BaseReply& other);
+  BaseReply(const BaseReply&) = delete;
+  BaseReply& operator=(const BaseReply&) = delete;
 
   virtual ~BaseReply() {}
 
+  // Marks the reply as unwanted: when its turn comes it is skipped over by
+  // length without being parsed or stored, and errors in it are ignored.
+  void ignore() { ignored = true; }
+
+  // Whether the reply was a server error, once it has been read, and the
+  // error's message.
+  bool failed() const { return hasError; }
+  const std::string& error() const { return errorText; }
+
 protected:
+  // Reads the reply if it is still outstanding. Server errors are stored for
+  // result() to throw rather than thrown here.
   virtual void readResult() = 0;
 
   void clearPendingResults();
 
+  // Skips the reply if it is ignored, or fails it if it is queued in a
+  // transaction that has not been committed, returning whether it did.
+  bool skipIgnored();
+
+  bool heldInTransaction();
+
+  // Reads an error reply into errorText, returning whether there was one.
+  bool readServerError(Connection* from);
+
+  // Throws the stored server error, if any.
+  void throwError() const;
+
   BaseReply(Connection* conn);
 
   mutable Connection* conn;
+  bool ignored;
+  bool hasError;
+  std::string errorText;
 };
 
 typedef boost::intrusive::list<BaseReply,
@@ -172,6 +367,9 @@ typedef boost::intrusive::list<BaseReply,
 
 class Transaction;
 
+// Commands the server refused to queue, by position in the transaction.
+typedef std::vector<std::pair<size_t, std::string>> QueueErrors;
+
 enum TransactionState {
   Blank,
   Dirty,
@@ -193,7 +391,10 @@ protected:
   virtual void readResult();
 
 private:
-  QueuedReply(Connection* conn) : BaseReply(conn), count(0), state(Blank) {}
+  QueuedReply(Connection* conn)
+      : BaseReply(unskipped(conn)), count(0), state(Blank) {}
+
+  static Connection* unskipped(Connection* conn);
 
   size_t count;
   TransactionState state;
@@ -207,22 +408,23 @@ public:
 
   ~VoidReply();
 
-  VoidReply(const VoidReply& other)
-      : BaseReply(other), storedResult(other.storedResult) {}
+  VoidReply(VoidReply&& other) noexcept
+      : BaseReply(std::move(other)),
+        storedResult(std::move(other.storedResult)) {}
 
-  VoidReply& operator=(const VoidReply& other) {
-    result();
-    BaseReply::operator=(other);
-    storedResult = other.storedResult;
+  VoidReply& operator=(VoidReply&& other) noexcept {
+    BaseReply::operator=(std::move(other));
+    storedResult = std::move(other.storedResult);
     return *this;
   }
 
   bool result();
+  Expected<bool> tryResult();
 
   operator bool() { return result(); }
 
 protected:
-  virtual void readResult() { result(); }
+  virtual void readResult();
 
 private:
   VoidReply(Connection* conn);
@@ -238,22 +440,23 @@ public:
 
   ~BoolReply();
 
-  BoolReply(const BoolReply& other)
-      : BaseReply(other), storedResult(other.storedResult) {}
+  BoolReply(BoolReply&& other) noexcept
+      : BaseReply(std::move(other)),
+        storedResult(std::move(other.storedResult)) {}
 
-  BoolReply& operator=(const BoolReply& other) {
-    result();
-    BaseReply::operator=(other);
-    storedResult = other.storedResult;
+  BoolReply& operator=(BoolReply&& other) noexcept {
+    BaseReply::operator=(std::move(other));
+    storedResult = std::move(other.storedResult);
     return *this;
   }
 
   bool result();
+  Expected<bool> tryResult();
 
   operator bool() { return result(); }
 
 protected:
-  virtual void readResult() { result(); }
+  virtual void readResult();
 
 private:
   BoolReply(Connection* conn);
@@ -269,22 +472,23 @@ public:
 
   ~IntReply();
 
-  IntReply(const IntReply& other)
-      : BaseReply(other), storedResult(other.storedResult) {}
+  IntReply(IntReply&& other) noexcept
+      : BaseReply(std::move(other)),
+        storedResult(std::move(other.storedResult)) {}
 
-  IntReply& operator=(const IntReply& other) {
-    result();
-    BaseReply::operator=(other);
-    storedResult = other.storedResult;
+  IntReply& operator=(IntReply&& other) noexcept {
+    BaseReply::operator=(std::move(other));
+    storedResult = std::move(other.storedResult);
     return *this;
   }
 
   int64_t result();
+  Expected<int64_t> tryResult();
 
   operator int() { return result(); }
 
 protected:
-  virtual void readResult() { result(); }
+  virtual void readResult();
 
 private:
   IntReply(Connection* conn);
@@ -300,17 +504,18 @@ public:
 
   ~StringReply();
 
-  StringReply(const StringReply& other)
-      : BaseReply(other), storedResult(other.storedResult) {}
+  StringReply(StringReply&& other) noexcept
+      : BaseReply(std::move(other)),
+        storedResult(std::move(other.storedResult)) {}
 
-  StringReply& operator=(const StringReply& other) {
-    result();
-    BaseReply::operator=(other);
-    storedResult = other.storedResult;
+  StringReply& operator=(StringReply&& other) noexcept {
+    BaseReply::operator=(std::move(other));
+    storedResult = std::move(other.storedResult);
     return *this;
   }
 
   const boost::optional<std::string>& result();
+  Expected<boost::optional<std::string>> tryResult();
 
   operator std::string() {
     result();
@@ -321,7 +526,7 @@ public:
   }
 
 protected:
-  virtual void readResult() { result(); }
+  virtual void readResult();
 
 private:
   StringReply(Connection* conn);
@@ -329,6 +534,208 @@ private:
   boost::optional<std::string> storedResult;
 };
 
+class DoubleReply : public BaseReply {
+  friend class Connection;
+
+public:
+  DoubleReply() {}
+
+  ~DoubleReply();
+
+  DoubleReply(DoubleReply&& other) noexcept
+      : BaseReply(std::move(other)),
+        storedResult(std::move(other.storedResult)) {}
+
+  DoubleReply& operator=(DoubleReply&& other) noexcept {
+    BaseReply::operator=(std::move(other));
+    storedResult = std::move(other.storedResult);
+    return *this;
+  }
+
+  const boost::optional<double>& result();
+  Expected<boost::optional<double>> tryResult();
+
+  operator double() {
+    result();
+    if (!storedResult) {
+      throw NullReplyException();
+    }
+    return *storedResult;
+  }
+
+protected:
+  virtual void readResult();
+
+private:
+  DoubleReply(Connection* conn);
+
+  boost::optional<double> storedResult;
+};
+
+// Reads a RESP3 map, or a RESP2 multi-bulk of alternating keys and values.
+class MapReply : public BaseReply {
+  friend class Connection;
+
+public:
+  MapReply() {}
+
+  ~MapReply();
+
+  MapReply(MapReply&& other) noexcept
+      : BaseReply(std::move(other)),
+        storedResult(std::move(other.storedResult)) {}
+
+  MapReply& operator=(MapReply&& other) noexcept {
+    BaseReply::operator=(std::move(other));
+    storedResult = std::move(other.storedResult);
+    return *this;
+  }
+
+  const KeyValueVector& result();
+  Expected<KeyValueVector> tryResult();
+
+  operator const KeyValueVector&() { return result(); }
+
+protected:
+  virtual void readResult();
+
+private:
+  MapReply(Connection* conn);
+
+  KeyValueVector storedResult;
+};
+
+// A reply that is an integer or nil, such as ZRANK of a missing member.
+class OptionalIntReply : public BaseReply {
+  friend class Connection;
+
+public:
+  OptionalIntReply() {}
+
+  ~OptionalIntReply();
+
+  OptionalIntReply(OptionalIntReply&& other) noexcept
+      : BaseReply(std::move(other)),
+        storedResult(std::move(other.storedResult)) {}
+
+  OptionalIntReply& operator=(OptionalIntReply&& other) noexcept {
+    BaseReply::operator=(std::move(other));
+    storedResult = std::move(other.storedResult);
+    return *this;
+  }
+
+  const boost::optional<int64_t>& result();
+  Expected<boost::optional<int64_t>> tryResult();
+
+protected:
+  virtual void readResult();
+
+private:
+  OptionalIntReply(Connection* conn);
+
+  boost::optional<int64_t> storedResult;
+};
+
+// Sorted set entries with their scores parsed, from either the flat RESP2
+// member, score, member... form or RESP3 [member, score] pairs.
+class ScoredReply : public BaseReply {
+  friend class Connection;
+
+public:
+  ScoredReply() {}
+
+  ~ScoredReply();
+
+  ScoredReply(ScoredReply&& other) noexcept
+      : BaseReply(std::move(other)),
+        storedResult(std::move(other.storedResult)) {}
+
+  ScoredReply& operator=(ScoredReply&& other) noexcept {
+    BaseReply::operator=(std::move(other));
+    storedResult = std::move(other.storedResult);
+    return *this;
+  }
+
+  const ScoredMemberVector& result();
+  Expected<ScoredMemberVector> tryResult();
+
+  operator const ScoredMemberVector&() { return result(); }
+
+protected:
+  virtual void readResult();
+
+private:
+  ScoredReply(Connection* conn);
+
+  ScoredMemberVector storedResult;
+};
+
+class ScanReply : public BaseReply {
+  friend class Connection;
+
+public:
+  ScanReply() {}
+
+  ~ScanReply();
+
+  ScanReply(ScanReply&& other) noexcept
+      : BaseReply(std::move(other)),
+        storedResult(std::move(other.storedResult)) {}
+
+  ScanReply& operator=(ScanReply&& other) noexcept {
+    BaseReply::operator=(std::move(other));
+    storedResult = std::move(other.storedResult);
+    return *this;
+  }
+
+  ScanPage& result();
+  Expected<ScanPage> tryResult();
+
+protected:
+  virtual void readResult();
+
+private:
+  ScanReply(Connection* conn);
+
+  ScanPage storedResult;
+};
+
+// Reads any reply into a Value. An error reply at the top level throws, errors
+// nested in aggregates are returned as Value::Error elements.
+class ValueReply : public BaseReply {
+  friend class Connection;
+
+public:
+  ValueReply() {}
+
+  ~ValueReply();
+
+  ValueReply(ValueReply&& other) noexcept
+      : BaseReply(std::move(other)),
+        storedResult(std::move(other.storedResult)) {}
+
+  ValueReply& operator=(ValueReply&& other) noexcept {
+    BaseReply::operator=(std::move(other));
+    storedResult = std::move(other.storedResult);
+    return *this;
+  }
+
+  const Value& result();
+  Expected<Value> tryResult();
+  // The result moved out of the reply, which is left empty.
+  Value take();
+
+  operator const Value&() { return result(); }
+
+protected:
+  virtual void readResult();
+
+private:
+  ValueReply(Connection* conn);
+
+  Value storedResult;
+};
+
 class MultiBulkEnumerator : public BaseReply {
   friend class Connection;
 
@@ -337,65 +744,209 @@ public:
 
   ~MultiBulkEnumerator();
 
-  MultiBulkEnumerator(const MultiBulkEnumerator& other)
-      : BaseReply(other), headerDone(other.headerDone), count(other.count) {
-    pending.splice(pending.begin(), other.pending);
+  MultiBulkEnumerator(MultiBulkEnumerator&& other) noexcept
+      : BaseReply(std::move(other)), headerDone(other.headerDone),
+        count(other.count) {
+    pending.swap(other.pending);
   }
 
-  MultiBulkEnumerator& operator=(const MultiBulkEnumerator& other) {
-    if (conn && count > 0) {
+  MultiBulkEnumerator& operator=(MultiBulkEnumerator&& other) noexcept {
+    if (this != &other) {
       // assume unread data can be discarded, this is the only object that
       // could/would have read it
-      std::string tmp;
-      while (next(&tmp))
-        ;
+      discard();
+      pending.clear();
+      BaseReply::operator=(std::move(other));
+      headerDone = other.headerDone;
+      count = other.count;
+      pending.swap(other.pending);
     }
-    pending.clear();
-    BaseReply::operator=(other);
-    headerDone = other.headerDone;
-    count = other.count;
     return *this;
   }
 
   bool nextOptional(boost::optional<std::string>& out);
   bool next(std::string* out);
 
+  // As nextOptional, but an error reply ends the enumeration instead of
+  // throwing, leaving failed() set.
+  bool tryNextOptional(boost::optional<std::string>& out);
+
 protected:
-  virtual void readResult() {
-    if (conn && (!headerDone || count > 0)) {
-      std::list<boost::optional<std::string>> readPending;
-      boost::optional<std::string> tmp;
-      while (nextOptional(tmp)) {
-        readPending.push_back(tmp);
-      }
-      pending.splice(pending.end(), readPending);
-    }
-  }
+  virtual void readResult();
 
   MultiBulkEnumerator(Connection* conn);
 
+  // Skips the rest of the reply without parsing it, ignoring errors.
+  void discard() noexcept;
+
   bool headerDone;
   int count;
   mutable std::list<boost::optional<std::string>> pending;
 };
 
+// The reply to a command that was sent in several chunks. The chunk replies
+// are read and merged together.
+class ChunkedIntReply {
+  friend class Connection;
+
+public:
+  ChunkedIntReply() : storedResult(0), hasError(false) {}
+
+  // The sum of the chunk replies.
+  int64_t result();
+  // Reads every chunk, keeping the first error.
+  Expected<int64_t> tryResult();
+
+  operator int64_t() { return result(); }
+
+private:
+  std::list<IntReply> parts;
+  int64_t storedResult;
+  bool hasError;
+  std::string errorText;
+};
+
+class ChunkedStringReply {
+  friend class Connection;
+
+public:
+  ChunkedStringReply() : hasError(false) {}
+
+  // The chunk replies concatenated, nil values being empty optionals.
+  const std::vector<boost::optional<std::string>>& result();
+  Expected<std::vector<boost::optional<std::string>>> tryResult();
+
+private:
+  std::list<MultiBulkEnumerator> parts;
+  std::vector<boost::optional<std::string>> storedResult;
+  bool hasError;
+  std::string errorText;
+};
+
+class ChunkedVoidReply {
+  friend class Connection;
+
+public:
+  ChunkedVoidReply() : storedResult(false), hasError(false) {}
+
+  // Throws the first error of any chunk.
+  void result();
+  Expected<bool> tryResult();
+
+private:
+  std::list<VoidReply> parts;
+  bool storedResult;
+  bool hasError;
+  std::string errorText;
+};
+
 class Connection;
 
+enum TransactionMode {
+  // MULTI and each queued command are sent as they are issued.
+  SendImmediately,
+  // MULTI and the queued commands are buffered until commit sends them
+  // together with EXEC, so the whole transaction costs one write and one
+  // round trip, and aborting it costs nothing.
+  SendOnCommit,
+};
+
 class Transaction : boost::noncopyable {
   friend class BaseReply;
+  friend class Connection;
 
 public:
-  Transaction(Connection* conn);
+  explicit Transaction(Connection* conn,
+                       TransactionMode mode = SendImmediately);
 
   ~Transaction();
 
-  void commit();
+  // Returns false if the server refused EXEC because a WATCHed key changed.
+  // The replies of the queued commands then fail with an error, as they do
+  // when the transaction is aborted.
+  bool commit();
 
   void abort();
 
 private:
   Connection* conn;
   QueuedReply replies;
+  bool buffered;
+  std::list<VoidReply> placeholders; // see Connection::holdPlace
+};
+
+struct CasOptions {
+  CasOptions() : maxAttempts(16), backoffMillis(1), maxBackoffMillis(100) {}
+
+  size_t maxAttempts;
+  // Doubled after each conflict up to maxBackoffMillis, and randomized
+  // between half and all of that.
+  int backoffMillis;
+  int maxBackoffMillis;
+};
+
+// An optimistic transaction: WATCH the keys, read them (the reads are
+// pipelined behind the WATCH), then queue the writes after multi(). exec
+// sends MULTI, the writes and EXEC in one write. If a watched key changed in
+// the meantime it returns false after backing off and watching the keys
+// again, ready for the next attempt:
+//
+//   CheckAndSet cas(&conn, keys);
+//   do {
+//     StringReply balance = conn.get("balance");
+//     const int64_t next = parse(balance) - amount;
+//     cas.multi();
+//     conn.set("balance", format(next));
+//   } while (!cas.exec());
+//
+// exec throws once options.maxAttempts attempts have failed. Without a call
+// to multi, exec just unwatches the keys.
+class CheckAndSet : boost::noncopyable {
+public:
+  CheckAndSet(Connection* conn, const ArgList& keys,
+              const CasOptions& options = CasOptions());
+
+  ~CheckAndSet();
+
+  void multi();
+
+  bool exec();
+
+  size_t attempts() const { return attempt; }
+
+private:
+  void watch();
+
+  Connection* conn;
+  ArgList keys;
+  CasOptions options;
+  size_t attempt;
+  bool watching;
+  VoidReply watchReply;
+  std::unique_ptr<Transaction> transaction;
+};
+
+// Runs body in a CheckAndSet on keys until it commits.
+void checkAndSet(Connection* conn, const ArgList& keys,
+                 const std::function<void(CheckAndSet&)>& body,
+                 const CasOptions& options = CasOptions());
+
+// Turns replies off on a connection for its lifetime, for writes whose
+// results are never looked at. The server sends nothing back, so reply objects
+// returned meanwhile are detached and never block. The server does not report
+// errors of these commands either: sync only confirms that everything sent so
+// far was received and processed, and surfaces connection errors.
+class FireAndForget : boost::noncopyable {
+public:
+  explicit FireAndForget(Connection* conn);
+
+  ~FireAndForget();
+
+  // Waits for the server to catch up, then turns replies off again.
+  void sync();
+
+private:
+  Connection* conn;
 };
 
 class Connection {
@@ -405,8 +956,22 @@ class Connection {
   friend class BoolReply;
   friend class IntReply;
   friend class StringReply;
+  friend class DoubleReply;
+  friend class MapReply;
+  friend class OptionalIntReply;
+  friend class ScoredReply;
+  friend class ScanReply;
+  friend class ValueReply;
   friend class MultiBulkEnumerator;
   friend class Transaction;
+  friend class PipelineBase;
+  friend class FireAndForget;
+  friend class Script;
+  friend class ScriptReply;
+  friend class CheckAndSet;
+  friend class Subscriber;
+  friend class Stream;
+  friend class WriteCombiner;
 
 public:
   static const size_t kDefaultBufferSize = 4 * 1024;
@@ -418,6 +983,9 @@ public:
   Connection(const std::string& unixDomainSocket, const std::string& password,
              size_t bufferSize = kDefaultBufferSize);
 #endif
+  explicit Connection(std::unique_ptr<Transport> transport,
+                      const std::string& password = std::string(),
+                      size_t bufferSize = kDefaultBufferSize);
 
   ~Connection();
 
@@ -425,12 +993,63 @@ public:
 
   VoidReply authenticate(const char* password);
 
+  // Negotiates the protocol version. After HELLO 3 the server sends RESP3
+  // types, which all reply objects understand.
+  ValueReply hello(int protocolVersion);
+
+  // Out-of-band RESP3 push messages (and RESP2 pub/sub messages read by
+  // processPushes) are passed to handler instead of being treated as replies.
+  // The handler must not issue commands on this connection.
+  void setPushHandler(const PushHandler& handler);
+
+  // The most recent RESP3 attribute sent ahead of a reply, if any.
+  const Value& lastAttribute() const { return attribute; }
+
+  // Reads unsolicited frames (RESP3 pushes, or pub/sub messages on a
+  // subscribed RESP2 connection) and passes them to the push handler. Waits up
+  // to timeoutMs for the first frame (-1 waits forever) and returns the number
+  // handled. Does nothing while replies are outstanding, reading those
+  // replies dispatches any pushes ahead of them.
+  size_t processPushes(int timeoutMs = 0);
+
+  // Sends an arbitrary command, the first element of args being its name.
+  ValueReply command(const ArgList& args);
+
+  // CLIENT REPLY OFF: the server stops replying until repliesOn. Reply
+  // objects returned meanwhile are detached and hold default values. Errors
+  // of the commands are not reported. See also FireAndForget.
+  void repliesOff();
+  // CLIENT REPLY ON, waiting for the server to confirm.
+  void repliesOn();
+  // CLIENT REPLY SKIP: the next command is sent without a reply. Commands
+  // that send several chunks only skip the reply of the first.
+  void skipNextReply();
+  bool repliesEnabled() const { return !noReplies; }
+
+  // Commands taking many keys, members or fields are split into chunks of at
+  // most maxKeys of them (fewer if the chunk would not fit the buffer) so a
+  // huge command cannot block the server. The chunks are pipelined and their
+  // replies merged. Defaults to 1024.
+  void setMaxKeysPerCommand(size_t maxKeys);
+
+  // Bounds the replies outstanding on the connection, see FlowControl. Not
+  // applied inside transactions or while replies are off.
+  void setFlowControl(const FlowControl& flowControl);
+  // The current limit on outstanding replies, 0 if there is none.
+  size_t inFlightLimit() const { return depthLimit; }
+
   BoolReply exists(const std::string& name);
   BoolReply del(const std::string& name);
+  ChunkedIntReply del(const ArgList& names);
+  ChunkedIntReply unlink(const ArgList& names);
 
   Type type(const std::string& name);
 
+  // KEYS blocks the server while it walks the whole keyspace, prefer scan or
+  // the Scanner class (scan.h).
   MultiBulkEnumerator keys(const std::string& pattern);
+  ScanReply scan(const std::string& cursor,
+                 const ScanOptions& options = ScanOptions());
   StringReply randomKey();
 
   VoidReply rename(const std::string& oldName, const std::string& newName);
@@ -442,6 +1061,7 @@ public:
   BoolReply expireAt(const std::string& name, int timestamp);
   // TODO: persist
   IntReply ttl(const std::string& name);
+  IntReply pttl(const std::string& name);
 
   VoidReply select(int db);
   BoolReply move(const std::string& name, int db);
@@ -451,21 +1071,24 @@ public:
 
   VoidReply set(const std::string& name, const std::string& value);
   StringReply get(const std::string& name);
-  // TODO: mget
+  ChunkedStringReply mget(const ArgList& names);
   StringReply getSet(const std::string& name, const std::string& value);
   BoolReply setNX(const std::string& name, const std::string& value);
   VoidReply setEx(const std::string& name, int time, const std::string& value);
 
-  // TODO: mset
-  // TODO: msetnx
+  ChunkedVoidReply mset(const KeyValueList& pairs);
+  // Never chunked, as that would break its all or nothing guarantee.
+  BoolReply msetNX(const KeyValueList& pairs);
 
   IntReply incr(const std::string& name);
   IntReply incrBy(const std::string& name, int value);
+  DoubleReply incrByFloat(const std::string& name, double value);
 
   IntReply decr(const std::string& name);
   IntReply decrBy(const std::string& name, int value);
 
   IntReply append(const std::string& name, const std::string& value);
+  IntReply strlen(const std::string& name);
   StringReply subStr(const std::string& name, int start, int end);
 
   IntReply rpush(const std::string& key, const std::string& value);
@@ -484,6 +1107,8 @@ public:
 
   BoolReply sadd(const std::string& key, const std::string& member);
   BoolReply srem(const std::string& key, const std::string& member);
+  ChunkedIntReply sadd(const std::string& key, const ArgList& members);
+  ChunkedIntReply srem(const std::string& key, const ArgList& members);
   StringReply spop(const std::string& key);
   BoolReply smove(const std::string& src, const std::string& dest,
                   const std::string& member);
@@ -497,8 +1122,60 @@ public:
   IntReply sdiffStore(const std::string& key, const ArgList& keys);
   MultiBulkEnumerator smembers(const std::string& key);
   StringReply srandMember(const std::string& key);
-
-  // TODO: all Z* functions
+  ScanReply sscan(const std::string& key, const std::string& cursor,
+                  const ScanOptions& options = ScanOptions());
+
+  BoolReply zadd(const std::string& key, double score,
+                 const std::string& member);
+  // Adds or updates many members, chunked like del.
+  ChunkedIntReply zadd(const std::string& key,
+                       const ScoredMemberVector& members, int flags = 0);
+  BoolReply zrem(const std::string& key, const std::string& member);
+  ChunkedIntReply zrem(const std::string& key, const ArgList& members);
+  DoubleReply zincrBy(const std::string& key, double increment,
+                      const std::string& member);
+  OptionalIntReply zrank(const std::string& key, const std::string& member);
+  OptionalIntReply zrevRank(const std::string& key, const std::string& member);
+  MultiBulkEnumerator zrange(const std::string& key, int64_t start,
+                             int64_t stop);
+  ScoredReply zrangeWithScores(const std::string& key, int64_t start,
+                               int64_t stop);
+  MultiBulkEnumerator zrevRange(const std::string& key, int64_t start,
+                                int64_t stop);
+  ScoredReply zrevRangeWithScores(const std::string& key, int64_t start,
+                                  int64_t stop);
+  MultiBulkEnumerator zrangeByScore(const std::string& key, double min,
+                                    double max);
+  ScoredReply zrangeByScoreWithScores(const std::string& key, double min,
+                                      double max);
+  // ZRANGE with BYSCORE, REV and LIMIT, needs Redis 6.2.
+  MultiBulkEnumerator zrange(const std::string& key, const std::string& start,
+                             const std::string& stop,
+                             const ZRangeOptions& options);
+  ScoredReply zrangeWithScores(const std::string& key, const std::string& start,
+                               const std::string& stop,
+                               const ZRangeOptions& options);
+  IntReply zcount(const std::string& key, const std::string& min,
+                  const std::string& max);
+  IntReply zremRangeByRank(const std::string& key, int64_t start,
+                           int64_t stop);
+  IntReply zremRangeByScore(const std::string& key, const std::string& min,
+                            const std::string& max);
+  IntReply zcard(const std::string& key);
+  DoubleReply zscore(const std::string& key, const std::string& member);
+  ScoredReply zpopMin(const std::string& key, int64_t count = 1);
+  ScoredReply zpopMax(const std::string& key, int64_t count = 1);
+  ScanReply zscan(const std::string& key, const std::string& cursor,
+                  const ScanOptions& options = ScanOptions());
+  // weights may be empty, otherwise it needs one weight per key.
+  IntReply
+  zunionStore(const std::string& dest, const ArgList& keys,
+              const std::vector<double>& weights = std::vector<double>(),
+              Aggregate aggregate = AggregateSum);
+  IntReply
+  zinterStore(const std::string& dest, const ArgList& keys,
+              const std::vector<double>& weights = std::vector<double>(),
+              Aggregate aggregate = AggregateSum);
 
   BoolReply hset(const std::string& key, const std::string& field,
                  const std::string& value);
@@ -510,12 +1187,18 @@ public:
   VoidReply hmset(const std::string& key,
                   const std::list<std::pair<std::string, std::string>>& fields);
   IntReply hincrBy(const std::string& key, const std::string& field, int value);
+  DoubleReply hincrByFloat(const std::string& key, const std::string& field,
+                           double value);
   BoolReply hexists(const std::string& key, const std::string& field);
   BoolReply hdel(const std::string& key, const std::string& field);
+  ChunkedIntReply hdel(const std::string& key, const ArgList& fields);
   IntReply hlen(const std::string& key);
   MultiBulkEnumerator hkeys(const std::string& key);
   MultiBulkEnumerator hvals(const std::string& key);
   MultiBulkEnumerator hgetAll(const std::string& key);
+  MapReply hgetAllMap(const std::string& key);
+  ScanReply hscan(const std::string& key, const std::string& cursor,
+                  const ScanOptions& options = ScanOptions());
 
   MultiBulkEnumerator scriptExists(const ArgList& script);
   VoidReply scriptFlush();
@@ -534,33 +1217,101 @@ public:
   void shutdown();
   StringReply info();
 
+  IntReply clientId();
+  // Enables server-assisted client side caching. Invalidations are sent as
+  // RESP3 pushes, or to the connection with id redirectId if it is given.
+  VoidReply clientTracking(bool enable, int64_t redirectId = -1);
+
   void subscribe(const std::string& channel);
   void unsubscribe(const std::string& channel);
   void psubscribe(const std::string& channel);
   void punsubscribe(const std::string& channel);
   IntReply publish(const std::string& channel, const std::string& message);
 
+  // See also CheckAndSet.
+  VoidReply watch(const ArgList& keys);
+  VoidReply unwatch();
+
 private:
+  char peekCode();
   char statusCode();
+  bool readError(std::string& message);
   void readErrorReply();
   void readStatusCodeReply(std::string* out);
   std::string readStatusCodeReply();
   int64_t readIntegerReply();
   void readBulkReply(boost::optional<std::string>& out);
   boost::optional<std::string> readBulkReply();
+  void readBlob(char* code, boost::optional<std::string>& out);
+  void readLine(std::string& out);
+  void readValue(Value& out);
+  void readReply(Value& out);
+  size_t readAggregateHeader(char code);
+  void readOutstandingReplies();
+  void skipValue();
+  bool skipQueued();
+  size_t readSome(char* data, size_t len, int timeoutMs);
+  bool holdPlace(BaseReply& reply);
+  void failReplies(BaseReply& after, size_t count, const std::string& reason,
+                   const QueueErrors& errors = QueueErrors());
+  void send();
+  void uncork();
+  void throttle();
+  void drain(size_t pending, size_t count);
+  void updateDepthLimit();
+  template <typename Iterator>
+  Iterator writeChunk(const char* name, const ArgList& head, Iterator first,
+                      Iterator last);
+
+  // Collects the commands sent while it lives into the one write made by
+  // release. Unwinding before release drops them and fails their replies,
+  // unless an enclosing cork (a buffered transaction) owns the writes.
+  class Cork : boost::noncopyable {
+  public:
+    explicit Cork(Connection* conn);
+    ~Cork();
+    void release();
+
+  private:
+    Connection* const conn;
+    const bool nested;
+    const uint64_t queued; // repliesQueued when corked
+  };
 
   std::unique_ptr<ClientSocket> connection;
   std::unique_ptr<std::iostream> ioStream;
   std::unique_ptr<Buffer> buffer;
   ReplyList outstandingReplies;
   Transaction* transaction;
+  PushHandler pushHandler;
+  Value attribute;
+  size_t maxKeysPerCommand;
+  bool noReplies;
+  bool skipReply;    // CLIENT REPLY SKIP was sent, for the next command
+  bool replySkipped; // the last command sent gets no reply
+  uint64_t commandsSent;
+  bool corked; // commands collect in corkedWrites, see uncork
+  std::string corkedWrites;
+  std::unordered_set<std::string> loadedScripts; // SHA1s, see Script
+  FlowControl flowControl;
+  size_t depthLimit;
+  size_t pendingEstimate; // at least the number of outstanding replies
+  uint64_t repliesQueued;
+  double replyBytes; // average, 0 until measured
+  double replyRate;  // replies per second, 0 until measured
+  double roundTrip;  // seconds, 0 until measured
+  std::chrono::steady_clock::time_point lastDrain;
+  uint64_t lastConsumed; // replies read before lastDrain
+  size_t drainsSinceProbe;
 
   DEFINE_COMMAND(Quit, 0);
   DEFINE_COMMAND(Auth, 1);
+  DEFINE_COMMAND(Hello, 1);
   DEFINE_COMMAND(Exists, 1);
   DEFINE_COMMAND(Del, 1);
   DEFINE_COMMAND(Type, 1);
   DEFINE_COMMAND(Keys, 1);
+  DEFINE_COMMAND(Scan, 1);
   DEFINE_COMMAND(RandomKey, 0);
   DEFINE_COMMAND(Rename, 2);
   DEFINE_COMMAND(RenameNX, 2);
@@ -569,6 +1320,7 @@ private:
   DEFINE_COMMAND(ExpireAt, 2);
   DEFINE_COMMAND(Persist, 1);
   DEFINE_COMMAND(Ttl, 1);
+  DEFINE_COMMAND(PTtl, 1);
   DEFINE_COMMAND(Select, 1);
   DEFINE_COMMAND(Move, 2);
   DEFINE_COMMAND(FlushDb, 0);
@@ -580,9 +1332,11 @@ private:
   DEFINE_COMMAND(SetEx, 3);
   DEFINE_COMMAND(Incr, 1);
   DEFINE_COMMAND(IncrBy, 2);
+  DEFINE_COMMAND(IncrByFloat, 2);
   DEFINE_COMMAND(Decr, 1);
   DEFINE_COMMAND(DecrBy, 2);
   DEFINE_COMMAND(Append, 2);
+  DEFINE_COMMAND(StrLen, 1);
   DEFINE_COMMAND(SubStr, 3);
 
   DEFINE_COMMAND(RPush, 2);
@@ -613,6 +1367,7 @@ private:
   DEFINE_COMMAND(SDiff, 1);
   DEFINE_COMMAND(SDiffStore, 2);
   DEFINE_COMMAND(SMembers, 1);
+  DEFINE_COMMAND(SScan, 2);
   DEFINE_COMMAND(SRandMember, 1);
 
   DEFINE_COMMAND(ZAdd, 2);
@@ -628,8 +1383,11 @@ private:
   DEFINE_COMMAND(ZRemRangeByScore, 3);
   DEFINE_COMMAND(ZCard, 1);
   DEFINE_COMMAND(ZScore, 2);
-  // TODO: zunionstore
-  // TODO: zinterstore
+  DEFINE_COMMAND(ZPopMin, 2);
+  DEFINE_COMMAND(ZPopMax, 2);
+  DEFINE_COMMAND(ZScan, 2);
+  DEFINE_COMMAND(ZUnionStore, 1);
+  DEFINE_COMMAND(ZInterStore, 1);
 
   DEFINE_COMMAND(HSet, 3);
   DEFINE_COMMAND(HSetNX, 3);
@@ -637,12 +1395,14 @@ private:
   DEFINE_COMMAND(HMGet, 2);
   DEFINE_COMMAND(HMSet, 2);
   DEFINE_COMMAND(HIncrBy, 3);
+  DEFINE_COMMAND(HIncrByFloat, 3);
   DEFINE_COMMAND(HExists, 2);
   DEFINE_COMMAND(HDel, 2);
   DEFINE_COMMAND(HLen, 1);
   DEFINE_COMMAND(HKeys, 1);
   DEFINE_COMMAND(HVals, 1);
   DEFINE_COMMAND(HGetAll, 1);
+  DEFINE_COMMAND(HScan, 2);
 
   DEFINE_COMMAND(Script, 2);
   DEFINE_COMMAND(Eval, 3);
@@ -655,14 +1415,16 @@ private:
   DEFINE_COMMAND(BgReWriteAOF, 0);
   DEFINE_COMMAND(Info, 0);
 
+  DEFINE_COMMAND(Client, 2);
+
   DEFINE_COMMAND(Subscribe, 1);
   DEFINE_COMMAND(Unsubscribe, 1);
   DEFINE_COMMAND(PSubscribe, 1);
   DEFINE_COMMAND(PUnsubscribe, 1);
   DEFINE_COMMAND(Publish, 2);
 
-  // TODO: watch
-  // TODO: unwatch
+  DEFINE_COMMAND(Watch, 1);
+  DEFINE_COMMAND(Unwatch, 0);
 
   DEFINE_COMMAND(Multi, 0);
   DEFINE_COMMAND(Exec, 0);
@@ -0,0 +1,100 @@
+#include "scan.h"
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+namespace redispp {
+
+Scanner::Scanner(Connection* conn, const ScanOptions& options)
+    : conn(conn), command(ScanKeys), options(options), started(false),
+      finished(false), position(0) {}
+
+Scanner::Scanner(Connection* conn, ScanCommand command, const std::string& key,
+                 const ScanOptions& options)
+    : conn(conn), command(command), key(key), options(options),
+      started(false), finished(false), position(0) {}
+
+ScanReply Scanner::request(const std::string& cursor) {
+  switch (command) {
+  case ScanSet:
+    return conn->sscan(key, cursor, options);
+  case ScanHash:
+    return conn->hscan(key, cursor, options);
+  case ScanSortedSet:
+    return conn->zscan(key, cursor, options);
+  default:
+    return conn->scan(cursor, options);
+  }
+}
+
+bool Scanner::next(std::vector<std::string>* page) {
+  page->clear();
+  if (position < buffered.size()) {
+    page->assign(buffered.begin() + position, buffered.end());
+    buffered.clear();
+    position = 0;
+    return true;
+  }
+  if (!started) {
+    started = true;
+    pending = request("0");
+  }
+  while (!finished) {
+    ScanPage& result = pending.result();
+    page->swap(result.elements);
+    if (result.cursor == "0") {
+      finished = true;
+    } else {
+      pending = request(result.cursor);
+    }
+    if (!page->empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Scanner::next(std::string* out) {
+  if (position >= buffered.size()) {
+    buffered.clear();
+    position = 0;
+    if (!next(&buffered)) {
+      return false;
+    }
+  }
+  out->swap(buffered[position++]);
+  return true;
+}
+
+void parallelScan(const std::vector<Connection*>& conns,
+                  const ScanOptions& options, const ScanHandler& handler) {
+  std::atomic<bool> stop(false);
+  std::mutex mutex;
+  std::exception_ptr error;
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < conns.size(); ++i) {
+    threads.push_back(std::thread([&, i]() {
+      try {
+        Scanner scanner(conns[i], options);
+        std::vector<std::string> page;
+        while (!stop && scanner.next(&page)) {
+          handler(i, page);
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+        stop = true;
+      }
+    }));
+  }
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "redispp.h"
+#include <boost/noncopyable.hpp>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace redispp {
+
+enum ScanCommand {
+  ScanKeys,
+  ScanSet,
+  ScanHash,
+  ScanSortedSet,
+};
+
+// Walks a SCAN family cursor page by page. As soon as a page arrives the
+// request for the next one is sent, so the server is working on it while the
+// caller processes the current page. Elements may be returned more than once
+// if the collection changes during the scan, as with SCAN itself.
+class Scanner : boost::noncopyable {
+public:
+  // Scans the keyspace of the selected database.
+  explicit Scanner(Connection* conn,
+                   const ScanOptions& options = ScanOptions());
+  // Scans the set, hash or sorted set at key.
+  Scanner(Connection* conn, ScanCommand command, const std::string& key,
+          const ScanOptions& options = ScanOptions());
+
+  // Replaces page with the next non-empty page, returning false when the
+  // scan is complete.
+  bool next(std::vector<std::string>* page);
+
+  // Returns the elements one at a time.
+  bool next(std::string* out);
+
+  bool done() const { return finished && buffered.empty(); }
+
+private:
+  ScanReply request(const std::string& cursor);
+
+  Connection* conn;
+  ScanCommand command;
+  std::string key;
+  ScanOptions options;
+  ScanReply pending;
+  bool started;
+  bool finished;
+  std::vector<std::string> buffered;
+  size_t position;
+};
+
+typedef std::function<void(size_t index, const std::vector<std::string>& page)>
+    ScanHandler;
+
+// Scans every connection on its own thread, for example one connection per
+// server or per selected database, passing each page to handler along with the
+// index of its connection. handler is called concurrently from the scanning
+// threads. If a scan or the handler throws, the other scans stop after their
+// current page and the first exception is rethrown.
+void parallelScan(const std::vector<Connection*>& conns,
+                  const ScanOptions& options, const ScanHandler& handler);
+};
@@ -0,0 +1,172 @@
+#include "script.h"
+#include <stdint.h>
+#include <stdio.h>
+
+namespace redispp {
+
+static uint32_t rotl(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+static void sha1Block(uint32_t state[5], const unsigned char* block) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; ++i) {
+    w[i] = uint32_t(block[4 * i]) << 24 | uint32_t(block[4 * i + 1]) << 16 |
+           uint32_t(block[4 * i + 2]) << 8 | uint32_t(block[4 * i + 3]);
+  }
+  for (int i = 16; i < 80; ++i) {
+    w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+  uint32_t a = state[0];
+  uint32_t b = state[1];
+  uint32_t c = state[2];
+  uint32_t d = state[3];
+  uint32_t e = state[4];
+  for (int i = 0; i < 80; ++i) {
+    uint32_t f;
+    uint32_t k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+    const uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rotl(b, 30);
+    b = a;
+    a = temp;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+std::string sha1Hex(const std::string& data) {
+  uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                       0xC3D2E1F0};
+  const unsigned char* bytes = (const unsigned char*)data.data();
+  const size_t full = data.size() / 64 * 64;
+  for (size_t i = 0; i < full; i += 64) {
+    sha1Block(state, bytes + i);
+  }
+
+  // the tail, a 1 bit, zeros and the length in bits fill one or two blocks
+  unsigned char tail[128] = {0};
+  const size_t rest = data.size() - full;
+  std::copy(bytes + full, bytes + data.size(), tail);
+  tail[rest] = 0x80;
+  const size_t tailSize = rest < 56 ? 64 : 128;
+  const uint64_t bits = uint64_t(data.size()) * 8;
+  for (int i = 0; i < 8; ++i) {
+    tail[tailSize - 1 - i] = (unsigned char)(bits >> (8 * i));
+  }
+  for (size_t i = 0; i < tailSize; i += 64) {
+    sha1Block(state, tail + i);
+  }
+
+  char hex[41];
+  for (int i = 0; i < 5; ++i) {
+    snprintf(hex + 8 * i, 9, "%08x", state[i]);
+  }
+  return std::string(hex, 40);
+}
+
+ScriptReply::ScriptReply(const Script* script, Connection* conn,
+                         ArgList& args)
+    : script(script), conn(conn), reply(conn->command(args)) {
+  sent = conn->commandsSent;
+  this->args.swap(args);
+}
+
+Expected<Value> ScriptReply::tryResult() {
+  Expected<Value> ret = reply.tryResult();
+  if (!ret && conn && ret.error().compare(0, 8, "NOSCRIPT") == 0) {
+    Connection* const tmp = conn;
+    conn = NULL;
+    script->setLoaded(tmp, false);
+    if (tmp->commandsSent == sent) {
+      ArgList::iterator arg = args.begin();
+      *arg = "EVAL";
+      *++arg = script->source();
+      reply = tmp->command(args);
+      ret = reply.tryResult();
+      script->setLoaded(tmp, true);
+    }
+  }
+  return ret;
+}
+
+const Value& ScriptReply::result() { return tryResult().value(); }
+
+Script::Script(const std::string& source)
+    : body(source), digest(sha1Hex(source)) {}
+
+bool Script::loadedOn(Connection* conn) const {
+  return conn->loadedScripts.count(digest) > 0;
+}
+
+void Script::setLoaded(Connection* conn, bool loaded) const {
+  if (loaded) {
+    conn->loadedScripts.insert(digest);
+  } else {
+    conn->loadedScripts.erase(digest);
+  }
+}
+
+ScriptReply Script::run(Connection* conn, const ArgList& keys,
+                        const ArgList& args) const {
+  ArgList command;
+  if (loadedOn(conn)) {
+    command.push_back("EVALSHA");
+    command.push_back(digest);
+  } else {
+    command.push_back("EVAL");
+    command.push_back(body);
+    // cached by the server once it runs
+    setLoaded(conn, true);
+  }
+  command.push_back(boost::lexical_cast<std::string>(keys.size()));
+  command.insert(command.end(), keys.begin(), keys.end());
+  command.insert(command.end(), args.begin(), args.end());
+  return ScriptReply(this, conn, command);
+}
+
+void Script::load(Connection* conn) const {
+  const std::string sha = conn->scriptLoad(body);
+  if (sha != digest) {
+    throw std::runtime_error("script digest mismatch: " + sha);
+  }
+  setLoaded(conn, true);
+}
+
+const Script& ScriptRegistry::add(const std::string& source) {
+  scripts.emplace_back(source);
+  return scripts.back();
+}
+
+void ScriptRegistry::preload(Connection* conn) const {
+  std::list<StringReply> replies;
+  BOOST_FOREACH (const Script& script, scripts) {
+    replies.push_back(conn->scriptLoad(script.source()));
+  }
+  std::list<StringReply>::iterator reply = replies.begin();
+  BOOST_FOREACH (const Script& script, scripts) {
+    const std::string sha = *reply++;
+    if (sha != script.sha()) {
+      throw std::runtime_error("script digest mismatch: " + sha);
+    }
+    script.setLoaded(conn, true);
+  }
+}
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "redispp.h"
+#include <boost/noncopyable.hpp>
+#include <list>
+#include <string>
+
+namespace redispp {
+
+// Hex SHA1 digest of data, as the server names scripts.
+std::string sha1Hex(const std::string& data);
+
+class Script;
+
+// The reply of a Script run. If the server has lost the script (NOSCRIPT,
+// e.g. after SCRIPT FLUSH or a restart) and nothing was sent on the
+// connection since, the script is run again with EVAL and that reply is
+// returned instead. Otherwise retrying would run the script after commands
+// sent later, so the NOSCRIPT error is returned as is.
+class ScriptReply {
+  friend class Script;
+
+public:
+  ScriptReply() : script(NULL), conn(NULL), sent(0) {}
+
+  const Value& result();
+  Expected<Value> tryResult();
+
+private:
+  ScriptReply(const Script* script, Connection* conn, ArgList& args);
+
+  const Script* script;
+  Connection* conn;
+  uint64_t sent;
+  ArgList args;
+  ValueReply reply;
+};
+
+// A Lua script run by its SHA1, which is computed locally. The body is only
+// sent the first time the script is run on a connection (with EVAL, which also
+// caches it on the server, so that commands pipelined behind it can use
+// EVALSHA) and after the server has lost it. The script must outlive its
+// replies.
+class Script : boost::noncopyable {
+public:
+  explicit Script(const std::string& source);
+
+  const std::string& source() const { return body; }
+  const std::string& sha() const { return digest; }
+
+  ScriptReply run(Connection* conn, const ArgList& keys = ArgList(),
+                  const ArgList& args = ArgList()) const;
+
+  // SCRIPT LOAD, after which runs on conn start with EVALSHA.
+  void load(Connection* conn) const;
+
+private:
+  friend class ScriptReply;
+  friend class ScriptRegistry;
+
+  bool loadedOn(Connection* conn) const;
+  void setLoaded(Connection* conn, bool loaded) const;
+
+  std::string body;
+  std::string digest;
+};
+
+// The scripts an application uses, loaded together onto each new connection.
+class ScriptRegistry : boost::noncopyable {
+public:
+  // The returned script lives as long as the registry.
+  const Script& add(const std::string& source);
+
+  // Pipelines SCRIPT LOAD of every script, checking the digests the server
+  // returns.
+  void preload(Connection* conn) const;
+
+private:
+  std::list<Script> scripts;
+};
+};
@@ -0,0 +1,236 @@
+#include "streams.h"
+#include <boost/lexical_cast.hpp>
+#include <list>
+
+namespace redispp {
+
+ArgList StreamEntries::ids() const {
+  ArgList ret;
+  BOOST_FOREACH (const Entry& entry, entries) { ret.push_back(entry.id); }
+  return ret;
+}
+
+void StreamEntries::clear() {
+  entries.clear();
+  fields.clear();
+}
+
+void StreamEntries::append(Value& reply) {
+  BOOST_FOREACH (Value& element, reply.elements) {
+    if (element.isNil()) {
+      // deleted, as XAUTOCLAIM of older servers reports it
+      continue;
+    }
+    if (element.elements.size() != 2) {
+      throw std::runtime_error("unexpected stream entry");
+    }
+    entries.push_back(Entry());
+    Entry& entry = entries.back();
+    entry.id.swap(element.elements[0].str);
+    entry.first = fields.size();
+    std::vector<Value>& values = element.elements[1].elements;
+    entry.count = values.size() / 2;
+    BOOST_FOREACH (Value& value, values) {
+      fields.push_back(std::string());
+      fields.back().swap(value.str);
+    }
+  }
+}
+
+ArgList Stream::addArgs(const std::string& id, size_t maxLen) const {
+  ArgList args;
+  args.push_back("XADD");
+  args.push_back(key);
+  if (maxLen > 0) {
+    args.push_back("MAXLEN");
+    args.push_back("~");
+    args.push_back(boost::lexical_cast<std::string>(maxLen));
+  }
+  args.push_back(id);
+  return args;
+}
+
+std::string Stream::add(const ArgList& fields, const std::string& id,
+                        size_t maxLen) {
+  ArgList args = addArgs(id, maxLen);
+  args.insert(args.end(), fields.begin(), fields.end());
+  return conn->command(args).take().str;
+}
+
+ArgList Stream::add(const std::vector<ArgList>& entries, size_t maxLen) {
+  std::list<ValueReply> replies;
+  ArgList args = addArgs("*", maxLen);
+  const size_t head = args.size();
+  // one write for the whole batch
+  Connection::Cork cork(conn);
+  BOOST_FOREACH (const ArgList& fields, entries) {
+    args.resize(head);
+    args.insert(args.end(), fields.begin(), fields.end());
+    replies.push_back(conn->command(args));
+  }
+  cork.release();
+  ArgList ids;
+  BOOST_FOREACH (ValueReply& reply, replies) {
+    ids.push_back(reply.take().str);
+  }
+  return ids;
+}
+
+int64_t Stream::length() {
+  ArgList args;
+  args.push_back("XLEN");
+  args.push_back(key);
+  return conn->command(args).result().integer;
+}
+
+bool Stream::createGroup(const std::string& group, const std::string& id) {
+  ArgList args;
+  args.push_back("XGROUP");
+  args.push_back("CREATE");
+  args.push_back(key);
+  args.push_back(group);
+  args.push_back(id);
+  args.push_back("MKSTREAM");
+  ValueReply reply = conn->command(args);
+  Expected<Value> created = reply.tryResult();
+  if (!created && created.error().compare(0, 9, "BUSYGROUP") == 0) {
+    return false;
+  }
+  created.value();
+  return true;
+}
+
+ArgList Stream::readGroupArgs(const std::string& group,
+                              const std::string& consumer, size_t count,
+                              int blockMs, const std::string& id) {
+  ArgList args;
+  args.push_back("XREADGROUP");
+  args.push_back("GROUP");
+  args.push_back(group);
+  args.push_back(consumer);
+  args.push_back("COUNT");
+  args.push_back(boost::lexical_cast<std::string>(count));
+  if (blockMs >= 0) {
+    args.push_back("BLOCK");
+    args.push_back(boost::lexical_cast<std::string>(blockMs));
+  }
+  args.push_back("STREAMS");
+  args.push_back(key);
+  args.push_back(id);
+  return args;
+}
+
+// Reads the entries of the one stream in an XREADGROUP reply, which is nil
+// when it timed out, a list of (stream, entries) pairs in RESP2 and a map in
+// RESP3.
+void Stream::readInto(Value& reply, StreamEntries& out) {
+  if (reply.elements.empty()) {
+    return;
+  }
+  Value& entries = reply.kind == Value::Map ? reply.elements.at(1)
+                                            : reply.elements[0].elements.at(1);
+  out.append(entries);
+}
+
+size_t Stream::readGroup(const std::string& group, const std::string& consumer,
+                         StreamEntries& out, size_t count, int blockMs,
+                         const std::string& id) {
+  out.clear();
+  Value reply =
+      conn->command(readGroupArgs(group, consumer, count, blockMs, id)).take();
+  readInto(reply, out);
+  return out.size();
+}
+
+int64_t Stream::ack(const std::string& group, const ArgList& ids) {
+  ArgList args;
+  args.push_back("XACK");
+  args.push_back(key);
+  args.push_back(group);
+  args.insert(args.end(), ids.begin(), ids.end());
+  return conn->command(args).result().integer;
+}
+
+std::string Stream::autoClaim(const std::string& group,
+                              const std::string& consumer, int64_t minIdleMs,
+                              const std::string& start, StreamEntries& out,
+                              size_t count) {
+  out.clear();
+  ArgList args;
+  args.push_back("XAUTOCLAIM");
+  args.push_back(key);
+  args.push_back(group);
+  args.push_back(consumer);
+  args.push_back(boost::lexical_cast<std::string>(minIdleMs));
+  args.push_back(start);
+  args.push_back("COUNT");
+  args.push_back(boost::lexical_cast<std::string>(count));
+  Value reply = conn->command(args).take();
+  if (reply.elements.size() < 2) {
+    throw std::runtime_error("unexpected XAUTOCLAIM reply");
+  }
+  out.append(reply.elements[1]);
+  return reply.elements[0].str;
+}
+
+StreamConsumer::StreamConsumer(Connection* conn, const std::string& key,
+                               const std::string& group,
+                               const std::string& consumer,
+                               const StreamConsumerOptions& options)
+    : stream(conn, key), group(group), consumer(consumer), options(options),
+      claimStart("0-0"), stopping(false) {}
+
+void StreamConsumer::run(const Handler& handler) {
+  Connection* const conn = stream.conn;
+  StreamEntries batch;
+  // the entries left pending by an earlier run, then new ones
+  std::string id = "0";
+  ValueReply next = conn->command(
+      stream.readGroupArgs(group, consumer, options.count, -1, id));
+  ValueReply acked;
+  while (!stopping) {
+    Value reply = next.take();
+    batch.clear();
+    Stream::readInto(reply, batch);
+    acked.result();
+    if (batch.empty()) {
+      if (id == ">") {
+        fetchIdle(batch);
+      } else {
+        id = ">";
+      }
+    } else if (id != ">") {
+      id = batch[batch.size() - 1].id;
+    }
+    next = conn->command(
+        stream.readGroupArgs(group, consumer, options.count, -1, id));
+    if (!batch.empty()) {
+      handler(batch);
+      ArgList args;
+      args.push_back("XACK");
+      args.push_back(stream.key);
+      args.push_back(group);
+      for (size_t i = 0; i < batch.size(); ++i) {
+        args.push_back(batch[i].id);
+      }
+      acked = conn->command(args);
+    }
+  }
+  next.take();
+  acked.result();
+  stopping = false;
+}
+
+// With nothing new to read, claims entries other consumers left idle, or else
+// waits for new ones.
+void StreamConsumer::fetchIdle(StreamEntries& out) {
+  if (options.claimIdleMs >= 0) {
+    claimStart = stream.autoClaim(group, consumer, options.claimIdleMs,
+                                  claimStart, out, options.count);
+    if (!out.empty()) {
+      return;
+    }
+  }
+  stream.readGroup(group, consumer, out, options.count, options.blockMs);
+}
+};
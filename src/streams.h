@@ -0,0 +1,135 @@
+#pragma once
+
+#include "redispp.h"
+#include <atomic>
+#include <boost/noncopyable.hpp>
+#include <string>
+#include <vector>
+
+namespace redispp {
+
+// Entries read from a stream. The fields of all entries are kept in one
+// array, name, value, name, value..., each entry owning a range of it. Reading
+// into the same object again reuses its storage.
+class StreamEntries {
+public:
+  struct Entry {
+    std::string id;
+    size_t first; // index of the entry's first field name in fields
+    size_t count; // number of fields, half the strings it owns
+  };
+
+  size_t size() const { return entries.size(); }
+  bool empty() const { return entries.empty(); }
+  const Entry& operator[](size_t index) const { return entries[index]; }
+
+  const std::string& name(const Entry& entry, size_t field) const {
+    return fields[entry.first + 2 * field];
+  }
+  const std::string& value(const Entry& entry, size_t field) const {
+    return fields[entry.first + 2 * field + 1];
+  }
+
+  // The ids of all entries, e.g. to acknowledge them.
+  ArgList ids() const;
+
+  void clear();
+
+  // Appends the entries of an XRANGE style reply, taking its strings. Entries
+  // deleted while pending are returned without fields.
+  void append(Value& reply);
+
+private:
+  std::vector<Entry> entries;
+  std::vector<std::string> fields;
+};
+
+// Commands on one stream. Ids are passed and returned as strings.
+class Stream {
+public:
+  Stream(Connection* conn, const std::string& key) : conn(conn), key(key) {}
+
+  // XADD, fields being name, value pairs. A maxLen above 0 trims the stream
+  // to about that many entries. Returns the id of the entry.
+  std::string add(const ArgList& fields, const std::string& id = "*",
+                  size_t maxLen = 0);
+  // One XADD per entry, all sent with one write. Returns the ids.
+  ArgList add(const std::vector<ArgList>& entries, size_t maxLen = 0);
+
+  int64_t length();
+
+  // XGROUP CREATE with MKSTREAM. Returns false if the group exists.
+  bool createGroup(const std::string& group, const std::string& id = "$");
+
+  // XREADGROUP of up to count entries after id (">" for entries never
+  // delivered to the group, "0" for those pending for this consumer). Waits up
+  // to blockMs for new entries when blockMs is not negative. Returns the
+  // number read into out, which is cleared first.
+  size_t readGroup(const std::string& group, const std::string& consumer,
+                   StreamEntries& out, size_t count, int blockMs = -1,
+                   const std::string& id = ">");
+
+  // XACK of ids with a single command. Returns the number acknowledged.
+  int64_t ack(const std::string& group, const ArgList& ids);
+
+  // XAUTOCLAIM of up to count entries pending for more than minIdleMs,
+  // starting at start ("0-0" at first). The claimed entries are read into out,
+  // which is cleared first. Returns the start of the next call, "0-0" once the
+  // pending entries have all been scanned.
+  std::string autoClaim(const std::string& group, const std::string& consumer,
+                        int64_t minIdleMs, const std::string& start,
+                        StreamEntries& out, size_t count = 100);
+
+private:
+  friend class StreamConsumer;
+
+  ArgList addArgs(const std::string& id, size_t maxLen) const;
+  ArgList readGroupArgs(const std::string& group, const std::string& consumer,
+                        size_t count, int blockMs, const std::string& id);
+  static void readInto(Value& reply, StreamEntries& out);
+
+  Connection* conn;
+  std::string key;
+};
+
+struct StreamConsumerOptions {
+  StreamConsumerOptions() : count(100), blockMs(1000), claimIdleMs(-1) {}
+
+  size_t count;   // entries per batch
+  int blockMs;    // how long to wait for new entries when there are none
+  // When not negative, entries other consumers left pending for longer than
+  // this are claimed whenever the stream runs dry.
+  int64_t claimIdleMs;
+};
+
+// Consumes a stream as a member of a consumer group. The next batch is
+// requested before the current one is handed to the handler, so the server
+// reads it and it travels while the handler runs. The batch is acknowledged
+// when the handler returns, with the XACK pipelined ahead of the next read.
+// Entries still pending for the consumer from an earlier run are handled
+// first. If the handler throws, its batch and the one already requested stay
+// pending, to be handled again or claimed by another consumer.
+class StreamConsumer : boost::noncopyable {
+public:
+  typedef std::function<void(const StreamEntries& entries)> Handler;
+
+  StreamConsumer(Connection* conn, const std::string& key,
+                 const std::string& group, const std::string& consumer,
+                 const StreamConsumerOptions& options =
+                     StreamConsumerOptions());
+
+  // Handles batches until stop is called, which takes up to blockMs.
+  void run(const Handler& handler);
+  void stop() { stopping = true; }
+
+private:
+  void fetchIdle(StreamEntries& out);
+
+  Stream stream;
+  std::string group;
+  std::string consumer;
+  StreamConsumerOptions options;
+  std::string claimStart;
+  std::atomic<bool> stopping;
+};
+};
@@ -0,0 +1,253 @@
+#include "subscriber.h"
+#include <string.h>
+
+namespace redispp {
+
+// Returns the end of the line starting at p, or NULL if it has not all
+// arrived.
+static const char* lineEnd(const char* p, const char* end) {
+  const char* const eol = (const char*)memchr(p, '\n', end - p);
+  return eol ? eol + 1 : NULL;
+}
+
+// The number following the type code of the line [p, next).
+static int64_t lineNumber(const char* p, const char* next) {
+  const char* const last = next - 2;
+  const bool negative = ++p < last && *p == '-';
+  if (negative) {
+    ++p;
+  }
+  int64_t number = 0;
+  for (; p < last; ++p) {
+    if (*p < '0' || *p > '9') {
+      throw std::runtime_error("invalid length in pub/sub message");
+    }
+    number = number * 10 + (*p - '0');
+  }
+  return negative ? -number : number;
+}
+
+// Parses the bulk string, simple string, integer or nil at p into out.
+// Returns the end of it, or NULL if it has not all arrived.
+static const char* parseString(const char* p, const char* end,
+                               Subscriber::View& out) {
+  const char* const next = lineEnd(p, end);
+  if (!next) {
+    return NULL;
+  }
+  switch (*p) {
+  case '$': {
+    const int64_t length = lineNumber(p, next);
+    if (length < 0) {
+      out = Subscriber::View();
+      return next;
+    }
+    if (end - next < length + 2) {
+      return NULL;
+    }
+    out = Subscriber::View(next, size_t(length));
+    return next + length + 2;
+  }
+  case '+':
+  case ':':
+    out = Subscriber::View(p + 1, next - p - 3);
+    return next;
+  case '_':
+    out = Subscriber::View();
+    return next;
+  default:
+    throw std::runtime_error(std::string("unexpected pub/sub element: ") + *p);
+  }
+}
+
+Subscriber::Subscriber(const std::string& host, const std::string& port,
+                       const std::string& password, size_t bufferSize)
+    : conn(host, port, password), buffer(bufferSize), begin(0), end(0),
+      partCount(0), arrayPayload(false), confirmed(0), id(-1),
+      stopping(false) {}
+
+#ifndef _WIN32
+Subscriber::Subscriber(const std::string& unixDomainSocket,
+                       const std::string& password, size_t bufferSize)
+    : conn(unixDomainSocket, password), buffer(bufferSize), begin(0), end(0),
+      partCount(0), arrayPayload(false), confirmed(0), id(-1),
+      stopping(false) {}
+#endif
+
+void Subscriber::subscribe(const std::string& channel,
+                           const Handler& handler) {
+  channels[channel] = std::make_shared<const Handler>(handler);
+  conn.subscribe(channel);
+}
+
+void Subscriber::unsubscribe(const std::string& channel) {
+  channels.erase(channel);
+  conn.unsubscribe(channel);
+}
+
+void Subscriber::psubscribe(const std::string& pattern,
+                            const Handler& handler) {
+  patterns[pattern] = std::make_shared<const Handler>(handler);
+  conn.psubscribe(pattern);
+}
+
+void Subscriber::punsubscribe(const std::string& pattern) {
+  patterns.erase(pattern);
+  conn.punsubscribe(pattern);
+}
+
+int64_t Subscriber::clientId() {
+  if (id < 0) {
+    if (!channels.empty() || !patterns.empty()) {
+      throw std::logic_error("clientId must be called before subscribing");
+    }
+    id = conn.clientId();
+  }
+  return id;
+}
+
+size_t Subscriber::poll(int timeoutMs) {
+  size_t count = 0;
+  do {
+    if (end == buffer.size()) {
+      if (begin > 0) {
+        memmove(&buffer[0], &buffer[begin], end - begin);
+        end -= begin;
+        begin = 0;
+      } else {
+        // a message larger than the buffer
+        buffer.resize(buffer.size() * 2);
+      }
+    }
+    const size_t got =
+        conn.readSome(&buffer[end], buffer.size() - end, timeoutMs);
+    if (got == 0) {
+      break;
+    }
+    end += got;
+    count = dispatchBuffered();
+  } while (count == 0 && begin < end);
+  return count;
+}
+
+void Subscriber::run() {
+  while (!stopping) {
+    poll(100);
+  }
+  stopping = false;
+}
+
+size_t Subscriber::dispatchBuffered() {
+  size_t count = 0;
+  const char* const data = &buffer[0];
+  while (begin < end) {
+    const char* const next = parseMessage(data + begin, data + end);
+    if (!next) {
+      break;
+    }
+    begin = next - data;
+    if (dispatch()) {
+      ++count;
+    }
+  }
+  if (begin == end) {
+    begin = end = 0;
+  }
+  return count;
+}
+
+// Parses the message at p into parts (and keys). Returns the end of it, or
+// NULL if it has not all arrived.
+const char* Subscriber::parseMessage(const char* p, const char* end) {
+  // the reply parser leaves the line ending of the last reply it read
+  while (p < end && (*p == '\r' || *p == '\n')) {
+    ++p;
+  }
+  if (p == end) {
+    return NULL;
+  }
+  if (*p != '*' && *p != '>') {
+    throw std::runtime_error(std::string("unexpected pub/sub frame: ") + *p);
+  }
+  const char* next = lineEnd(p, end);
+  if (!next) {
+    return NULL;
+  }
+  const int64_t count = lineNumber(p, next);
+  if (count < 1 || count > int64_t(kMaxParts)) {
+    throw std::runtime_error("unexpected pub/sub message size");
+  }
+  arrayPayload = false;
+  for (int64_t i = 0; i < count; ++i) {
+    if (next == end) {
+      return NULL;
+    }
+    if (*next == '*' && i == count - 1) {
+      // invalidated keys
+      const char* const header = next;
+      next = lineEnd(header, end);
+      if (!next) {
+        return NULL;
+      }
+      const int64_t size = lineNumber(header, next);
+      keys.clear();
+      if (size < 0) {
+        keys.push_back(View());
+      }
+      for (int64_t k = 0; k < size; ++k) {
+        View key;
+        if (next == end || !(next = parseString(next, end, key))) {
+          return NULL;
+        }
+        keys.push_back(key);
+      }
+      parts[i] = View();
+      arrayPayload = true;
+    } else if (!(next = parseString(next, end, parts[i]))) {
+      return NULL;
+    }
+  }
+  partCount = size_t(count);
+  return next;
+}
+
+// Passes the parsed message to its handler, returning whether it was a
+// message rather than a confirmation.
+bool Subscriber::dispatch() {
+  const View kind = parts[0];
+  if (kind == "message" && partCount == 3) {
+    deliver(channels, parts[1], parts[1], parts[2]);
+    return true;
+  }
+  if (kind == "pmessage" && partCount == 4) {
+    deliver(patterns, parts[1], parts[2], parts[3]);
+    return true;
+  }
+  if (partCount == 3 && !arrayPayload &&
+      (kind == "subscribe" || kind == "unsubscribe" || kind == "psubscribe" ||
+       kind == "punsubscribe")) {
+    confirmed = boost::lexical_cast<size_t>(parts[2].to_string());
+  }
+  // anything else, e.g. the reply of a PING, is ignored
+  return false;
+}
+
+void Subscriber::deliver(const Handlers& handlers, View name, View channel,
+                         View payload) {
+  key.assign(name.data(), name.size());
+  Handlers::const_iterator const found = handlers.find(key);
+  if (found == handlers.end()) {
+    // unsubscribed since the message was sent
+    return;
+  }
+  // kept alive in case the handler unsubscribes
+  const HandlerPtr handler = found->second;
+  if (arrayPayload) {
+    BOOST_FOREACH (const View& invalidated, keys) {
+      (*handler)(channel, invalidated);
+    }
+  } else {
+    (*handler)(channel, payload);
+  }
+}
+};
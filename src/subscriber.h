@@ -0,0 +1,91 @@
+#pragma once
+
+#include "redispp.h"
+#include <atomic>
+#include <boost/noncopyable.hpp>
+#include <boost/utility/string_view.hpp>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace redispp {
+
+// A connection dedicated to Pub/Sub. Handlers registered with subscribe and
+// psubscribe are called with (channel, payload) views into the receive
+// buffer, which are only valid during the call. poll reads whatever has
+// arrived with one recv and dispatches every complete message in it, parsing
+// in place rather than building a Value per message.
+//
+// Invalidation messages of client side caching (clientTracking with
+// redirectId set to clientId) carry the invalidated keys as an array. Their
+// handler is called once per key, and once with an empty payload when the
+// server flushed everything.
+//
+// Handlers may subscribe and unsubscribe but must not poll. Only stop may be
+// called from another thread.
+class Subscriber : boost::noncopyable {
+public:
+  typedef boost::string_view View;
+  typedef std::function<void(View channel, View payload)> Handler;
+
+  static const size_t kDefaultBufferSize = 64 * 1024;
+
+  Subscriber(const std::string& host, const std::string& port,
+             const std::string& password,
+             size_t bufferSize = kDefaultBufferSize);
+#ifndef _WIN32
+  Subscriber(const std::string& unixDomainSocket, const std::string& password,
+             size_t bufferSize = kDefaultBufferSize);
+#endif
+
+  // Subscribing again replaces the handler.
+  void subscribe(const std::string& channel, const Handler& handler);
+  void unsubscribe(const std::string& channel);
+  // The handler is called with the channel each message was published to.
+  void psubscribe(const std::string& pattern, const Handler& handler);
+  void punsubscribe(const std::string& pattern);
+
+  // The number of subscriptions the server last confirmed.
+  size_t subscriptions() const { return confirmed; }
+
+  // The id to redirect invalidations to. Only the first call asks the server,
+  // which has to happen before subscribing.
+  int64_t clientId();
+
+  // Waits up to timeoutMs (-1 waits forever) for data, then dispatches the
+  // messages received, reading again while only part of one has arrived.
+  // Returns the number of messages dispatched, not counting confirmations.
+  size_t poll(int timeoutMs = -1);
+
+  // Dispatches messages until stop is called.
+  void run();
+  void stop() { stopping = true; }
+
+private:
+  typedef std::shared_ptr<const Handler> HandlerPtr;
+  typedef std::unordered_map<std::string, HandlerPtr> Handlers;
+
+  static const size_t kMaxParts = 4; // pmessage, pattern, channel, payload
+
+  const char* parseMessage(const char* p, const char* end);
+  size_t dispatchBuffered();
+  bool dispatch();
+  void deliver(const Handlers& handlers, View name, View channel,
+               View payload);
+
+  Connection conn;
+  std::vector<char> buffer;
+  size_t begin; // of the data not yet dispatched
+  size_t end;
+  View parts[kMaxParts];
+  size_t partCount;
+  bool arrayPayload; // the payload is in keys
+  std::vector<View> keys;
+  std::string key; // reused to look up handlers without allocating
+  Handlers channels;
+  Handlers patterns;
+  size_t confirmed;
+  int64_t id;
+  std::atomic<bool> stopping;
+};
+};
@@ -0,0 +1,189 @@
+#include "writecombiner.h"
+#include <boost/lexical_cast.hpp>
+#include <chrono>
+#include <list>
+
+namespace redispp {
+
+WriteCombiner::WriteCombiner(Connection* conn,
+                             const WriteCombinerOptions& options)
+    : conn(conn), options(options), stopping(false), full(false), updates(0),
+      commands(0), flushes(0) {
+  if (options.flushIntervalMs > 0) {
+    flusher = std::thread(&WriteCombiner::flushLoop, this);
+  }
+}
+
+WriteCombiner::~WriteCombiner() {
+  if (flusher.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_one();
+    flusher.join();
+  }
+  try {
+    flush();
+  } catch (...) {
+  }
+}
+
+void WriteCombiner::incrBy(const std::string& key, int64_t increment) {
+  std::unique_lock<std::mutex> lock(mutex);
+  const size_t before = pending.counters.size();
+  pending.counters[key] += increment;
+  added(lock, pending.counters.size() != before);
+}
+
+void WriteCombiner::hincrBy(const std::string& key, const std::string& field,
+                            int64_t increment) {
+  std::unique_lock<std::mutex> lock(mutex);
+  Counters& fields = pending.hashCounters[key];
+  const size_t before = fields.size();
+  fields[field] += increment;
+  added(lock, fields.size() != before);
+}
+
+void WriteCombiner::set(const std::string& key, const std::string& value) {
+  std::unique_lock<std::mutex> lock(mutex);
+  const size_t before = pending.values.size();
+  pending.values[key] = value;
+  added(lock, pending.values.size() != before);
+}
+
+void WriteCombiner::hset(const std::string& key, const std::string& field,
+                         const std::string& value) {
+  std::unique_lock<std::mutex> lock(mutex);
+  Values& fields = pending.hashValues[key];
+  const size_t before = fields.size();
+  fields[field] = value;
+  added(lock, fields.size() != before);
+}
+
+// Counts an update, starting a flush once maxPending keys are buffered.
+void WriteCombiner::added(std::unique_lock<std::mutex>& lock, bool isNew) {
+  ++updates;
+  if (!isNew || ++pending.size < options.maxPending) {
+    return;
+  }
+  if (flusher.joinable()) {
+    full = true;
+    wake.notify_one();
+  } else {
+    lock.unlock();
+    flush();
+  }
+}
+
+void WriteCombiner::flush() {
+  std::exception_ptr failed;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::swap(failed, error);
+  }
+  sendPending();
+  if (failed) {
+    std::rethrow_exception(failed);
+  }
+}
+
+void WriteCombiner::sendPending() {
+  std::lock_guard<std::mutex> sending(sendMutex);
+  Pending batch;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::swap(batch, pending);
+    full = false;
+  }
+  if (batch.size > 0) {
+    send(batch);
+  }
+}
+
+void WriteCombiner::send(Pending& batch) {
+  std::list<ValueReply> replies;
+  ChunkedVoidReply values;
+  ArgList args;
+  Connection::Cork cork(conn);
+  BOOST_FOREACH (const Counters::value_type& counter, batch.counters) {
+    if (counter.second != 0) {
+      args.clear();
+      args.push_back("INCRBY");
+      args.push_back(counter.first);
+      args.push_back(boost::lexical_cast<std::string>(counter.second));
+      replies.push_back(conn->command(args));
+    }
+  }
+  typedef std::unordered_map<std::string, Counters>::value_type HashCounters;
+  BOOST_FOREACH (const HashCounters& hash, batch.hashCounters) {
+    BOOST_FOREACH (const Counters::value_type& counter, hash.second) {
+      if (counter.second != 0) {
+        args.clear();
+        args.push_back("HINCRBY");
+        args.push_back(hash.first);
+        args.push_back(counter.first);
+        args.push_back(boost::lexical_cast<std::string>(counter.second));
+        replies.push_back(conn->command(args));
+      }
+    }
+  }
+  if (!batch.values.empty()) {
+    KeyValueList pairs;
+    BOOST_FOREACH (Values::value_type& value, batch.values) {
+      pairs.push_back(KeyValuePair(value.first, std::string()));
+      pairs.back().second.swap(value.second);
+    }
+    values = conn->mset(pairs);
+  }
+  typedef std::unordered_map<std::string, Values>::value_type HashValues;
+  BOOST_FOREACH (HashValues& hash, batch.hashValues) {
+    args.clear();
+    args.push_back("HSET");
+    args.push_back(hash.first);
+    BOOST_FOREACH (Values::value_type& value, hash.second) {
+      args.push_back(value.first);
+      args.push_back(std::string());
+      args.back().swap(value.second);
+    }
+    replies.push_back(conn->command(args));
+  }
+  cork.release();
+
+  commands += replies.size() + (batch.values.empty() ? 0 : 1);
+  ++flushes;
+  values.result();
+  BOOST_FOREACH (ValueReply& reply, replies) { reply.result(); }
+}
+
+// Flushes every flushIntervalMs, or as soon as maxPending is reached.
+void WriteCombiner::flushLoop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stopping) {
+    wake.wait_for(lock, std::chrono::milliseconds(options.flushIntervalMs),
+                  [this]() { return stopping || full; });
+    if (stopping) {
+      break;
+    }
+    lock.unlock();
+    try {
+      sendPending();
+    } catch (...) {
+      lock.lock();
+      if (!error) {
+        error = std::current_exception();
+      }
+      continue;
+    }
+    lock.lock();
+  }
+}
+
+WriteCombinerStats WriteCombiner::stats() const {
+  WriteCombinerStats ret;
+  ret.updates = updates;
+  ret.commands = commands;
+  ret.flushes = flushes;
+  return ret;
+}
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "redispp.h"
+#include <atomic>
+#include <boost/noncopyable.hpp>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace redispp {
+
+struct WriteCombinerOptions {
+  WriteCombinerOptions() : flushIntervalMs(100), maxPending(10000) {}
+
+  // How often a background thread flushes, 0 to only flush when maxPending
+  // is reached or flush is called.
+  int flushIntervalMs;
+  // Distinct keys (and hash fields) buffered before a flush is started.
+  size_t maxPending;
+};
+
+struct WriteCombinerStats {
+  WriteCombinerStats() : updates(0), commands(0), flushes(0) {}
+
+  uint64_t updates;  // calls buffered
+  uint64_t commands; // commands they were combined into
+  uint64_t flushes;
+};
+
+// Buffers counter increments and last-writer-wins writes, combining the
+// updates of each key (or hash field) and sending them in one pipelined write
+// per flush: an INCRBY per counter, an HINCRBY per hash counter, one MSET for
+// all values and one HSET per hash. Updates become visible on the server up
+// to flushIntervalMs late, and are lost if the process dies before they are
+// flushed. The destructor flushes what is left.
+//
+// A key should only receive one kind of update, as the order of updates of
+// different kinds within a flush is not kept. Safe to use from several
+// threads. The connection must not be used directly while the combiner
+// exists. If a flush fails its updates are dropped (some may have been
+// applied) and the error is rethrown by the next call to flush.
+class WriteCombiner : boost::noncopyable {
+public:
+  explicit WriteCombiner(Connection* conn, const WriteCombinerOptions& options =
+                                               WriteCombinerOptions());
+  ~WriteCombiner();
+
+  void incrBy(const std::string& key, int64_t increment);
+  void hincrBy(const std::string& key, const std::string& field,
+               int64_t increment);
+  void set(const std::string& key, const std::string& value);
+  void hset(const std::string& key, const std::string& field,
+            const std::string& value);
+
+  // Sends everything buffered and waits for the server to apply it.
+  void flush();
+
+  WriteCombinerStats stats() const;
+
+private:
+  typedef std::unordered_map<std::string, int64_t> Counters;
+  typedef std::unordered_map<std::string, std::string> Values;
+
+  struct Pending {
+    Pending() : size(0) {}
+
+    Counters counters;
+    std::unordered_map<std::string, Counters> hashCounters;
+    Values values;
+    std::unordered_map<std::string, Values> hashValues;
+    size_t size;
+  };
+
+  void added(std::unique_lock<std::mutex>& lock, bool isNew);
+  void sendPending();
+  void send(Pending& batch);
+  void flushLoop();
+
+  Connection* conn;
+  WriteCombinerOptions options;
+  std::mutex mutex; // guards pending
+  Pending pending;
+  std::mutex sendMutex; // held while a batch is on the connection
+  std::exception_ptr error;
+  std::condition_variable wake;
+  bool stopping;
+  bool full;
+  std::thread flusher;
+  std::atomic<uint64_t> updates;
+  std::atomic<uint64_t> commands;
+  std::atomic<uint64_t> flushes;
+};
+};
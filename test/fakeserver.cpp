@@ -0,0 +1,2078 @@
+#include "fakeserver.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <boost/lexical_cast.hpp>
+#include <chrono>
+#include <deque>
+#include <errno.h>
+#include <iterator>
+#include <map>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace redispp {
+
+typedef std::vector<std::string> Args;
+
+// Answered to the client as an error reply.
+class CommandError : public std::runtime_error {
+public:
+  explicit CommandError(const std::string& message)
+      : std::runtime_error(message) {}
+};
+
+static const char* kWrongType =
+    "WRONGTYPE Operation against a key holding the wrong kind of value";
+
+static int64_t nowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static std::string upper(std::string text) {
+  std::transform(text.begin(), text.end(), text.begin(), ::toupper);
+  return text;
+}
+
+static int64_t toInteger(const std::string& text) {
+  char* end = NULL;
+  errno = 0;
+  const long long ret = strtoll(text.c_str(), &end, 10);
+  if (text.empty() || *end != 0 || errno == ERANGE) {
+    throw CommandError("ERR value is not an integer or out of range");
+  }
+  return ret;
+}
+
+static double toDouble(const std::string& text) {
+  char* end = NULL;
+  const double ret = strtod(text.c_str(), &end);
+  if (text.empty() || *end != 0 || ret != ret) {
+    throw CommandError("ERR value is not a valid float");
+  }
+  return ret;
+}
+
+static std::string formatDouble(double value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.17g", value);
+  return buf;
+}
+
+// Glob style matching as KEYS and SCAN do: *, ? and [...] classes.
+static bool matches(const char* pattern, const char* text) {
+  for (; *pattern; ++pattern) {
+    switch (*pattern) {
+    case '*':
+      for (const char* rest = text;; ++rest) {
+        if (matches(pattern + 1, rest)) {
+          return true;
+        }
+        if (!*rest) {
+          return false;
+        }
+      }
+    case '?':
+      if (!*text++) {
+        return false;
+      }
+      break;
+    case '[': {
+      const bool negate = pattern[1] == '^';
+      const char* cur = pattern + (negate ? 2 : 1);
+      bool found = false;
+      for (; *cur && *cur != ']'; ++cur) {
+        if (cur[1] == '-' && cur[2] && cur[2] != ']') {
+          found |= *text >= cur[0] && *text <= cur[2];
+          cur += 2;
+        } else {
+          found |= *cur == *text;
+        }
+      }
+      if (!*text++ || found == negate) {
+        return false;
+      }
+      pattern = *cur ? cur : cur - 1;
+      break;
+    }
+    case '\\':
+      if (pattern[1]) {
+        ++pattern;
+      }
+    // fall through
+    default:
+      if (*pattern != *text++) {
+        return false;
+      }
+    }
+  }
+  return !*text;
+}
+
+class Reply {
+public:
+  explicit Reply(std::string& out) : out(out) {}
+
+  void ok() { status("OK"); }
+  void status(const std::string& text) { out += "+" + text + "\r\n"; }
+  void error(const std::string& text) { out += "-" + text + "\r\n"; }
+  void integer(int64_t value) {
+    out += ":" + boost::lexical_cast<std::string>(value) + "\r\n";
+  }
+  void bulk(const std::string& value) {
+    out += "$" + boost::lexical_cast<std::string>(value.size()) + "\r\n";
+    out += value;
+    out += "\r\n";
+  }
+  void number(double value) { bulk(formatDouble(value)); }
+  void nil() { out += "$-1\r\n"; }
+  void nilArray() { out += "*-1\r\n"; }
+  void array(size_t count) {
+    out += "*" + boost::lexical_cast<std::string>(count) + "\r\n";
+  }
+  template <typename Container> void bulks(const Container& values) {
+    array(values.size());
+    for (typename Container::const_iterator i = values.begin();
+         i != values.end(); ++i) {
+      bulk(*i);
+    }
+  }
+
+  std::string& out;
+};
+
+struct Entry {
+  enum Kind { String, List, Set, Hash, ZSet };
+
+  Entry() : kind(String), expiresAt(0) {}
+
+  Kind kind;
+  std::string str;
+  std::deque<std::string> list;
+  std::set<std::string> members;
+  std::map<std::string, std::string> hash;
+  std::map<std::string, double> zset;
+  int64_t expiresAt; // ms of the steady clock, 0 for never
+};
+
+struct Session {
+  explicit Session(int64_t id)
+      : id(id), authenticated(false), db(0), inMulti(false),
+        multiFailed(false), inExec(false), repliesOff(false), skipReplies(0),
+        quit(false), lock(NULL) {}
+
+  int64_t id;
+  std::string name;
+  bool authenticated;
+  size_t db;
+  bool inMulti;
+  bool multiFailed; // a command could not be queued, EXEC fails
+  bool inExec;
+  std::vector<Args> queued;
+  std::map<std::pair<size_t, std::string>, uint64_t> watched; // versions
+  bool repliesOff;    // CLIENT REPLY OFF
+  size_t skipReplies; // CLIENT REPLY SKIP, counting its own reply
+  bool quit;
+  std::unique_lock<std::mutex>* lock; // held while a command runs
+};
+
+typedef std::vector<std::pair<double, std::string>> Scored;
+
+// The data of all databases and the commands on it.
+class FakeStore {
+public:
+  FakeStore() : stopping(false), dbs(16), nextVersion(0) {
+    add("PING", -1, &FakeStore::ping);
+    add("ECHO", 2, &FakeStore::echo);
+    add("SELECT", 2, &FakeStore::select);
+    add("QUIT", 1, &FakeStore::quit);
+    add("CLIENT", -2, &FakeStore::client);
+    add("HELLO", -1, &FakeStore::hello);
+    add("INFO", -1, &FakeStore::info);
+
+    add("DEL", -2, &FakeStore::del);
+    add("UNLINK", -2, &FakeStore::del);
+    add("EXISTS", -2, &FakeStore::exists);
+    add("TYPE", 2, &FakeStore::type);
+    add("KEYS", 2, &FakeStore::keys);
+    add("SCAN", -2, &FakeStore::scan);
+    add("RANDOMKEY", 1, &FakeStore::randomKey);
+    add("RENAME", 3, &FakeStore::rename);
+    add("RENAMENX", 3, &FakeStore::rename);
+    add("MOVE", 3, &FakeStore::move);
+    add("EXPIRE", 3, &FakeStore::expire);
+    add("PEXPIRE", 3, &FakeStore::expire);
+    add("EXPIREAT", 3, &FakeStore::expire);
+    add("PEXPIREAT", 3, &FakeStore::expire);
+    add("PERSIST", 2, &FakeStore::persist);
+    add("TTL", 2, &FakeStore::ttl);
+    add("PTTL", 2, &FakeStore::ttl);
+    add("DBSIZE", 1, &FakeStore::dbSize);
+    add("FLUSHDB", -1, &FakeStore::flushDb);
+    add("FLUSHALL", -1, &FakeStore::flushAll);
+
+    add("SET", -3, &FakeStore::set);
+    add("SETNX", 3, &FakeStore::setNX);
+    add("SETEX", 4, &FakeStore::setEX);
+    add("GETSET", 3, &FakeStore::getSet);
+    add("GET", 2, &FakeStore::get);
+    add("MGET", -2, &FakeStore::mget);
+    add("MSET", -3, &FakeStore::mset);
+    add("MSETNX", -3, &FakeStore::mset);
+    add("INCR", 2, &FakeStore::incrBy);
+    add("DECR", 2, &FakeStore::incrBy);
+    add("INCRBY", 3, &FakeStore::incrBy);
+    add("DECRBY", 3, &FakeStore::incrBy);
+    add("INCRBYFLOAT", 3, &FakeStore::incrByFloat);
+    add("APPEND", 3, &FakeStore::append);
+    add("STRLEN", 2, &FakeStore::strlen);
+    add("GETRANGE", 4, &FakeStore::getRange);
+    add("SUBSTR", 4, &FakeStore::getRange);
+
+    add("LPUSH", -3, &FakeStore::push);
+    add("RPUSH", -3, &FakeStore::push);
+    add("LPOP", -2, &FakeStore::pop);
+    add("RPOP", -2, &FakeStore::pop);
+    add("BLPOP", -3, &FakeStore::blockingPop);
+    add("BRPOP", -3, &FakeStore::blockingPop);
+    add("RPOPLPUSH", 3, &FakeStore::rpopLPush);
+    add("BRPOPLPUSH", 4, &FakeStore::rpopLPush);
+    add("LLEN", 2, &FakeStore::llen);
+    add("LRANGE", 4, &FakeStore::lrange);
+    add("LINDEX", 3, &FakeStore::lindex);
+    add("LSET", 4, &FakeStore::lset);
+    add("LTRIM", 4, &FakeStore::ltrim);
+    add("LREM", 4, &FakeStore::lrem);
+
+    add("SADD", -3, &FakeStore::sadd);
+    add("SREM", -3, &FakeStore::srem);
+    add("SPOP", -2, &FakeStore::spop);
+    add("SRANDMEMBER", -2, &FakeStore::spop);
+    add("SMOVE", 4, &FakeStore::smove);
+    add("SCARD", 2, &FakeStore::scard);
+    add("SISMEMBER", 3, &FakeStore::sismember);
+    add("SMISMEMBER", -3, &FakeStore::sismember);
+    add("SMEMBERS", 2, &FakeStore::setOp);
+    add("SINTER", -2, &FakeStore::setOp);
+    add("SUNION", -2, &FakeStore::setOp);
+    add("SDIFF", -2, &FakeStore::setOp);
+    add("SINTERSTORE", -3, &FakeStore::setOp);
+    add("SUNIONSTORE", -3, &FakeStore::setOp);
+    add("SDIFFSTORE", -3, &FakeStore::setOp);
+    add("SSCAN", -3, &FakeStore::scanKey);
+
+    add("HSET", -4, &FakeStore::hset);
+    add("HMSET", -4, &FakeStore::hset);
+    add("HSETNX", 4, &FakeStore::hset);
+    add("HGET", 3, &FakeStore::hget);
+    add("HMGET", -3, &FakeStore::hget);
+    add("HDEL", -3, &FakeStore::hdel);
+    add("HLEN", 2, &FakeStore::hlen);
+    add("HEXISTS", 3, &FakeStore::hexists);
+    add("HKEYS", 2, &FakeStore::hgetAll);
+    add("HVALS", 2, &FakeStore::hgetAll);
+    add("HGETALL", 2, &FakeStore::hgetAll);
+    add("HINCRBY", 4, &FakeStore::hincrBy);
+    add("HINCRBYFLOAT", 4, &FakeStore::hincrBy);
+    add("HSCAN", -3, &FakeStore::scanKey);
+
+    add("ZADD", -4, &FakeStore::zadd);
+    add("ZINCRBY", 4, &FakeStore::zincrBy);
+    add("ZREM", -3, &FakeStore::zrem);
+    add("ZSCORE", 3, &FakeStore::zscore);
+    add("ZCARD", 2, &FakeStore::zcard);
+    add("ZRANK", 3, &FakeStore::zrank);
+    add("ZREVRANK", 3, &FakeStore::zrank);
+    add("ZRANGE", -4, &FakeStore::zrange);
+    add("ZREVRANGE", -4, &FakeStore::zrange);
+    add("ZRANGEBYSCORE", -4, &FakeStore::zrange);
+    add("ZREVRANGEBYSCORE", -4, &FakeStore::zrange);
+    add("ZCOUNT", 4, &FakeStore::zcount);
+    add("ZREMRANGEBYRANK", 4, &FakeStore::zremRange);
+    add("ZREMRANGEBYSCORE", 4, &FakeStore::zremRange);
+    add("ZPOPMIN", -2, &FakeStore::zpop);
+    add("ZPOPMAX", -2, &FakeStore::zpop);
+    add("ZUNIONSTORE", -4, &FakeStore::zstore);
+    add("ZINTERSTORE", -4, &FakeStore::zstore);
+    add("ZSCAN", -3, &FakeStore::scanKey);
+
+    add("WATCH", -2, &FakeStore::watch);
+    add("UNWATCH", 1, &FakeStore::unwatch);
+  }
+
+  // Runs one command, appending its reply (if any) to out.
+  void execute(Session& session, const Args& args, std::string& out,
+               const std::string& password) {
+    std::string reply;
+    Reply to(reply);
+    dispatch(session, args, to, password);
+    if (session.skipReplies > 0) {
+      --session.skipReplies;
+    } else if (!session.repliesOff) {
+      out += reply;
+    }
+  }
+
+private:
+  typedef void (FakeStore::*Handler)(Session& session, const Args& args,
+                                     Reply& to);
+
+  struct Command {
+    int arity; // argument count with the name, negative for a minimum
+    Handler handler;
+  };
+
+  struct Database {
+    std::map<std::string, Entry> keys;
+    std::map<std::string, uint64_t> versions; // of keys changed, for WATCH
+  };
+
+  void add(const char* name, int arity, Handler handler) {
+    Command command = {arity, handler};
+    commands[name] = command;
+  }
+
+  void dispatch(Session& session, const Args& args, Reply& to,
+                const std::string& password) {
+    const std::string name = upper(args[0]);
+    if (name == "AUTH") {
+      if (args.size() < 2) {
+        to.error("ERR wrong number of arguments for 'auth' command");
+      } else if (password.empty()) {
+        to.error("ERR AUTH <password> called without any password "
+                 "configured for the default user");
+      } else if (args.back() != password) {
+        to.error("WRONGPASS invalid username-password pair");
+      } else {
+        session.authenticated = true;
+        to.ok();
+      }
+      return;
+    }
+    if (!password.empty() && !session.authenticated) {
+      to.error("NOAUTH Authentication required.");
+      return;
+    }
+    std::map<std::string, Command>::const_iterator command =
+        commands.find(name);
+    const bool transaction =
+        name == "MULTI" || name == "EXEC" || name == "DISCARD";
+    if (!transaction && command == commands.end()) {
+      session.multiFailed = session.inMulti;
+      to.error("ERR unknown command '" + args[0] + "'");
+      return;
+    }
+    const int arity = transaction ? 1 : command->second.arity;
+    if (arity > 0 ? int(args.size()) != arity : int(args.size()) < -arity) {
+      session.multiFailed = session.inMulti;
+      to.error("ERR wrong number of arguments for '" + args[0] + "' command");
+      return;
+    }
+    if (name == "MULTI") {
+      if (session.inMulti) {
+        to.error("ERR MULTI calls can not be nested");
+      } else {
+        session.inMulti = true;
+        session.multiFailed = false;
+        to.ok();
+      }
+    } else if (name == "DISCARD") {
+      if (!session.inMulti) {
+        to.error("ERR DISCARD without MULTI");
+      } else {
+        session.inMulti = false;
+        session.queued.clear();
+        session.watched.clear();
+        to.ok();
+      }
+    } else if (name == "EXEC") {
+      exec(session, to);
+    } else if (session.inMulti && name != "WATCH") {
+      session.queued.push_back(args);
+      to.status("QUEUED");
+    } else {
+      try {
+        (this->*command->second.handler)(session, args, to);
+      } catch (const CommandError& e) {
+        to.error(e.what());
+      }
+    }
+  }
+
+  void exec(Session& session, Reply& to) {
+    if (!session.inMulti) {
+      to.error("ERR EXEC without MULTI");
+      return;
+    }
+    std::vector<Args> queued;
+    queued.swap(session.queued);
+    session.inMulti = false;
+    const bool changed = watchedChanged(session);
+    session.watched.clear();
+    if (session.multiFailed) {
+      session.multiFailed = false;
+      to.error("EXECABORT Transaction discarded because of previous errors.");
+      return;
+    }
+    if (changed) {
+      to.nilArray();
+      return;
+    }
+    to.array(queued.size());
+    session.inExec = true;
+    for (size_t i = 0; i < queued.size(); ++i) {
+      try {
+        (this->*commands[upper(queued[i][0])].handler)(session, queued[i], to);
+      } catch (const CommandError& e) {
+        to.error(e.what());
+      }
+    }
+    session.inExec = false;
+  }
+
+  bool watchedChanged(const Session& session) {
+    typedef std::map<std::pair<size_t, std::string>, uint64_t> Watched;
+    for (Watched::const_iterator i = session.watched.begin();
+         i != session.watched.end(); ++i) {
+      if (version(i->first.first, i->first.second) != i->second) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  uint64_t version(size_t db, const std::string& key) {
+    std::map<std::string, uint64_t>& versions = dbs[db].versions;
+    std::map<std::string, uint64_t>::const_iterator found = versions.find(key);
+    return found == versions.end() ? 0 : found->second;
+  }
+
+  void touch(Session& session, const std::string& key) {
+    dbs[session.db].versions[key] = ++nextVersion;
+  }
+
+  std::map<std::string, Entry>& keyspace(Session& session) {
+    return dbs[session.db].keys;
+  }
+
+  // The live entry at key, NULL if there is none. Throws if it is of another
+  // kind.
+  Entry* find(Session& session, const std::string& key, int kind = -1) {
+    std::map<std::string, Entry>& keys = keyspace(session);
+    std::map<std::string, Entry>::iterator found = keys.find(key);
+    if (found == keys.end()) {
+      return NULL;
+    }
+    if (found->second.expiresAt != 0 && found->second.expiresAt <= nowMs()) {
+      keys.erase(found);
+      return NULL;
+    }
+    if (kind >= 0 && found->second.kind != kind) {
+      throw CommandError(kWrongType);
+    }
+    return &found->second;
+  }
+
+  // As find, marking the key as changed if it exists.
+  Entry* modify(Session& session, const std::string& key, int kind) {
+    Entry* entry = find(session, key, kind);
+    if (entry) {
+      touch(session, key);
+    }
+    return entry;
+  }
+
+  // The entry at key, created empty if there is none.
+  Entry& create(Session& session, const std::string& key, Entry::Kind kind) {
+    Entry* entry = modify(session, key, kind);
+    if (entry) {
+      return *entry;
+    }
+    touch(session, key);
+    Entry& created = keyspace(session)[key];
+    created = Entry();
+    created.kind = kind;
+    return created;
+  }
+
+  bool erase(Session& session, const std::string& key) {
+    if (!find(session, key)) {
+      return false;
+    }
+    keyspace(session).erase(key);
+    touch(session, key);
+    return true;
+  }
+
+  // Deletes containers left empty, as the server does.
+  void eraseIfEmpty(Session& session, const std::string& key) {
+    Entry* entry = find(session, key);
+    if (entry && entry->list.empty() && entry->members.empty() &&
+        entry->hash.empty() && entry->zset.empty() &&
+        entry->kind != Entry::String) {
+      keyspace(session).erase(key);
+    }
+  }
+
+  // Clamps start and stop, which may count from the end, to [0, size).
+  // Returns false for an empty range.
+  static bool clamp(int64_t start, int64_t stop, size_t size, size_t& first,
+                    size_t& last) {
+    const int64_t count = int64_t(size);
+    start = start < 0 ? std::max<int64_t>(0, count + start) : start;
+    stop = stop < 0 ? count + stop : std::min(stop, count - 1);
+    if (start > stop || start >= count) {
+      return false;
+    }
+    first = size_t(start);
+    last = size_t(stop);
+    return true;
+  }
+
+  // connection
+
+  void ping(Session&, const Args& args, Reply& to) {
+    if (args.size() > 1) {
+      to.bulk(args[1]);
+    } else {
+      to.status("PONG");
+    }
+  }
+
+  void echo(Session&, const Args& args, Reply& to) { to.bulk(args[1]); }
+
+  void select(Session& session, const Args& args, Reply& to) {
+    const int64_t db = toInteger(args[1]);
+    if (db < 0 || db >= int64_t(dbs.size())) {
+      throw CommandError("ERR DB index is out of range");
+    }
+    session.db = size_t(db);
+    to.ok();
+  }
+
+  void quit(Session& session, const Args&, Reply& to) {
+    session.quit = true;
+    to.ok();
+  }
+
+  void client(Session& session, const Args& args, Reply& to) {
+    const std::string sub = upper(args[1]);
+    if (sub == "ID") {
+      to.integer(session.id);
+    } else if (sub == "SETNAME" && args.size() == 3) {
+      session.name = args[2];
+      to.ok();
+    } else if (sub == "GETNAME") {
+      session.name.empty() ? to.nil() : to.bulk(session.name);
+    } else if (sub == "REPLY" && args.size() == 3) {
+      const std::string mode = upper(args[2]);
+      if (mode == "ON") {
+        session.repliesOff = false;
+        to.ok();
+      } else if (mode == "OFF") {
+        session.repliesOff = true;
+      } else if (mode == "SKIP") {
+        session.skipReplies = 2;
+      } else {
+        throw CommandError("ERR syntax error");
+      }
+    } else {
+      throw CommandError("ERR unknown subcommand '" + args[1] + "'");
+    }
+  }
+
+  void hello(Session& session, const Args& args, Reply& to) {
+    if (args.size() > 1 && args[1] != "2") {
+      throw CommandError("NOPROTO unsupported protocol version");
+    }
+    to.array(14);
+    to.bulk("server");
+    to.bulk("redis");
+    to.bulk("version");
+    to.bulk("6.2.0");
+    to.bulk("proto");
+    to.integer(2);
+    to.bulk("id");
+    to.integer(session.id);
+    to.bulk("mode");
+    to.bulk("standalone");
+    to.bulk("role");
+    to.bulk("master");
+    to.bulk("modules");
+    to.array(0);
+  }
+
+  void info(Session&, const Args&, Reply& to) {
+    to.bulk("# Server\r\nredis_version:6.2.0\r\nredis_mode:standalone\r\n");
+  }
+
+  // keys
+
+  void del(Session& session, const Args& args, Reply& to) {
+    int64_t count = 0;
+    for (size_t i = 1; i < args.size(); ++i) {
+      count += erase(session, args[i]);
+    }
+    to.integer(count);
+  }
+
+  void exists(Session& session, const Args& args, Reply& to) {
+    int64_t count = 0;
+    for (size_t i = 1; i < args.size(); ++i) {
+      count += find(session, args[i]) != NULL;
+    }
+    to.integer(count);
+  }
+
+  static std::string typeName(const Entry* entry) {
+    static const char* names[] = {"string", "list", "set", "hash", "zset"};
+    return entry ? names[entry->kind] : "none";
+  }
+
+  void type(Session& session, const Args& args, Reply& to) {
+    to.status(typeName(find(session, args[1])));
+  }
+
+  std::vector<std::string> liveKeys(Session& session) {
+    std::vector<std::string> ret;
+    std::map<std::string, Entry>& keys = keyspace(session);
+    const int64_t now = nowMs();
+    for (std::map<std::string, Entry>::const_iterator i = keys.begin();
+         i != keys.end(); ++i) {
+      if (i->second.expiresAt == 0 || i->second.expiresAt > now) {
+        ret.push_back(i->first);
+      }
+    }
+    return ret;
+  }
+
+  void keys(Session& session, const Args& args, Reply& to) {
+    std::vector<std::string> found;
+    std::vector<std::string> all = liveKeys(session);
+    for (size_t i = 0; i < all.size(); ++i) {
+      if (matches(args[1].c_str(), all[i].c_str())) {
+        found.push_back(all[i]);
+      }
+    }
+    to.bulks(found);
+  }
+
+  // Replies to a SCAN style command over items, taken group elements at a
+  // time (the cursor counting groups), with MATCH applied to the first
+  // element of each group. TYPE is only accepted when typed, the caller
+  // having filtered items by it.
+  void scanItems(const std::vector<std::string>& items, size_t group,
+                 const Args& args, size_t cursorArg, bool typed, Reply& to) {
+    size_t cursor = size_t(toInteger(args[cursorArg]));
+    size_t count = 10;
+    std::string pattern = "*";
+    for (size_t i = cursorArg + 1; i + 1 < args.size(); i += 2) {
+      const std::string option = upper(args[i]);
+      if (option == "COUNT") {
+        count = size_t(std::max<int64_t>(1, toInteger(args[i + 1])));
+      } else if (option == "MATCH") {
+        pattern = args[i + 1];
+      } else if (option != "TYPE" || !typed) {
+        throw CommandError("ERR syntax error");
+      }
+    }
+    const size_t groups = items.size() / group;
+    std::vector<std::string> page;
+    for (; cursor < groups && count > 0; ++cursor, --count) {
+      if (matches(pattern.c_str(), items[cursor * group].c_str())) {
+        page.insert(page.end(), items.begin() + cursor * group,
+                    items.begin() + (cursor + 1) * group);
+      }
+    }
+    to.array(2);
+    to.bulk(boost::lexical_cast<std::string>(cursor < groups ? cursor : 0));
+    to.bulks(page);
+  }
+
+  void scan(Session& session, const Args& args, Reply& to) {
+    std::vector<std::string> keys = liveKeys(session);
+    for (size_t i = 2; i + 1 < args.size(); i += 2) {
+      if (upper(args[i]) != "TYPE") {
+        continue;
+      }
+      const std::string type = upper(args[i + 1]);
+      std::vector<std::string> typed;
+      for (size_t k = 0; k < keys.size(); ++k) {
+        if (upper(typeName(find(session, keys[k]))) == type) {
+          typed.push_back(keys[k]);
+        }
+      }
+      keys.swap(typed);
+    }
+    scanItems(keys, 1, args, 1, true, to);
+  }
+
+  void scanKey(Session& session, const Args& args, Reply& to) {
+    const std::string name = upper(args[0]);
+    std::vector<std::string> items;
+    size_t group = 2;
+    if (name == "SSCAN") {
+      group = 1;
+      if (const Entry* entry = find(session, args[1], Entry::Set)) {
+        items.assign(entry->members.begin(), entry->members.end());
+      }
+    } else if (name == "HSCAN") {
+      if (const Entry* entry = find(session, args[1], Entry::Hash)) {
+        typedef std::map<std::string, std::string>::const_iterator Iterator;
+        for (Iterator i = entry->hash.begin(); i != entry->hash.end(); ++i) {
+          items.push_back(i->first);
+          items.push_back(i->second);
+        }
+      }
+    } else if (const Entry* entry = find(session, args[1], Entry::ZSet)) {
+      const Scored scored = sorted(*entry);
+      for (size_t i = 0; i < scored.size(); ++i) {
+        items.push_back(scored[i].second);
+        items.push_back(formatDouble(scored[i].first));
+      }
+    }
+    scanItems(items, group, args, 2, false, to);
+  }
+
+  void randomKey(Session& session, const Args&, Reply& to) {
+    const std::vector<std::string> all = liveKeys(session);
+    all.empty() ? to.nil() : to.bulk(all[size_t(rand()) % all.size()]);
+  }
+
+  void rename(Session& session, const Args& args, Reply& to) {
+    Entry* entry = find(session, args[1]);
+    if (!entry) {
+      throw CommandError("ERR no such key");
+    }
+    const bool nx = upper(args[0]) == "RENAMENX";
+    if (nx && find(session, args[2])) {
+      to.integer(0);
+      return;
+    }
+    Entry moved = *entry;
+    erase(session, args[1]);
+    touch(session, args[2]);
+    keyspace(session)[args[2]] = moved;
+    nx ? to.integer(1) : to.ok();
+  }
+
+  void move(Session& session, const Args& args, Reply& to) {
+    const int64_t db = toInteger(args[2]);
+    if (db < 0 || db >= int64_t(dbs.size())) {
+      throw CommandError("ERR DB index is out of range");
+    }
+    Entry* entry = find(session, args[1]);
+    std::map<std::string, Entry>& target = dbs[size_t(db)].keys;
+    if (!entry || size_t(db) == session.db || target.count(args[1])) {
+      to.integer(0);
+      return;
+    }
+    target[args[1]] = *entry;
+    dbs[size_t(db)].versions[args[1]] = ++nextVersion;
+    erase(session, args[1]);
+    to.integer(1);
+  }
+
+  void expire(Session& session, const Args& args, Reply& to) {
+    const std::string name = upper(args[0]);
+    const int64_t amount = toInteger(args[2]);
+    const bool millis = name[0] == 'P';
+    const bool at = name.size() > 2 && name.substr(name.size() - 2) == "AT";
+    int64_t ms = millis ? amount : amount * 1000;
+    if (at) {
+      // convert from the system clock to the steady one
+      ms -= std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch())
+                .count();
+    }
+    Entry* entry = modify(session, args[1], -1);
+    if (!entry) {
+      to.integer(0);
+      return;
+    }
+    if (ms <= 0) {
+      erase(session, args[1]);
+    } else {
+      entry->expiresAt = nowMs() + ms;
+    }
+    to.integer(1);
+  }
+
+  void persist(Session& session, const Args& args, Reply& to) {
+    Entry* entry = find(session, args[1]);
+    const bool had = entry && entry->expiresAt != 0;
+    if (had) {
+      entry->expiresAt = 0;
+      touch(session, args[1]);
+    }
+    to.integer(had);
+  }
+
+  void ttl(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1]);
+    if (!entry) {
+      to.integer(-2);
+    } else if (entry->expiresAt == 0) {
+      to.integer(-1);
+    } else {
+      const int64_t ms = entry->expiresAt - nowMs();
+      to.integer(upper(args[0]) == "PTTL" ? ms : (ms + 500) / 1000);
+    }
+  }
+
+  void dbSize(Session& session, const Args&, Reply& to) {
+    to.integer(int64_t(liveKeys(session).size()));
+  }
+
+  void flushDb(Session& session, const Args&, Reply& to) {
+    flush(session.db);
+    to.ok();
+  }
+
+  void flushAll(Session&, const Args&, Reply& to) {
+    for (size_t db = 0; db < dbs.size(); ++db) {
+      flush(db);
+    }
+    to.ok();
+  }
+
+  void flush(size_t db) {
+    std::map<std::string, Entry>& keys = dbs[db].keys;
+    for (std::map<std::string, Entry>::const_iterator i = keys.begin();
+         i != keys.end(); ++i) {
+      dbs[db].versions[i->first] = ++nextVersion;
+    }
+    keys.clear();
+  }
+
+  // strings
+
+  void set(Session& session, const Args& args, Reply& to) {
+    bool nx = false;
+    bool xx = false;
+    bool get = false;
+    bool keepTtl = false;
+    int64_t ms = 0;
+    for (size_t i = 3; i < args.size(); ++i) {
+      const std::string option = upper(args[i]);
+      if (option == "NX") {
+        nx = true;
+      } else if (option == "XX") {
+        xx = true;
+      } else if (option == "GET") {
+        get = true;
+      } else if (option == "KEEPTTL") {
+        keepTtl = true;
+      } else if ((option == "EX" || option == "PX") && i + 1 < args.size()) {
+        ms = toInteger(args[++i]) * (option == "EX" ? 1000 : 1);
+        if (ms <= 0) {
+          throw CommandError("ERR invalid expire time in 'set' command");
+        }
+      } else {
+        throw CommandError("ERR syntax error");
+      }
+    }
+    Entry* entry = find(session, args[1]);
+    if (get && entry && entry->kind != Entry::String) {
+      throw CommandError(kWrongType);
+    }
+    const std::string old = entry ? entry->str : std::string();
+    const bool existed = entry != NULL;
+    if ((nx && existed) || (xx && !existed)) {
+      get && existed ? to.bulk(old) : to.nil();
+      return;
+    }
+    const int64_t expiresAt = keepTtl && entry ? entry->expiresAt : 0;
+    Entry& stored = replace(session, args[1], Entry::String);
+    stored.str = args[2];
+    stored.expiresAt = ms > 0 ? nowMs() + ms : expiresAt;
+    if (get) {
+      existed ? to.bulk(old) : to.nil();
+    } else {
+      to.ok();
+    }
+  }
+
+  // A fresh entry at key, whatever was there before.
+  Entry& replace(Session& session, const std::string& key, Entry::Kind kind) {
+    touch(session, key);
+    Entry& entry = keyspace(session)[key];
+    entry = Entry();
+    entry.kind = kind;
+    return entry;
+  }
+
+  void setNX(Session& session, const Args& args, Reply& to) {
+    if (find(session, args[1])) {
+      to.integer(0);
+      return;
+    }
+    replace(session, args[1], Entry::String).str = args[2];
+    to.integer(1);
+  }
+
+  void setEX(Session& session, const Args& args, Reply& to) {
+    const int64_t seconds = toInteger(args[2]);
+    if (seconds <= 0) {
+      throw CommandError("ERR invalid expire time in 'setex' command");
+    }
+    Entry& entry = replace(session, args[1], Entry::String);
+    entry.str = args[3];
+    entry.expiresAt = nowMs() + seconds * 1000;
+    to.ok();
+  }
+
+  void getSet(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::String);
+    entry ? to.bulk(entry->str) : to.nil();
+    replace(session, args[1], Entry::String).str = args[2];
+  }
+
+  void get(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::String);
+    entry ? to.bulk(entry->str) : to.nil();
+  }
+
+  void mget(Session& session, const Args& args, Reply& to) {
+    to.array(args.size() - 1);
+    for (size_t i = 1; i < args.size(); ++i) {
+      const Entry* entry = find(session, args[i]);
+      entry && entry->kind == Entry::String ? to.bulk(entry->str) : to.nil();
+    }
+  }
+
+  void mset(Session& session, const Args& args, Reply& to) {
+    if (args.size() % 2 == 0) {
+      throw CommandError("ERR wrong number of arguments for '" + args[0] +
+                         "' command");
+    }
+    const bool nx = upper(args[0]) == "MSETNX";
+    if (nx) {
+      for (size_t i = 1; i < args.size(); i += 2) {
+        if (find(session, args[i])) {
+          to.integer(0);
+          return;
+        }
+      }
+    }
+    for (size_t i = 1; i < args.size(); i += 2) {
+      replace(session, args[i], Entry::String).str = args[i + 1];
+    }
+    nx ? to.integer(1) : to.ok();
+  }
+
+  void incrBy(Session& session, const Args& args, Reply& to) {
+    const std::string name = upper(args[0]);
+    int64_t by = args.size() > 2 ? toInteger(args[2]) : 1;
+    if (name[0] == 'D') {
+      by = -by;
+    }
+    Entry& entry = create(session, args[1], Entry::String);
+    const int64_t value = (entry.str.empty() ? 0 : toInteger(entry.str)) + by;
+    entry.str = boost::lexical_cast<std::string>(value);
+    to.integer(value);
+  }
+
+  void incrByFloat(Session& session, const Args& args, Reply& to) {
+    Entry& entry = create(session, args[1], Entry::String);
+    const double value =
+        (entry.str.empty() ? 0 : toDouble(entry.str)) + toDouble(args[2]);
+    entry.str = formatDouble(value);
+    to.bulk(entry.str);
+  }
+
+  void append(Session& session, const Args& args, Reply& to) {
+    Entry& entry = create(session, args[1], Entry::String);
+    entry.str += args[2];
+    to.integer(int64_t(entry.str.size()));
+  }
+
+  void strlen(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::String);
+    to.integer(entry ? int64_t(entry->str.size()) : 0);
+  }
+
+  void getRange(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::String);
+    size_t first = 0;
+    size_t last = 0;
+    if (!entry || !clamp(toInteger(args[2]), toInteger(args[3]),
+                         entry->str.size(), first, last)) {
+      to.bulk(std::string());
+      return;
+    }
+    to.bulk(entry->str.substr(first, last - first + 1));
+  }
+
+  // lists
+
+  void push(Session& session, const Args& args, Reply& to) {
+    Entry& entry = create(session, args[1], Entry::List);
+    const bool left = upper(args[0])[0] == 'L';
+    for (size_t i = 2; i < args.size(); ++i) {
+      left ? entry.list.push_front(args[i]) : entry.list.push_back(args[i]);
+    }
+    to.integer(int64_t(entry.list.size()));
+  }
+
+  // Pops up to count elements from one end of the list at key.
+  std::vector<std::string> popList(Session& session, const std::string& key,
+                                   bool left, size_t count) {
+    std::vector<std::string> ret;
+    Entry* entry = modify(session, key, Entry::List);
+    for (; entry && !entry->list.empty() && ret.size() < count;) {
+      if (left) {
+        ret.push_back(entry->list.front());
+        entry->list.pop_front();
+      } else {
+        ret.push_back(entry->list.back());
+        entry->list.pop_back();
+      }
+    }
+    eraseIfEmpty(session, key);
+    return ret;
+  }
+
+  void pop(Session& session, const Args& args, Reply& to) {
+    const bool left = upper(args[0])[0] == 'L';
+    if (args.size() > 2) {
+      const int64_t count = toInteger(args[2]);
+      if (count < 0) {
+        throw CommandError("ERR value is out of range, must be positive");
+      }
+      if (!find(session, args[1], Entry::List)) {
+        to.nilArray();
+        return;
+      }
+      to.bulks(popList(session, args[1], left, size_t(count)));
+      return;
+    }
+    const std::vector<std::string> popped = popList(session, args[1], left, 1);
+    popped.empty() ? to.nil() : to.bulk(popped[0]);
+  }
+
+  // Waits, with the store unlocked, for up to timeout seconds (0 forever) or
+  // until until returns true. Does not wait inside a transaction.
+  template <typename Until>
+  bool block(Session& session, const std::string& timeout, Until until) {
+    const double seconds = toDouble(timeout);
+    if (seconds < 0) {
+      throw CommandError("ERR timeout is negative");
+    }
+    const int64_t deadline = nowMs() + int64_t(seconds * 1000);
+    while (!until()) {
+      if (session.inExec || stopping ||
+          (seconds > 0 && nowMs() >= deadline)) {
+        return false;
+      }
+      session.lock->unlock();
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      session.lock->lock();
+    }
+    return true;
+  }
+
+  void blockingPop(Session& session, const Args& args, Reply& to) {
+    const bool left = upper(args[0])[1] == 'L';
+    std::string key;
+    std::vector<std::string> popped;
+    const bool got = block(session, args.back(), [&]() {
+      for (size_t i = 1; i + 1 < args.size() && popped.empty(); ++i) {
+        key = args[i];
+        popped = popList(session, key, left, 1);
+      }
+      return !popped.empty();
+    });
+    if (!got) {
+      to.nilArray();
+      return;
+    }
+    to.array(2);
+    to.bulk(key);
+    to.bulk(popped[0]);
+  }
+
+  void rpopLPush(Session& session, const Args& args, Reply& to) {
+    std::vector<std::string> popped;
+    const bool blocking = args.size() == 4;
+    const bool got = block(session, blocking ? args[3] : "0", [&]() {
+      Entry* target = find(session, args[2]);
+      if (target && target->kind != Entry::List) {
+        throw CommandError(kWrongType);
+      }
+      popped = popList(session, args[1], false, 1);
+      return !popped.empty() || !blocking;
+    });
+    if (!got || popped.empty()) {
+      blocking ? to.nilArray() : to.nil();
+      return;
+    }
+    create(session, args[2], Entry::List).list.push_front(popped[0]);
+    to.bulk(popped[0]);
+  }
+
+  void llen(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::List);
+    to.integer(entry ? int64_t(entry->list.size()) : 0);
+  }
+
+  void lrange(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::List);
+    size_t first = 0;
+    size_t last = 0;
+    if (!entry || !clamp(toInteger(args[2]), toInteger(args[3]),
+                         entry->list.size(), first, last)) {
+      to.array(0);
+      return;
+    }
+    to.array(last - first + 1);
+    for (size_t i = first; i <= last; ++i) {
+      to.bulk(entry->list[i]);
+    }
+  }
+
+  void lindex(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::List);
+    int64_t index = toInteger(args[2]);
+    if (entry && index < 0) {
+      index += int64_t(entry->list.size());
+    }
+    if (!entry || index < 0 || index >= int64_t(entry->list.size())) {
+      to.nil();
+      return;
+    }
+    to.bulk(entry->list[size_t(index)]);
+  }
+
+  void lset(Session& session, const Args& args, Reply& to) {
+    Entry* entry = modify(session, args[1], Entry::List);
+    if (!entry) {
+      throw CommandError("ERR no such key");
+    }
+    int64_t index = toInteger(args[2]);
+    if (index < 0) {
+      index += int64_t(entry->list.size());
+    }
+    if (index < 0 || index >= int64_t(entry->list.size())) {
+      throw CommandError("ERR index out of range");
+    }
+    entry->list[size_t(index)] = args[3];
+    to.ok();
+  }
+
+  void ltrim(Session& session, const Args& args, Reply& to) {
+    Entry* entry = modify(session, args[1], Entry::List);
+    if (entry) {
+      size_t first = 0;
+      size_t last = 0;
+      if (clamp(toInteger(args[2]), toInteger(args[3]), entry->list.size(),
+                first, last)) {
+        entry->list.erase(entry->list.begin() + last + 1, entry->list.end());
+        entry->list.erase(entry->list.begin(), entry->list.begin() + first);
+      } else {
+        entry->list.clear();
+      }
+      eraseIfEmpty(session, args[1]);
+    }
+    to.ok();
+  }
+
+  void lrem(Session& session, const Args& args, Reply& to) {
+    const int64_t count = toInteger(args[2]);
+    Entry* entry = modify(session, args[1], Entry::List);
+    int64_t removed = 0;
+    if (entry) {
+      std::deque<std::string>& list = entry->list;
+      const size_t limit =
+          count == 0 ? list.size() : size_t(count < 0 ? -count : count);
+      if (count >= 0) {
+        for (size_t i = 0; i < list.size() && size_t(removed) < limit;) {
+          if (list[i] == args[3]) {
+            list.erase(list.begin() + i);
+            ++removed;
+          } else {
+            ++i;
+          }
+        }
+      } else {
+        for (size_t i = list.size(); i > 0 && size_t(removed) < limit; --i) {
+          if (list[i - 1] == args[3]) {
+            list.erase(list.begin() + (i - 1));
+            ++removed;
+          }
+        }
+      }
+      eraseIfEmpty(session, args[1]);
+    }
+    to.integer(removed);
+  }
+
+  // sets
+
+  void sadd(Session& session, const Args& args, Reply& to) {
+    Entry& entry = create(session, args[1], Entry::Set);
+    int64_t added = 0;
+    for (size_t i = 2; i < args.size(); ++i) {
+      added += entry.members.insert(args[i]).second;
+    }
+    to.integer(added);
+  }
+
+  void srem(Session& session, const Args& args, Reply& to) {
+    Entry* entry = modify(session, args[1], Entry::Set);
+    int64_t removed = 0;
+    for (size_t i = 2; entry && i < args.size(); ++i) {
+      removed += int64_t(entry->members.erase(args[i]));
+    }
+    eraseIfEmpty(session, args[1]);
+    to.integer(removed);
+  }
+
+  void spop(Session& session, const Args& args, Reply& to) {
+    const bool pop = upper(args[0]) == "SPOP";
+    Entry* entry = pop ? modify(session, args[1], Entry::Set)
+                       : find(session, args[1], Entry::Set);
+    const bool many = args.size() > 2;
+    const int64_t count = many ? toInteger(args[2]) : 1;
+    const int64_t distinct = count < 0 ? -count : count;
+    std::vector<std::string> picked;
+    std::vector<std::string> members;
+    if (entry) {
+      members.assign(entry->members.begin(), entry->members.end());
+      std::random_shuffle(members.begin(), members.end());
+    }
+    for (size_t i = 0; i < members.size() && int64_t(i) < distinct;
+         ++i) {
+      picked.push_back(members[i]);
+      if (pop) {
+        entry->members.erase(members[i]);
+      }
+    }
+    for (size_t i = picked.size(); !pop && count < 0 && !members.empty() &&
+                                   int64_t(i) < -count;
+         ++i) {
+      // a negative count allows repeats
+      picked.push_back(members[size_t(rand()) % members.size()]);
+    }
+    eraseIfEmpty(session, args[1]);
+    if (many) {
+      to.bulks(picked);
+    } else {
+      picked.empty() ? to.nil() : to.bulk(picked[0]);
+    }
+  }
+
+  void smove(Session& session, const Args& args, Reply& to) {
+    Entry* source = modify(session, args[1], Entry::Set);
+    find(session, args[2], Entry::Set); // fails if not a set
+    if (!source || !source->members.erase(args[3])) {
+      to.integer(0);
+      return;
+    }
+    eraseIfEmpty(session, args[1]);
+    create(session, args[2], Entry::Set).members.insert(args[3]);
+    to.integer(1);
+  }
+
+  void scard(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::Set);
+    to.integer(entry ? int64_t(entry->members.size()) : 0);
+  }
+
+  void sismember(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::Set);
+    if (upper(args[0]) == "SISMEMBER") {
+      to.integer(entry && entry->members.count(args[2]));
+      return;
+    }
+    to.array(args.size() - 2);
+    for (size_t i = 2; i < args.size(); ++i) {
+      to.integer(entry && entry->members.count(args[i]));
+    }
+  }
+
+  // SMEMBERS, SINTER, SUNION, SDIFF and their STORE forms.
+  void setOp(Session& session, const Args& args, Reply& to) {
+    const std::string name = upper(args[0]);
+    const bool store =
+        name.size() > 5 && name.substr(name.size() - 5) == "STORE";
+    const size_t first = store ? 2 : 1;
+    std::set<std::string> result;
+    for (size_t i = first; i < args.size(); ++i) {
+      const Entry* entry = find(session, args[i], Entry::Set);
+      static const std::set<std::string> none;
+      const std::set<std::string>& members = entry ? entry->members : none;
+      if (i == first || name.compare(0, 6, "SUNION") == 0) {
+        result.insert(members.begin(), members.end());
+      } else if (name.compare(0, 6, "SINTER") == 0) {
+        std::set<std::string> both;
+        std::set_intersection(result.begin(), result.end(), members.begin(),
+                              members.end(),
+                              std::inserter(both, both.begin()));
+        result.swap(both);
+      } else {
+        for (std::set<std::string>::const_iterator m = members.begin();
+             m != members.end(); ++m) {
+          result.erase(*m);
+        }
+      }
+    }
+    if (!store) {
+      to.bulks(result);
+      return;
+    }
+    erase(session, args[1]);
+    if (!result.empty()) {
+      create(session, args[1], Entry::Set).members.swap(result);
+      to.integer(int64_t(find(session, args[1])->members.size()));
+    } else {
+      to.integer(0);
+    }
+  }
+
+  // hashes
+
+  void hset(Session& session, const Args& args, Reply& to) {
+    const std::string name = upper(args[0]);
+    if (args.size() % 2 != 0) {
+      throw CommandError("ERR wrong number of arguments for '" + args[0] +
+                         "' command");
+    }
+    Entry& entry = create(session, args[1], Entry::Hash);
+    if (name == "HSETNX") {
+      to.integer(entry.hash.insert(std::make_pair(args[2], args[3])).second);
+      return;
+    }
+    int64_t added = 0;
+    for (size_t i = 2; i < args.size(); i += 2) {
+      added += entry.hash.count(args[i]) == 0;
+      entry.hash[args[i]] = args[i + 1];
+    }
+    name == "HMSET" ? to.ok() : to.integer(added);
+  }
+
+  void hget(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::Hash);
+    const bool many = upper(args[0]) == "HMGET";
+    if (many) {
+      to.array(args.size() - 2);
+    }
+    for (size_t i = 2; i < args.size(); ++i) {
+      std::map<std::string, std::string>::const_iterator found;
+      if (entry && (found = entry->hash.find(args[i])) != entry->hash.end()) {
+        to.bulk(found->second);
+      } else {
+        to.nil();
+      }
+    }
+  }
+
+  void hdel(Session& session, const Args& args, Reply& to) {
+    Entry* entry = modify(session, args[1], Entry::Hash);
+    int64_t removed = 0;
+    for (size_t i = 2; entry && i < args.size(); ++i) {
+      removed += int64_t(entry->hash.erase(args[i]));
+    }
+    eraseIfEmpty(session, args[1]);
+    to.integer(removed);
+  }
+
+  void hlen(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::Hash);
+    to.integer(entry ? int64_t(entry->hash.size()) : 0);
+  }
+
+  void hexists(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::Hash);
+    to.integer(entry && entry->hash.count(args[2]));
+  }
+
+  // HKEYS, HVALS and HGETALL.
+  void hgetAll(Session& session, const Args& args, Reply& to) {
+    const std::string name = upper(args[0]);
+    const Entry* entry = find(session, args[1], Entry::Hash);
+    const size_t size = entry ? entry->hash.size() : 0;
+    to.array(name == "HGETALL" ? size * 2 : size);
+    if (!entry) {
+      return;
+    }
+    typedef std::map<std::string, std::string>::const_iterator Iterator;
+    for (Iterator field = entry->hash.begin(); field != entry->hash.end();
+         ++field) {
+      if (name != "HVALS") {
+        to.bulk(field->first);
+      }
+      if (name != "HKEYS") {
+        to.bulk(field->second);
+      }
+    }
+  }
+
+  void hincrBy(Session& session, const Args& args, Reply& to) {
+    Entry& entry = create(session, args[1], Entry::Hash);
+    std::string& value = entry.hash[args[2]];
+    if (upper(args[0]) == "HINCRBY") {
+      const int64_t sum =
+          (value.empty() ? 0 : toInteger(value)) + toInteger(args[3]);
+      value = boost::lexical_cast<std::string>(sum);
+      to.integer(sum);
+    } else {
+      value = formatDouble((value.empty() ? 0 : toDouble(value)) +
+                           toDouble(args[3]));
+      to.bulk(value);
+    }
+  }
+
+  // sorted sets
+
+  static Scored sorted(const Entry& entry) {
+    Scored ret;
+    for (std::map<std::string, double>::const_iterator i = entry.zset.begin();
+         i != entry.zset.end(); ++i) {
+      ret.push_back(std::make_pair(i->second, i->first));
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+  }
+
+  void zadd(Session& session, const Args& args, Reply& to) {
+    bool nx = false;
+    bool xx = false;
+    bool ch = false;
+    bool incr = false;
+    bool gt = false;
+    bool lt = false;
+    size_t i = 2;
+    for (; i < args.size(); ++i) {
+      const std::string option = upper(args[i]);
+      if (option == "NX") {
+        nx = true;
+      } else if (option == "XX") {
+        xx = true;
+      } else if (option == "GT") {
+        gt = true;
+      } else if (option == "LT") {
+        lt = true;
+      } else if (option == "CH") {
+        ch = true;
+      } else if (option == "INCR") {
+        incr = true;
+      } else {
+        break;
+      }
+    }
+    if (i == args.size() || (args.size() - i) % 2 != 0 ||
+        (incr && args.size() - i != 2) || (nx && xx)) {
+      throw CommandError("ERR syntax error");
+    }
+    if ((gt && lt) || (nx && (gt || lt))) {
+      throw CommandError(
+          "ERR GT, LT, and/or NX options at the same time are not compatible");
+    }
+    for (size_t j = i; j < args.size(); j += 2) {
+      toDouble(args[j]);
+    }
+    Entry& entry = create(session, args[1], Entry::ZSet);
+    int64_t changed = 0;
+    double result = 0;
+    bool skipped = false;
+    for (; i < args.size(); i += 2) {
+      std::map<std::string, double>::iterator found =
+          entry.zset.find(args[i + 1]);
+      const bool exists = found != entry.zset.end();
+      if ((nx && exists) || (xx && !exists)) {
+        skipped = true;
+        continue;
+      }
+      double score = toDouble(args[i]);
+      if (incr && exists) {
+        score += found->second;
+      }
+      if (exists && ((gt && score <= found->second) ||
+                     (lt && score >= found->second))) {
+        skipped = true;
+        continue;
+      }
+      result = score;
+      if (!exists || (ch && found->second != score)) {
+        ++changed;
+      }
+      entry.zset[args[i + 1]] = score;
+    }
+    eraseIfEmpty(session, args[1]);
+    if (incr) {
+      skipped ? to.nil() : to.number(result);
+    } else {
+      to.integer(changed);
+    }
+  }
+
+  // ZUNIONSTORE and ZINTERSTORE, taking sets as members scored 1.
+  void zstore(Session& session, const Args& args, Reply& to) {
+    const bool inter = upper(args[0]) == "ZINTERSTORE";
+    const int64_t numKeys = toInteger(args[2]);
+    if (numKeys < 1) {
+      throw CommandError("ERR at least 1 input key is needed for " +
+                         upper(args[0]));
+    }
+    if (size_t(numKeys) > args.size() - 3) {
+      throw CommandError("ERR syntax error");
+    }
+    std::vector<double> weights(size_t(numKeys), 1);
+    std::string aggregate = "SUM";
+    for (size_t i = 3 + size_t(numKeys); i < args.size();) {
+      const std::string option = upper(args[i]);
+      if (option == "WEIGHTS" && args.size() - i > weights.size()) {
+        for (size_t w = 0; w < weights.size(); ++w) {
+          weights[w] = toDouble(args[i + 1 + w]);
+        }
+        i += 1 + weights.size();
+      } else if (option == "AGGREGATE" && i + 1 < args.size()) {
+        aggregate = upper(args[i + 1]);
+        if (aggregate != "SUM" && aggregate != "MIN" && aggregate != "MAX") {
+          throw CommandError("ERR syntax error");
+        }
+        i += 2;
+      } else {
+        throw CommandError("ERR syntax error");
+      }
+    }
+    std::map<std::string, double> result;
+    for (size_t k = 0; k < weights.size(); ++k) {
+      const Entry* entry = find(session, args[3 + k]);
+      if (entry && entry->kind != Entry::Set && entry->kind != Entry::ZSet) {
+        throw CommandError(kWrongType);
+      }
+      std::map<std::string, double> scores;
+      if (entry && entry->kind == Entry::Set) {
+        for (std::set<std::string>::const_iterator m = entry->members.begin();
+             m != entry->members.end(); ++m) {
+          scores[*m] = 1;
+        }
+      } else if (entry) {
+        scores = entry->zset;
+      }
+      std::map<std::string, double> merged;
+      for (std::map<std::string, double>::const_iterator m = scores.begin();
+           m != scores.end(); ++m) {
+        // inf * 0 is taken as 0, as the server does
+        const double score = m->second * weights[k];
+        const double weighted = score != score ? 0 : score;
+        std::map<std::string, double>::const_iterator old =
+            result.find(m->first);
+        if (k > 0 && inter && old == result.end()) {
+          continue;
+        }
+        double& out = merged[m->first];
+        if (old == result.end()) {
+          out = weighted;
+        } else if (aggregate == "SUM") {
+          out = old->second + weighted;
+          out = out != out ? 0 : out;
+        } else if (aggregate == "MIN") {
+          out = std::min(old->second, weighted);
+        } else {
+          out = std::max(old->second, weighted);
+        }
+      }
+      if (inter) {
+        result.swap(merged);
+      } else {
+        for (std::map<std::string, double>::const_iterator m = merged.begin();
+             m != merged.end(); ++m) {
+          result[m->first] = m->second;
+        }
+      }
+    }
+    erase(session, args[1]);
+    if (!result.empty()) {
+      create(session, args[1], Entry::ZSet).zset.swap(result);
+      to.integer(int64_t(find(session, args[1])->zset.size()));
+    } else {
+      to.integer(0);
+    }
+  }
+
+  void zincrBy(Session& session, const Args& args, Reply& to) {
+    const double by = toDouble(args[2]);
+    Entry& entry = create(session, args[1], Entry::ZSet);
+    double& score = entry.zset[args[3]];
+    score += by;
+    to.number(score);
+  }
+
+  void zrem(Session& session, const Args& args, Reply& to) {
+    Entry* entry = modify(session, args[1], Entry::ZSet);
+    int64_t removed = 0;
+    for (size_t i = 2; entry && i < args.size(); ++i) {
+      removed += int64_t(entry->zset.erase(args[i]));
+    }
+    eraseIfEmpty(session, args[1]);
+    to.integer(removed);
+  }
+
+  void zscore(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::ZSet);
+    std::map<std::string, double>::const_iterator found;
+    if (entry && (found = entry->zset.find(args[2])) != entry->zset.end()) {
+      to.number(found->second);
+    } else {
+      to.nil();
+    }
+  }
+
+  void zcard(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::ZSet);
+    to.integer(entry ? int64_t(entry->zset.size()) : 0);
+  }
+
+  void zrank(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::ZSet);
+    if (!entry || !entry->zset.count(args[2])) {
+      to.nil();
+      return;
+    }
+    const Scored scored = sorted(*entry);
+    for (size_t i = 0; i < scored.size(); ++i) {
+      if (scored[i].second == args[2]) {
+        const bool rev = upper(args[0]) == "ZREVRANK";
+        to.integer(int64_t(rev ? scored.size() - 1 - i : i));
+        return;
+      }
+    }
+  }
+
+  struct ScoreBound {
+    double value;
+    bool exclusive;
+
+    bool below(double score) const {
+      return exclusive ? value < score : value <= score;
+    }
+    bool above(double score) const {
+      return exclusive ? value > score : value >= score;
+    }
+  };
+
+  static ScoreBound toBound(const std::string& text) {
+    ScoreBound bound;
+    bound.exclusive = !text.empty() && text[0] == '(';
+    try {
+      bound.value = toDouble(bound.exclusive ? text.substr(1) : text);
+    } catch (const CommandError&) {
+      throw CommandError("ERR min or max is not a float");
+    }
+    return bound;
+  }
+
+  // The entries of a ZRANGE (with BYSCORE, REV and LIMIT) or one of its
+  // older forms, in reply order.
+  Scored zrangeEntries(const Entry& entry, const std::string& name,
+                       const Args& args, bool& withScores) {
+    bool byScore = name.find("BYSCORE") != std::string::npos;
+    bool rev = name.compare(0, 4, "ZREV") == 0;
+    int64_t offset = 0;
+    int64_t count = -1;
+    withScores = false;
+    for (size_t i = 4; i < args.size(); ++i) {
+      const std::string option = upper(args[i]);
+      if (option == "WITHSCORES") {
+        withScores = true;
+      } else if (option == "BYSCORE") {
+        byScore = true;
+      } else if (option == "REV") {
+        rev = true;
+      } else if (option == "LIMIT" && i + 2 < args.size()) {
+        offset = toInteger(args[i + 1]);
+        count = toInteger(args[i + 2]);
+        i += 2;
+      } else {
+        throw CommandError("ERR syntax error");
+      }
+    }
+    Scored scored = sorted(entry);
+    if (rev) {
+      std::reverse(scored.begin(), scored.end());
+    }
+    Scored ret;
+    if (byScore) {
+      // reversed ranges give the upper bound first
+      const ScoreBound min = toBound(args[rev ? 3 : 2]);
+      const ScoreBound max = toBound(args[rev ? 2 : 3]);
+      for (size_t i = 0; i < scored.size(); ++i) {
+        if (min.below(scored[i].first) && max.above(scored[i].first)) {
+          ret.push_back(scored[i]);
+        }
+      }
+      if (offset > 0) {
+        ret.erase(ret.begin(),
+                  ret.begin() + std::min<size_t>(size_t(offset), ret.size()));
+      }
+      if (count >= 0 && size_t(count) < ret.size()) {
+        ret.resize(size_t(count));
+      }
+      return ret;
+    }
+    size_t first = 0;
+    size_t last = 0;
+    if (clamp(toInteger(args[2]), toInteger(args[3]), scored.size(), first,
+              last)) {
+      ret.assign(scored.begin() + first, scored.begin() + last + 1);
+    }
+    return ret;
+  }
+
+  void zrange(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::ZSet);
+    bool withScores = false;
+    const Scored ret = entry ? zrangeEntries(*entry, upper(args[0]), args,
+                                             withScores)
+                             : Scored();
+    to.array(ret.size() * (withScores ? 2 : 1));
+    for (size_t i = 0; i < ret.size(); ++i) {
+      to.bulk(ret[i].second);
+      if (withScores) {
+        to.number(ret[i].first);
+      }
+    }
+  }
+
+  void zcount(Session& session, const Args& args, Reply& to) {
+    const Entry* entry = find(session, args[1], Entry::ZSet);
+    const ScoreBound min = toBound(args[2]);
+    const ScoreBound max = toBound(args[3]);
+    int64_t count = 0;
+    if (entry) {
+      typedef std::map<std::string, double>::const_iterator Iterator;
+      for (Iterator i = entry->zset.begin(); i != entry->zset.end(); ++i) {
+        count += min.below(i->second) && max.above(i->second);
+      }
+    }
+    to.integer(count);
+  }
+
+  void zremRange(Session& session, const Args& args, Reply& to) {
+    Entry* entry = modify(session, args[1], Entry::ZSet);
+    if (!entry) {
+      to.integer(0);
+      return;
+    }
+    Args range(args.begin(), args.begin() + 4);
+    bool withScores = false;
+    const std::string name =
+        upper(args[0]) == "ZREMRANGEBYSCORE" ? "ZRANGEBYSCORE" : "ZRANGE";
+    const Scored removed = zrangeEntries(*entry, name, range, withScores);
+    for (size_t i = 0; i < removed.size(); ++i) {
+      entry->zset.erase(removed[i].second);
+    }
+    eraseIfEmpty(session, args[1]);
+    to.integer(int64_t(removed.size()));
+  }
+
+  void zpop(Session& session, const Args& args, Reply& to) {
+    Entry* entry = modify(session, args[1], Entry::ZSet);
+    const int64_t count = args.size() > 2 ? toInteger(args[2]) : 1;
+    Scored scored = entry ? sorted(*entry) : Scored();
+    if (upper(args[0]) == "ZPOPMAX") {
+      std::reverse(scored.begin(), scored.end());
+    }
+    if (count < int64_t(scored.size())) {
+      scored.resize(size_t(std::max<int64_t>(0, count)));
+    }
+    to.array(scored.size() * 2);
+    for (size_t i = 0; i < scored.size(); ++i) {
+      entry->zset.erase(scored[i].second);
+      to.bulk(scored[i].second);
+      to.number(scored[i].first);
+    }
+    eraseIfEmpty(session, args[1]);
+  }
+
+  // transactions
+
+  void watch(Session& session, const Args& args, Reply& to) {
+    if (session.inMulti) {
+      throw CommandError("ERR WATCH inside MULTI is not allowed");
+    }
+    for (size_t i = 1; i < args.size(); ++i) {
+      session.watched[std::make_pair(session.db, args[i])] =
+          version(session.db, args[i]);
+    }
+    to.ok();
+  }
+
+  void unwatch(Session& session, const Args&, Reply& to) {
+    session.watched.clear();
+    to.ok();
+  }
+
+public:
+  std::mutex mutex; // held while a command runs
+  std::atomic<bool> stopping; // ends blocking commands
+
+private:
+  std::vector<Database> dbs;
+  uint64_t nextVersion;
+  std::map<std::string, Command> commands;
+};
+
+// Reads the line ending at or after offset, without its line ending.
+static bool readLine(const std::string& data, size_t& offset,
+                     std::string& line) {
+  const size_t end = data.find("\r\n", offset);
+  if (end == std::string::npos) {
+    return false;
+  }
+  line.assign(data, offset, end - offset);
+  offset = end + 2;
+  return true;
+}
+
+// Parses the command at offset, a multi bulk request or an inline one as
+// typed into telnet, moving offset past it. Returns false if it has not all
+// arrived.
+static bool parseCommand(const std::string& data, size_t& offset,
+                         Args& args) {
+  args.clear();
+  size_t cur = offset;
+  std::string line;
+  if (!readLine(data, cur, line)) {
+    if (data.size() - offset > 64 * 1024) {
+      throw std::runtime_error("Protocol error: too big request");
+    }
+    return false;
+  }
+  if (line.empty() || line[0] != '*') {
+    std::istringstream words(line);
+    std::string word;
+    while (words >> word) {
+      args.push_back(word);
+    }
+    offset = cur;
+    return true;
+  }
+  const long count = strtol(line.c_str() + 1, NULL, 10);
+  if (count > 1024 * 1024) {
+    throw std::runtime_error("Protocol error: invalid multibulk length");
+  }
+  for (long i = 0; i < count; ++i) {
+    if (!readLine(data, cur, line)) {
+      return false;
+    }
+    if (line.empty() || line[0] != '$') {
+      throw std::runtime_error("Protocol error: expected '$', got '" +
+                               line.substr(0, 1) + "'");
+    }
+    const long len = strtol(line.c_str() + 1, NULL, 10);
+    if (len < 0 || len > 512 * 1024 * 1024) {
+      throw std::runtime_error("Protocol error: invalid bulk length");
+    }
+    if (data.size() < cur + size_t(len) + 2) {
+      return false;
+    }
+    args.push_back(data.substr(cur, size_t(len)));
+    cur += size_t(len) + 2;
+  }
+  offset = cur;
+  return true;
+}
+
+static void check(bool ok, const std::string& what) {
+  if (!ok) {
+    throw std::runtime_error("fake server: error " + what + " (" +
+                             strerror(errno) + ")");
+  }
+}
+
+FakeServer::FakeServer(int port, const FakeServerOptions& options)
+    : store(new FakeStore()), options(options), listenFd(-1),
+      stopping(false), processed(0) {
+  listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  check(listenFd >= 0, "creating socket");
+  const int on = 1;
+  setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(uint16_t(port));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if (bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      getsockname(listenFd, (struct sockaddr*)&addr, &len) != 0) {
+    close(listenFd);
+    check(false, "binding port");
+  }
+  portName = boost::lexical_cast<std::string>(ntohs(addr.sin_port));
+  start();
+}
+
+#ifndef _WIN32
+FakeServer::FakeServer(const std::string& path,
+                       const FakeServerOptions& options)
+    : store(new FakeStore()), options(options), listenFd(-1), path(path),
+      stopping(false), processed(0) {
+  listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  check(listenFd >= 0, "creating socket");
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(path.c_str());
+  if (bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(listenFd);
+    check(false, "binding " + path);
+  }
+  start();
+}
+#endif
+
+FakeServer::~FakeServer() { stop(); }
+
+void FakeServer::start() {
+  if (listen(listenFd, 128) != 0) {
+    close(listenFd);
+    check(false, "listening");
+  }
+  acceptor = std::thread(&FakeServer::acceptLoop, this);
+}
+
+void FakeServer::setOptions(const FakeServerOptions& options) {
+  std::lock_guard<std::mutex> lock(mutex);
+  this->options = options;
+}
+
+FakeServerOptions FakeServer::getOptions() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return options;
+}
+
+void FakeServer::stop() {
+  if (stopping.exchange(true)) {
+    return;
+  }
+  store->stopping = true;
+  acceptor.join();
+  // clients notice within a poll interval
+  for (size_t i = 0; i < clients.size(); ++i) {
+    clients[i].join();
+  }
+  close(listenFd);
+  if (!path.empty()) {
+    unlink(path.c_str());
+  }
+}
+
+// Polls rather than blocks so that stop is noticed.
+static const int kPollMs = 20;
+
+void FakeServer::acceptLoop() {
+  while (!stopping) {
+    struct pollfd pfd = {listenFd, POLLIN, 0};
+    if (poll(&pfd, 1, kPollMs) <= 0) {
+      continue;
+    }
+    const int fd = accept(listenFd, NULL, NULL);
+    if (fd < 0) {
+      continue;
+    }
+    // as redis-server does, so that small and partial replies go out at once
+    const int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    std::lock_guard<std::mutex> lock(mutex);
+    clients.push_back(std::thread(&FakeServer::serve, this, fd,
+                                  int64_t(clients.size() + 1)));
+  }
+}
+
+void FakeServer::serve(int fd, int64_t id) {
+  Session session(id);
+  std::string in;
+  std::vector<char> chunk(16 * 1024);
+  size_t seen = 0;
+  try {
+    while (!stopping && !session.quit) {
+      struct pollfd pfd = {fd, POLLIN, 0};
+      if (poll(&pfd, 1, kPollMs) <= 0) {
+        continue;
+      }
+      const ssize_t got = recv(fd, &chunk[0], chunk.size(), 0);
+      if (got <= 0) {
+        break;
+      }
+      in.append(&chunk[0], size_t(got));
+
+      // runs what has arrived, replying once
+      const FakeServerOptions now = getOptions();
+      std::string out;
+      bool delayed = false;
+      size_t offset = 0;
+      Args args;
+      try {
+        while (!session.quit && parseCommand(in, offset, args)) {
+          if (args.empty()) {
+            continue;
+          }
+          if (now.slowEvery > 0 && ++seen % now.slowEvery == 0) {
+            if (!out.empty()) {
+              std::this_thread::sleep_for(
+                  std::chrono::milliseconds(delayed ? 0 : now.latencyMs));
+              delayed = true;
+              reply(fd, out, now);
+              out.clear();
+            }
+            std::this_thread::sleep_for(
+                std::chrono::milliseconds(now.slowReplyMs));
+          }
+          std::unique_lock<std::mutex> lock(store->mutex);
+          session.lock = &lock;
+          store->execute(session, args, out, now.password);
+          session.lock = NULL;
+          ++processed;
+        }
+      } catch (const std::runtime_error& e) {
+        out += "-ERR " + std::string(e.what()) + "\r\n";
+        session.quit = true;
+      }
+      in.erase(0, offset);
+      if (!out.empty()) {
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(delayed ? 0 : now.latencyMs));
+        reply(fd, out, now);
+      }
+    }
+  } catch (const std::exception&) {
+    // the client went away
+  }
+  close(fd);
+}
+
+void FakeServer::reply(int fd, const std::string& data,
+                       const FakeServerOptions& now) {
+  const size_t piece =
+      now.partialWriteBytes > 0 ? now.partialWriteBytes : data.size();
+  for (size_t sent = 0; sent < data.size();) {
+    if (sent > 0 && now.partialWriteBytes > 0) {
+      std::this_thread::sleep_for(
+          std::chrono::microseconds(now.partialWriteDelayUs));
+    }
+    const size_t end = std::min(data.size(), sent + piece);
+    while (sent < end) {
+      const ssize_t ret = ::send(fd, data.data() + sent, end - sent,
+                                 MSG_NOSIGNAL);
+      check(ret > 0, "writing to client");
+      sent += size_t(ret);
+    }
+  }
+}
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <boost/noncopyable.hpp>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace redispp {
+
+struct FakeServerOptions {
+  FakeServerOptions()
+      : latencyMs(0), slowReplyMs(0), slowEvery(0), partialWriteBytes(0),
+        partialWriteDelayUs(100) {}
+
+  // Waited before replying to each batch of commands read from a client, as
+  // one network round trip would take.
+  int latencyMs;
+  // Every slowEvery-th command of a client takes slowReplyMs longer, the
+  // replies before it being sent first.
+  int slowReplyMs;
+  size_t slowEvery;
+  // When above 0, replies are written in pieces of at most this many bytes,
+  // partialWriteDelayUs apart, so that they arrive split.
+  size_t partialWriteBytes;
+  int partialWriteDelayUs;
+  // Clients must AUTH with it when it is set.
+  std::string password;
+};
+
+class FakeStore;
+
+// A stand-in for redis-server for tests and benchmarks, running in the
+// process. It speaks RESP2 over TCP or a unix domain socket and keeps its
+// data in memory, implementing the key, string, list, set, hash, sorted set,
+// transaction (with WATCH) and connection commands redispp sends, with 16
+// databases and expiry. Scripting, pub/sub and streams are not supported.
+// Each client is served by its own thread, commands run one at a time.
+class FakeServer : boost::noncopyable {
+public:
+  // Listens on 127.0.0.1, on a free port when port is 0.
+  explicit FakeServer(int port = 0,
+                      const FakeServerOptions& options = FakeServerOptions());
+#ifndef _WIN32
+  // Listens on a unix domain socket, replacing any file at path.
+  explicit FakeServer(const std::string& path,
+                      const FakeServerOptions& options = FakeServerOptions());
+#endif
+  ~FakeServer();
+
+  // The port listened on, as Connection takes it.
+  const std::string& port() const { return portName; }
+
+  // Applies to the batches of commands read after the call.
+  void setOptions(const FakeServerOptions& options);
+  FakeServerOptions getOptions() const;
+
+  uint64_t commandsProcessed() const { return processed; }
+
+  // Closes the listening socket and every client connection.
+  void stop();
+
+private:
+  void start();
+  void acceptLoop();
+  void serve(int fd, int64_t id);
+  void reply(int fd, const std::string& data, const FakeServerOptions& now);
+
+  std::unique_ptr<FakeStore> store;
+  mutable std::mutex mutex; // guards options and clients
+  FakeServerOptions options;
+  int listenFd;
+  std::string portName;
+  std::string path;
+  std::atomic<bool> stopping;
+  std::atomic<uint64_t> processed;
+  std::thread acceptor;
+  std::vector<std::thread> clients;
+};
+};
@@ -0,0 +1,79 @@
+// Runs the fake server on its own, e.g. to point perftest at it.
+#include "fakeserver.h"
+#include <chrono>
+#include <iostream>
+#include <signal.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+using namespace redispp;
+
+static volatile sig_atomic_t stopped = 0;
+
+static void onSignal(int) { stopped = 1; }
+
+static void usage() {
+  std::cerr << "usage: ./fakeserver [options]\n"
+               "  --port <port>                 default 6399\n"
+               "  --socket <path>               listen on a unix socket\n"
+               "  --password <password>\n"
+               "  --latency-ms <ms>             before each batch of replies\n"
+               "  --slow-reply-ms <ms>          added to every slow command\n"
+               "  --slow-every <n>              every nth command is slow\n"
+               "  --partial-write-bytes <n>     write replies in pieces\n"
+               "  --partial-write-delay-us <us> between pieces, default 100\n";
+}
+
+int main(int argc, char* argv[]) {
+  FakeServerOptions options;
+  int port = 6399;
+  std::string socket;
+  for (int i = 1; i < argc; i += 2) {
+    const std::string name = argv[i];
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    const char* value = argv[i + 1];
+    if (name == "--port") {
+      port = atoi(value);
+    } else if (name == "--socket") {
+      socket = value;
+    } else if (name == "--password") {
+      options.password = value;
+    } else if (name == "--latency-ms") {
+      options.latencyMs = atoi(value);
+    } else if (name == "--slow-reply-ms") {
+      options.slowReplyMs = atoi(value);
+    } else if (name == "--slow-every") {
+      options.slowEvery = size_t(atol(value));
+    } else if (name == "--partial-write-bytes") {
+      options.partialWriteBytes = size_t(atol(value));
+    } else if (name == "--partial-write-delay-us") {
+      options.partialWriteDelayUs = atoi(value);
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  try {
+    std::unique_ptr<FakeServer> server(
+        socket.empty() ? new FakeServer(port, options)
+                       : new FakeServer(socket, options));
+    std::cout << "listening on "
+              << (socket.empty() ? "127.0.0.1:" + server->port() : socket)
+              << std::endl;
+    while (!stopped) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    std::cout << server->commandsProcessed() << " commands processed"
+              << std::endl;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
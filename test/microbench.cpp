@@ -0,0 +1,199 @@
+// Client-side costs without a server: commands are encoded into a transport
+// that discards them, and replies are parsed from recorded RESP bytes replayed
+// from memory. Prints ns/op and heap allocations/op for each case.
+#include "redispp.h"
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+using namespace redispp;
+
+static uint64_t allocations = 0;
+
+void* operator new(size_t size) {
+  ++allocations;
+  void* ret = malloc(size ? size : 1);
+  if (!ret) {
+    throw std::bad_alloc();
+  }
+  return ret;
+}
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+
+// Serves the same recorded reply over and over, one per command, and counts
+// what is written.
+class ReplayTransport : public Transport {
+public:
+  explicit ReplayTransport(const std::string& reply)
+      : reply(reply), offset(0), written(0) {}
+
+  void write(const void* data, size_t len) {
+    if (written == 0) {
+      first.assign((const char*)data, len);
+    }
+    written += len;
+  }
+
+  size_t read(void* data, size_t len) {
+    if (reply.empty()) {
+      throw std::runtime_error("no replies to replay");
+    }
+    size_t got = 0;
+    while (got < len) {
+      const size_t chunk = std::min(len - got, reply.size() - offset);
+      memcpy((char*)data + got, reply.data() + offset, chunk);
+      got += chunk;
+      offset = (offset + chunk) % reply.size();
+    }
+    return got;
+  }
+
+  bool waitReadable(int) { return !reply.empty(); }
+
+  const std::string reply;
+  size_t offset;
+  uint64_t written;
+  std::string first; // the first write, to check the encoding
+};
+
+static size_t iterations = 200000;
+
+template <typename Op>
+void bench(const char* name, const std::string& reply, Op op,
+           size_t scale = 1) {
+  ReplayTransport* transport = new ReplayTransport(reply);
+  Connection conn{std::unique_ptr<Transport>(transport)};
+  if (reply.empty()) {
+    conn.repliesOff();
+  }
+  const size_t count = std::max<size_t>(1, iterations / scale);
+  for (size_t i = 0; i < count / 10; ++i) {
+    op(conn);
+  }
+  const uint64_t allocated = allocations;
+  const std::chrono::steady_clock::time_point begin =
+      std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; ++i) {
+    op(conn);
+  }
+  const double ns = std::chrono::duration<double, std::nano>(
+                        std::chrono::steady_clock::now() - begin)
+                        .count();
+  std::cout << std::left << std::setw(28) << name << std::right
+            << std::setw(12) << std::fixed << std::setprecision(1)
+            << ns / count << " ns/op" << std::setw(10) << std::setprecision(2)
+            << double(allocations - allocated) / count << " allocs/op"
+            << std::endl;
+}
+
+static std::string bulk(const std::string& value) {
+  std::ostringstream out;
+  out << "$" << value.size() << "\r\n" << value << "\r\n";
+  return out.str();
+}
+
+static std::string repeat(size_t count, const std::string& text) {
+  std::string ret;
+  for (size_t i = 0; i < count; ++i) {
+    ret += text;
+  }
+  return ret;
+}
+
+static std::string array(size_t count, const std::string& element) {
+  std::ostringstream out;
+  out << "*" << count << "\r\n" << repeat(count, element);
+  return out.str();
+}
+
+// Fails if the commands are no longer encoded as expected.
+static void checkEncoding() {
+  ReplayTransport* transport = new ReplayTransport("+OK\r\n");
+  Connection conn{std::unique_ptr<Transport>(transport)};
+  conn.set("key", "value").result();
+  const std::string expected =
+      "*3\r\n$3\r\nSet\r\n$3\r\nkey\r\n$5\r\nvalue\r\n";
+  if (transport->first != expected) {
+    std::cerr << "unexpected encoding: " << transport->first << std::endl;
+    exit(1);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1) {
+    iterations = size_t(atol(argv[1]));
+  }
+  checkEncoding();
+
+  const std::string key = "somemediumkey";
+  const std::string small(16, 'x');
+  const std::string large(1024, 'x');
+  const std::string huge(64 * 1024, 'x');
+  ArgList args;
+  args.push_back("XADD");
+  args.push_back("stream");
+  args.push_back("*");
+  for (int i = 0; i < 5; ++i) {
+    args.push_back("field");
+    args.push_back(small);
+  }
+  KeyValueList pairs;
+  for (int i = 0; i < 10; ++i) {
+    pairs.push_back(KeyValuePair(key, small));
+  }
+
+  std::cout << "encoding (replies off)" << std::endl;
+  bench("set 16B", "", [&](Connection& conn) { conn.set(key, small); });
+  bench("set 1KB", "", [&](Connection& conn) { conn.set(key, large); });
+  bench("incr", "", [&](Connection& conn) { conn.incr(key); });
+  bench("mset 10 pairs", "", [&](Connection& conn) { conn.mset(pairs); });
+  bench("command 13 args", "", [&](Connection& conn) { conn.command(args); });
+
+  std::cout << "parsing (includes encoding a short command)" << std::endl;
+  bench("status", "+OK\r\n",
+        [&](Connection& conn) { conn.set(key, small).result(); });
+  bench("integer", ":123456\r\n",
+        [&](Connection& conn) { conn.incr(key).result(); });
+  bench("nil bulk", "$-1\r\n",
+        [&](Connection& conn) { conn.get(key).result(); });
+  bench("bulk 16B", bulk(small),
+        [&](Connection& conn) { conn.get(key).result(); });
+  bench("bulk 1KB", bulk(large),
+        [&](Connection& conn) { conn.get(key).result(); });
+  bench("bulk 64KB", bulk(huge),
+        [&](Connection& conn) { conn.get(key).result(); }, 16);
+  bench("array 100x16B", array(100, bulk(small)), [&](Connection& conn) {
+    MultiBulkEnumerator elements = conn.lrange(key, 0, -1);
+    std::string element;
+    while (elements.next(&element)) {
+    }
+  }, 10);
+  bench("map 50 pairs", array(100, bulk(small)),
+        [&](Connection& conn) { conn.hgetAllMap(key).result(); }, 10);
+  bench("scored 50 members", array(100, bulk("1.5")), [&](Connection& conn) {
+    conn.zrangeWithScores(key, 0, -1).result();
+  }, 10);
+  bench("value nested 10x10", array(10, array(10, ":1\r\n")),
+        [&](Connection& conn) { conn.command(args).result(); }, 10);
+  bench("value resp3 map 10", "%10\r\n" + repeat(10, "+k\r\n,1.5\r\n"),
+        [&](Connection& conn) { conn.command(args).result(); }, 10);
+  bench("pipelined get x100", bulk(small),
+        [&](Connection& conn) {
+          std::vector<StringReply> replies;
+          replies.reserve(100);
+          for (int i = 0; i < 100; ++i) {
+            replies.push_back(conn.get(key));
+          }
+          for (int i = 0; i < 100; ++i) {
+            replies[i].result();
+          }
+        },
+        100);
+  return 0;
+}
@@ -1,75 +1,477 @@
 #include "redispp.h"
-#include <boost/bind.hpp>
-#include <boost/date_time/posix_time/posix_time.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <iostream>
-#include <list>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
 #ifdef _WIN32
 #include <Windows.h>
 #endif
 using namespace redispp;
-using namespace boost::posix_time;
 
-void runFunc(const char* arg, size_t count) {
-#ifdef UNIX_DOMAIN_SOCKET
-  Connection conn(arg, "");
-#else
-  Connection conn("localhost", arg, "");
-#endif
+typedef std::chrono::steady_clock Clock;
 
-  std::string key = "somemediumkey2";
-  std::string value = "somemediumvalue";
+// Latencies in nanoseconds, bucketed log-linearly as in HdrHistogram: every
+// power of two is split into 64 buckets, so values are kept to within 1.6%.
+class Histogram {
+public:
+  Histogram() : buckets(128 + 58 * 64), total(0), sum(0), largest(0) {}
 
-  // Write benchmark
-  {
-    const size_t chunkFactor = 256;
-    VoidReply replies[chunkFactor];
+  void record(uint64_t value) {
+    ++buckets[index(value)];
+    ++total;
+    sum += value;
+    largest = std::max(largest, value);
+  }
 
-    ptime begin(microsec_clock::local_time());
+  void merge(const Histogram& other) {
+    for (size_t i = 0; i < buckets.size(); ++i) {
+      buckets[i] += other.buckets[i];
+    }
+    total += other.total;
+    sum += other.sum;
+    largest = std::max(largest, other.largest);
+  }
 
-    for (size_t i = 0; i < count; ++i) {
-      const size_t index = i & (chunkFactor - 1);
-      replies[index] = conn.set(key, value);
-      if (index == (chunkFactor - 1)) {
-        for (size_t j = 0; j < chunkFactor; ++j) {
-          replies[j].result();
-        }
+  // The value at or below which percent of the values fall.
+  uint64_t percentile(double percent) const {
+    const uint64_t rank =
+        std::max<uint64_t>(1, uint64_t(std::ceil(percent / 100 * total)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+      seen += buckets[i];
+      if (seen >= rank) {
+        return std::min(highest(i), largest);
       }
     }
+    return largest;
+  }
+
+  uint64_t count() const { return total; }
+  uint64_t max() const { return largest; }
+  double mean() const { return total ? double(sum) / total : 0; }
+
+private:
+  static size_t index(uint64_t value) {
+    if (value < 128) {
+      return size_t(value);
+    }
+    int shift = 0;
+    while ((value >> shift) >= 128) {
+      ++shift;
+    }
+    return 128 + (shift - 1) * 64 + size_t((value >> shift) - 64);
+  }
+
+  static uint64_t highest(size_t index) {
+    if (index < 128) {
+      return index;
+    }
+    const size_t shift = (index - 128) / 64 + 1;
+    const uint64_t sub = (index - 128) % 64 + 64;
+    return ((sub + 1) << shift) - 1;
+  }
 
-    ptime end(microsec_clock::local_time());
+  std::vector<uint64_t> buckets;
+  uint64_t total;
+  uint64_t sum;
+  uint64_t largest;
+};
 
-    std::cout << count << " writes in " << (end - begin).total_microseconds()
-              << " usecs ~= "
-              << (double)count * 1000000.0 /
-                     (double)(end - begin).total_microseconds()
-              << " requests per second" << std::endl;
+struct Options {
+  Options()
+      : host("localhost"), port("6379"), requests(100000), keys(10000),
+        zipf(false), zipfExponent(0.99), connections(1), threads(1) {
+    commands.push_back("set");
+    commands.push_back("get");
+    sizes.push_back(16);
+    depths.push_back(256);
   }
 
-  // Read benchmark
-  {
-    const size_t chunkFactor = 256;
-    StringReply replies[chunkFactor];
+  std::string host;
+  std::string port;
+  std::string socket;
+  std::string password;
+  std::vector<std::string> commands;
+  size_t requests;
+  std::vector<size_t> sizes;
+  size_t keys;
+  bool zipf;
+  double zipfExponent;
+  std::vector<size_t> depths;
+  size_t connections; // per thread
+  size_t threads;
+};
 
-    ptime begin(microsec_clock::local_time());
+struct Result {
+  std::string command;
+  size_t size;
+  size_t depth;
+  double seconds;
+  Histogram latency;
+};
 
+std::unique_ptr<Connection> connect(const Options& options) {
+#ifndef _WIN32
+  if (!options.socket.empty()) {
+    return std::unique_ptr<Connection>(
+        new Connection(options.socket, options.password));
+  }
+#endif
+  return std::unique_ptr<Connection>(
+      new Connection(options.host, options.port, options.password, true));
+}
+
+// The sequence of key indexes a thread uses, uniform or zipfian over the key
+// space (index 0 being the most popular).
+std::vector<size_t> keySequence(const Options& options, size_t count,
+                                unsigned seed) {
+  std::mt19937_64 random(seed);
+  std::vector<size_t> sequence(count);
+  if (!options.zipf) {
+    std::uniform_int_distribution<size_t> uniform(0, options.keys - 1);
     for (size_t i = 0; i < count; ++i) {
-      const size_t index = i & (chunkFactor - 1);
-      replies[index] = conn.get(key);
-      if (index == (chunkFactor - 1)) {
-        for (size_t j = 0; j < chunkFactor; ++j) {
-          replies[j].result();
-        }
+      sequence[i] = uniform(random);
+    }
+    return sequence;
+  }
+  std::vector<double> cumulative(options.keys);
+  double total = 0;
+  for (size_t i = 0; i < options.keys; ++i) {
+    total += 1.0 / std::pow(double(i + 1), options.zipfExponent);
+    cumulative[i] = total;
+  }
+  std::uniform_real_distribution<double> uniform(0, total);
+  for (size_t i = 0; i < count; ++i) {
+    const double point = uniform(random);
+    sequence[i] = std::min<size_t>(
+        std::lower_bound(cumulative.begin(), cumulative.end(), point) -
+            cumulative.begin(),
+        options.keys - 1);
+  }
+  return sequence;
+}
+
+std::string keyName(size_t index) {
+  std::ostringstream out;
+  out << "perf:" << index;
+  return out.str();
+}
+
+// Keeps up to depth commands in flight on each connection, recording the time
+// from sending each command to reading its reply.
+template <typename Reply, typename Issue>
+void runWindow(std::vector<std::unique_ptr<Connection>>& conns, size_t count,
+               size_t depth, Histogram& latency, Issue issue) {
+  struct InFlight {
+    Reply reply;
+    Clock::time_point sent;
+  };
+  std::vector<std::vector<InFlight>> windows(conns.size());
+  std::vector<size_t> oldest(conns.size(), 0);
+  for (size_t i = 0; i < conns.size(); ++i) {
+    windows[i].reserve(depth);
+  }
+  for (size_t i = 0; i < count; ++i) {
+    const size_t c = i % conns.size();
+    std::vector<InFlight>& window = windows[c];
+    if (window.size() == depth) {
+      InFlight& entry = window[oldest[c]];
+      entry.reply.result();
+      const Clock::time_point now = Clock::now();
+      latency.record(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(now - entry.sent)
+              .count());
+      entry.sent = now;
+      entry.reply = issue(*conns[c], i);
+      oldest[c] = (oldest[c] + 1) % depth;
+    } else {
+      InFlight entry = {issue(*conns[c], i), Clock::now()};
+      window.push_back(std::move(entry));
+    }
+  }
+  for (size_t c = 0; c < conns.size(); ++c) {
+    std::vector<InFlight>& window = windows[c];
+    for (size_t n = 0; n < window.size(); ++n) {
+      InFlight& entry = window[(oldest[c] + n) % window.size()];
+      entry.reply.result();
+      latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         Clock::now() - entry.sent)
+                         .count());
+    }
+  }
+}
+
+void runCommand(const std::string& command,
+                std::vector<std::unique_ptr<Connection>>& conns,
+                const std::vector<std::string>& keys,
+                const std::vector<size_t>& sequence, const std::string& value,
+                size_t depth, Histogram& latency) {
+  const size_t count = sequence.size();
+  if (command == "set") {
+    runWindow<VoidReply>(conns, count, depth, latency,
+                         [&](Connection& conn, size_t i) {
+                           return conn.set(keys[sequence[i]], value);
+                         });
+  } else if (command == "get") {
+    runWindow<StringReply>(conns, count, depth, latency,
+                           [&](Connection& conn, size_t i) {
+                             return conn.get(keys[sequence[i]]);
+                           });
+  } else if (command == "incr") {
+    runWindow<IntReply>(conns, count, depth, latency,
+                        [&](Connection& conn, size_t i) {
+                          return conn.incr(keys[sequence[i]] + ":n");
+                        });
+  } else if (command == "hset") {
+    runWindow<BoolReply>(conns, count, depth, latency,
+                         [&](Connection& conn, size_t i) {
+                           return conn.hset("perf:hash", keys[sequence[i]],
+                                            value);
+                         });
+  } else if (command == "hget") {
+    runWindow<StringReply>(conns, count, depth, latency,
+                           [&](Connection& conn, size_t i) {
+                             return conn.hget("perf:hash", keys[sequence[i]]);
+                           });
+  } else if (command == "lpush") {
+    runWindow<IntReply>(conns, count, depth, latency,
+                        [&](Connection& conn, size_t) {
+                          return conn.lpush("perf:list", value);
+                        });
+  } else if (command == "rpop") {
+    runWindow<StringReply>(conns, count, depth, latency,
+                           [&](Connection& conn, size_t) {
+                             return conn.rpop("perf:list");
+                           });
+  } else if (command == "sadd") {
+    runWindow<BoolReply>(conns, count, depth, latency,
+                         [&](Connection& conn, size_t i) {
+                           return conn.sadd("perf:set", keys[sequence[i]]);
+                         });
+  } else {
+    throw std::invalid_argument("unknown command: " + command);
+  }
+}
+
+// Runs one command at one size and depth on every thread at once.
+Result runTest(const Options& options, const std::string& command,
+               size_t size, size_t depth,
+               const std::vector<std::string>& keys) {
+  const std::string value(size, 'x');
+  const size_t perThread = options.requests / options.threads;
+  std::vector<Histogram> latencies(options.threads);
+  std::vector<std::vector<size_t>> sequences;
+  std::vector<std::vector<std::unique_ptr<Connection>>> conns(options.threads);
+  for (size_t t = 0; t < options.threads; ++t) {
+    sequences.push_back(keySequence(options, perThread, unsigned(t + 1)));
+    for (size_t c = 0; c < options.connections; ++c) {
+      conns[t].push_back(connect(options));
+    }
+  }
+
+  const Clock::time_point begin = Clock::now();
+  std::vector<std::thread> threads;
+  std::vector<std::string> errors(options.threads);
+  for (size_t t = 0; t < options.threads; ++t) {
+    threads.emplace_back([&, t]() {
+      try {
+        runCommand(command, conns[t], keys, sequences[t], value, depth,
+                   latencies[t]);
+      } catch (const std::exception& e) {
+        errors[t] = e.what();
       }
+    });
+  }
+  for (size_t t = 0; t < threads.size(); ++t) {
+    threads[t].join();
+  }
+  const Clock::time_point end = Clock::now();
+  for (size_t t = 0; t < errors.size(); ++t) {
+    if (!errors[t].empty()) {
+      throw std::runtime_error(errors[t]);
     }
+  }
+
+  Result result;
+  result.command = command;
+  result.size = size;
+  result.depth = depth;
+  result.seconds = std::chrono::duration<double>(end - begin).count();
+  for (size_t t = 0; t < latencies.size(); ++t) {
+    result.latency.merge(latencies[t]);
+  }
+  return result;
+}
+
+// Stores a value of size under every key (and hash field), so that reads hit.
+void populate(const Options& options, const std::vector<std::string>& keys,
+              size_t size) {
+  std::unique_ptr<Connection> conn = connect(options);
+  const std::string value(size, 'x');
+  std::vector<VoidReply> sets;
+  std::vector<BoolReply> hsets;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    sets.push_back(conn->set(keys[i], value));
+    hsets.push_back(conn->hset("perf:hash", keys[i], value));
+    if (sets.size() == 1000) {
+      sets.clear();
+      hsets.clear();
+    }
+  }
+}
+
+template <typename T> std::string join(const std::vector<T>& values) {
+  std::ostringstream out;
+  for (size_t i = 0; i < values.size(); ++i) {
+    out << (i ? "," : "") << values[i];
+  }
+  return out.str();
+}
+
+std::string quoted(const std::string& text) { return "\"" + text + "\""; }
 
-    ptime end(microsec_clock::local_time());
+void printJson(const Options& options, const std::vector<Result>& results) {
+  std::ostringstream out;
+  out << "{\n  \"config\": {\"target\": "
+      << quoted(options.socket.empty() ? options.host + ":" + options.port
+                                       : options.socket)
+      << ", \"requests\": " << options.requests
+      << ", \"keys\": " << options.keys << ", \"distribution\": "
+      << quoted(options.zipf ? "zipf" : "uniform");
+  if (options.zipf) {
+    out << ", \"zipf_exponent\": " << options.zipfExponent;
+  }
+  out << ", \"threads\": " << options.threads
+      << ", \"connections_per_thread\": " << options.connections << "},\n"
+      << "  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& result = results[i];
+    const Histogram& latency = result.latency;
+    out << (i ? ",\n" : "\n") << "    {\"command\": " << quoted(result.command)
+        << ", \"value_size\": " << result.size
+        << ", \"depth\": " << result.depth
+        << ", \"requests\": " << latency.count()
+        << ", \"seconds\": " << result.seconds << ", \"ops_per_sec\": "
+        << (result.seconds > 0 ? latency.count() / result.seconds : 0)
+        << ", \"latency_us\": {\"mean\": " << latency.mean() / 1000
+        << ", \"p50\": " << latency.percentile(50) / 1000.0
+        << ", \"p90\": " << latency.percentile(90) / 1000.0
+        << ", \"p99\": " << latency.percentile(99) / 1000.0
+        << ", \"p99.9\": " << latency.percentile(99.9) / 1000.0
+        << ", \"max\": " << latency.max() / 1000.0 << "}}";
+  }
+  out << "\n  ]\n}" << std::endl;
+  std::cout << out.str();
+}
 
-    std::cout << count << " reads in " << (end - begin).total_microseconds()
-              << " usecs ~= "
-              << (double)count * 1000000.0 /
-                     (double)(end - begin).total_microseconds()
-              << " requests per second" << std::endl;
+template <typename T> std::vector<T> parseList(const std::string& text) {
+  std::vector<T> values;
+  std::istringstream in(text);
+  std::string item;
+  while (std::getline(in, item, ',')) {
+    std::istringstream field(item);
+    T value;
+    if (!(field >> value)) {
+      throw std::invalid_argument("bad list: " + text);
+    }
+    values.push_back(value);
   }
+  return values;
+}
+
+void usage() {
+  std::cerr
+      << "usage: ./perftest [options]\n"
+         "  --host <host>            default localhost\n"
+         "  --port <port>            default 6379\n"
+         "  --socket <path>          connect to a unix domain socket\n"
+         "  --password <password>\n"
+         "  --commands <list>        any of set,get,incr,hset,hget,lpush,\n"
+         "                           rpop,sadd, default set,get\n"
+         "  --requests <n>           per test, default 100000\n"
+         "  --sizes <list>           value sizes in bytes, default 16\n"
+         "  --keys <n>               key space, default 10000\n"
+         "  --distribution <name>    uniform (default) or zipf\n"
+         "  --zipf-exponent <s>      default 0.99\n"
+         "  --depths <list>          commands in flight per connection,\n"
+         "                           default 256\n"
+         "  --connections <n>        per thread, default 1\n"
+         "  --threads <n>            default 1\n"
+         "  or: ./perftest <port or socket> [requests]\n"
+         "Every combination of command, size and depth is run, and the\n"
+         "results are printed as JSON.\n"
+         "The keys perf:* are overwritten.\n";
+}
+
+Options parseOptions(int argc, char* argv[]) {
+  Options options;
+  int i = 1;
+  // the old form: ./perftest <port or socket> [count]
+  if (argc > 1 && std::string(argv[1]).compare(0, 2, "--") != 0) {
+#ifdef UNIX_DOMAIN_SOCKET
+    options.socket = argv[1];
+#else
+    options.port = argv[1];
+#endif
+    if (argc > 2) {
+      options.requests = size_t(atol(argv[2]));
+    }
+    return options;
+  }
+  for (; i + 1 < argc; i += 2) {
+    const std::string name = argv[i];
+    const std::string value = argv[i + 1];
+    if (name == "--host") {
+      options.host = value;
+    } else if (name == "--port") {
+      options.port = value;
+    } else if (name == "--socket") {
+      options.socket = value;
+    } else if (name == "--password") {
+      options.password = value;
+    } else if (name == "--commands") {
+      options.commands = parseList<std::string>(value);
+    } else if (name == "--requests") {
+      options.requests = parseList<size_t>(value).at(0);
+    } else if (name == "--sizes") {
+      options.sizes = parseList<size_t>(value);
+    } else if (name == "--keys") {
+      options.keys = parseList<size_t>(value).at(0);
+    } else if (name == "--distribution") {
+      if (value != "uniform" && value != "zipf") {
+        throw std::invalid_argument("unknown distribution: " + value);
+      }
+      options.zipf = value == "zipf";
+    } else if (name == "--zipf-exponent") {
+      options.zipfExponent = parseList<double>(value).at(0);
+    } else if (name == "--depths") {
+      options.depths = parseList<size_t>(value);
+    } else if (name == "--connections") {
+      options.connections = parseList<size_t>(value).at(0);
+    } else if (name == "--threads") {
+      options.threads = parseList<size_t>(value).at(0);
+    } else {
+      throw std::invalid_argument("unknown option: " + name);
+    }
+  }
+  if (i != argc) {
+    throw std::invalid_argument(std::string("missing value for ") + argv[i]);
+  }
+  if (options.keys == 0 || options.threads == 0 || options.connections == 0 ||
+      std::count(options.depths.begin(), options.depths.end(), 0u) > 0) {
+    throw std::invalid_argument("keys, threads, connections and depths must "
+                                "be positive");
+  }
+  return options;
 }
 
 int main(int argc, char* argv[]) {
@@ -80,15 +482,39 @@ int main(int argc, char* argv[]) {
   WSAStartup(version, &wsaData);
 #endif
 
-  if (argc <= 1) {
-#ifdef UNIX_DOMAIN_SOCKET
-    std::cout << "usage: ./perf <socket> [count]" << std::endl;
-#else
-    std::cout << "usage: ./perf <port> [count]" << std::endl;
-#endif
+  if (argc <= 1 || std::string(argv[1]) == "--help") {
+    usage();
+    return 1;
+  }
+  Options options;
+  try {
+    options = parseOptions(argc, argv);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    usage();
+    return 1;
+  }
+
+  try {
+    std::vector<std::string> keys(options.keys);
+    for (size_t i = 0; i < keys.size(); ++i) {
+      keys[i] = keyName(i);
+    }
+    std::vector<Result> results;
+    for (size_t s = 0; s < options.sizes.size(); ++s) {
+      populate(options, keys, options.sizes[s]);
+      for (size_t c = 0; c < options.commands.size(); ++c) {
+        for (size_t d = 0; d < options.depths.size(); ++d) {
+          results.push_back(runTest(options, options.commands[c],
+                                    options.sizes[s], options.depths[d],
+                                    keys));
+        }
+      }
+    }
+    printJson(options, results);
+  } catch (const std::exception& e) {
+    std::cerr << "benchmark failed: " << e.what() << std::endl;
     return 1;
   }
-  int count = argc > 2 ? atoi(argv[2]) : 100000;
-  runFunc(argv[1], count);
   return 0;
 }
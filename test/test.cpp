@@ -1,8 +1,23 @@
 #define BOOST_TEST_ALTERNATIVE_INIT_API
+#include "fakeserver.h"
 #include <boost/assign/list_of.hpp>
 #include <boost/test/included/unit_test.hpp>
+#include <cachedloader.h>
+#include <coalescing.h>
+#include <fstream>
+#include <mutex>
+#include <nearcache.h>
+#include <pipeline.h>
+#include <queueconsumer.h>
 #include <redispp.h>
+#include <scan.h>
+#include <script.h>
+#include <set>
+#include <streams.h>
+#include <subscriber.h>
+#include <thread>
 #include <time.h>
+#include <writecombiner.h>
 #ifdef _WIN32
 #include <windows.h>
 void sleep(size_t seconds) { Sleep(seconds * 1000); }
@@ -14,17 +29,32 @@ const char* TEST_PORT = "6379";
 const char* TEST_HOST = "127.0.0.1";
 const char* TEST_UNIX_DOMAIN_SOCKET = "/tmp/redis.sock";
 
+#ifdef FAKE_SERVER
+// Built with -DFAKE_SERVER, the tests connect over TCP to a FakeServer in the
+// process instead of redis-server. It lacks scripting, pub/sub, streams,
+// RESP3 and server commands such as DEBUG and LASTSAVE, so run the tests of
+// the commands it has, e.g.
+// ./unittests --run_test=s/set_get_exists_del
+static std::unique_ptr<FakeServer> fakeServer;
+#endif
+
 bool init_unit_test() {
 #ifdef _WIN32
   WSADATA wsaData;
   WORD version;
   version = MAKEWORD(2, 0);
   WSAStartup(version, &wsaData);
+#endif
+#ifdef FAKE_SERVER
+  FakeServerOptions options;
+  options.password = "password";
+  fakeServer.reset(new FakeServer(0, options));
+  TEST_PORT = fakeServer->port().c_str();
 #endif
   return true;
 }
 
-#ifdef UNIX_DOMAIN_SOCKET
+#if defined(UNIX_DOMAIN_SOCKET) && !defined(FAKE_SERVER)
 struct F {
   F() : conn(TEST_UNIX_DOMAIN_SOCKET, "password") {
     BOOST_TEST_MESSAGE("Set up fixture");
@@ -42,6 +72,29 @@ struct F {
 };
 #endif
 
+// Serves canned replies, discarding what is written.
+class CannedTransport : public Transport {
+public:
+  explicit CannedTransport(const std::string& replies) : replies(replies) {}
+
+  void write(const void*, size_t) {}
+
+  size_t read(void* data, size_t len) {
+    len = std::min(len, replies.size());
+    if (len == 0) {
+      throw std::runtime_error("no more canned replies");
+    }
+    memcpy(data, replies.data(), len);
+    replies.erase(0, len);
+    return len;
+  }
+
+  bool waitReadable(int) { return !replies.empty(); }
+
+private:
+  std::string replies;
+};
+
 BOOST_FIXTURE_TEST_SUITE(s, F)
 
 BOOST_AUTO_TEST_CASE(set_get_exists_del) {
@@ -90,6 +143,86 @@ BOOST_AUTO_TEST_CASE(keys) {
   BOOST_CHECK(found);
 }
 
+BOOST_AUTO_TEST_CASE(scan) {
+  conn.select(2);
+  conn.flushDb();
+  std::set<std::string> expected;
+  KeyValueList pairs;
+  for (int i = 0; i < 100; ++i) {
+    const std::string key = "scan" + boost::lexical_cast<std::string>(i);
+    expected.insert(key);
+    pairs.push_back(KeyValuePair(key, "value"));
+  }
+  conn.mset(pairs);
+  conn.sadd("scanset", "member");
+
+  ScanOptions options;
+  options.match = "scan*";
+  options.count = 10;
+  options.type = "string";
+  std::set<std::string> seen;
+  Scanner scanner(&conn, options);
+  std::vector<std::string> page;
+  while (scanner.next(&page)) {
+    BOOST_CHECK(!page.empty());
+    seen.insert(page.begin(), page.end());
+    // the next page is already requested, other commands still work
+    BOOST_CHECK(conn.exists(page.front()).result());
+  }
+  BOOST_CHECK(scanner.done());
+  BOOST_CHECK(seen == expected);
+
+  ArgList members(expected.begin(), expected.end());
+  conn.sadd("scanset", members);
+  seen.clear();
+  BOOST_CHECK_THROW(conn.sscan("scanset", "0", options).result(),
+                    std::invalid_argument);
+  options.type.clear();
+  Scanner setScanner(&conn, ScanSet, "scanset", options);
+  std::string member;
+  while (setScanner.next(&member)) {
+    seen.insert(member);
+  }
+  BOOST_CHECK(seen == expected);
+
+  conn.hset("scanhash", "field", "value");
+  ScanReply hash = conn.hscan("scanhash", "0");
+  BOOST_CHECK_EQUAL(hash.result().cursor, "0");
+  BOOST_CHECK_EQUAL(hash.result().elements.size(), 2u);
+  conn.zadd("scanzset", 1.5, "member");
+  Scanner zsetScanner(&conn, ScanSortedSet, "scanzset");
+  BOOST_CHECK(zsetScanner.next(&page));
+  BOOST_CHECK(page[0] == "member" && page[1] == "1.5");
+  BOOST_CHECK(!zsetScanner.next(&page));
+
+  // two databases scanned at once
+  Connection other(TEST_HOST, TEST_PORT, "password");
+  other.select(3);
+  other.flushDb();
+  other.set("scanother", "value");
+  std::vector<Connection*> conns;
+  conns.push_back(&conn);
+  conns.push_back(&other);
+  std::mutex mutex;
+  std::vector<size_t> counts(2);
+  parallelScan(conns, ScanOptions(),
+               [&](size_t index, const std::vector<std::string>& page) {
+                 std::lock_guard<std::mutex> lock(mutex);
+                 counts[index] += page.size();
+               });
+  BOOST_CHECK_EQUAL(counts[0], 103u);
+  BOOST_CHECK_EQUAL(counts[1], 1u);
+  BOOST_CHECK_THROW(
+      parallelScan(conns, ScanOptions(),
+                   [](size_t, const std::vector<std::string>&) {
+                     throw std::runtime_error("handler failed");
+                   }),
+      std::runtime_error);
+  other.flushDb();
+  conn.flushDb();
+  conn.select(0);
+}
+
 BOOST_AUTO_TEST_CASE(randomkey) {
   conn.set("hello", "world");
   BOOST_CHECK((bool)conn.exists(conn.randomKey()));
@@ -174,6 +307,56 @@ BOOST_AUTO_TEST_CASE(setex) {
   BOOST_CHECK(conn.ttl("hello") <= 5);
 }
 
+BOOST_AUTO_TEST_CASE(multikey) {
+  conn.setMaxKeysPerCommand(7);
+  ArgList keys;
+  KeyValueList pairs;
+  for (int i = 0; i < 50; ++i) {
+    const std::string key = "multi" + boost::lexical_cast<std::string>(i);
+    keys.push_back(key);
+    pairs.push_back(KeyValuePair(key, "value" + key));
+  }
+  conn.del(keys).result();
+
+  conn.mset(pairs).result();
+  keys.push_back("nonexistant");
+  ChunkedStringReply reply = conn.mget(keys);
+  const std::vector<boost::optional<std::string>>& values = reply.result();
+  BOOST_CHECK_EQUAL(values.size(), 51u);
+  BOOST_CHECK(*values.front() == "valuemulti0");
+  BOOST_CHECK(*values[49] == "valuemulti49");
+  BOOST_CHECK(!values.back());
+  BOOST_CHECK(conn.mget(ArgList()).result().empty());
+
+  BOOST_CHECK(!conn.msetNX(pairs).result());
+  BOOST_CHECK_EQUAL(conn.del(keys).result(), 50);
+  BOOST_CHECK(conn.msetNX(pairs).result());
+  BOOST_CHECK_EQUAL(conn.unlink(keys).result(), 50);
+
+  conn.del("multiset");
+  BOOST_CHECK_EQUAL(conn.sadd("multiset", keys).result(), 51);
+  BOOST_CHECK_EQUAL(conn.scard("multiset").result(), 51);
+  BOOST_CHECK_EQUAL(conn.srem("multiset", keys).result(), 51);
+
+  conn.del("multihash");
+  conn.hmset("multihash", pairs);
+  BOOST_CHECK_EQUAL(conn.hdel("multihash", keys).result(), 50);
+  BOOST_CHECK(!conn.exists("multihash"));
+
+  // chunks are also cut when they would not fit the buffer
+  conn.setMaxKeysPerCommand(1000);
+  const std::string big(1000, 'x');
+  KeyValueList bigPairs;
+  for (int i = 0; i < 10; ++i) {
+    bigPairs.push_back(
+        KeyValuePair("multibig" + boost::lexical_cast<std::string>(i), big));
+  }
+  conn.mset(bigPairs).result();
+  BOOST_CHECK_EQUAL((std::string)conn.get("multibig9"), big);
+  BOOST_CHECK_THROW(conn.msetNX(bigPairs), std::runtime_error);
+  BOOST_CHECK_EQUAL((std::string)conn.get("multibig0"), big);
+}
+
 BOOST_AUTO_TEST_CASE(incrdecr) {
   conn.set("hello", "5");
   BOOST_CHECK(conn.incr("hello") == 6);
@@ -330,6 +513,109 @@ BOOST_AUTO_TEST_CASE(sets) {
   BOOST_CHECK(conn.scard("res") == 1);
 }
 
+BOOST_AUTO_TEST_CASE(sorted_sets) {
+  conn.del("zset");
+  conn.del("zset2");
+  conn.del("zdest");
+  BOOST_CHECK(conn.zadd("zset", 1.5, "a").result());
+  BOOST_CHECK(!conn.zadd("zset", 1.25, "a").result());
+  ScoredMemberVector entries;
+  entries.push_back(ScoredMember("b", 2));
+  entries.push_back(ScoredMember("c", 3));
+  entries.push_back(ScoredMember("d", -1e300));
+  BOOST_CHECK_EQUAL(conn.zadd("zset", entries).result(), 3);
+  BOOST_CHECK_EQUAL(conn.zcard("zset").result(), 4);
+  BOOST_CHECK_EQUAL(*conn.zscore("zset", "a").result(), 1.25);
+  BOOST_CHECK(!conn.zscore("zset", "nonexistant").result());
+  BOOST_CHECK_EQUAL((double)conn.zincrBy("zset", 0.5, "a"), 1.75);
+
+  entries.clear();
+  entries.push_back(ScoredMember("b", 1));
+  entries.push_back(ScoredMember("c", 4));
+  entries.push_back(ScoredMember("e", 5));
+  BOOST_CHECK_EQUAL(conn.zadd("zset", entries, ZAddGT | ZAddCH).result(), 2);
+  BOOST_CHECK_EQUAL(*conn.zscore("zset", "b").result(), 2);
+  BOOST_CHECK_EQUAL(*conn.zscore("zset", "e").result(), 5);
+  BOOST_CHECK_EQUAL(conn.zadd("zset", entries, ZAddXX | ZAddCH).result(), 1);
+  BOOST_CHECK_EQUAL(*conn.zscore("zset", "b").result(), 1);
+  BOOST_CHECK(conn.zrem("zset", "e").result());
+  BOOST_CHECK_EQUAL(*conn.zrank("zset", "d").result(), 0);
+  BOOST_CHECK_EQUAL(*conn.zrevRank("zset", "d").result(), 3);
+  BOOST_CHECK(!conn.zrank("zset", "nonexistant").result());
+
+  std::string member;
+  MultiBulkEnumerator range = conn.zrange("zset", 0, -1);
+  BOOST_CHECK(range.next(&member) && member == "d");
+  ScoredReply scored = conn.zrangeWithScores("zset", 0, -1);
+  BOOST_CHECK_EQUAL(scored.result().size(), 4u);
+  BOOST_CHECK_EQUAL(scored.result()[0].second, -1e300);
+  BOOST_CHECK_EQUAL(scored.result()[1].first, "b");
+  BOOST_CHECK_EQUAL(scored.result()[1].second, 1);
+  ScoredReply reversed = conn.zrevRangeWithScores("zset", 0, 0);
+  BOOST_CHECK_EQUAL(reversed.result()[0].first, "c");
+  BOOST_CHECK_EQUAL(reversed.result()[0].second, 4);
+  ScoredReply byScore = conn.zrangeByScoreWithScores("zset", 1, 2);
+  BOOST_CHECK_EQUAL(byScore.result().size(), 2u);
+
+  ZRangeOptions options;
+  options.byScore = true;
+  options.rev = true;
+  options.offset = 1;
+  options.count = 2;
+  ScoredReply limited =
+      conn.zrangeWithScores("zset", "+inf", "(-inf", options);
+  BOOST_CHECK_EQUAL(limited.result().size(), 2u);
+  BOOST_CHECK_EQUAL(limited.result()[0].first, "a");
+  BOOST_CHECK_EQUAL(limited.result()[1].first, "b");
+  BOOST_CHECK_EQUAL(conn.zcount("zset", "(1", "4").result(), 2);
+
+  // scores arrive as RESP3 doubles after HELLO 3
+  conn.hello(3);
+  ScoredReply resp3 = conn.zrangeWithScores("zset", 0, -1);
+  BOOST_CHECK_EQUAL(resp3.result().size(), 4u);
+  BOOST_CHECK_EQUAL(resp3.result()[3].second, 4);
+  BOOST_CHECK_EQUAL(*conn.zscore("zset", "a").result(), 1.75);
+  BOOST_CHECK_EQUAL(*conn.zrank("zset", "a").result(), 2);
+  BOOST_CHECK(!conn.zrank("zset", "nonexistant").result());
+  conn.hello(2);
+
+  conn.zadd("zset2", 10, "a");
+  conn.zadd("zset2", 20, "z");
+  ArgList keys;
+  keys.push_back("zset");
+  keys.push_back("zset2");
+  std::vector<double> weights;
+  weights.push_back(2);
+  weights.push_back(1);
+  BOOST_CHECK_EQUAL(conn.zunionStore("zdest", keys, weights).result(), 5);
+  BOOST_CHECK_EQUAL(*conn.zscore("zdest", "a").result(), 13.5);
+  BOOST_CHECK_EQUAL(
+      conn.zinterStore("zdest", keys, std::vector<double>(), AggregateMax)
+          .result(),
+      1);
+  BOOST_CHECK_EQUAL(*conn.zscore("zdest", "a").result(), 10);
+  BOOST_CHECK_THROW(conn.zunionStore("zdest", keys, std::vector<double>(1, 1)),
+                    std::invalid_argument);
+
+  ScoredReply popped = conn.zpopMin("zset", 2);
+  BOOST_CHECK_EQUAL(popped.result().size(), 2u);
+  BOOST_CHECK_EQUAL(popped.result()[1].first, "b");
+  ScoredReply top = conn.zpopMax("zset");
+  BOOST_CHECK_EQUAL(top.result()[0].first, "c");
+  BOOST_CHECK(conn.zrem("zset", "a").result());
+  BOOST_CHECK(conn.zpopMin("zset").result().empty());
+
+  ArgList members;
+  members.push_back("a");
+  members.push_back("z");
+  members.push_back("nonexistant");
+  BOOST_CHECK_EQUAL(conn.zrem("zset2", members).result(), 2);
+  BOOST_CHECK_EQUAL(conn.zremRangeByRank("zdest", 0, -1).result(), 1);
+  conn.zadd("zdest", 1, "x");
+  BOOST_CHECK_EQUAL(conn.zremRangeByScore("zdest", "-inf", "+inf").result(),
+                    1);
+}
+
 BOOST_AUTO_TEST_CASE(hashes) {
   conn.del("hello");
   BOOST_CHECK((bool)conn.hset("hello", "world", "one"));
@@ -423,6 +709,287 @@ BOOST_AUTO_TEST_CASE(scripts) {
   conn.scriptKill();
 }
 
+BOOST_AUTO_TEST_CASE(script_objects) {
+  BOOST_CHECK_EQUAL(sha1Hex(""), "da39a3ee5e6b4b0d3255bfef95601890afd80709");
+  BOOST_CHECK_EQUAL(sha1Hex(std::string(1000, 'a')),
+                    "291e9a6c66994949b57ba5e650361e98fc36b1ba");
+
+  Script script("return {KEYS[1], ARGV[1]}");
+  BOOST_CHECK_EQUAL((std::string)conn.scriptLoad(script.source()),
+                    script.sha());
+
+  ArgList keys;
+  keys.push_back("k");
+  ArgList args;
+  args.push_back("v");
+  ScriptReply first = script.run(&conn, keys, args);
+  ScriptReply second = script.run(&conn, keys, args);
+  BOOST_CHECK_EQUAL(first.result().elements.at(0).str, "k");
+  BOOST_CHECK_EQUAL(second.result().elements.at(1).str, "v");
+
+  // lost by the server: retried when nothing was sent after it
+  Connection other(TEST_HOST, TEST_PORT, "password");
+  other.scriptFlush();
+  BOOST_CHECK_EQUAL(script.run(&conn, keys, args).result().elements.size(),
+                    2u);
+
+  // but not when that would reorder it after later commands
+  other.scriptFlush();
+  ScriptReply reordered = script.run(&conn, keys, args);
+  StringReply later = conn.get("k");
+  BOOST_CHECK(!reordered.tryResult());
+  BOOST_CHECK_EQUAL(reordered.tryResult().error().find("NOSCRIPT"), 0u);
+  BOOST_CHECK_EQUAL(script.run(&conn, keys, args).result().elements.size(),
+                    2u);
+
+  ScriptRegistry registry;
+  const Script& registered = registry.add("return ARGV[1]");
+  other.scriptFlush();
+  registry.preload(&conn);
+  BOOST_CHECK_EQUAL(registered.run(&conn, ArgList(), args).result().str, "v");
+}
+
+
+BOOST_AUTO_TEST_CASE(subscriber) {
+  Subscriber sub(TEST_HOST, TEST_PORT, "password", 64);
+  conn.clientTracking(true, sub.clientId());
+  std::vector<std::string> received;
+  Subscriber::Handler record = [&](Subscriber::View channel,
+                                   Subscriber::View payload) {
+    received.push_back(channel.to_string() + "=" + payload.to_string());
+  };
+  sub.subscribe("subchan", record);
+  sub.psubscribe("subpat.*", record);
+  sub.subscribe("__redis__:invalidate", record);
+  for (int i = 0; i < 10 && sub.subscriptions() < 3; ++i) {
+    sub.poll(100);
+  }
+  BOOST_CHECK_EQUAL(sub.subscriptions(), 3u);
+
+  BOOST_CHECK_EQUAL(conn.publish("subchan", "hello").result(), 1);
+  BOOST_CHECK_EQUAL(conn.publish("subpat.x", "world").result(), 1);
+  conn.set("subkey", "1");
+  conn.get("subkey").result();
+  conn.set("subkey", "2");
+  size_t count = 0;
+  for (int i = 0; i < 10 && count < 3; ++i) {
+    count += sub.poll(100);
+  }
+  BOOST_REQUIRE_EQUAL(received.size(), 3u);
+  BOOST_CHECK_EQUAL(received[0], "subchan=hello");
+  BOOST_CHECK_EQUAL(received[1], "subpat.x=world");
+  BOOST_CHECK_EQUAL(received[2], "__redis__:invalidate=subkey");
+  conn.clientTracking(false);
+
+  // many messages, some larger than the initial buffer, per read
+  const std::string large(1000, 'x');
+  std::list<IntReply> published;
+  for (int i = 0; i < 1000; ++i) {
+    published.push_back(conn.publish("subchan", i % 100 ? "m" : large));
+  }
+  published.clear();
+  received.clear();
+  for (int i = 0; i < 100 && received.size() < 1000; ++i) {
+    sub.poll(100);
+  }
+  BOOST_CHECK_EQUAL(received.size(), 1000u);
+  BOOST_CHECK_EQUAL(received[100], "subchan=" + large);
+
+  // handlers may unsubscribe, later messages are dropped
+  sub.subscribe("subchan", [&](Subscriber::View, Subscriber::View payload) {
+    received.push_back(payload.to_string());
+    sub.unsubscribe("subchan");
+    sub.stop();
+  });
+  received.clear();
+  conn.publish("subchan", "first").result();
+  conn.publish("subchan", "second").result();
+  sub.run();
+  BOOST_CHECK_EQUAL(received.size(), 1u);
+  for (int i = 0; i < 10 && sub.subscriptions() > 2; ++i) {
+    sub.poll(100);
+  }
+  BOOST_CHECK_EQUAL(sub.subscriptions(), 2u);
+  BOOST_CHECK_EQUAL(conn.publish("subchan", "unheard").result(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(queue_consumer) {
+  for (int i = 0; i < 250; ++i) {
+    conn.lpush("jobs", boost::lexical_cast<std::string>(i));
+  }
+  QueueOptions options;
+  options.blockSeconds = 1;
+  QueueConsumer consumer(&conn, "jobs", options);
+  QueueConsumer::Batch items;
+  consumer.fetch(items);
+  BOOST_REQUIRE_EQUAL(items.size(), 100u);
+  BOOST_CHECK_EQUAL(items.front(), "0");
+  BOOST_CHECK_EQUAL(items.back(), "99");
+  BOOST_CHECK_EQUAL(conn.llen(consumer.processingList(0)).result(), 100);
+  consumer.ack(items);
+  BOOST_CHECK_EQUAL(conn.llen(consumer.processingList(0)).result(), 0);
+
+  // unacknowledged items go back to be taken first
+  consumer.fetch(items);
+  BOOST_CHECK_EQUAL(consumer.recover(), 100u);
+  BOOST_CHECK_EQUAL(conn.llen("jobs").result(), 150);
+  consumer.fetch(items);
+  BOOST_CHECK_EQUAL(items.front(), "100");
+  BOOST_CHECK_EQUAL(consumer.recover(), 100u);
+
+  // a thread per connection
+  Connection second(TEST_HOST, TEST_PORT, "password");
+  std::vector<Connection*> pool;
+  pool.push_back(&conn);
+  pool.push_back(&second);
+  QueueConsumer workers(pool, "jobs", options);
+  std::mutex mutex;
+  std::set<std::string> handled;
+  workers.run([&](const QueueConsumer::Batch& batch) {
+    std::lock_guard<std::mutex> lock(mutex);
+    handled.insert(batch.begin(), batch.end());
+    if (handled.size() == 150) {
+      workers.stop();
+    }
+  });
+  BOOST_CHECK_EQUAL(handled.size(), 150u);
+  BOOST_CHECK_EQUAL(conn.llen("jobs").result(), 0);
+  BOOST_CHECK_EQUAL(conn.llen(workers.processingList(0)).result(), 0);
+  BOOST_CHECK_EQUAL(conn.llen(workers.processingList(1)).result(), 0);
+
+  options.mode = AtMostOnce;
+  options.blockSeconds = 0;
+  QueueConsumer popper(&conn, "jobs", options);
+  for (int i = 0; i < 10; ++i) {
+    conn.lpush("jobs", boost::lexical_cast<std::string>(i));
+  }
+  popper.fetch(items);
+  BOOST_CHECK_EQUAL(items.size(), 10u);
+  BOOST_CHECK_EQUAL(items.front(), "0");
+  popper.fetch(items);
+  BOOST_CHECK(items.empty());
+}
+
+BOOST_AUTO_TEST_CASE(streams) {
+  conn.del("events");
+  Stream events(&conn, "events");
+  BOOST_CHECK(events.createGroup("group", "0"));
+  BOOST_CHECK(!events.createGroup("group", "0"));
+
+  std::vector<ArgList> batch;
+  for (int i = 0; i < 250; ++i) {
+    ArgList fields;
+    fields.push_back("n");
+    fields.push_back(boost::lexical_cast<std::string>(i));
+    batch.push_back(fields);
+  }
+  const ArgList ids = events.add(batch);
+  BOOST_CHECK_EQUAL(ids.size(), 250u);
+  BOOST_CHECK_EQUAL(events.length(), 250);
+
+  // a batch that fails part way sends nothing
+  std::vector<ArgList> failing(2, batch[0]);
+  failing[1].push_back("big");
+  failing[1].push_back(std::string(64 * 1024, 'x'));
+  BOOST_CHECK_THROW(events.add(failing), std::runtime_error);
+  BOOST_CHECK_EQUAL(events.length(), 250);
+
+  StreamEntries entries;
+  BOOST_REQUIRE_EQUAL(events.readGroup("group", "first", entries, 100), 100u);
+  BOOST_CHECK_EQUAL(entries[0].id, ids.front());
+  BOOST_CHECK_EQUAL(entries[0].count, 1u);
+  BOOST_CHECK_EQUAL(entries.name(entries[99], 0), "n");
+  BOOST_CHECK_EQUAL(entries.value(entries[99], 0), "99");
+  BOOST_CHECK_EQUAL(events.ack("group", entries.ids()), 100);
+
+  // left pending by one consumer, claimed by another
+  BOOST_CHECK_EQUAL(events.readGroup("group", "first", entries, 10), 10u);
+  BOOST_CHECK_EQUAL(
+      events.autoClaim("group", "second", 0, "0-0", entries), "0-0");
+  BOOST_REQUIRE_EQUAL(entries.size(), 10u);
+  BOOST_CHECK_EQUAL(entries.value(entries[0], 0), "100");
+  BOOST_CHECK_EQUAL(events.ack("group", entries.ids()), 10);
+
+  // pending entries of the consumer come first
+  BOOST_CHECK_EQUAL(events.readGroup("group", "third", entries, 5), 5u);
+  StreamConsumerOptions options;
+  options.count = 50;
+  options.blockMs = 100;
+  StreamConsumer consumer(&conn, "events", "group", "third", options);
+  std::vector<size_t> sizes;
+  std::set<std::string> handled;
+  consumer.run([&](const StreamEntries& entries) {
+    sizes.push_back(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+      handled.insert(entries.value(entries[i], 0));
+    }
+    if (handled.size() == 140) {
+      consumer.stop();
+    }
+  });
+  BOOST_CHECK_EQUAL(handled.size(), 140u);
+  BOOST_CHECK_EQUAL(sizes.front(), 5u);
+  BOOST_CHECK_EQUAL(*handled.begin(), "110");
+  ArgList pending;
+  pending.push_back("XPENDING");
+  pending.push_back("events");
+  pending.push_back("group");
+  BOOST_CHECK_EQUAL(conn.command(pending).result().elements.at(0).integer, 0);
+}
+
+BOOST_AUTO_TEST_CASE(write_combiner) {
+  ArgList keys;
+  keys.push_back("wccounter");
+  keys.push_back("wchash");
+  keys.push_back("wcvalue");
+  keys.push_back("wcfields");
+  conn.del(keys);
+  {
+    WriteCombinerOptions options;
+    options.flushIntervalMs = 0;
+    WriteCombiner combiner(&conn, options);
+    for (int i = 0; i < 1000; ++i) {
+      combiner.incrBy("wccounter", 2);
+      combiner.hincrBy("wchash", "a", 1);
+      combiner.set("wcvalue", boost::lexical_cast<std::string>(i));
+      combiner.hset("wcfields", "f", boost::lexical_cast<std::string>(i));
+    }
+    BOOST_CHECK(!conn.exists("wccounter"));
+    combiner.flush();
+    BOOST_CHECK_EQUAL((std::string)conn.get("wccounter"), "2000");
+    BOOST_CHECK_EQUAL((std::string)conn.hget("wchash", "a"), "1000");
+    BOOST_CHECK_EQUAL((std::string)conn.get("wcvalue"), "999");
+    BOOST_CHECK_EQUAL((std::string)conn.hget("wcfields", "f"), "999");
+    const WriteCombinerStats stats = combiner.stats();
+    BOOST_CHECK_EQUAL(stats.updates, 4000u);
+    BOOST_CHECK_EQUAL(stats.commands, 4u);
+    BOOST_CHECK_EQUAL(stats.flushes, 1u);
+
+    // a flush that fails part way sends nothing and leaves the connection
+    // usable
+    combiner.incrBy("wccounter", 5);
+    combiner.set("wcvalue", std::string(64 * 1024, 'x'));
+    BOOST_CHECK_THROW(combiner.flush(), std::runtime_error);
+    BOOST_CHECK_EQUAL((std::string)conn.get("wccounter"), "2000");
+
+    // flushed on destruction
+    combiner.incrBy("wccounter", 1);
+  }
+  BOOST_CHECK_EQUAL((std::string)conn.get("wccounter"), "2001");
+
+  Connection other(TEST_HOST, TEST_PORT, "password");
+  WriteCombinerOptions options;
+  options.flushIntervalMs = 10;
+  options.maxPending = 3;
+  WriteCombiner combiner(&other, options);
+  combiner.incrBy("wccounter", 4);
+  for (int i = 0; i < 100 && (std::string)conn.get("wccounter") != "2005";
+       ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  BOOST_CHECK_EQUAL((std::string)conn.get("wccounter"), "2005");
+}
+
 BOOST_AUTO_TEST_CASE(misc) {
   time_t now = time(NULL);
   ::sleep(2);
@@ -433,6 +1000,445 @@ BOOST_AUTO_TEST_CASE(misc) {
   BOOST_CHECK(((std::string)conn.info()).length() > 0);
 }
 
+BOOST_AUTO_TEST_CASE(resp3) {
+  conn.del("hello");
+  conn.hset("hello", "world", "one");
+  conn.hset("hello", "mars", "two");
+  BOOST_CHECK(conn.hgetAllMap("hello").result().size() == 2);
+
+  const Value& hello = conn.hello(3).result();
+  BOOST_CHECK(hello.kind == Value::Map);
+  bool sawProto = false;
+  for (size_t i = 0; i + 1 < hello.elements.size(); i += 2) {
+    if (hello.elements[i].str == "proto") {
+      sawProto = true;
+      BOOST_CHECK(hello.elements[i + 1].integer == 3);
+    }
+  }
+  BOOST_CHECK(sawProto);
+
+  KeyValueVector fields = conn.hgetAllMap("hello");
+  BOOST_CHECK(fields.size() == 2);
+  BOOST_CHECK((fields[0].first == "world" && fields[0].second == "one") ||
+              (fields[0].first == "mars" && fields[0].second == "two"));
+  MultiBulkEnumerator result = conn.hgetAll("hello");
+  std::string str;
+  size_t count = 0;
+  while (result.next(&str))
+    ++count;
+  BOOST_CHECK(count == 4);
+  BOOST_CHECK(!conn.get("nonexistant").result().is_initialized());
+  BOOST_CHECK((bool)conn.exists("hello"));
+  conn.set("float", "1.5");
+  BOOST_CHECK((double)conn.incrByFloat("float", 1.25) == 2.75);
+  BOOST_CHECK((double)conn.hincrByFloat("hello", "pi", 3.5) == 3.5);
+
+  Value echo = conn.command(boost::assign::list_of("ECHO")("hi"));
+  BOOST_CHECK(echo.kind == Value::Bulk && echo.str == "hi");
+  BOOST_CHECK_THROW(
+      conn.command(boost::assign::list_of("NOTACOMMAND")).result(),
+      std::runtime_error);
+
+  std::vector<Value> pushes;
+  conn.setPushHandler([&pushes](const Value& push) { pushes.push_back(push); });
+  conn.command(boost::assign::list_of("CLIENT")("TRACKING")("on"));
+  conn.set("tracked", "a");
+  BOOST_CHECK((std::string)conn.get("tracked") == "a");
+  {
+    Connection other(TEST_HOST, TEST_PORT, "password");
+    other.set("tracked", "b");
+  }
+  BOOST_CHECK((std::string)conn.get("tracked") == "b");
+  BOOST_CHECK(pushes.size() == 1);
+  BOOST_CHECK(pushes.size() == 1 && pushes[0].kind == Value::Push &&
+              pushes[0].elements[0].str == "invalidate");
+
+  // an invalidation waiting ahead of a command's reply goes to the handler
+  {
+    Connection other(TEST_HOST, TEST_PORT, "password");
+    other.set("tracked", "c");
+  }
+  Value pong = conn.command(boost::assign::list_of("PING"));
+  BOOST_CHECK(pong.kind == Value::Status && pong.str == "PONG");
+  BOOST_CHECK_EQUAL(pushes.size(), 2u);
+  Value echoed = conn.command(boost::assign::list_of("ECHO")("next"));
+  BOOST_CHECK(echoed.kind == Value::Bulk && echoed.str == "next");
+
+  // an attribute inside an attribute is read aside, then dropped
+  Connection canned{std::unique_ptr<Transport>(
+      new CannedTransport("|1\r\n+key\r\n|1\r\n+inner\r\n+x\r\n"
+                          ":1\r\n$5\r\nreply\r\n"))};
+  BOOST_CHECK_EQUAL((std::string)canned.get("key"), "reply");
+}
+
+BOOST_AUTO_TEST_CASE(nearcache) {
+  Connection other(TEST_HOST, TEST_PORT, "password");
+  for (int mode = 0; mode < 2; ++mode) {
+    conn.set("cached", "a");
+    conn.del("cachedhash");
+    conn.hset("cachedhash", "field", "x");
+    conn.del("cachedset");
+    conn.sadd("cachedset", "m");
+    conn.del("cachedmissing");
+    conn.setEx("cachedexpiring", 100, "e");
+
+    Connection invalidations(TEST_HOST, TEST_PORT, "password");
+    std::unique_ptr<NearCache> cache(
+        mode == 0 ? new NearCache(&conn)
+                  : new NearCache(&conn, &invalidations));
+    BOOST_CHECK(*cache->get("cached") == "a");
+    BOOST_CHECK(*cache->get("cached") == "a");
+    BOOST_CHECK(!cache->get("cachedmissing"));
+    BOOST_CHECK(!cache->get("cachedmissing"));
+    BOOST_CHECK(*cache->get("cachedexpiring") == "e");
+    BOOST_CHECK(*cache->hget("cachedhash", "field") == "x");
+    BOOST_CHECK(cache->hgetAll("cachedhash").size() == 1);
+    BOOST_CHECK(cache->smembers("cachedset").size() == 1);
+    BOOST_CHECK(cache->smembers("cachedset").size() == 1);
+    NearCacheStats stats = cache->stats();
+    BOOST_CHECK_EQUAL(stats.hits, 3u);
+    BOOST_CHECK_EQUAL(stats.misses, 6u);
+    BOOST_CHECK_EQUAL(stats.entries, 5u);
+
+    other.set("cached", "b");
+    other.sadd("cachedset", "n");
+    cache->poll(1000);
+    BOOST_CHECK(*cache->get("cached") == "b");
+    BOOST_CHECK(cache->smembers("cachedset").size() == 2);
+    other.del("cachedset");
+    BOOST_CHECK(cache->stats().invalidations >= 2);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(nearcache_snapshot) {
+  const std::string path = "nearcache_snapshot.bin";
+  conn.set("snap1", "one");
+  conn.set("snap2", "two");
+  conn.setEx("snap3", 100, "three");
+  conn.set("snap4", "four");
+  conn.del("snaphash");
+  conn.hset("snaphash", "field", "x");
+  conn.del("snapfields");
+  conn.hset("snapfields", "a", "1");
+  conn.hset("snapfields", "b", "2");
+  conn.del("snapset");
+  conn.sadd("snapset", "a");
+  conn.sadd("snapset", "b");
+  conn.del("snapset2");
+  conn.sadd("snapset2", "x");
+  {
+    NearCache cache(&conn);
+    BOOST_CHECK(*cache.get("snap1") == "one");
+    BOOST_CHECK(*cache.get("snap2") == "two");
+    BOOST_CHECK(*cache.get("snap3") == "three");
+    BOOST_CHECK(*cache.get("snap4") == "four");
+    BOOST_CHECK(cache.hgetAll("snaphash").size() == 1);
+    BOOST_CHECK(*cache.hget("snapfields", "a") == "1");
+    BOOST_CHECK(*cache.hget("snapfields", "b") == "2");
+    BOOST_CHECK(cache.smembers("snapset").size() == 2);
+    BOOST_CHECK(cache.smembers("snapset2").size() == 1);
+    cache.save(path);
+  }
+  conn.set("snap2", "changed");
+  // same-sized overwrites are caught too
+  conn.set("snap4", "FOUR");
+  conn.hset("snapfields", "b", "3");
+  conn.srem("snapset2", "x");
+  conn.sadd("snapset2", "y");
+
+  NearCache cache(&conn);
+  BOOST_CHECK_EQUAL(cache.load(path), 8u);
+  BOOST_CHECK(*cache.get("snap1") == "one");
+  BOOST_CHECK(*cache.get("snap2") == "changed");
+  BOOST_CHECK(*cache.get("snap3") == "three");
+  BOOST_CHECK(*cache.get("snap4") == "FOUR");
+  BOOST_CHECK(cache.hgetAll("snaphash").size() == 1);
+  BOOST_CHECK(*cache.hget("snapfields", "a") == "1");
+  BOOST_CHECK(*cache.hget("snapfields", "b") == "3");
+  BOOST_CHECK(cache.smembers("snapset").size() == 2);
+  BOOST_CHECK(cache.smembers("snapset2")[0] == "y");
+  NearCacheStats stats = cache.stats();
+  BOOST_CHECK_EQUAL(stats.restored, 8u);
+  BOOST_CHECK_EQUAL(stats.stale, 4u);
+  BOOST_CHECK_EQUAL(stats.hits, 4u);
+
+  // a damaged snapshot loads nothing
+  std::string data;
+  {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    data.assign(std::istreambuf_iterator<char>(in),
+                std::istreambuf_iterator<char>());
+  }
+  const std::string damaged = "nearcache_damaged.bin";
+  std::ofstream(damaged.c_str(), std::ios::binary)
+      .write(data.data(), data.size() - 3);
+  NearCache truncated(&conn);
+  BOOST_CHECK_THROW(truncated.load(damaged), std::runtime_error);
+  BOOST_CHECK_EQUAL(truncated.stats().entries, 0u);
+  // a hash claiming 4G fields is refused before allocating them
+  // (one entry "k" with a hash, no expiry)
+  const char hugeHash[] = "\x01\0\0\0\0\0\0\0"
+                          "\x01\0\0\0k\x04\0\0\0\0\0\0\0\0"
+                          "\xff\xff\xff\xff";
+  std::ofstream(damaged.c_str(), std::ios::binary)
+      .write(data.data(), 12)
+      .write(hugeHash, sizeof(hugeHash) - 1);
+  NearCache corrupt(&conn);
+  BOOST_CHECK_THROW(corrupt.load(damaged), std::runtime_error);
+  BOOST_CHECK_EQUAL(corrupt.stats().entries, 0u);
+  ::remove(damaged.c_str());
+  ::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(nearcache_snapshot_flow_control) {
+  // revalidating with a shallow pipeline reads invalidations while the probes
+  // are sent, and they must not wait on the shard being checked
+  const std::string path = "nearcache_flow.bin";
+  NearCache::Options options;
+  options.shards = 1;
+  std::vector<std::string> keys;
+  for (int i = 0; i < 2000; ++i) {
+    keys.push_back("flow" + boost::lexical_cast<std::string>(i));
+    conn.set(keys.back(), "v");
+  }
+  {
+    NearCache cache(&conn, options);
+    for (size_t i = 0; i < keys.size(); ++i) {
+      cache.get(keys[i]);
+    }
+    cache.save(path);
+  }
+  FlowControl flowControl;
+  flowControl.maxInFlight = 2;
+  conn.setFlowControl(flowControl);
+  NearCache cache(&conn, options);
+  BOOST_CHECK_EQUAL(cache.load(path), keys.size());
+
+  std::atomic<bool> done(false);
+  std::thread writer([&]() {
+    Connection other(TEST_HOST, TEST_PORT, "password");
+    while (!done) {
+      for (size_t i = 0; i < keys.size() && !done; i += 7) {
+        other.set(keys[i], "v");
+      }
+    }
+  });
+  BOOST_CHECK_EQUAL(cache.revalidate(keys.size()), keys.size());
+  done = true;
+  writer.join();
+  BOOST_CHECK(*cache.get(keys[0]) == "v");
+  ::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(coalescing) {
+  conn.set("coalesced", "value");
+  CoalescingReader reader(&conn);
+  BOOST_CHECK(*reader.get("coalesced") == "value");
+  BOOST_CHECK(!reader.get("nonexistant"));
+
+  // a slow command keeps the first request in flight while the others arrive
+  ArgList slow;
+  slow.push_back("DEBUG");
+  slow.push_back("SLEEP");
+  slow.push_back("0.2");
+  std::vector<std::thread> threads;
+  std::vector<std::string> results(8);
+  for (size_t i = 0; i < results.size(); ++i) {
+    threads.push_back(
+        std::thread([&, i]() { results[i] = reader.command(slow).str; }));
+  }
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+  }
+  for (size_t i = 0; i < results.size(); ++i) {
+    BOOST_CHECK_EQUAL(results[i], "OK");
+  }
+  CoalescingStats stats = reader.stats();
+  BOOST_CHECK_EQUAL(stats.requests, 10u);
+  BOOST_CHECK(stats.coalesced > 0);
+}
+
+BOOST_AUTO_TEST_CASE(cached_loader) {
+  conn.del("loaded");
+  conn.del("loaded:lock");
+  int calls = 0;
+  CachedLoader::Loader loader = [&calls]() {
+    ++calls;
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    return "value" + boost::lexical_cast<std::string>(calls);
+  };
+
+  CachedLoader::Options options;
+  options.lockMillis = 100;
+  CachedLoader cache(&conn, options);
+  BOOST_CHECK_EQUAL(cache.get("loaded", loader), "value1");
+  BOOST_CHECK_EQUAL(cache.get("loaded", loader), "value1");
+  BOOST_CHECK(conn.ttl("loaded") > 0);
+  BOOST_CHECK_EQUAL(calls, 1);
+
+  // a huge beta always picks early recomputation, but while the lock is held
+  // by someone else the current value keeps being served
+  CachedLoader::Options eager = options;
+  eager.beta = 1e12;
+  CachedLoader early(&conn, eager);
+  conn.set("loaded:lock", "other");
+  BOOST_CHECK_EQUAL(early.get("loaded", loader), "value1");
+  BOOST_CHECK_EQUAL(early.stats().staleServed, 1u);
+  conn.del("loaded:lock");
+  BOOST_CHECK_EQUAL(early.get("loaded", loader), "value2");
+  BOOST_CHECK_EQUAL(early.stats().earlyRefreshes, 1u);
+  BOOST_CHECK(!conn.exists("loaded:lock"));
+
+  // a miss waits for the lock holder, then loads by itself
+  cache.invalidate("loaded");
+  conn.setEx("loaded:lock", 10, "other");
+  BOOST_CHECK_EQUAL(cache.get("loaded", loader), "value3");
+  CachedLoaderStats stats = cache.stats();
+  BOOST_CHECK_EQUAL(stats.lockWaits, 1u);
+  BOOST_CHECK_EQUAL(stats.misses, 2u);
+  BOOST_CHECK_EQUAL(stats.hits, 1u);
+  conn.del("loaded:lock");
+
+  BOOST_CHECK_THROW(cache.get("loaded:error",
+                              []() -> std::string {
+                                throw std::runtime_error("failed");
+                              }),
+                    std::runtime_error);
+  BOOST_CHECK(!conn.exists("loaded:error:lock"));
+}
+
+BOOST_AUTO_TEST_CASE(typed_pipeline) {
+  conn.del("pipelinelist");
+  conn.del("pipelinezset");
+  StringReply earlier = conn.get("nonexistant");
+
+  std::tuple<bool, boost::optional<std::string>, int64_t, int64_t, bool,
+             boost::optional<double>, std::vector<boost::optional<std::string>>,
+             Value, boost::optional<std::string>>
+      results = Pipeline<>(&conn)
+                    .set("pipelined", "value")
+                    .get("pipelined")
+                    .incrBy("pipelinecount", 2)
+                    .rpush("pipelinelist", "a")
+                    .zadd("pipelinezset", 1.5, "member")
+                    .zscore("pipelinezset", "member")
+                    .lrange("pipelinelist", 0, -1)
+                    .command(boost::assign::list_of("ECHO")("hello"))
+                    .get("nonexistant")
+                    .execute();
+  BOOST_CHECK(!earlier.result());
+  BOOST_CHECK(std::get<0>(results));
+  BOOST_CHECK(*std::get<1>(results) == "value");
+  BOOST_CHECK(std::get<2>(results) >= 2);
+  BOOST_CHECK_EQUAL(std::get<3>(results), 1);
+  BOOST_CHECK(std::get<4>(results));
+  BOOST_CHECK_EQUAL(*std::get<5>(results), 1.5);
+  BOOST_CHECK_EQUAL(std::get<6>(results).size(), 1u);
+  BOOST_CHECK_EQUAL(std::get<7>(results).str, "hello");
+  BOOST_CHECK(!std::get<8>(results));
+
+  // an error is thrown after the whole batch is read
+  BOOST_CHECK_THROW(Pipeline<>(&conn)
+                        .incr("pipelinelist")
+                        .set("pipelined", "after")
+                        .execute(),
+                    std::runtime_error);
+  BOOST_CHECK_EQUAL((std::string)conn.get("pipelined"), "after");
+
+  std::tuple<> empty = Pipeline<>(&conn).execute();
+  (void)empty;
+  BOOST_CHECK_EQUAL((std::string)conn.get("pipelined"), "after");
+
+  // a RESP3 map is read whole, leaving the next reply in place
+  conn.del("pipelinehash");
+  conn.hset("pipelinehash", "a", "1");
+  conn.hset("pipelinehash", "b", "2");
+  conn.hello(3);
+  std::tuple<std::vector<boost::optional<std::string>>,
+             boost::optional<std::string>>
+      resp3 = Pipeline<>(&conn)
+                  .hgetAll("pipelinehash")
+                  .get("pipelined")
+                  .execute();
+  BOOST_CHECK_EQUAL(std::get<0>(resp3).size(), 4u);
+  BOOST_CHECK(*std::get<1>(resp3) == "after");
+  conn.hello(2);
+}
+
+BOOST_AUTO_TEST_CASE(fused_pipeline) {
+  ArgList keys;
+  keys.push_back("fusedset");
+  keys.push_back("fusedhash");
+  keys.push_back("fusedlist");
+  keys.push_back("fusedother");
+  conn.del(keys);
+  conn.set("fused", "1");
+  conn.sadd("fusedset", "x");
+  conn.hset("fusedhash", "f1", "old");
+  ArgList stats;
+  stats.push_back("INFO");
+  stats.push_back("commandstats");
+  const std::string before = conn.command(stats).result().str;
+
+  std::tuple<boost::optional<std::string>, boost::optional<std::string>,
+             boost::optional<std::string>, bool, bool, bool, bool, bool, bool,
+             bool, int64_t, int64_t, bool, boost::optional<std::string>>
+      results = Pipeline<>(&conn, FuseCommands)
+                    .get("fused")
+                    .get("nonexistant")
+                    .get("fused")
+                    .sadd("fusedset", "x")
+                    .sadd("fusedset", "y")
+                    .sadd("fusedset", "y")
+                    .sadd("fusedset", "z")
+                    .hset("fusedhash", "f1", "a")
+                    .hset("fusedhash", "f2", "b")
+                    .hset("fusedhash", "f2", "c")
+                    .rpush("fusedlist", "1")
+                    .rpush("fusedlist", "2")
+                    .sadd("fusedother", "q")
+                    .get("fused")
+                    .execute();
+  BOOST_CHECK(*std::get<0>(results) == "1");
+  BOOST_CHECK(!std::get<1>(results));
+  BOOST_CHECK(*std::get<2>(results) == "1");
+  BOOST_CHECK(!std::get<3>(results));
+  BOOST_CHECK(std::get<4>(results));
+  BOOST_CHECK(!std::get<5>(results));
+  BOOST_CHECK(std::get<6>(results));
+  BOOST_CHECK(!std::get<7>(results));
+  BOOST_CHECK(std::get<8>(results));
+  BOOST_CHECK(!std::get<9>(results));
+  BOOST_CHECK_EQUAL(std::get<10>(results), 1);
+  BOOST_CHECK_EQUAL(std::get<11>(results), 2);
+  BOOST_CHECK(std::get<12>(results));
+  BOOST_CHECK(*std::get<13>(results) == "1");
+  BOOST_CHECK_EQUAL((std::string)conn.hget("fusedhash", "f2"), "c");
+  BOOST_CHECK_EQUAL(conn.scard("fusedset").result(), 3);
+
+  // one MGET for the three gets, the last one is sent on its own
+  const std::string after = conn.command(stats).result().str;
+  const auto calls = [](const std::string& info, const std::string& name) {
+    const size_t at = info.find("cmdstat_" + name + ":calls=");
+    return at == std::string::npos
+               ? 0
+               : atoi(info.c_str() + at + name.size() + 15);
+  };
+  BOOST_CHECK_EQUAL(calls(after, "mget") - calls(before, "mget"), 1);
+  BOOST_CHECK_EQUAL(calls(after, "rpush") - calls(before, "rpush"), 1);
+  BOOST_CHECK_EQUAL(calls(after, "sadd") - calls(before, "sadd"), 2);
+
+  // every command of a failed run fails, the rest still run
+  BOOST_CHECK_THROW(Pipeline<>(&conn, FuseCommands)
+                        .sadd("fused", "a")
+                        .sadd("fused", "b")
+                        .sadd("fused", "c")
+                        .set("fusedafter", "yes")
+                        .execute(),
+                    std::runtime_error);
+  BOOST_CHECK_EQUAL((std::string)conn.get("fusedafter"), "yes");
+}
+
 // TODO: test for pipelined requests
 
 BOOST_AUTO_TEST_CASE(pipelined) {
@@ -482,4 +1488,421 @@ BOOST_AUTO_TEST_CASE(pipelined) {
   }
 }
 
+BOOST_AUTO_TEST_CASE(transactions) {
+  conn.set("transx", "a");
+  {
+    Transaction transaction(&conn);
+    VoidReply set = conn.set("transx", "1");
+    conn.set("transy", "unread");
+    StringReply get = conn.get("transx");
+    BOOST_CHECK(transaction.commit());
+    BOOST_CHECK(set.result());
+    BOOST_CHECK_EQUAL((std::string)get, "1");
+  }
+  {
+    Transaction transaction(&conn);
+    VoidReply set = conn.set("transx", "2");
+    transaction.abort();
+    BOOST_CHECK(set.failed());
+    BOOST_CHECK_THROW(set.result(), std::runtime_error);
+  }
+  BOOST_CHECK_EQUAL((std::string)conn.get("transx"), "1");
+  BOOST_CHECK_EQUAL((std::string)conn.get("transy"), "unread");
+
+  {
+    Transaction transaction(&conn, SendOnCommit);
+    std::vector<IntReply> counts;
+    for (int i = 0; i < 100; ++i) {
+      counts.push_back(conn.incr("transcount"));
+    }
+    IntReply wrongType = conn.incr("transy");
+    conn.del("transcount");
+    BOOST_CHECK(transaction.commit());
+    BOOST_CHECK_EQUAL(counts.back().result() - counts.front().result(), 99);
+    BOOST_CHECK(!wrongType.tryResult());
+  }
+
+  // a command refused while queuing aborts the whole transaction
+  {
+    Transaction transaction(&conn, SendOnCommit);
+    VoidReply set = conn.set("transx", "2");
+    ArgList args;
+    args.push_back("SET");
+    args.push_back("transx");
+    ValueReply refused = conn.command(args);
+    BOOST_CHECK(!transaction.commit());
+    BOOST_CHECK_EQUAL(set.error().find("EXECABORT"), 0u);
+    BOOST_CHECK_EQUAL(refused.tryResult().error().find("ERR wrong number"),
+                      0u);
+  }
+  BOOST_CHECK_EQUAL((std::string)conn.get("transx"), "1");
+}
+
+BOOST_AUTO_TEST_CASE(check_and_set) {
+  ArgList keys;
+  keys.push_back("casbalance");
+  conn.set("casbalance", "100");
+
+  Connection other(TEST_HOST, TEST_PORT, "password");
+  std::vector<IntReply> results;
+  CasOptions options;
+  options.backoffMillis = 2;
+  checkAndSet(
+      &conn, keys,
+      [&](CheckAndSet& cas) {
+        const int64_t balance =
+            boost::lexical_cast<int64_t>((std::string)conn.get("casbalance"));
+        if (cas.attempts() == 1) {
+          // a concurrent writer invalidates the first attempt
+          other.set("casbalance", "50");
+        }
+        cas.multi();
+        conn.set("casbalance", boost::lexical_cast<std::string>(balance - 10));
+        results.push_back(conn.incr("casops"));
+      },
+      options);
+  BOOST_CHECK_EQUAL((std::string)conn.get("casbalance"), "40");
+  BOOST_REQUIRE_EQUAL(results.size(), 2u);
+  BOOST_CHECK(results[0].failed());
+  BOOST_CHECK(!results[1].failed());
+
+  // without multi nothing is written
+  {
+    CheckAndSet cas(&conn, keys);
+    StringReply balance = conn.get("casbalance");
+    BOOST_CHECK(cas.exec());
+    BOOST_CHECK_EQUAL((std::string)balance, "40");
+  }
+  // reads left unread behind the WATCH come before MULTI's reply
+  {
+    CheckAndSet cas(&conn, keys);
+    StringReply first = conn.get("casbalance");
+    StringReply second = conn.get("casbalance");
+    BOOST_CHECK_EQUAL((std::string)first, "40");
+    cas.multi();
+    conn.set("casother", "1");
+    BOOST_CHECK(cas.exec());
+    BOOST_CHECK_EQUAL((std::string)second, "40");
+  }
+  BOOST_CHECK_EQUAL((std::string)conn.get("casother"), "1");
+  // an abandoned attempt sends nothing but the UNWATCH
+  {
+    CheckAndSet cas(&conn, keys);
+    cas.multi();
+    conn.set("casbalance", "0");
+  }
+  BOOST_CHECK_EQUAL((std::string)conn.get("casbalance"), "40");
+
+  options.maxAttempts = 2;
+  // a large base is capped, not shifted past the range of int
+  options.backoffMillis = std::numeric_limits<int>::max();
+  options.maxBackoffMillis = 1;
+  CheckAndSet cas(&conn, keys, options);
+  for (int i = 0; i < 2; ++i) {
+    other.set("casbalance", "30");
+    cas.multi();
+    conn.set("casbalance", "0");
+    if (i == 0) {
+      BOOST_CHECK(!cas.exec());
+    } else {
+      BOOST_CHECK_THROW(cas.exec(), std::runtime_error);
+    }
+  }
+  BOOST_CHECK_EQUAL((std::string)conn.get("casbalance"), "30");
+}
+
+BOOST_AUTO_TEST_CASE(fire_and_forget) {
+  conn.del("forgotten");
+  {
+    FireAndForget writes(&conn);
+    BOOST_CHECK(!conn.repliesEnabled());
+    for (int i = 0; i < 1000; ++i) {
+      conn.incr("forgotten");
+    }
+    IntReply detached = conn.incr("forgotten");
+    BOOST_CHECK_EQUAL(detached.result(), 0);
+    BOOST_CHECK_THROW(Transaction transaction(&conn), std::logic_error);
+    writes.sync();
+    conn.incr("forgotten");
+  }
+  BOOST_CHECK(conn.repliesEnabled());
+  BOOST_CHECK_EQUAL((std::string)conn.get("forgotten"), "1002");
+
+  conn.skipNextReply();
+  conn.set("forgotten", "skipped");
+  BOOST_CHECK_EQUAL((std::string)conn.get("forgotten"), "skipped");
+
+  // a transaction cannot start while a skip is pending, the skip stays for
+  // the next command
+  conn.skipNextReply();
+  BOOST_CHECK_THROW(Transaction transaction(&conn), std::logic_error);
+  BOOST_CHECK_THROW(CheckAndSet cas(&conn, ArgList(1, "forgotten")),
+                    std::logic_error);
+  conn.set("forgotten", "skipped again");
+
+  // the next command uses the skip up even if it makes no reply object
+  Connection canned{
+      std::unique_ptr<Transport>(new CannedTransport("$1\r\nx\r\n"))};
+  canned.skipNextReply();
+  canned.subscribe("channel");
+  BOOST_CHECK_EQUAL((std::string)canned.get("key"), "x");
+  {
+    Transaction transaction(&conn);
+    conn.set("forgotten", "committed");
+    BOOST_CHECK(transaction.commit());
+  }
+  BOOST_CHECK_EQUAL((std::string)conn.get("forgotten"), "committed");
+
+  conn.repliesOff();
+  conn.set("forgotten", "off");
+  conn.repliesOn();
+  BOOST_CHECK_EQUAL((std::string)conn.get("forgotten"), "off");
+}
+
+BOOST_AUTO_TEST_CASE(expected_results) {
+  conn.del("expectedmissing");
+  conn.set("expectedstring", "x");
+
+  StringReply missing = conn.get("expectedmissing");
+  IntReply wrongType = conn.incr("expectedstring");
+  MultiBulkEnumerator notList = conn.lrange("expectedstring", 0, -1);
+  StringReply present = conn.get("expectedstring");
+
+  const Expected<boost::optional<std::string>> value = present.tryResult();
+  BOOST_CHECK(value.ok());
+  BOOST_CHECK_EQUAL(**value, "x");
+
+  const Expected<boost::optional<std::string>> miss = missing.tryResult();
+  BOOST_CHECK(miss);
+  BOOST_CHECK(!*miss);
+
+  const Expected<int64_t> error = wrongType.tryResult();
+  BOOST_CHECK(!error);
+  BOOST_CHECK(wrongType.failed());
+  BOOST_CHECK_EQUAL(error.error().find("ERR"), 0u);
+  BOOST_CHECK_THROW(error.value(), std::runtime_error);
+  BOOST_CHECK_THROW(wrongType.result(), std::runtime_error);
+
+  boost::optional<std::string> element;
+  BOOST_CHECK(!notList.tryNextOptional(element));
+  BOOST_CHECK_EQUAL(notList.error().find("WRONGTYPE"), 0u);
+
+  ArgList members;
+  members.push_back("a");
+  members.push_back("b");
+  ChunkedIntReply chunked = conn.sadd("expectedstring", members);
+  BOOST_CHECK(!chunked.tryResult());
+
+  ArgList args;
+  args.push_back("HGET");
+  args.push_back("expectedstring");
+  args.push_back("field");
+  ValueReply command = conn.command(args);
+  BOOST_CHECK(!command.tryResult().ok());
+  BOOST_CHECK_EQUAL((std::string)conn.get("expectedstring"), "x");
+}
+
+BOOST_AUTO_TEST_CASE(flow_control) {
+  conn.del("flow");
+  FlowControl flowControl;
+  flowControl.maxInFlight = 8;
+  conn.setFlowControl(flowControl);
+  BOOST_CHECK_EQUAL(conn.inFlightLimit(), 8u);
+  std::vector<IntReply> counts;
+  for (int i = 0; i < 100; ++i) {
+    counts.push_back(conn.incr("flow"));
+  }
+  for (int i = 0; i < 100; ++i) {
+    BOOST_CHECK_EQUAL(counts[i].result(), i + 1);
+  }
+
+  // drained errors stay with their reply
+  flowControl.maxInFlight = 1;
+  conn.setFlowControl(flowControl);
+  conn.set("flowstring", "x");
+  IntReply failed = conn.incr("flowstring");
+  BOOST_CHECK_EQUAL(conn.incr("flow").result(), 101);
+  BOOST_CHECK_THROW(failed.result(), std::runtime_error);
+
+  flowControl.maxInFlight = 0;
+  flowControl.maxInFlightBytes = 4096;
+  conn.setFlowControl(flowControl);
+  BOOST_CHECK_EQUAL(conn.inFlightLimit(), 64u);
+  conn.set("flowstring", std::string(1000, 'x'));
+  std::vector<StringReply> values;
+  for (int i = 0; i < 100; ++i) {
+    values.push_back(conn.get("flowstring"));
+  }
+  BOOST_CHECK_LE(conn.inFlightLimit(), 5u);
+  BOOST_FOREACH (StringReply& value, values) {
+    BOOST_CHECK_EQUAL(value.result()->size(), 1000u);
+  }
+
+  flowControl.maxInFlightBytes = 0;
+  flowControl.maxInFlight = 1000;
+  flowControl.adaptive = true;
+  flowControl.minInFlight = 4;
+  conn.setFlowControl(flowControl);
+  BOOST_CHECK_EQUAL(conn.inFlightLimit(), 4u);
+  counts.clear();
+  for (int i = 0; i < 5000; ++i) {
+    counts.push_back(conn.incr("flow"));
+  }
+  BOOST_CHECK_GE(conn.inFlightLimit(), 4u);
+  BOOST_CHECK_LE(conn.inFlightLimit(), 1000u);
+  BOOST_CHECK_EQUAL(counts.back().result(), 5101);
+
+  conn.setFlowControl(FlowControl());
+  BOOST_CHECK_EQUAL(conn.inFlightLimit(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(ignored_replies) {
+  conn.del("ignoredlist");
+  ArgList values;
+  for (int i = 0; i < 500; ++i) {
+    values.push_back(std::string(i, 'x'));
+  }
+  BOOST_FOREACH (const std::string& value, values) {
+    conn.rpush("ignoredlist", value);
+  }
+
+  {
+    MultiBulkEnumerator unread = conn.lrange("ignoredlist", 0, -1);
+    MultiBulkEnumerator partial = conn.lrange("ignoredlist", 0, -1);
+    std::string value;
+    BOOST_CHECK(partial.next(&value));
+  }
+  BOOST_CHECK_EQUAL(conn.llen("ignoredlist").result(), 500);
+
+  MultiBulkEnumerator skipped = conn.lrange("ignoredlist", 0, -1);
+  skipped.ignore();
+  StringReply missing = conn.get("nonexistant");
+  missing.ignore();
+  IntReply failed = conn.incr("ignoredlist");
+  failed.ignore();
+  MapReply map = conn.hgetAllMap("nonexistant");
+  map.ignore();
+  StringReply after = conn.lindex("ignoredlist", 2);
+  BOOST_CHECK_EQUAL((std::string)after, "xx");
+  BOOST_CHECK_EQUAL(failed.result(), 0);
+  std::string value;
+  BOOST_CHECK(!skipped.next(&value));
+
+  conn.hello(3);
+  conn.hset("ignoredhash", "field", "value");
+  ValueReply nested = conn.command(boost::assign::list_of("HGETALL")(
+      "ignoredhash"));
+  nested.ignore();
+  ScoredReply doubles = conn.zrangeWithScores("nonexistant", 0, -1);
+  doubles.ignore();
+  BOOST_CHECK(conn.exists("ignoredhash").result());
+  conn.hello(2);
+}
+
+BOOST_AUTO_TEST_CASE(reply_containers) {
+  // growing the vector moves the outstanding replies, they must keep their
+  // place in the connection's queue
+  std::vector<IntReply> replies;
+  conn.del("movedlist");
+  for (int i = 0; i < 2000; ++i) {
+    replies.push_back(conn.rpush("movedlist", "x"));
+  }
+  StringReply last = conn.lindex("movedlist", -1);
+  for (size_t i = 0; i < replies.size(); ++i) {
+    BOOST_CHECK_EQUAL(replies[i].result(), (int64_t)i + 1);
+  }
+  BOOST_CHECK_EQUAL((std::string)last, "x");
+
+  // assigning over an outstanding reply reads it first
+  std::vector<StringReply> window(4);
+  conn.set("moved", "a");
+  for (int i = 0; i < 10; ++i) {
+    window[i % window.size()] = conn.get("moved");
+  }
+  BOOST_CHECK_EQUAL((std::string)window[0], "a");
+
+  MultiBulkEnumerator range = conn.lrange("movedlist", 0, 1);
+  MultiBulkEnumerator moved(std::move(range));
+  std::string value;
+  BOOST_CHECK(!range.next(&value));
+  BOOST_CHECK(moved.next(&value) && value == "x");
+  moved = conn.lrange("movedlist", 0, 2);
+  int count = 0;
+  while (moved.next(&value)) {
+    ++count;
+  }
+  BOOST_CHECK_EQUAL(count, 3);
+  BOOST_CHECK_EQUAL(conn.llen("movedlist").result(), 2000);
+}
+
+#ifndef _WIN32
+BOOST_AUTO_TEST_CASE(fake_server) {
+  FakeServerOptions options;
+  options.password = "secret";
+  options.partialWriteBytes = 5;
+  options.partialWriteDelayUs = 0;
+  FakeServer server(0, options);
+  Connection fake(TEST_HOST, server.port(), "secret");
+
+  fake.set("hello", "world");
+  BOOST_CHECK_EQUAL((std::string)fake.get("hello"), "world");
+  BOOST_CHECK(!fake.get("missing").result());
+  BOOST_CHECK_THROW(fake.rpush("hello", "x").result(), std::runtime_error);
+  std::vector<IntReply> counts;
+  for (int i = 0; i < 100; ++i) {
+    counts.push_back(fake.incr("counter"));
+  }
+  BOOST_CHECK_EQUAL(counts.back().result(), 100);
+
+  fake.rpush("list", "a");
+  fake.rpush("list", "b");
+  MultiBulkEnumerator items = fake.lrange("list", 0, -1);
+  std::string item;
+  BOOST_CHECK(items.next(&item) && item == "a");
+  BOOST_CHECK(items.next(&item) && item == "b");
+  BOOST_CHECK(!items.next(&item));
+  BOOST_CHECK(fake.hset("hash", "field", "value").result());
+  BOOST_CHECK_EQUAL(fake.hgetAllMap("hash").result().size(), 1u);
+  fake.zadd("zset", 2, "two");
+  fake.zadd("zset", 1, "one");
+  ScoredReply range = fake.zrangeWithScores("zset", 0, -1);
+  const ScoredMemberVector& scored = range.result();
+  BOOST_REQUIRE_EQUAL(scored.size(), 2u);
+  BOOST_CHECK_EQUAL(scored[0].first, "one");
+  BOOST_CHECK_EQUAL(scored[1].second, 2.0);
+
+  // a write from another client aborts a transaction watching the key
+  Connection other(TEST_HOST, server.port(), "secret");
+  ArgList keys;
+  keys.push_back("counter");
+  CasOptions casOptions;
+  casOptions.backoffMillis = 0;
+  CheckAndSet cas(&fake, keys, casOptions);
+  BOOST_CHECK_EQUAL(fake.get("counter").result().get(), "100");
+  other.incr("counter").result();
+  cas.multi();
+  fake.incr("counter");
+  BOOST_CHECK(!cas.exec());
+  cas.multi();
+  fake.incr("counter");
+  BOOST_CHECK(cas.exec());
+  BOOST_CHECK_EQUAL(other.get("counter").result().get(), "102");
+
+  options.partialWriteBytes = 0;
+  options.latencyMs = 50;
+  server.setOptions(options);
+  const std::chrono::steady_clock::time_point begin =
+      std::chrono::steady_clock::now();
+  fake.get("hello").result();
+  BOOST_CHECK(std::chrono::steady_clock::now() - begin >=
+              std::chrono::milliseconds(50));
+  BOOST_CHECK_GT(server.commandsProcessed(), 100u);
+
+  FakeServer local("/tmp/redispp-fake.sock");
+  Connection unixConn("/tmp/redispp-fake.sock", "");
+  unixConn.set("hello", "there");
+  BOOST_CHECK_EQUAL((std::string)unixConn.get("hello"), "there");
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()